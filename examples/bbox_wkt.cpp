@@ -1,6 +1,7 @@
 #include <vector>
 #include <iomanip>
 #include "osmx/storage.h"
+#include "osmx/geom.h"
 #include "osmx/util.h"
 #include "s2/s2latlng.h"
 #include "s2/s2region_coverer.h"
@@ -13,7 +14,8 @@ using namespace std;
 // and print them out as WKT.
 // see way_wkt for a simpler example.
 // This program does not handle Relations at all,
-// so it can't be used to find all Polygons in a region, since they may be Multipolygon relations.
+// so it can't be used to find all Polygons in a region, since they may be Multipolygon relations;
+// osmx::geom::Builder::area assembles those.
 // Usage: ./bbox_wkt OSMX_FILE MIN_LON MIN_LAT MAX_LON MAX_LAT
 
 int main(int argc, char* argv[]) {
@@ -29,13 +31,14 @@ int main(int argc, char* argv[]) {
   auto bbox = S2LatLngRect{lo,hi};
 
   // Find the cell covering for the LatLngRect,
-  // with a maximum cell level of 16.
-  // Although nodes in the database are stored at level=16,
-  // Cells with levels less than 16 will be correctly handled by the traverseCell function.
+  // with a maximum cell level of the database's index level (16 by default).
+  // Although nodes in the database are stored at that level,
+  // Cells with lower levels will be correctly handled by the traverseCell function.
   // This allows for more compact representations of large regions.
+  int cell_level = osmx::db::cellLevel(txn);
 
   S2RegionCoverer::Options options;
-  options.set_max_level(16);
+  options.set_max_level(cell_level);
   S2RegionCoverer coverer(options);
   S2CellUnion covering = coverer.GetCovering(bbox);
 
@@ -48,7 +51,7 @@ int main(int argc, char* argv[]) {
   CHECK_LMDB(mdb_dbi_open(txn, "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
   CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
   for (auto cell_id : covering.cell_ids()) {
-    osmx::db::traverseCell(cursor,cell_id,node_ids);
+    osmx::db::traverseCell(cursor,cell_id,node_ids,cell_level);
   }
   mdb_cursor_close(cursor);
 
@@ -65,9 +68,13 @@ int main(int argc, char* argv[]) {
 
   cerr << "Ways in region: " << way_ids.cardinality() << endl;
 
-  osmx::db::Locations locations(txn);
   osmx::db::Elements ways(txn,"ways");
 
+  // A geometry Builder looks up the node locations of all ways in one batch, in ID order,
+  // and reads a node shared by several ways only once.
+  osmx::geom::Builder builder(txn,osmx::geom::Format::wkt);
+  builder.prefetch(way_ids);
+
   for (auto way_id : way_ids) {
     // Fetch a Way element by ID.
     auto message = ways.getReader(way_id);
@@ -81,15 +88,9 @@ int main(int argc, char* argv[]) {
     }
 
     // Assemble a WKT LineString geometry.
-    cout << "\tLINESTRING (";
-    cout << std::fixed << std::setprecision(7); // the output should have 7 decimal places.
-    auto nodes = way.getNodes();
-    for (int i = 0; i < nodes.size(); i++) {
-      auto location = locations.get(nodes[i]);
-      if (i > 0) cout << ",";
-      cout << location.coords.lon() << " " << location.coords.lat();
-    }
-    cout << ")" << endl;
+    string wkt;
+    if (builder.linestring(way_id,wkt)) cout << "\t" << wkt;
+    cout << endl;
   }
 
   mdb_env_close(env); // close the database.
@@ -0,0 +1,68 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "osmium/osm/area.hpp"
+#include "osmium/osm/relation.hpp"
+#include "osmium/osm/way.hpp"
+#include "s2/s2latlng.h"
+#include "s2/s2polygon.h"
+#include "osmx/storage.h"
+
+namespace osmx {
+
+// a boundary relation containing a point.
+struct AdminArea {
+  uint64_t relation_id;
+  int admin_level;
+};
+
+// boundary=administrative relations assembled into S2 polygons, so a point lookup doesn't read relations, ways or locations.
+// admin_polygons maps a relation ID to its admin_level, its covering and interior covering cells, and its encoded S2Polygon.
+// admin_cells maps each of those cells to relation IDs shifted left by one, with the low bit set for interior cells,
+// which lie entirely inside the boundary, so the polygon only needs to be tested for points near its edges.
+// Both tables are created by osmx admin build and kept current by updates.
+class AdminIndex : public db::Noncopyable {
+  public:
+  struct Boundary {
+    int admin_level;
+    std::vector<S2CellId> covering;
+    std::vector<S2CellId> interior;
+    std::string polygon;
+  };
+
+  enum class Assembled { not_boundary, invalid, ok };
+
+  AdminIndex(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  // assemble a relation's outer and inner ways into a polygon and its cells, repairing rings that touch.
+  // invalid if it is an administrative boundary, but no polygon could be built from its rings.
+  static Assembled assemble(MDB_txn *txn, uint64_t relation_id, Boundary &boundary);
+  // the same for a relation and its member ways, in member order, whose node refs have locations,
+  // such as the versions an update is about to write.
+  static Assembled assemble(const osmium::Relation &relation, const std::vector<const osmium::Way *> &ways, Boundary &boundary);
+  void put(uint64_t relation_id, const Boundary &boundary);
+  void del(uint64_t relation_id);
+  // remove every boundary, before a rebuild.
+  void clear();
+  bool contains(uint64_t relation_id);
+  // boundaries containing the point, by ascending admin_level.
+  std::vector<AdminArea> lookup(const S2LatLng &point);
+
+  private:
+  struct Polygon {
+    int admin_level;
+    std::unique_ptr<S2Polygon> polygon;
+  };
+  Polygon &load(uint64_t relation_id);
+  static Assembled fromArea(const osmium::Area &area, Boundary &boundary);
+
+  MDB_txn *mTxn;
+  MDB_dbi mPolygonsDbi;
+  MDB_dbi mCellsDbi;
+  bool mMissing;
+  std::unordered_map<uint64_t,Polygon> mPolygons;
+};
+
+}
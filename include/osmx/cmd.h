@@ -1,3 +1,10 @@
 void cmdExpand(int argc, char* argv[]);
 void cmdExtract(int argc, char* argv[]);
 void cmdUpdate(int argc, char* argv[]);
+void cmdUpdated(int argc, char* argv[]);
+void cmdAugmentedDiff(int argc, char* argv[]);
+void cmdRegions(int argc, char* argv[]);
+void cmdStats(int argc, char* argv[]);
+void cmdReindex(int argc, char* argv[]);
+void cmdAdmin(int argc, char* argv[]);
+void cmdServe(int argc, char* argv[]);
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include "osmx/messages.capnp.h"
+
+namespace osmx {
+
+struct StringRef {
+  const char *data;
+  uint32_t size;
+};
+
+struct StoredHeader {
+  uint64_t id;
+  uint32_t version;
+  uint64_t timestamp;
+  uint32_t changeset;
+  uint32_t uid;
+  StringRef user;
+};
+
+// Sequential reader over one record of an ElementStore.
+// Records are laid out as:
+//   way:      header | num_refs:u32 | ref:u64... | num_tags:u32 | (key,value)...
+//   relation: header | num_members:u32 | (type:u8,ref:u64,role)... | num_tags:u32 | (key,value)...
+// where header is id:u64 version:u32 timestamp:u64 changeset:u32 uid:u32 user
+// and strings are a u32 length followed by the bytes.
+class StoredRecord {
+  public:
+  StoredRecord(const char *data) : mPos(data) { }
+
+  template <typename T>
+  T read() {
+    T val;
+    memcpy(&val,mPos,sizeof(T));
+    mPos += sizeof(T);
+    return val;
+  }
+
+  StringRef readString() {
+    uint32_t size = read<uint32_t>();
+    StringRef s{mPos,size};
+    mPos += size;
+    return s;
+  }
+
+  StoredHeader readHeader() {
+    StoredHeader h;
+    h.id = read<uint64_t>();
+    h.version = read<uint32_t>();
+    h.timestamp = read<uint64_t>();
+    h.changeset = read<uint32_t>();
+    h.uid = read<uint32_t>();
+    h.user = readString();
+    return h;
+  }
+
+  private:
+  const char *mPos;
+};
+
+// Holds ways or relations decoded once from the database,
+// so later passes of extract don't go back to LMDB.
+// Records must be added in ascending ID order; once the arena exceeds
+// the memory budget it is appended to a spill file, which preserves that order.
+class ElementStore {
+  public:
+  ElementStore(const std::string &spillPath, size_t budget);
+  ~ElementStore();
+  ElementStore( const ElementStore& ) = delete;
+  ElementStore& operator=( const ElementStore& ) = delete;
+
+  void add(uint64_t id, Way::Reader way);
+  void add(uint64_t id, Relation::Reader relation);
+  void forEach(const std::function<void(StoredRecord &)> &fn);
+
+  uint64_t size() const { return mCount; }
+  size_t residentSize() const { return mArena.size(); }
+
+  private:
+  template <typename T>
+  void write(T val) {
+    const char *p = (const char *)&val;
+    mArena.insert(mArena.end(),p,p + sizeof(T));
+  }
+
+  void writeString(const char *data, size_t size);
+  void writeHeader(uint64_t id, Metadata::Reader metadata);
+  void writeTags(capnp::List<capnp::Text>::Reader tags);
+  void beginRecord();
+  void endRecord();
+  void spill();
+
+  std::vector<char> mArena;
+  size_t mRecordStart = 0;
+  size_t mBudget;
+  uint64_t mCount = 0;
+  std::string mSpillPath;
+  std::ofstream mSpill;
+  bool mSpilled = false;
+};
+
+}
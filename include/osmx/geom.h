@@ -0,0 +1,69 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "osmium/osm/location.hpp"
+#include "osmium/osm/item_type.hpp"
+#include "osmium/memory/buffer.hpp"
+#include "osmium/geom/wkb.hpp"
+#include "osmium/geom/wkt.hpp"
+#include "osmium/geom/geojson.hpp"
+#include "s2/s2cell_union.h"
+#include "osmx/storage.h"
+
+namespace osmx { namespace geom {
+
+enum class Format { wkb, wkt, geojson };
+
+// Node locations for one query. Missing IDs are looked up together in ascending order, so reads follow
+// the order of the locations table, and a node shared by several ways is read once.
+class LocationCache : public db::Noncopyable {
+  public:
+  LocationCache(MDB_txn *txn);
+  void fetch(std::vector<uint64_t> &ids);
+  // an undefined location if the node doesn't exist.
+  osmium::Location get(uint64_t id);
+  void clear() { mCache.clear(); }
+
+  private:
+  db::Cursor mLocations;
+  std::unordered_map<uint64_t,osmium::Location> mCache;
+};
+
+// Geometries of stored elements, written by osmium's geometry factories and appended to an output string.
+// Ways are linestrings, or areas if closed; multipolygon and boundary relations are assembled into areas
+// by osmium's area assembler. Locations are cached for the lifetime of the Builder, so use one per query.
+class Builder : public db::Noncopyable {
+  public:
+  Builder(MDB_txn *txn, Format format);
+  bool point(uint64_t node_id, std::string &out);
+  bool linestring(uint64_t way_id, std::string &out);
+  // false if the element isn't a closed way or a multipolygon or boundary relation, or its rings don't close.
+  bool area(osmium::item_type type, uint64_t id, std::string &out);
+  // add the osmium::Area of a closed way or a multipolygon or boundary relation to areas, for callers that need
+  // its rings rather than a formatted geometry. false if no area was added.
+  bool assemble(osmium::item_type type, uint64_t id, osmium::memory::Buffer &areas);
+  // look up the node locations of these ways in one batch, before their geometries are built.
+  void prefetch(const roaring::Roaring64Map &way_ids);
+  // call fn with the point of every tagged node and the linestring of every way with a node in the covering.
+  // The covering is read one cell at a time, clearing the location cache in between, so memory use follows
+  // the largest cell rather than the whole region. A way is passed once, with the first cell it has a node in.
+  void region(const S2CellUnion &covering, std::function<void(osmium::item_type type, uint64_t id, const std::string &geometry)> fn);
+  LocationCache &locations() { return mLocations; }
+
+  private:
+  void addWay(const MDB_val &data, uint64_t way_id, osmium::memory::Buffer &buffer);
+  void collectNodes(const MDB_val &data, std::vector<uint64_t> &node_ids);
+
+  MDB_txn *mTxn;
+  Format mFormat;
+  LocationCache mLocations;
+  db::Elements mWays;
+  db::Elements mRelations;
+  osmium::geom::WKBFactory<> mWKB;
+  osmium::geom::WKTFactory<> mWKT;
+  osmium::geom::GeoJSONFactory<> mGeoJSON;
+};
+
+} }
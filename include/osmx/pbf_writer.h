@@ -0,0 +1,94 @@
+#pragma once
+#include <deque>
+#include <fstream>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "protozero/pbf_writer.hpp"
+#include "osmium/thread/pool.hpp"
+#include "osmx/messages.capnp.h"
+#include "osmx/element_store.h"
+#include "osmx/storage.h"
+
+namespace osmx {
+
+struct PbfHeader {
+  bool has_box = false;
+  double min_lon = 0;
+  double min_lat = 0;
+  double max_lon = 0;
+  double max_lat = 0;
+  std::string replication_timestamp;
+  std::string replication_sequence_number;
+  // declare Sort.Type_then_ID; streaming extracts interleave element types.
+  bool sorted = true;
+};
+
+// Writes an .osm.pbf directly from osmx values, without going through osmium builders.
+// Unless the header is marked unsorted, elements must be written in PBF order:
+// all nodes, then ways, then relations, each by ascending ID.
+// Blocks are compressed on a thread pool and written out in submission order.
+class PbfWriter {
+  public:
+  PbfWriter(const std::string &path, const PbfHeader &header, bool includeUserData);
+  ~PbfWriter();
+  PbfWriter( const PbfWriter& ) = delete;
+  PbfWriter& operator=( const PbfWriter& ) = delete;
+
+  // untagged nodes only have a location and version.
+  void node(uint64_t id, const db::Location &location);
+  void node(uint64_t id, const db::Location &location, Node::Reader node);
+  void way(StoredRecord &record);
+  void way(uint64_t id, Way::Reader way);
+  void relation(StoredRecord &record);
+  void relation(uint64_t id, Relation::Reader relation);
+  void close();
+
+  private:
+  enum class GroupType { NONE, NODES, WAYS, RELATIONS };
+
+  uint32_t stringId(const char *data, size_t size);
+  void beginEntity(GroupType type);
+  void denseNode(uint64_t id, const db::Location &location, uint32_t version, uint64_t timestamp, uint32_t changeset, uint32_t uid, uint32_t user_sid);
+  void collectTags(StoredRecord &record);
+  void collectTags(capnp::List<capnp::Text>::Reader tags);
+  void writeInfo(protozero::pbf_writer &element, const StoredHeader &header);
+  void writeWay(const StoredHeader &header);
+  void writeRelation(const StoredHeader &header);
+  void flushBlock();
+  void writeBlob(const std::string &type, std::string data);
+  void writePending(size_t max_pending);
+
+  std::ofstream mStream;
+  osmium::thread::Pool mPool;
+  std::deque<std::future<std::string>> mPending;
+  bool mIncludeUserData;
+  bool mClosed = false;
+
+  GroupType mGroupType = GroupType::NONE;
+  int mGroupCount = 0;
+  std::unordered_map<std::string,uint32_t> mStringIds;
+  std::vector<std::string> mStrings;
+
+  // DenseNodes are columnar, so they are buffered until the block is flushed.
+  std::vector<int64_t> mIds;
+  std::vector<int64_t> mLats;
+  std::vector<int64_t> mLons;
+  std::vector<int32_t> mVersions;
+  std::vector<int64_t> mTimestamps;
+  std::vector<int64_t> mChangesets;
+  std::vector<int32_t> mUids;
+  std::vector<int32_t> mUserSids;
+  std::vector<int32_t> mKeysVals;
+
+  // ways and relations are encoded as they arrive.
+  std::string mGroup;
+  std::vector<uint32_t> mKeys;
+  std::vector<uint32_t> mVals;
+  std::vector<int64_t> mRefs;
+  std::vector<int32_t> mRoles;
+  std::vector<int32_t> mTypes;
+};
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <limits>
+#include <vector>
+#include "s2/s2latlng.h"
+#include "s2/s2cell_id.h"
+#include "s2/s1chord_angle.h"
+#include "osmx/storage.h"
+#include "osmx/tag_filter.h"
+
+namespace osmx {
+
+// A node or way found by a proximity search, with its distance from the point in meters.
+struct Neighbor {
+  osmium::item_type type;
+  uint64_t id;
+  double distance;
+};
+
+// Nearby tagged nodes and ways to a point, optionally limited by a TagFilter.
+// Cells are visited in order of their distance from the point, descending from the six faces to the
+// index level and skipping cells without nodes. Nodes and ways are queued by their exact distance,
+// and the search stops once k results are out or the radius is reached.
+// Ways are found through their nodes, which can be farther away than the way itself, so a cell is visited
+// at its distance less the half segment length cell_segments records for it: by the time a result comes
+// out of the queue, every way that could be closer has been queued, and results are exact.
+// Databases without cell_segments are searched for nodes only.
+class ProximitySearch : public db::Noncopyable {
+  public:
+  ProximitySearch(MDB_txn *txn, const TagFilter *filter = nullptr);
+  ~ProximitySearch();
+  // up to k nearby elements within radius meters, sorted by distance.
+  std::vector<Neighbor> nearest(const S2LatLng &point, size_t k, double radius = std::numeric_limits<double>::infinity());
+  // every element within radius meters that was reached, sorted by distance.
+  std::vector<Neighbor> within(const S2LatLng &point, double radius);
+
+  private:
+  struct Entry {
+    // for cells, the distance they are visited at.
+    S1ChordAngle distance;
+    S2CellId cell;
+    osmium::item_type type;
+    uint64_t id;
+    bool operator>(const Entry &other) const { return other.distance < distance; }
+  };
+
+  bool hasNodes(S2CellId cell_id);
+  // the distance a cell is visited at.
+  S1ChordAngle cellDistance(S2CellId cell_id, const S2Point &target);
+  bool nodeMatches(uint64_t id);
+  bool wayDistance(uint64_t id, const S2Point &target, S1ChordAngle &distance);
+
+  const TagFilter *mFilter;
+  int mLevel;
+  bool mNodesIndexed = false;
+  bool mWaysIndexed = false;
+  roaring::Roaring64Map mNodeCandidates;
+  roaring::Roaring64Map mWayCandidates;
+  db::Locations mLocations;
+  db::Elements mNodes;
+  db::Elements mWays;
+  db::Presence mTagged;
+  db::CellLocations mCellLocations;
+  db::SegmentBounds mSegmentBounds;
+  MDB_cursor *mCellNode;
+  MDB_cursor *mNodeWay;
+};
+
+}
@@ -2,19 +2,31 @@
 
 #include <nlohmann/json.hpp>
 #include "s2/s2region.h"
+#include "s2/s2loop.h"
 #include "s2/s2cell_union.h"
 #include "s2/s2region_coverer.h"
 #include "s2/s2latlng_rect.h"
 
+// polygons with more vertices than this are covered on multiple threads.
+#define PARALLEL_COVERING_VERTICES 100000
+
 class Region {
 public:
 	Region(const std::string &text, const std::string &ext);
 	bool Contains(S2Point p);
-	S2CellUnion GetCovering(S2RegionCoverer &coverer);
+	// polygons with at least parallel_vertices vertices are covered on multiple threads.
+	S2CellUnion GetCovering(S2RegionCoverer &coverer, int parallel_vertices = PARALLEL_COVERING_VERTICES);
 	S2LatLngRect GetBounds();
 
 private:
 	void AddS2RegionFromGeometry(nlohmann::json &geometry);
 	void AddS2RegionFromPolyFile(std::istringstream &file);
-	std::vector<std::unique_ptr<S2Region>> mRegions;
+	void BuildPolygon();
+
+	// loops are collected per polygon part while parsing,
+	// then assembled into a single indexed S2Polygon by BuildPolygon.
+	std::vector<std::vector<std::unique_ptr<S2Loop>>> mParts;
+	std::unique_ptr<S2Region> mRegion;
+	S2LatLngRect mBounds;
+	int mNumVertices = 0;
 };
@@ -0,0 +1,31 @@
+#pragma once
+#include <memory>
+#include <string>
+#include "osmx/storage.h"
+
+namespace osmx {
+
+// An HTTP/1.1 server for element, geometry, extract and stats queries.
+// The main thread accepts connections and polls the idle ones; a connection with data to read is handed to a worker,
+// which answers every complete request in its buffer, so pipelined requests are batched, then hands it back.
+// Each worker keeps one read transaction: it is renewed for each batch to see the latest commit by osmx update
+// in another process, and reset in between so it doesn't keep the pages that update frees from being reused.
+class Server : public db::Noncopyable {
+  public:
+  // listen_fd is a non-blocking listening socket, like the one listenOn returns.
+  Server(MDB_env *env, int listen_fd, unsigned int num_threads);
+  ~Server();
+  // answer connections until stop is called.
+  void run();
+  // make run return once the workers finish their current batches; safe to call from another thread or a signal handler.
+  void stop();
+
+  private:
+  class Impl;
+  std::unique_ptr<Impl> mImpl;
+};
+
+// a non-blocking socket listening on an IPv4 address and port; for port 0, the port the system picked is written back.
+int listenOn(const std::string &address, int &port);
+
+}
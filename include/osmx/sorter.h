@@ -0,0 +1,88 @@
+#pragma once
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include "lmdb.h"
+#include "s2/s2cell_id.h"
+#include "osmium/osm/location.hpp"
+
+namespace osmx {
+
+typedef std::pair<uint64_t, uint64_t> Pair; 
+
+// a node with its cell, location and version, as sorted into cell_location.
+struct CellLocationEntry {
+  uint64_t cell;
+  uint64_t id;
+  int32_t x;
+  int32_t y;
+  int32_t version;
+
+  bool operator<(const CellLocationEntry &other) const {
+    return cell < other.cell || (cell == other.cell && id < other.id);
+  }
+  bool operator!=(const CellLocationEntry &other) const {
+    return cell != other.cell || id != other.id;
+  }
+};
+
+// reads fixed-size entries of one sorted run.
+template <typename T>
+class RunReader {
+  public:
+  RunReader(std::string filename) : mStream(filename, std::ios::in | std::ios::binary) { }
+
+  bool getNext() {
+    mStream.read((char *)&entry,sizeof(T));
+    if (mStream.eof()) return false;
+    return true;
+  }
+
+  T entry;
+
+  private:
+  std::ifstream mStream;
+};
+
+// External sort of (from,to) pairs into a DUPSORT index.
+// Runs are sorted in memory, persisted to tempDir and merged by writeDb.
+class Sorter {
+int MAX_RUN_SIZE = 64000000; // about 1 GB
+public:
+  Sorter(std::string tempDir,std::string name);
+  void put(uint64_t from, uint64_t to);
+  void put(S2CellId from, uint64_t to);
+  void persist();
+  // call fn for each distinct pair in sorted order.
+  void merge(std::function<void(uint64_t from, uint64_t to)> fn);
+  void writeDb(MDB_env *env);
+
+private:
+  Sorter( const Sorter& ) = delete;
+  Sorter& operator=( const Sorter& ) = delete;
+  std::vector<std::pair<uint64_t,uint64_t>> mStorage;
+  int mRunNumber = 0;
+  std::vector<std::string> mSavedRuns;
+  std::string mTempDir;
+  std::string mName;
+};
+
+// External sort of nodes by cell and ID into cell_location, in the same way as Sorter.
+class CellLocationSorter {
+int MAX_RUN_SIZE = 40000000; // about 1 GB
+public:
+  CellLocationSorter(std::string tempDir);
+  void put(S2CellId cell, uint64_t id, osmium::Location location, int32_t version);
+  void persist();
+  void writeDb(MDB_env *env);
+
+private:
+  CellLocationSorter( const CellLocationSorter& ) = delete;
+  CellLocationSorter& operator=( const CellLocationSorter& ) = delete;
+  std::vector<CellLocationEntry> mStorage;
+  std::vector<std::string> mSavedRuns;
+  std::string mTempDir;
+};
+
+}
@@ -1,12 +1,17 @@
 #pragma once
+#include <vector>
+#include <functional>
+#include <unordered_map>
 #include "lmdb.h"
 #include "osmium/osm/location.hpp"
+#include "osmium/osm/item_type.hpp"
 #include "kj/io.h"
 #include "capnp/message.h"
 #include "capnp/serialize.h"
 #include "osmx/messages.capnp.h"
 #include "osmx/util.h"
 #include "s2/s2cell_id.h"
+#include "s2/s2cell_union.h"
 #include "roaring/roaring64map.hh"
 
 namespace osmx { namespace db {
@@ -14,7 +19,12 @@ namespace osmx { namespace db {
 
 uint64_t to64(osmium::Location loc);
 osmium::Location toLoc(uint64_t val);
+capnp::FlatArrayMessageReader toReader(const MDB_val &data);
 MDB_env *createEnv(std::string path, bool writable = false);
+// open every table in the database in one read transaction and commit it, so the handles are shared by all
+// later transactions. LMDB tables must not be opened by concurrent transactions: call this before starting
+// threads that read, and opening a table in them only looks up its handle.
+void openTables(MDB_env *env);
 
 class Noncopyable {
   public:
@@ -34,12 +44,17 @@ class Metadata : public Noncopyable {
   MDB_dbi mDbi;
 };
 
+// the level of the cells in cell_node, from the cell_level metadata, or CELL_INDEX_LEVEL if it isn't set.
+int cellLevel(MDB_txn *txn);
+
 class Elements : public Noncopyable {
   public:
   Elements(MDB_txn *txn, const std::string &name);
   void put(uint64_t id, kj::VectorOutputStream &vos, int flags = 0);
+  void put(uint64_t id, MDB_val &data, int flags = 0);
   void del(uint64_t id);
   bool exists(uint64_t id);
+  bool get(uint64_t id, MDB_val &data);
   capnp::FlatArrayMessageReader getReader(uint64_t id);
 
   private:
@@ -103,7 +118,239 @@ class IndexWriter : public Noncopyable {
   int mWrites = 0;
 };
 
-void traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &set);
+// A cursor over one table, for reads and writes in ascending key order.
+// LMDB skips the descent from the root when the key is on the page the cursor is already on.
+// In a write transaction the cursor must be closed before the transaction ends.
+class Cursor : public Noncopyable {
+  public:
+  Cursor(MDB_txn *txn, const std::string &name, unsigned int flags);
+  ~Cursor();
+  bool get(uint64_t id, MDB_val &data);
+  void put(uint64_t id, MDB_val &data);
+  void del(uint64_t id);
+  void put(uint64_t from, uint64_t to);
+  void del(uint64_t from, uint64_t to);
+  void close();
+
+  private:
+  MDB_cursor *mCursor = nullptr;
+};
+
+// IDs present in an element table, kept in TABLE_presence as one bitmap per 2^20 IDs.
+// Loaded bitmaps are cached, so repeated existence checks, including misses, don't descend the table.
+// Without a presence table, contains() looks up the element table itself.
+// The cache isn't updated by writes to the element table in the same transaction.
+class Presence : public Noncopyable {
+  public:
+  Presence(MDB_txn *txn, const std::string &table, bool create = false);
+  bool exists() const { return !mMissing; }
+  bool contains(uint64_t id);
+  static uint64_t chunk(uint64_t id);
+  static uint32_t offset(uint64_t id);
+  void put(uint64_t chunk, roaring::Roaring &ids, int flags = 0);
+  void update(const roaring::Roaring64Map &added, const roaring::Roaring64Map &removed);
+
+  private:
+  roaring::Roaring &load(uint64_t chunk);
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  MDB_dbi mTableDbi;
+  bool mMissing;
+  std::unordered_map<uint64_t,roaring::Roaring> mChunks;
+};
+
+// Nodes by index level cell with their location and version, so a scan of a cell range yields
+// finished locations instead of one lookup in locations per node. Kept alongside cell_node.
+// Values are 20 bytes: the node ID as uint64_t, then x, y and version as int32_t, in host byte order.
+class CellLocations : public Noncopyable {
+  public:
+  CellLocations(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  void put(uint64_t cell, uint64_t id, const Location &location, int flags = 0);
+  void del(uint64_t cell, uint64_t id, const Location &location);
+  // call fn for every node in the index level cells contained by cell_id.
+  void traverse(S2CellId cell_id, std::function<void(uint64_t id, const Location &location)> fn);
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+  int mLevel;
+};
+
+// Counts of nodes, ways and relations per S2 cell at every level from 0 to the index level, keyed by cell ID.
+// Ways are counted in the cell of their first node, and relations in the cell of their first node member,
+// or else of the first node of their first way member. Counts are estimates: a way isn't moved when its first node is.
+// Values are the three counts as uint64_t in host byte order; cells with no elements have no entry.
+class CellStats : public Noncopyable {
+  public:
+  struct Counts {
+    uint64_t nodes;
+    uint64_t ways;
+    uint64_t relations;
+    uint64_t total() const { return nodes + ways + relations; }
+  };
+
+  CellStats(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  Counts get(S2CellId cell_id);
+  void put(S2CellId cell_id, const Counts &counts);
+  // add signed changes to one cell, without going below zero.
+  void add(S2CellId cell_id, int64_t nodes, int64_t ways, int64_t relations);
+  Counts estimate(const S2CellUnion &covering);
+  // divide a covering into at most n parts of about equal element counts, each contiguous along the cell order.
+  std::vector<S2CellUnion> split(const S2CellUnion &covering, size_t n);
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+  int mLevel;
+};
+
+// For each cell at levels 0 to the database's cell_level, half the length in meters of the longest way segment
+// with an end in the cell. A point on a way has a node of the way at most that much farther away than itself,
+// at one end of its segment, so a proximity search knows how much closer than a cell's nodes the ways through them can be.
+// Each cell's value is at least that of its children. Values only grow: segments that are shortened
+// or deleted leave them as upper bounds.
+class SegmentBounds : public Noncopyable {
+  public:
+  SegmentBounds(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  // 0 for cells without segments.
+  double get(S2CellId cell_id);
+  // raise the value of an index level cell and its parents to at least meters.
+  void raise(S2CellId cell_id, double meters);
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+  int mLevel;
+};
+
+// Cells at the database's cell_level touched by each committed update, keyed by its replication sequence number.
+// The entry for a sequence number covers everything since the previous entry.
+// Updates only record them with a changes_retention set, and prune entries older than that many sequence numbers.
+class Changes : public Noncopyable {
+  public:
+  Changes(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  void put(uint64_t seqnum, roaring::Roaring64Map &cells);
+  // the union of cells touched after from_seqnum, up to and including to_seqnum.
+  roaring::Roaring64Map get(uint64_t from_seqnum, uint64_t to_seqnum);
+  // the oldest sequence number with an entry, or false if there is none.
+  bool first(uint64_t &seqnum);
+  // remove the entries up to and including seqnum.
+  void prune(uint64_t seqnum);
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+};
+
+// Regions registered for per-region diffs, keyed by name, with their cell coverings.
+class Regions : public Noncopyable {
+  public:
+  Regions(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  void put(const std::string &name, const S2CellUnion &covering);
+  bool del(const std::string &name);
+  std::vector<std::pair<std::string,S2CellUnion>> getAll();
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+};
+
+// Versions of elements, keyed by type ('n', 'w' or 'r'), ID and version. Each value starts with the
+// sequence number of the update that replaced or deleted the version, or UINT64_MAX while it is current,
+// and the sequence number of the update that made it current, or 0 if that is older than the history.
+// The values of superseded versions continue with the stored element: for a node its location as
+// int32_t[3] padded to 16 bytes, followed by its tags message if it had tags; for ways and relations their messages.
+// LMDB doesn't keep values word-aligned, so lookups copy them out before they are decoded.
+// Sequence numbers are those of whole transactions, so versions that were current only between the
+// diffs of one batch are not kept.
+class History : public Noncopyable {
+  public:
+  enum class Lookup { stored, current, absent };
+
+  History(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  // record that a new version became current with the update of this sequence number.
+  void current(char type, uint64_t id, uint32_t version, uint64_t seqnum);
+  void put(char type, uint64_t id, uint32_t version, uint64_t seqnum, const std::vector<char> &value);
+  // the version that was current after the update with this sequence number: stored if it has since been replaced,
+  // with a copy of its value, current if the version in the database applies, and absent if the element
+  // was created later or the versions current at that time were pruned.
+  Lookup get(char type, uint64_t id, uint64_t seqnum, uint32_t &version, kj::Array<capnp::word> &value);
+  // remove versions that were replaced at or before this sequence number,
+  // and forget when versions that became current at or before it did so.
+  void prune(uint64_t seqnum);
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  MDB_dbi mSeqnumDbi;
+  bool mMissing;
+};
+
+// IDs of elements by the hour of their latest version, one bitmap per hour and element type.
+// Entries are only added, so an element can also be listed under the hours of its older versions;
+// this doesn't matter for "changed since" queries, which take every hour from a time onwards.
+class TimeIndex : public Noncopyable {
+  public:
+  TimeIndex(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  static uint64_t key(int64_t timestamp, osmium::item_type type);
+  void put(uint64_t key, roaring::Roaring64Map &ids, int flags = 0);
+  void add(uint64_t key, roaring::Roaring64Map &ids);
+  // elements whose latest version is from the hour of timestamp or later.
+  void since(int64_t timestamp, roaring::Roaring64Map &nodes, roaring::Roaring64Map &ways, roaring::Roaring64Map &relations);
+
+  private:
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+};
+
+// IDs of elements by tag, per element type and tag key, and per type, key and value.
+// Tag keys are the type ('n', 'w' or 'r') followed by the tag key, or by the tag key, a NUL byte and the value.
+// Each posting list is split like Presence into one bitmap per 2^20 IDs, stored under the tag key followed by
+// the chunk number as a big-endian uint64_t, so updates only rewrite the chunks they touch.
+// A key and value too long for an LMDB key, or with an empty value, is only indexed under its tag key.
+class TagIndex : public Noncopyable {
+  public:
+  TagIndex(MDB_txn *txn, bool create = false);
+  bool exists() const { return !mMissing; }
+  static std::string key(char type, const char *tag_key);
+  static std::string key(char type, const char *tag_key, const char *tag_value);
+  // add and remove IDs of one tag key, deleting chunks that become empty.
+  void update(const std::string &key, roaring::Roaring64Map &added, const roaring::Roaring64Map &removed);
+  // false if the key can't be indexed; otherwise ids holds the matches, which may be none.
+  bool get(const std::string &key, roaring::Roaring64Map &ids);
+
+  private:
+  bool indexed(const std::string &key) const;
+  void put(const std::string &key, uint64_t chunk, roaring::Roaring64Map &ids, int flags = 0);
+  MDB_txn *mTxn;
+  MDB_dbi mDbi;
+  bool mMissing;
+  size_t mMaxKeySize;
+};
+
+// add the nodes of the index level cells in cell_id, using a cell_node cursor. A cell finer than level yields its whole parent.
+void traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &set, int level = CELL_INDEX_LEVEL);
+// like traverseCell, but starting at the index level cell from (or the start of cell_id if it is None)
+// and stopping after the first index level cell that brings set to limit nodes;
+// returns the index level cell to continue from, which is cell_id.child_end(level) once cell_id is done.
+S2CellId traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &set, int level, uint64_t limit, S2CellId from);
+// the number of nodes traverseCell would add, counting no further once it is over limit.
+uint64_t countCell(MDB_cursor *cursor, S2CellId cell_id, int level, uint64_t limit);
 void traverseReverse(MDB_cursor *cursor, uint64_t from, roaring::Roaring64Map &set);
+// add every relation that contains relation_id, directly or through other relations, using a relation_relation cursor.
+void traverseAncestors(MDB_cursor *relation_relation, uint64_t relation_id, roaring::Roaring64Map &set);
 
 } }
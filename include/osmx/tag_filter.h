@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "osmx/storage.h"
+
+namespace osmx {
+
+// A tag filter in the style of osmium tags-filter, compiled once and matched against stored tag lists.
+// Expressions are separated by commas, each [TYPES/]KEY, [TYPES/]KEY=* or [TYPES/]KEY=VALUE,
+// where TYPES is any of n, w and r and defaults to all three.
+// An element matches if any expression for its type matches one of its tags.
+class TagFilter {
+  public:
+  TagFilter(const std::string &expressions);
+  bool valid() const { return !mExpressions.empty(); }
+  // type is 'n', 'w' or 'r'; tags is the flat key,value list of a Node, Way or Relation message.
+  bool matches(char type, capnp::List<capnp::Text>::Reader tags) const;
+  // a superset of the matching IDs of this type, from the tag index.
+  // false if a key of an expression for this type isn't indexed, so the IDs of the type can't be narrowed down.
+  bool candidates(char type, db::TagIndex &tag_index, roaring::Roaring64Map &ids) const;
+
+  private:
+  struct Expression {
+    std::string types;
+    std::string key;
+    std::string value;
+    bool any_value;
+  };
+  std::vector<Expression> mExpressions;
+};
+
+}
@@ -7,6 +7,7 @@
 #define CHECK_LMDB(x) if (0 != x) { printf("%s, file %s, line %d.\n", mdb_strerror(x), __FILE__, __LINE__); abort(); }
 
 // a higher cell level results in more precise extracts, as the size of 1 cell is the minimum index resolution.
+// this is the default; a database records the level it was built with in its cell_level metadata.
 #define CELL_INDEX_LEVEL 16
 
 class Timer {
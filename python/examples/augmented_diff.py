@@ -9,6 +9,7 @@ import osmx
 # generates an augmented diff for an OSC (OsmChange) file.
 # see https://wiki.openstreetmap.org/wiki/Overpass_API/Augmented_Diffs
 # this is intended to be run before the OSC file is applied to the osmx file.
+# `osmx augmented-diff OSMX_FILE OSC_FILE OUTPUT` does the same natively and is much faster for large diffs.
 
 if len(sys.argv) < 4:
     print("Usage: augmented_diff.py OSMX_FILE OSC_FILE OUTPUT")
@@ -9,7 +9,7 @@ if len(sys.argv) <= 1:
 env  = osmx.Environment(sys.argv[1])
 
 # simple implementation of OSM GeoJSON API using osmx + Python standard library.
-# not production ready!
+# not production ready! osmx serve is a multithreaded server for the same queries.
 
 class Handler(BaseHTTPRequestHandler):
     def do_GET(self):
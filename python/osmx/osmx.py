@@ -112,3 +112,21 @@ class WayRelation(Index):
 class RelationRelation(Index):
     def __init__(self,txn):
         super().__init__(txn,b'relation_relation')
+
+# the default S2 cell level of cell_node, for databases without cell_level metadata.
+CELL_INDEX_LEVEL = 16
+
+class Metadata:
+    def __init__(self,txn):
+        self.txn = txn
+        self._handle = txn.env._handle.open_db(b'metadata',txn=txn._handle,create=False)
+
+    def get(self,key):
+        value = self.txn._handle.get(key.encode(),db=self._handle)
+        if value is None:
+            return None
+        return bytes(value).decode()
+
+    def cell_level(self):
+        level = self.get('cell_level')
+        return int(level) if level else CELL_INDEX_LEVEL
@@ -0,0 +1,462 @@
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include "cxxopts.hpp"
+#include "osmium/area/assembler.hpp"
+#include "s2/s2builder.h"
+#include "s2/s2builderutil_s2polygon_layer.h"
+#include "s2/s2error.h"
+#include "s2/s2loop.h"
+#include "s2/s2region_coverer.h"
+#include "s2/util/coding/coder.h"
+#include "osmx/admin.h"
+#include "osmx/geom.h"
+#include "osmx/util.h"
+
+using namespace std;
+
+namespace osmx {
+
+// boundary coverings are at most this level, so a lookup checks the point's cells from level 0 to it.
+static const int ADMIN_CELL_LEVEL = 16;
+static const int ADMIN_COVERING_CELLS = 64;
+
+AdminIndex::AdminIndex(MDB_txn *txn, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, "admin_polygons", MDB_INTEGERKEY | (create ? MDB_CREATE : 0), &mPolygonsDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (mMissing) return;
+  CHECK_LMDB(retval);
+  CHECK_LMDB(mdb_dbi_open(txn, "admin_cells", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP | (create ? MDB_CREATE : 0), &mCellsDbi));
+}
+
+static bool isBoundary(capnp::List<capnp::Text>::Reader tags, int &admin_level) {
+  bool boundary = false;
+  admin_level = 0;
+  for (unsigned int i = 0; i < tags.size() / 2; i++) {
+    if (tags[i*2] == "boundary" && tags[i*2+1] == "administrative") boundary = true;
+    if (tags[i*2] == "admin_level") admin_level = atoi(tags[i*2+1].cStr());
+  }
+  return boundary;
+}
+
+static bool isBoundary(const osmium::TagList &tags, int &admin_level) {
+  const char *level = tags.get_value_by_key("admin_level");
+  admin_level = level ? atoi(level) : 0;
+  return tags.has_tag("boundary","administrative");
+}
+
+// a ring of an assembled area as normalized loops. A ring that is not a valid loop, like one touching itself,
+// is split by S2Builder at its crossings and touching points into loops that are.
+static void addRing(const osmium::NodeRefList &ring, vector<unique_ptr<S2Loop>> &loops) {
+  vector<S2Point> points;
+  for (auto const &node_ref : ring) {
+    S2Point point = S2LatLng::FromDegrees(node_ref.location().lat(),node_ref.location().lon()).Normalized().ToPoint();
+    if (points.empty() || points.back() != point) points.push_back(point);
+  }
+  if (points.size() > 1 && points.front() == points.back()) points.pop_back();
+  if (points.size() < 3) return;
+  auto loop = make_unique<S2Loop>(points,S2Debug::DISABLE);
+  loop->Normalize();
+  if (loop->IsValid()) {
+    loops.push_back(std::move(loop));
+    return;
+  }
+
+  S2Builder::Options options;
+  options.set_split_crossing_edges(true);
+  S2Builder builder(options);
+  S2Polygon repaired;
+  builder.StartLayer(make_unique<s2builderutil::S2PolygonLayer>(&repaired));
+  builder.AddLoop(*loop);
+  S2Error error;
+  if (!builder.Build(&error)) return;
+  for (int i = 0; i < repaired.num_loops(); i++) {
+    if (!repaired.loop(i)->is_hole()) loops.push_back(unique_ptr<S2Loop>(repaired.loop(i)->Clone()));
+  }
+}
+
+static unique_ptr<S2Polygon> unionOf(vector<unique_ptr<S2Loop>> &loops) {
+  vector<unique_ptr<S2Polygon>> polygons;
+  for (auto &loop : loops) polygons.push_back(make_unique<S2Polygon>(std::move(loop)));
+  return S2Polygon::DestructiveUnion(std::move(polygons));
+}
+
+AdminIndex::Assembled AdminIndex::assemble(MDB_txn *txn, uint64_t relation_id, Boundary &boundary) {
+  db::Elements relations(txn,"relations");
+  MDB_val data;
+  if (!relations.get(relation_id,data)) return Assembled::not_boundary;
+  auto relation_reader = db::toReader(data);
+  if (!isBoundary(relation_reader.getRoot<Relation>().getTags(),boundary.admin_level)) return Assembled::not_boundary;
+
+  // osmium's assembler joins the member ways into rings, splits rings that touch, and assigns inner rings to outer rings.
+  geom::Builder builder(txn,geom::Format::wkb);
+  osmium::memory::Buffer areas{1024,osmium::memory::Buffer::auto_grow::yes};
+  if (!builder.assemble(osmium::item_type::relation,relation_id,areas)) return Assembled::invalid;
+  return fromArea(areas.get<osmium::Area>(0),boundary);
+}
+
+AdminIndex::Assembled AdminIndex::assemble(const osmium::Relation &relation, const vector<const osmium::Way *> &ways, Boundary &boundary) {
+  if (!isBoundary(relation.tags(),boundary.admin_level)) return Assembled::not_boundary;
+  // like geom::Builder, only multipolygon and boundary relations have areas.
+  const char *type = relation.tags().get_value_by_key("type");
+  if (!type || (strcmp(type,"multipolygon") != 0 && strcmp(type,"boundary") != 0)) return Assembled::invalid;
+  osmium::area::AssemblerConfig config;
+  osmium::area::Assembler assembler{config};
+  osmium::memory::Buffer areas{1024,osmium::memory::Buffer::auto_grow::yes};
+  if (!assembler(relation,ways,areas) || areas.committed() == 0) return Assembled::invalid;
+  return fromArea(areas.get<osmium::Area>(0),boundary);
+}
+
+AdminIndex::Assembled AdminIndex::fromArea(const osmium::Area &area, Boundary &boundary) {
+  // each outer ring minus its inner rings is built on its own, and the parts are unioned,
+  // so rings that touch or overlap each other don't make the polygon invalid.
+  vector<unique_ptr<S2Polygon>> parts;
+  for (auto const &outer : area.outer_rings()) {
+    vector<unique_ptr<S2Loop>> outer_loops, inner_loops;
+    addRing(outer,outer_loops);
+    if (outer_loops.empty()) continue;
+    for (auto const &inner : area.inner_rings(outer)) addRing(inner,inner_loops);
+    auto part = unionOf(outer_loops);
+    if (!inner_loops.empty()) {
+      auto holes = unionOf(inner_loops);
+      auto difference = make_unique<S2Polygon>();
+      difference->InitToDifference(*part,*holes);
+      part = std::move(difference);
+    }
+    if (!part->is_empty()) parts.push_back(std::move(part));
+  }
+  if (parts.empty()) return Assembled::invalid;
+  auto polygon = S2Polygon::DestructiveUnion(std::move(parts));
+
+  S2RegionCoverer::Options options;
+  options.set_max_cells(ADMIN_COVERING_CELLS);
+  options.set_max_level(ADMIN_CELL_LEVEL);
+  S2RegionCoverer coverer(options);
+  coverer.GetCovering(*polygon,&boundary.covering);
+  coverer.GetInteriorCovering(*polygon,&boundary.interior);
+
+  Encoder encoder;
+  polygon->Encode(&encoder);
+  boundary.polygon.assign(encoder.base(),encoder.length());
+  return Assembled::ok;
+}
+
+// values are admin_level and the numbers of covering and interior cells as int32_t,
+// the cells as uint64_t, then the encoded polygon.
+void AdminIndex::put(uint64_t relation_id, const Boundary &boundary) {
+  del(relation_id);
+  int32_t header[3] = {boundary.admin_level,(int32_t)boundary.covering.size(),(int32_t)boundary.interior.size()};
+  string value((const char *)header,sizeof(header));
+  for (auto const &cell_id : boundary.covering) value.append((const char *)&cell_id,sizeof(uint64_t));
+  for (auto const &cell_id : boundary.interior) value.append((const char *)&cell_id,sizeof(uint64_t));
+  value += boundary.polygon;
+
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&relation_id;
+  data.mv_size = value.size();
+  data.mv_data = (void *)value.data();
+  CHECK_LMDB(mdb_put(mTxn, mPolygonsDbi, &key, &data, 0));
+
+  auto putCells = [&](const vector<S2CellId> &cells, uint64_t entry) {
+    for (auto const &cell_id : cells) {
+      uint64_t cell = cell_id.id();
+      key.mv_data = (void *)&cell;
+      data.mv_size = sizeof(uint64_t);
+      data.mv_data = (void *)&entry;
+      CHECK_LMDB(mdb_put(mTxn, mCellsDbi, &key, &data, 0));
+    }
+  };
+  putCells(boundary.covering,relation_id << 1);
+  putCells(boundary.interior,relation_id << 1 | 1);
+  mPolygons.erase(relation_id);
+}
+
+void AdminIndex::del(uint64_t relation_id) {
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&relation_id;
+  if (mdb_get(mTxn, mPolygonsDbi, &key, &data) != 0) return;
+  int32_t header[3];
+  memcpy(header,data.mv_data,sizeof(header));
+  vector<uint64_t> cells(header[1] + header[2]);
+  memcpy(cells.data(),(const char *)data.mv_data + sizeof(header),cells.size() * sizeof(uint64_t));
+  CHECK_LMDB(mdb_del(mTxn, mPolygonsDbi, &key, NULL));
+
+  for (size_t i = 0; i < cells.size(); i++) {
+    uint64_t entry = relation_id << 1 | (i >= (size_t)header[1] ? 1 : 0);
+    MDB_val cell_key, cell_data;
+    cell_key.mv_size = sizeof(uint64_t);
+    cell_key.mv_data = (void *)&cells[i];
+    cell_data.mv_size = sizeof(uint64_t);
+    cell_data.mv_data = (void *)&entry;
+    mdb_del(mTxn, mCellsDbi, &cell_key, &cell_data);
+  }
+  mPolygons.erase(relation_id);
+}
+
+void AdminIndex::clear() {
+  CHECK_LMDB(mdb_drop(mTxn, mPolygonsDbi, 0));
+  CHECK_LMDB(mdb_drop(mTxn, mCellsDbi, 0));
+  mPolygons.clear();
+}
+
+bool AdminIndex::contains(uint64_t relation_id) {
+  if (mMissing) return false;
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&relation_id;
+  return mdb_get(mTxn, mPolygonsDbi, &key, &data) == 0;
+}
+
+// decoded polygons are cached for the lifetime of the index, as lookups of nearby points test the same ones.
+AdminIndex::Polygon &AdminIndex::load(uint64_t relation_id) {
+  auto found = mPolygons.find(relation_id);
+  if (found != mPolygons.end()) return found->second;
+  Polygon &polygon = mPolygons[relation_id];
+  polygon.polygon = make_unique<S2Polygon>();
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&relation_id;
+  CHECK_LMDB(mdb_get(mTxn, mPolygonsDbi, &key, &data));
+  int32_t header[3];
+  memcpy(header,data.mv_data,sizeof(header));
+  polygon.admin_level = header[0];
+  size_t offset = sizeof(header) + (header[1] + header[2]) * sizeof(uint64_t);
+  Decoder decoder((const char *)data.mv_data + offset,data.mv_size - offset);
+  polygon.polygon->Decode(&decoder);
+  return polygon;
+}
+
+vector<AdminArea> AdminIndex::lookup(const S2LatLng &point) {
+  vector<AdminArea> areas;
+  if (mMissing) return areas;
+  S2Point target = point.Normalized().ToPoint();
+  S2CellId leaf(target);
+
+  map<uint64_t,bool> candidates;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mCellsDbi, &cursor));
+  for (int level = 0; level <= ADMIN_CELL_LEVEL; level++) {
+    uint64_t cell = leaf.parent(level).id();
+    MDB_val key, data;
+    key.mv_size = sizeof(uint64_t);
+    key.mv_data = (void *)&cell;
+    if (mdb_cursor_get(cursor,&key,&data,MDB_SET) != 0) continue;
+    int retval = mdb_cursor_get(cursor,&key,&data,MDB_GET_MULTIPLE);
+    while (retval == 0) {
+      for (size_t i = 0; i < data.mv_size / sizeof(uint64_t); i++) {
+        uint64_t entry = ((uint64_t *)data.mv_data)[i];
+        candidates[entry >> 1] |= (entry & 1) == 1;
+      }
+      retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT_MULTIPLE);
+    }
+  }
+  mdb_cursor_close(cursor);
+
+  for (auto const &candidate : candidates) {
+    Polygon &polygon = load(candidate.first);
+    if (candidate.second || polygon.polygon->Contains(target)) areas.push_back(AdminArea{candidate.first,polygon.admin_level});
+  }
+  stable_sort(areas.begin(),areas.end(),[](const AdminArea &a, const AdminArea &b) {
+    return a.admin_level < b.admin_level;
+  });
+  return areas;
+}
+
+}
+
+using namespace osmx;
+
+// boundaries are assembled on all threads, each with its own read transaction, in batches of this many.
+static const size_t ADMIN_BUILD_BATCH = 4096;
+
+static void buildAdmin(MDB_env *env) {
+  vector<uint64_t> relation_ids;
+  {
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    db::TagIndex tag_index(txn);
+    roaring::Roaring64Map ids;
+    if (tag_index.exists()) {
+      tag_index.get(db::TagIndex::key('r',"boundary","administrative"),ids);
+    } else {
+      MDB_dbi dbi;
+      MDB_cursor *cursor;
+      CHECK_LMDB(mdb_dbi_open(txn, "relations", MDB_INTEGERKEY, &dbi));
+      CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+      MDB_val key, data;
+      int retval = mdb_cursor_get(cursor,&key,&data,MDB_FIRST);
+      while (retval == 0) {
+        ids.add(*(uint64_t *)key.mv_data);
+        retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT);
+      }
+      mdb_cursor_close(cursor);
+    }
+    for (auto id : ids) relation_ids.push_back(id);
+    mdb_txn_abort(txn);
+  }
+
+  {
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+    AdminIndex(txn,true).clear();
+    CHECK_LMDB(mdb_txn_commit(txn));
+  }
+  db::openTables(env);
+
+  unsigned int num_threads = max(1u,std::thread::hardware_concurrency());
+  size_t built = 0;
+  vector<uint64_t> dropped;
+  for (size_t begin = 0; begin < relation_ids.size(); begin += ADMIN_BUILD_BATCH) {
+    size_t end = min(begin + ADMIN_BUILD_BATCH,relation_ids.size());
+    vector<AdminIndex::Boundary> boundaries(end - begin);
+    vector<AdminIndex::Assembled> assembled(end - begin,AdminIndex::Assembled::not_boundary);
+    std::atomic<size_t> next{begin};
+    vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&]() {
+        MDB_txn *txn;
+        CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+        size_t i;
+        while ((i = next++) < end) {
+          assembled[i - begin] = AdminIndex::assemble(txn,relation_ids[i],boundaries[i - begin]);
+        }
+        mdb_txn_abort(txn);
+      });
+    }
+    for (auto &thread : threads) thread.join();
+
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+    AdminIndex index(txn);
+    for (size_t i = begin; i < end; i++) {
+      if (assembled[i - begin] == AdminIndex::Assembled::invalid) dropped.push_back(relation_ids[i]);
+      if (assembled[i - begin] != AdminIndex::Assembled::ok) continue;
+      index.put(relation_ids[i],boundaries[i - begin]);
+      built++;
+    }
+    CHECK_LMDB(mdb_txn_commit(txn));
+  }
+  cout << "Indexed " << built << " of " << relation_ids.size() << " candidate relations." << endl;
+  if (!dropped.empty()) {
+    cout << "No polygon could be built for " << dropped.size() << " boundary relations:";
+    for (auto relation_id : dropped) cout << " " << relation_id;
+    cout << endl;
+  }
+}
+
+static string describe(AdminIndex &index, db::Elements &relations, const S2LatLng &point) {
+  stringstream line;
+  line << point.lat().degrees() << "," << point.lng().degrees();
+  for (auto const &area : index.lookup(point)) {
+    line << "\t" << area.admin_level << ":" << area.relation_id << ":";
+    MDB_val data;
+    if (!relations.get(area.relation_id,data)) continue;
+    auto reader = db::toReader(data);
+    auto tags = reader.getRoot<Relation>().getTags();
+    for (unsigned int i = 0; i < tags.size() / 2; i++) {
+      if (tags[i*2] == "name") line << tags[i*2+1].cStr();
+    }
+  }
+  return line.str();
+}
+
+static bool parsePoint(const string &text, S2LatLng &point) {
+  double lat, lon;
+  char sep;
+  stringstream stream(text);
+  if (!(stream >> lat >> sep >> lon) || sep != ',') return false;
+  point = S2LatLng::FromDegrees(lat,lon);
+  return true;
+}
+
+// points are read from stdin as LAT,LON lines and looked up on all threads, in chunks of this many.
+static const size_t ADMIN_LOOKUP_BATCH = 1000000;
+
+static void lookupAdmin(MDB_env *env, istream &input) {
+  db::openTables(env);
+  unsigned int num_threads = max(1u,std::thread::hardware_concurrency());
+  vector<S2LatLng> points;
+  auto lookupBatch = [&]() {
+    vector<string> lines(points.size());
+    std::atomic<size_t> next{0};
+    vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&]() {
+        MDB_txn *txn;
+        CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+        AdminIndex index(txn);
+        db::Elements relations(txn,"relations");
+        size_t i;
+        while ((i = next++) < points.size()) lines[i] = describe(index,relations,points[i]);
+        mdb_txn_abort(txn);
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    for (auto const &line : lines) cout << line << "\n";
+    points.clear();
+  };
+
+  string text;
+  while (getline(input,text)) {
+    S2LatLng point;
+    if (!parsePoint(text,point)) continue;
+    points.push_back(point);
+    if (points.size() == ADMIN_LOOKUP_BATCH) lookupBatch();
+  }
+  lookupBatch();
+  cout << flush;
+}
+
+void cmdAdmin(int argc, char* argv[]) {
+  cxxopts::Options cmd_options("Admin", "Look up the administrative boundaries containing points.");
+  cmd_options.add_options()
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", "Input .osmx", cxxopts::value<string>())
+    ("action", "build or lookup", cxxopts::value<string>())
+    ("point", "LAT,LON to look up instead of reading stdin", cxxopts::value<string>())
+  ;
+  cmd_options.parse_positional({"cmd","osmx","action"});
+  auto result = cmd_options.parse(argc, argv);
+
+  string action = result.count("action") ? result["action"].as<string>() : "";
+  if (result.count("osmx") == 0 || !(action == "build" || action == "lookup")) {
+    cout << "Usage: osmx admin OSMX_FILE build" << endl;
+    cout << "       osmx admin OSMX_FILE lookup [--point LAT,LON]" << endl;
+    cout << "build assembles boundary=administrative relations into polygons, which updates keep current." << endl;
+    cout << "lookup reads LAT,LON lines from stdin and prints each point with ADMIN_LEVEL:RELATION_ID:NAME of every boundary containing it." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx admin planet.osmx build" << endl;
+    cout << " osmx admin planet.osmx lookup --point 40.7411,-73.9937" << endl;
+    exit(1);
+  }
+
+  MDB_env* env = db::createEnv(result["osmx"].as<string>(),action == "build");
+  if (action == "build") {
+    Timer timer("admin build");
+    buildAdmin(env);
+  } else {
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    bool indexed = AdminIndex(txn).exists();
+    mdb_txn_abort(txn);
+    if (!indexed) {
+      cout << "No boundary index; create it with osmx admin OSMX_FILE build." << endl;
+      exit(1);
+    }
+    if (result.count("point")) {
+      stringstream input(result["point"].as<string>());
+      lookupAdmin(env,input);
+    } else {
+      lookupAdmin(env,cin);
+    }
+  }
+  mdb_env_sync(env,true);
+  mdb_env_close(env);
+}
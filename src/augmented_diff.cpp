@@ -0,0 +1,567 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+#include "cxxopts.hpp"
+#include "osmium/io/any_input.hpp"
+#include "osmium/osm/box.hpp"
+#include "osmium/osm/object_comparisons.hpp"
+#include "osmium/osm/timestamp.hpp"
+#include "roaring/roaring64map.hh"
+#include "osmx/storage.h"
+#include "osmx/util.h"
+
+using namespace std;
+using namespace osmx;
+
+// Generates an augmented diff for an OSC (OsmChange) file.
+// see https://wiki.openstreetmap.org/wiki/Overpass_API/Augmented_Diffs
+// This is intended to be run before the OSC file is applied to the osmx file:
+// the database holds the old versions and the diff holds the new ones.
+// Everything is read in one read transaction, and each table is read once in ascending key order.
+
+namespace {
+
+struct Member {
+  osmium::item_type type;
+  uint64_t ref;
+  string role;
+};
+
+// one version of an element, read either from the diff or from the database.
+struct Element {
+  osmium::item_type type;
+  uint64_t id = 0;
+  bool visible = true;
+  bool has_metadata = false;
+  uint32_t version = 0;
+  int64_t timestamp = 0;
+  uint64_t changeset = 0;
+  uint32_t uid = 0;
+  string user;
+  vector<pair<string,string>> tags;
+  osmium::Location location;
+  vector<uint64_t> refs;
+  vector<Member> members;
+};
+
+string escape(const string &s) {
+  string out;
+  out.reserve(s.size());
+  for (char c : s) {
+    switch (c) {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"': out += "&quot;"; break;
+      case '\n': out += "&#10;"; break;
+      default: out += c;
+    }
+  }
+  return out;
+}
+
+const char *typeName(osmium::item_type type) {
+  if (type == osmium::item_type::node) return "node";
+  if (type == osmium::item_type::way) return "way";
+  return "relation";
+}
+
+osmium::item_type fromMemberType(RelationMember::Type type) {
+  if (type == RelationMember::Type::NODE) return osmium::item_type::node;
+  if (type == RelationMember::Type::WAY) return osmium::item_type::way;
+  return osmium::item_type::relation;
+}
+
+template <typename T>
+void setMetadata(Element &element, T metadata) {
+  element.has_metadata = true;
+  element.version = metadata.getVersion();
+  element.timestamp = metadata.getTimestamp();
+  element.changeset = metadata.getChangeset();
+  element.uid = metadata.getUid();
+  element.user = metadata.getUser().cStr();
+}
+
+template <typename T>
+void copyTags(Element &element, T tags) {
+  for (unsigned int i = 0; i + 1 < tags.size(); i += 2) {
+    element.tags.emplace_back(tags[i].cStr(),tags[i+1].cStr());
+  }
+}
+
+Element fromObject(const osmium::OSMObject &object) {
+  Element element;
+  element.type = object.type();
+  element.id = object.id();
+  element.visible = object.visible();
+  element.has_metadata = true;
+  element.version = object.version();
+  element.timestamp = object.timestamp().seconds_since_epoch();
+  element.changeset = object.changeset();
+  element.uid = object.uid();
+  element.user = object.user();
+  for (auto const &tag : object.tags()) element.tags.emplace_back(tag.key(),tag.value());
+  if (object.type() == osmium::item_type::node) {
+    element.location = static_cast<const osmium::Node &>(object).location();
+  } else if (object.type() == osmium::item_type::way) {
+    for (auto const &node_ref : static_cast<const osmium::Way &>(object).nodes()) element.refs.push_back(node_ref.ref());
+  } else {
+    for (auto const &member : static_cast<const osmium::Relation &>(object).members()) {
+      element.members.push_back(Member{member.type(),(uint64_t)member.ref(),member.role()});
+    }
+  }
+  return element;
+}
+
+class AugmentedDiff {
+  public:
+  AugmentedDiff(MDB_txn *txn) : mTxn(txn) {
+  }
+
+  void add(osmium::memory::Buffer &&buffer) {
+    for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+      mObjects.push_back(&*it);
+    }
+    mBuffers.push_back(std::move(buffer));
+  }
+
+  void write(ostream &out) {
+    // keep only the latest version of each element, like osmx update does.
+    stable_sort(mObjects.begin(),mObjects.end(),[](const osmium::OSMObject *a, const osmium::OSMObject *b) {
+      return osmium::object_order_type_id_version()(*a,*b);
+    });
+    vector<const osmium::OSMObject *> changes;
+    for (size_t i = 0; i < mObjects.size(); i++) {
+      if (i + 1 < mObjects.size() && mObjects[i+1]->type() == mObjects[i]->type() && mObjects[i+1]->id() == mObjects[i]->id()) continue;
+      changes.push_back(mObjects[i]);
+    }
+
+    for (auto object : changes) {
+      uint64_t id = object->id();
+      if (object->type() == osmium::item_type::node) {
+        mChangedNodes.add(id);
+        if (object->visible()) mNewLocations[id] = static_cast<const osmium::Node *>(object)->location();
+      } else if (object->type() == osmium::item_type::way) {
+        mChangedWays.add(id);
+        if (object->visible()) mNewWays[id] = static_cast<const osmium::Way *>(object);
+      } else if (object->type() == osmium::item_type::relation) {
+        mChangedRelations.add(id);
+        if (object->visible()) mNewRelations[id] = static_cast<const osmium::Relation *>(object);
+      }
+    }
+
+    loadOld();
+    findAffected();
+    loadGeometry();
+
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    out << "<osm version=\"0.6\" generator=\"Overpass API not used, but achavi detects it at the start of string; OSMExpress osmx augmented-diff\">\n";
+    out << "  <note>The data included in this document is from www.openstreetmap.org. The data is made available under ODbL.</note>\n";
+    out << std::fixed << std::setprecision(7);
+
+    // changes are already sorted by type and ID; affected parents are merged in that order.
+    auto affected_way = mAffectedWays.begin();
+    auto affected_relation = mAffectedRelations.begin();
+    for (auto object : changes) {
+      if (object->type() == osmium::item_type::relation) {
+        for (; affected_way != mAffectedWays.end(); ++affected_way) writeAffected(out,osmium::item_type::way,*affected_way);
+        for (; affected_relation != mAffectedRelations.end() && *affected_relation < (uint64_t)object->id(); ++affected_relation) {
+          writeAffected(out,osmium::item_type::relation,*affected_relation);
+        }
+      } else if (object->type() == osmium::item_type::way) {
+        for (; affected_way != mAffectedWays.end() && *affected_way < (uint64_t)object->id(); ++affected_way) {
+          writeAffected(out,osmium::item_type::way,*affected_way);
+        }
+      }
+      writeChange(out,*object);
+    }
+    for (; affected_way != mAffectedWays.end(); ++affected_way) writeAffected(out,osmium::item_type::way,*affected_way);
+    for (; affected_relation != mAffectedRelations.end(); ++affected_relation) writeAffected(out,osmium::item_type::relation,*affected_relation);
+
+    out << "</osm>\n";
+  }
+
+  private:
+  // read the stored versions of all changed elements in key order.
+  void loadOld() {
+    db::Locations locations(mTxn);
+    db::Elements nodes(mTxn,"nodes");
+    db::Elements ways(mTxn,"ways");
+    db::Elements relations(mTxn,"relations");
+    for (auto id : mChangedNodes) {
+      auto location = locations.get(id);
+      if (!location.is_defined()) continue;
+      Element element;
+      element.type = osmium::item_type::node;
+      element.id = id;
+      element.location = location.coords;
+      element.version = location.version;
+      MDB_val data;
+      if (nodes.get(id,data)) {
+        auto reader = db::toReader(data);
+        auto node = reader.getRoot<Node>();
+        setMetadata(element,node.getMetadata());
+        copyTags(element,node.getTags());
+      }
+      mOldNodes[id] = std::move(element);
+    }
+    for (auto id : mChangedWays) loadWay(ways,id);
+    for (auto id : mChangedRelations) loadRelation(relations,id);
+  }
+
+  void loadWay(db::Elements &ways, uint64_t id) {
+    MDB_val data;
+    if (mOldWays.count(id) || !ways.get(id,data)) return;
+    auto reader = db::toReader(data);
+    auto way = reader.getRoot<Way>();
+    Element element;
+    element.type = osmium::item_type::way;
+    element.id = id;
+    setMetadata(element,way.getMetadata());
+    copyTags(element,way.getTags());
+    for (auto node_id : way.getNodes()) element.refs.push_back(node_id);
+    mOldWays[id] = std::move(element);
+  }
+
+  void loadRelation(db::Elements &relations, uint64_t id) {
+    MDB_val data;
+    if (mOldRelations.count(id) || !relations.get(id,data)) return;
+    auto reader = db::toReader(data);
+    auto relation = reader.getRoot<Relation>();
+    Element element;
+    element.type = osmium::item_type::relation;
+    element.id = id;
+    setMetadata(element,relation.getMetadata());
+    copyTags(element,relation.getTags());
+    for (auto const &member : relation.getMembers()) {
+      element.members.push_back(Member{fromMemberType(member.getType()),member.getRef(),member.getRole().cStr()});
+    }
+    mOldRelations[id] = std::move(element);
+  }
+
+  // A node that moved changes the geometry of its parent ways and relations,
+  // a way whose node list changed changes the geometry of its parent relations,
+  // and a relation whose geometry or member list changed changes the geometry of the relations containing it.
+  void findAffected() {
+    MDB_dbi dbi;
+    MDB_cursor *node_way, *node_relation, *way_relation, *relation_relation;
+    unsigned int flags = MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP;
+    CHECK_LMDB(mdb_dbi_open(mTxn, "node_way", flags, &dbi));
+    CHECK_LMDB(mdb_cursor_open(mTxn, dbi, &node_way));
+    CHECK_LMDB(mdb_dbi_open(mTxn, "node_relation", flags, &dbi));
+    CHECK_LMDB(mdb_cursor_open(mTxn, dbi, &node_relation));
+    CHECK_LMDB(mdb_dbi_open(mTxn, "way_relation", flags, &dbi));
+    CHECK_LMDB(mdb_cursor_open(mTxn, dbi, &way_relation));
+    CHECK_LMDB(mdb_dbi_open(mTxn, "relation_relation", flags, &dbi));
+    CHECK_LMDB(mdb_cursor_open(mTxn, dbi, &relation_relation));
+
+    for (auto id : mChangedNodes) {
+      auto old_node = mOldNodes.find(id);
+      if (old_node == mOldNodes.end()) continue;
+      auto new_location = mNewLocations.find(id);
+      if (new_location != mNewLocations.end() && new_location->second == old_node->second.location) continue;
+      db::traverseReverse(node_way,id,mAffectedWays);
+      db::traverseReverse(node_relation,id,mAffectedRelations);
+    }
+    mAffectedWays -= mChangedWays;
+
+    roaring::Roaring64Map reshaped_ways = mAffectedWays;
+    for (auto id : mChangedWays) {
+      auto old_way = mOldWays.find(id);
+      auto new_way = mNewWays.find(id);
+      if (old_way == mOldWays.end()) continue;
+      if (new_way != mNewWays.end()) {
+        auto const &nodes = new_way->second->nodes();
+        auto const &refs = old_way->second.refs;
+        bool same = nodes.size() == refs.size();
+        for (size_t i = 0; same && i < refs.size(); i++) same = (uint64_t)nodes[i].ref() == refs[i];
+        if (same) continue;
+      }
+      reshaped_ways.add(id);
+    }
+    for (auto id : reshaped_ways) db::traverseReverse(way_relation,id,mAffectedRelations);
+
+    roaring::Roaring64Map reshaped_relations = mAffectedRelations;
+    for (auto id : mChangedRelations) {
+      auto old_relation = mOldRelations.find(id);
+      auto new_relation = mNewRelations.find(id);
+      if (old_relation == mOldRelations.end()) continue;
+      if (new_relation != mNewRelations.end()) {
+        auto const &members = new_relation->second->members();
+        auto const &old_members = old_relation->second.members;
+        bool same = members.size() == old_members.size();
+        auto member = members.begin();
+        for (size_t i = 0; same && i < old_members.size(); i++, ++member) {
+          same = member->type() == old_members[i].type && (uint64_t)member->ref() == old_members[i].ref;
+        }
+        if (same) continue;
+      }
+      reshaped_relations.add(id);
+    }
+    for (auto id : reshaped_relations) db::traverseAncestors(relation_relation,id,mAffectedRelations);
+    mAffectedRelations -= mChangedRelations;
+
+    mdb_cursor_close(node_way);
+    mdb_cursor_close(node_relation);
+    mdb_cursor_close(way_relation);
+    mdb_cursor_close(relation_relation);
+  }
+
+  // batch-read every way and node location needed for the old and new geometries.
+  void loadGeometry() {
+    db::Elements ways(mTxn,"ways");
+    db::Elements relations(mTxn,"relations");
+    for (auto id : mAffectedRelations) loadRelation(relations,id);
+
+    roaring::Roaring64Map way_ids = mAffectedWays;
+    auto addMembers = [&](const vector<Member> &members) {
+      for (auto const &member : members) {
+        if (member.type == osmium::item_type::way) way_ids.add(member.ref);
+      }
+    };
+    for (auto const &relation : mOldRelations) addMembers(relation.second.members);
+    for (auto const &relation : mNewRelations) {
+      for (auto const &member : relation.second->members()) {
+        if (member.type() == osmium::item_type::way) way_ids.add(member.ref());
+      }
+    }
+    for (auto id : way_ids) loadWay(ways,id);
+
+    roaring::Roaring64Map node_ids;
+    for (auto const &way : mOldWays) {
+      for (auto ref : way.second.refs) node_ids.add(ref);
+    }
+    for (auto const &way : mNewWays) {
+      for (auto const &node_ref : way.second->nodes()) node_ids.add(node_ref.ref());
+    }
+    for (auto const &relation : mOldRelations) {
+      for (auto const &member : relation.second.members) {
+        if (member.type == osmium::item_type::node) node_ids.add(member.ref);
+      }
+    }
+    for (auto const &relation : mNewRelations) {
+      for (auto const &member : relation.second->members()) {
+        if (member.type() == osmium::item_type::node) node_ids.add(member.ref());
+      }
+    }
+    db::Locations locations(mTxn);
+    for (auto id : node_ids) {
+      auto location = locations.get(id);
+      if (location.is_defined()) mOldLocations[id] = location.coords;
+    }
+  }
+
+  osmium::Location location(uint64_t id, bool use_new) const {
+    if (use_new) {
+      auto found = mNewLocations.find(id);
+      if (found != mNewLocations.end()) return found->second;
+      if (mChangedNodes.contains(id)) return osmium::Location{};
+    }
+    auto found = mOldLocations.find(id);
+    if (found != mOldLocations.end()) return found->second;
+    return osmium::Location{};
+  }
+
+  vector<uint64_t> wayRefs(uint64_t id, bool use_new) const {
+    vector<uint64_t> refs;
+    if (use_new) {
+      auto found = mNewWays.find(id);
+      if (found != mNewWays.end()) {
+        for (auto const &node_ref : found->second->nodes()) refs.push_back(node_ref.ref());
+        return refs;
+      }
+    }
+    auto found = mOldWays.find(id);
+    if (found != mOldWays.end()) refs = found->second.refs;
+    return refs;
+  }
+
+  void writeElement(ostream &out, const Element &element, bool use_new) {
+    out << "      <" << typeName(element.type) << " id=\"" << element.id << "\"";
+    if (!element.visible) out << " visible=\"false\"";
+    out << " version=\"" << element.version << "\"";
+    if (element.has_metadata) {
+      out << " timestamp=\"" << osmium::Timestamp(element.timestamp).to_iso() << "\"";
+      out << " changeset=\"" << element.changeset << "\"";
+      out << " uid=\"" << element.uid << "\"";
+      out << " user=\"" << escape(element.user) << "\"";
+    }
+    if (element.type == osmium::item_type::node && element.visible && element.location.valid()) {
+      out << " lat=\"" << element.location.lat() << "\" lon=\"" << element.location.lon() << "\"";
+    }
+    if (!element.visible || (element.tags.empty() && element.refs.empty() && element.members.empty())) {
+      out << "/>\n";
+      return;
+    }
+    out << ">\n";
+
+    if (element.type == osmium::item_type::way) {
+      vector<osmium::Location> locs;
+      for (auto ref : element.refs) locs.push_back(location(ref,use_new));
+      writeBounds(out,locs);
+      for (size_t i = 0; i < locs.size(); i++) {
+        out << "        <nd ref=\"" << element.refs[i] << "\"";
+        if (locs[i].valid()) out << " lon=\"" << locs[i].lon() << "\" lat=\"" << locs[i].lat() << "\"";
+        out << "/>\n";
+      }
+    } else if (element.type == osmium::item_type::relation) {
+      vector<vector<osmium::Location>> member_locs;
+      vector<osmium::Location> all_locs;
+      for (auto const &member : element.members) {
+        member_locs.emplace_back();
+        if (member.type == osmium::item_type::node) {
+          member_locs.back().push_back(location(member.ref,use_new));
+        } else if (member.type == osmium::item_type::way) {
+          for (auto ref : wayRefs(member.ref,use_new)) member_locs.back().push_back(location(ref,use_new));
+        }
+        all_locs.insert(all_locs.end(),member_locs.back().begin(),member_locs.back().end());
+      }
+      writeBounds(out,all_locs);
+      for (size_t i = 0; i < element.members.size(); i++) {
+        auto const &member = element.members[i];
+        out << "        <member type=\"" << typeName(member.type) << "\" ref=\"" << member.ref << "\" role=\"" << escape(member.role) << "\"";
+        if (member.type == osmium::item_type::node && member_locs[i][0].valid()) {
+          out << " lat=\"" << member_locs[i][0].lat() << "\" lon=\"" << member_locs[i][0].lon() << "\"/>\n";
+        } else if (member.type == osmium::item_type::way && !member_locs[i].empty()) {
+          out << ">\n";
+          for (auto const &loc : member_locs[i]) {
+            out << "          <nd";
+            if (loc.valid()) out << " lon=\"" << loc.lon() << "\" lat=\"" << loc.lat() << "\"";
+            out << "/>\n";
+          }
+          out << "        </member>\n";
+        } else {
+          out << "/>\n";
+        }
+      }
+    }
+
+    for (auto const &tag : element.tags) {
+      out << "        <tag k=\"" << escape(tag.first) << "\" v=\"" << escape(tag.second) << "\"/>\n";
+    }
+    out << "      </" << typeName(element.type) << ">\n";
+  }
+
+  void writeBounds(ostream &out, const vector<osmium::Location> &locs) {
+    osmium::Box box;
+    for (auto const &loc : locs) {
+      if (loc.valid()) box.extend(loc);
+    }
+    if (!box.valid()) return;
+    out << "        <bounds minlat=\"" << box.bottom_left().lat() << "\" minlon=\"" << box.bottom_left().lon();
+    out << "\" maxlat=\"" << box.top_right().lat() << "\" maxlon=\"" << box.top_right().lon() << "\"/>\n";
+  }
+
+  const Element *oldElement(osmium::item_type type, uint64_t id) const {
+    const unordered_map<uint64_t,Element> &olds = type == osmium::item_type::node ? mOldNodes : (type == osmium::item_type::way ? mOldWays : mOldRelations);
+    auto found = olds.find(id);
+    if (found == olds.end()) return nullptr;
+    return &found->second;
+  }
+
+  void writeChange(ostream &out, const osmium::OSMObject &object) {
+    const Element *old_element = oldElement(object.type(),object.id());
+    Element new_element = fromObject(object);
+    const char *action;
+    if (!object.visible()) {
+      // created and deleted within the diff interval.
+      if (!old_element) return;
+      action = "delete";
+    } else if (old_element) {
+      action = "modify";
+    } else {
+      action = "create";
+    }
+
+    out << "  <action type=\"" << action << "\">\n";
+    if (old_element) {
+      out << "    <old>\n";
+      writeElement(out,*old_element,false);
+      out << "    </old>\n";
+      out << "    <new>\n";
+      writeElement(out,new_element,true);
+      out << "    </new>\n";
+    } else {
+      writeElement(out,new_element,true);
+    }
+    out << "  </action>\n";
+  }
+
+  // a parent that is unchanged itself but whose geometry changed through its members.
+  void writeAffected(ostream &out, osmium::item_type type, uint64_t id) {
+    const Element *element = oldElement(type,id);
+    if (!element) return;
+    out << "  <action type=\"modify\">\n";
+    out << "    <old>\n";
+    writeElement(out,*element,false);
+    out << "    </old>\n";
+    out << "    <new>\n";
+    writeElement(out,*element,true);
+    out << "    </new>\n";
+    out << "  </action>\n";
+  }
+
+  MDB_txn *mTxn;
+  vector<osmium::memory::Buffer> mBuffers;
+  vector<const osmium::OSMObject *> mObjects;
+
+  roaring::Roaring64Map mChangedNodes;
+  roaring::Roaring64Map mChangedWays;
+  roaring::Roaring64Map mChangedRelations;
+  roaring::Roaring64Map mAffectedWays;
+  roaring::Roaring64Map mAffectedRelations;
+
+  unordered_map<uint64_t,osmium::Location> mNewLocations;
+  unordered_map<uint64_t,const osmium::Way *> mNewWays;
+  unordered_map<uint64_t,const osmium::Relation *> mNewRelations;
+
+  unordered_map<uint64_t,osmium::Location> mOldLocations;
+  unordered_map<uint64_t,Element> mOldNodes;
+  unordered_map<uint64_t,Element> mOldWays;
+  unordered_map<uint64_t,Element> mOldRelations;
+};
+
+}
+
+void cmdAugmentedDiff(int argc, char* argv[]) {
+  cxxopts::Options cmdoptions("AugmentedDiff", "Create an augmented diff for a .osc diff.");
+  cmdoptions.add_options()
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", ".osmx the diff applies to", cxxopts::value<string>())
+    ("osc", ".osc to augment", cxxopts::value<string>())
+    ("output", "Output file", cxxopts::value<string>())
+  ;
+
+  cmdoptions.parse_positional({"cmd","osmx","osc","output"});
+  auto result = cmdoptions.parse(argc, argv);
+
+  if (result.count("osmx") == 0 || result.count("osc") == 0 || result.count("output") == 0) {
+    cout << "Usage: osmx augmented-diff OSMX_FILE OSC_FILE OUTPUT" << endl;
+    cout << "Writes an augmented diff of OSC_FILE with old versions, geometries and affected parent ways and relations." << endl;
+    cout << "Run it before OSC_FILE is applied with osmx update." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx augmented-diff planet.osmx 123456.osc 123456.adiff" << endl;
+    exit(1);
+  }
+
+  MDB_env* env = db::createEnv(result["osmx"].as<string>());
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+
+  AugmentedDiff augmented_diff(txn);
+  const osmium::io::File input_file{result["osc"].as<string>()};
+  osmium::io::Reader reader{input_file, osmium::osm_entity_bits::object};
+  while (osmium::memory::Buffer buffer = reader.read()) {
+    augmented_diff.add(std::move(buffer));
+  }
+  reader.close();
+
+  std::ofstream out(result["output"].as<string>());
+  augmented_diff.write(out);
+  out.close();
+
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+}
@@ -1,5 +1,9 @@
 #include <vector>
+#include <memory>
+#include <limits>
+#include "s2/s2cell_union.h"
 #include "osmx/storage.h"
+#include "osmx/proximity.h"
 #include "osmx/cmd.h"
 #include "osmx/util.h"
 
@@ -12,7 +16,14 @@ void printHelp() {
   cout << " expand   Convert an OSM PBF or XML to an osmx database." << endl;
   cout << " extract  Create a regional extract PBF from an osmx database." << endl;
   cout << " update   Apply an OSM changeset to an osmx database." << endl;
+  cout << " updated  Keep an osmx database open and apply diffs from a replication directory." << endl;
   cout << " query    Look up objects by ID in an osmx database." << endl;
+  cout << " augmented-diff  Create an augmented diff for an OSM changeset before it is applied." << endl;
+  cout << " regions  Register regions that get their own diffs during update." << endl;
+  cout << " stats    Estimate element counts of a region, or split it into parts of equal size." << endl;
+  cout << " reindex  Rebuild the spatial index of an osmx database at a different cell level." << endl;
+  cout << " admin    Index administrative boundaries and look up the ones containing points." << endl;
+  cout << " serve    Answer element, geometry, extract and stats queries over HTTP." << endl;
   exit(1);
 }
 
@@ -27,6 +38,10 @@ void printQueryHelp() {
   cout << " [node,way,relation] ID: print OSM object" << endl;
   cout << " timestamp: print data timestamp" << endl;
   cout << " seqnum: print replication seqence number" << endl;
+  cout << " changes FROM TO: print the cells changed by updates after seqnum FROM up to seqnum TO, as S2 cell tokens" << endl;
+  cout << " history [node,way,relation] ID SEQNUM: print the version of an OSM object current at SEQNUM, if it has since been replaced" << endl;
+  cout << " tag [node,way,relation] KEY[=VALUE]: print the IDs of objects with this tag; needs expand --tagIndex" << endl;
+  cout << " near LAT LON COUNT [RADIUS [FILTER]]: print COUNT (or all) nearby tagged nodes and ways within RADIUS meters, nearest first, matching the tag FILTER of extract --filter; ways only if expand was run with --cellSegments" << endl;
   exit(1);
 }
 
@@ -42,6 +57,20 @@ int main(int argc, char* argv[]) {
     cmdExtract(argc,argv);
   } else if (args[1] == "update") {
     cmdUpdate(argc,argv);
+  } else if (args[1] == "updated") {
+    cmdUpdated(argc,argv);
+  } else if (args[1] == "augmented-diff") {
+    cmdAugmentedDiff(argc,argv);
+  } else if (args[1] == "regions") {
+    cmdRegions(argc,argv);
+  } else if (args[1] == "stats") {
+    cmdStats(argc,argv);
+  } else if (args[1] == "reindex") {
+    cmdReindex(argc,argv);
+  } else if (args[1] == "admin") {
+    cmdAdmin(argc,argv);
+  } else if (args[1] == "serve") {
+    cmdServe(argc,argv);
   } else if (args[1] == "query") {
     if (args.size() == 2) {
       printQueryHelp();
@@ -91,6 +120,91 @@ int main(int argc, char* argv[]) {
       } else if (args[3] == "seqnum") {
         db::Metadata metadata(txn);
         cout << metadata.get("osmosis_replication_sequence_number") << endl;
+      } else if (args[3] == "history" && args.size() >= 7) {
+        char type = args[4][0];
+        uint32_t version;
+        kj::Array<capnp::word> value;
+        auto found = db::History(txn).get(type,stoull(args[5]),stoull(args[6]),version,value);
+        if (found == db::History::Lookup::current) {
+          cout << "Not in history; the current version applies." << endl;
+        } else if (found == db::History::Lookup::absent) {
+          cout << "No version at this sequence number: created later, or its versions were pruned." << endl;
+        } else {
+          cout << "version " << version << endl;
+          kj::ArrayPtr<const capnp::word> message = value;
+          if (type == 'n') {
+            int32_t *buf = (int32_t *)value.begin();
+            cout << osmium::Location(buf[0],buf[1]) << endl;
+            message = message.slice(sizeof(int32_t) * 4 / sizeof(capnp::word),message.size());
+          }
+          if (message.size() > 0) {
+            capnp::FlatArrayMessageReader reader(message);
+            capnp::List<capnp::Text>::Reader tags;
+            if (type == 'n') tags = reader.getRoot<Node>().getTags();
+            else if (type == 'w') {
+              for (auto node_id : reader.getRoot<Way>().getNodes()) cout << node_id << " ";
+              cout << endl;
+              tags = reader.getRoot<Way>().getTags();
+            } else {
+              for (auto const &member : reader.getRoot<Relation>().getMembers()) cout << member.getRef() << " ";
+              cout << endl;
+              tags = reader.getRoot<Relation>().getTags();
+            }
+            for (int i = 0; i < tags.size() / 2; i++) {
+              cout << tags[i*2].cStr() << "=" << tags[i*2+1].cStr() << "\n";
+            }
+          }
+        }
+      } else if (args[3] == "tag" && args.size() >= 6) {
+        db::TagIndex tag_index(txn);
+        if (!tag_index.exists()) {
+          cout << "No tag index; create the .osmx with osmx expand --tagIndex." << endl;
+          exit(1);
+        }
+        char type = args[4][0];
+        auto eq = args[5].find('=');
+        string key = eq == string::npos ? db::TagIndex::key(type,args[5].c_str()) : db::TagIndex::key(type,args[5].substr(0,eq).c_str(),args[5].substr(eq+1).c_str());
+        roaring::Roaring64Map ids;
+        if (!tag_index.get(key,ids)) {
+          cout << "Tag is not indexed: it is too long or its value is empty." << endl;
+          exit(1);
+        }
+        for (auto id : ids) cout << id << endl;
+      } else if (args[3] == "near" && args.size() >= 7) {
+        size_t count = args[6] == "all" ? std::numeric_limits<size_t>::max() : stoull(args[6]);
+        double radius = args.size() >= 8 ? stod(args[7]) : std::numeric_limits<double>::infinity();
+        if (count == std::numeric_limits<size_t>::max() && args.size() < 8) {
+          cout << "A search for all elements needs a radius." << endl;
+          exit(1);
+        }
+        std::unique_ptr<TagFilter> filter;
+        if (args.size() >= 9) {
+          filter = std::make_unique<TagFilter>(args[8]);
+          if (!filter->valid()) {
+            cout << "Invalid filter: " << args[8] << endl;
+            exit(1);
+          }
+        }
+        ProximitySearch search(txn,filter.get());
+        for (auto const &neighbor : search.nearest(S2LatLng::FromDegrees(stod(args[4]),stod(args[5])),count,radius)) {
+          cout << osmium::item_type_to_name(neighbor.type) << " " << neighbor.id << " " << neighbor.distance << endl;
+        }
+      } else if (args[3] == "changes" && args.size() >= 6) {
+        db::Changes changes(txn);
+        uint64_t first;
+        if (!changes.first(first)) {
+          cerr << "No changes recorded; update with --changes N to record them." << endl;
+        } else if (stoull(args[4]) < first) {
+          cerr << "Changes are only kept from sequence number " << first << "; earlier cells may be missing." << endl;
+        }
+        auto cells = changes.get(stoull(args[4]),stoull(args[5]));
+        vector<S2CellId> cell_ids;
+        for (auto cell : cells) cell_ids.push_back(S2CellId(cell));
+        // normalizing replaces complete sets of children with their coarser parent.
+        S2CellUnion cell_union(std::move(cell_ids));
+        for (auto const &cell_id : cell_union.cell_ids()) {
+          cout << cell_id.ToToken() << endl;
+        }
       } else {
         printQueryHelp();
       }
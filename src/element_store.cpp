@@ -0,0 +1,111 @@
+#include <cstdio>
+#include "osmx/element_store.h"
+
+namespace osmx {
+
+ElementStore::ElementStore(const std::string &spillPath, size_t budget) : mBudget(budget), mSpillPath(spillPath) {
+}
+
+ElementStore::~ElementStore() {
+  if (mSpilled) {
+    mSpill.close();
+    remove(mSpillPath.c_str());
+  }
+}
+
+void ElementStore::writeString(const char *data, size_t size) {
+  write<uint32_t>(size);
+  mArena.insert(mArena.end(),data,data + size);
+}
+
+void ElementStore::writeHeader(uint64_t id, Metadata::Reader metadata) {
+  write<uint64_t>(id);
+  write<uint32_t>(metadata.getVersion());
+  write<uint64_t>(metadata.getTimestamp());
+  write<uint32_t>(metadata.getChangeset());
+  write<uint32_t>(metadata.getUid());
+  auto user = metadata.getUser();
+  writeString(user.cStr(),user.size());
+}
+
+void ElementStore::writeTags(capnp::List<capnp::Text>::Reader tags) {
+  write<uint32_t>(tags.size() / 2);
+  for (auto const &tag : tags) {
+    writeString(tag.cStr(),tag.size());
+  }
+}
+
+// each record is prefixed with its length, patched in by endRecord.
+void ElementStore::beginRecord() {
+  mRecordStart = mArena.size();
+  write<uint32_t>(0);
+}
+
+void ElementStore::endRecord() {
+  uint32_t length = mArena.size() - mRecordStart - sizeof(uint32_t);
+  memcpy(&mArena[mRecordStart],&length,sizeof(uint32_t));
+  mCount++;
+  if (mArena.size() > mBudget) spill();
+}
+
+void ElementStore::spill() {
+  if (!mSpilled) {
+    mSpill.open(mSpillPath,std::ios::binary | std::ios::trunc);
+    mSpilled = true;
+  }
+  mSpill.write(mArena.data(),mArena.size());
+  mArena.clear();
+}
+
+void ElementStore::add(uint64_t id, Way::Reader way) {
+  beginRecord();
+  writeHeader(id,way.getMetadata());
+  auto nodes = way.getNodes();
+  write<uint32_t>(nodes.size());
+  for (auto node_id : nodes) {
+    write<uint64_t>(node_id);
+  }
+  writeTags(way.getTags());
+  endRecord();
+}
+
+void ElementStore::add(uint64_t id, Relation::Reader relation) {
+  beginRecord();
+  writeHeader(id,relation.getMetadata());
+  auto members = relation.getMembers();
+  write<uint32_t>(members.size());
+  for (auto const &member : members) {
+    write<uint8_t>((uint8_t)member.getType());
+    write<uint64_t>(member.getRef());
+    auto role = member.getRole();
+    writeString(role.cStr(),role.size());
+  }
+  writeTags(relation.getTags());
+  endRecord();
+}
+
+void ElementStore::forEach(const std::function<void(StoredRecord &)> &fn) {
+  if (mSpilled) {
+    mSpill.flush();
+    std::ifstream stream(mSpillPath,std::ios::binary);
+    std::vector<char> buf;
+    uint32_t length;
+    while (stream.read((char *)&length,sizeof(uint32_t))) {
+      buf.resize(length);
+      stream.read(buf.data(),length);
+      StoredRecord record(buf.data());
+      fn(record);
+    }
+  }
+
+  size_t pos = 0;
+  while (pos < mArena.size()) {
+    uint32_t length;
+    memcpy(&length,&mArena[pos],sizeof(uint32_t));
+    StoredRecord record(&mArena[pos + sizeof(uint32_t)]);
+    fn(record);
+    pos += sizeof(uint32_t) + length;
+  }
+}
+
+}
@@ -1,5 +1,8 @@
 #include <iomanip>
+#include <memory>
 #include <fstream>
+#include <map>
+#include <unordered_map>
 #include "osmium/handler.hpp"
 #include "osmium/visitor.hpp"
 #include "osmium/io/any_input.hpp"
@@ -11,150 +14,222 @@
 #include "capnp/serialize.h"
 #include "s2/s2latlng.h"
 #include "s2/s2cell_id.h"
+#include "s2/s2earth.h"
 #include "osmx/storage.h"
+#include "osmx/sorter.h"
 #include "osmx/util.h"
 #include "osmx/messages.capnp.h"
 
 using namespace std;
 using namespace osmx;
 
+// merge the sorted (hour and type, ID) pairs into one bitmap per key.
+static void writeTimeIndex(MDB_env *env, Sorter &sorter) {
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+  db::TimeIndex time_index(txn,true);
+  roaring::Roaring64Map ids;
+  bool started = false;
+  uint64_t current;
+  sorter.merge([&](uint64_t key, uint64_t id) {
+    if (started && key != current) {
+      time_index.put(current,ids,MDB_APPEND);
+      ids.clear();
+    }
+    current = key;
+    started = true;
+    ids.add(id);
+  });
+  if (started) time_index.put(current,ids,MDB_APPEND);
+  CHECK_LMDB(mdb_txn_commit(txn));
+}
 
-typedef std::pair<uint64_t, uint64_t> Pair; 
-typedef std::pair<Pair, uint64_t> pqelem; 
-
-class SortReader {
+// Sums index level counts, arriving in cell order, into every level of cell_stats.
+class CellStatsWriter {
   public:
-  SortReader(std::string filename) : mStream(filename, std::ios::in | std::ios::binary) { }
-
-  bool getNext() {
-    mStream.read((char *)&entry,sizeof(uint64_t) *2);
-    if (mStream.eof()) return false;
-    return true;
-  }
-
-  Pair entry;
-
-  private:
-  std::ifstream mStream;
-};
-
-class Sorter {
-int MAX_RUN_SIZE = 64000000; // about 1 GB
-public:
-  Sorter(std::string tempDir,std::string name) : mTempDir(tempDir), mName(name) { 
-    mStorage.reserve(MAX_RUN_SIZE);
-  }
-
-  void put(uint64_t from, uint64_t to) {
-    mStorage.push_back(std::make_pair(from,to));
-    if (mStorage.size() > MAX_RUN_SIZE) persist();
+  CellStatsWriter(MDB_txn *txn) : mStats(txn,true), mLevel(db::cellLevel(txn)) { }
+
+  void add(uint64_t cell, uint64_t nodes, uint64_t ways, uint64_t relations) {
+    S2CellId cell_id(cell);
+    for (int level = 0; level <= mLevel; level++) {
+      S2CellId parent = cell_id.parent(level);
+      if (mStarted && parent != mCurrent[level]) flush(level);
+      mCurrent[level] = parent;
+      mCounts[level].nodes += nodes;
+      mCounts[level].ways += ways;
+      mCounts[level].relations += relations;
+    }
+    mStarted = true;
   }
 
-  void put(S2CellId from, uint64_t to) {
-    put(from.id(),to);
+  void finish() {
+    if (!mStarted) return;
+    for (int level = 0; level <= mLevel; level++) flush(level);
   }
 
-  void persist() {
-    if (mStorage.size() == 0) return;
-    sort(mStorage.begin(),mStorage.end());
-    int runNumber = mSavedRuns.size();
-    std::ofstream stream;
-    std::stringstream fname;
-    fname << mTempDir << "/" << std::setw(2) << std::setfill('0') << mName << "_" << std::setw(3) << std::setfill('0') << runNumber << ".run";
-    stream.open(fname.str(),std::ios::binary);
-    for (auto const &entry: mStorage) {
-      stream.write((char *)&entry.first,sizeof(uint64_t));
-      stream.write((char *)&entry.second,sizeof(uint64_t));
-    }
-    stream.close();
-    mStorage.clear();
-    mStorage.reserve(MAX_RUN_SIZE);
-    mSavedRuns.push_back(fname.str());
+  private:
+  void flush(int level) {
+    mStats.put(mCurrent[level],mCounts[level]);
+    mCounts[level] = db::CellStats::Counts{0,0,0};
   }
 
-  void writeDb(MDB_env *env) {
-    persist();
-
-    Timer timer("External sort " + mName);
-    osmium::ProgressBar progress{MAX_RUN_SIZE * mSavedRuns.size(), osmium::isatty(2)};
-    int read = 0;
-    std::priority_queue<pqelem, std::vector<pqelem>, std::greater<pqelem>> q;
-    std::vector<SortReader> readers;
-    db::IndexWriter index(env,mName);
+  db::CellStats mStats;
+  int mLevel;
+  S2CellId mCurrent[S2CellId::kMaxLevel + 1];
+  db::CellStats::Counts mCounts[S2CellId::kMaxLevel + 1] = {};
+  bool mStarted = false;
+};
 
-    for (int i = 0; i < mSavedRuns.size(); i++) {
-      readers.emplace_back(mSavedRuns[i]);  
-      if (readers[i].getNext()) q.push(make_pair(readers[i].entry, i));
+// merge node counts from cell_node with the sorted (cell, ID and type) entries of ways and relations.
+static void writeCellStats(MDB_env *env, Sorter &sorter) {
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, "cell_node", MDB_INTEGERKEY | MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+  CellStatsWriter writer(txn);
+
+  MDB_val key, data;
+  int retval = mdb_cursor_get(cursor,&key,&data,MDB_FIRST);
+  auto nodesUpTo = [&](uint64_t cell) {
+    while (retval == 0 && *(uint64_t *)key.mv_data <= cell) {
+      size_t count;
+      CHECK_LMDB(mdb_cursor_count(cursor,&count));
+      writer.add(*(uint64_t *)key.mv_data,count,0,0);
+      retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT_NODUP);
     }
+  };
+  sorter.merge([&](uint64_t cell, uint64_t entry) {
+    nodesUpTo(cell);
+    if ((entry & 3) == 1) writer.add(cell,0,1,0);
+    else writer.add(cell,0,0,1);
+  });
+  nodesUpTo(UINT64_MAX);
+  writer.finish();
+  mdb_cursor_close(cursor);
+  CHECK_LMDB(mdb_txn_commit(txn));
+}
 
-    Pair last;
+// materialize the transitive closure of relation_relation, so extracts find all parent relations in one lookup.
+static void writeRelationAncestors(MDB_env *env) {
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, "relation_relation", MDB_INTEGERKEY | MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+
+  vector<uint64_t> children;
+  MDB_val key, data;
+  int retval = mdb_cursor_get(cursor,&key,&data,MDB_FIRST);
+  while (retval == 0) {
+    children.push_back(*(uint64_t *)key.mv_data);
+    retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT_NODUP);
+  }
 
-    while (q.size() > 0) {
-      pqelem pair = q.top();
-      auto idx = pair.second;
-      if (pair.first != last) {
-        if (pair.first.first != last.first) index.put(pair.first.first,pair.first.second,MDB_APPEND);
-        else index.put(pair.first.first,pair.first.second,MDB_APPENDDUP);
-      }
-      q.pop();
-      if (readers[idx].getNext()) q.push(make_pair(readers[idx].entry, idx));
-      progress.update(read++);
-      last = pair.first;
+  db::Index ancestors(txn,"relation_ancestors");
+  for (auto child : children) {
+    roaring::Roaring64Map set;
+    db::traverseAncestors(cursor,child,set);
+    bool first = true;
+    for (auto ancestor : set) {
+      ancestors.put(child,ancestor,first ? MDB_APPEND : MDB_APPENDDUP);
+      first = false;
     }
+  }
+  mdb_cursor_close(cursor);
+  CHECK_LMDB(mdb_txn_commit(txn));
+}
 
-    index.commit();
-
-    progress.done();
+// elements arrive in ascending ID order, so each chunk of a presence table is appended once complete.
+class PresenceWriter {
+  public:
+  PresenceWriter(MDB_txn *txn, const string &table) : mPresence(txn,table,true) { }
+
+  void add(uint64_t id) {
+    uint64_t chunk = db::Presence::chunk(id);
+    if (mStarted && chunk != mChunk) flush();
+    mChunk = chunk;
+    mStarted = true;
+    mIds.add(db::Presence::offset(id));
+  }
 
-    for (auto const &run : mSavedRuns) {
-      remove(run.c_str());
-    }
+  void flush() {
+    if (mIds.isEmpty()) return;
+    mPresence.put(mChunk,mIds,MDB_APPEND);
+    mIds = roaring::Roaring();
   }
 
-private:
-  Sorter( const Sorter& ) = delete;
-  Sorter& operator=( const Sorter& ) = delete;
-  std::vector<std::pair<uint64_t,uint64_t>> mStorage;
-  int mRunNumber = 0;
-  std::vector<std::string> mSavedRuns;
-  std::string mTempDir;
-  std::string mName;
+  private:
+  db::Presence mPresence;
+  roaring::Roaring mIds;
+  uint64_t mChunk = 0;
+  bool mStarted = false;
 };
 
+// pending tag bitmaps are merged into the database once they hold this many IDs.
+static const size_t TAG_INDEX_FLUSH = 64000000;
+
 class Handler: public osmium::handler::Handler {
   public:
-  Handler(MDB_env *env, MDB_txn *txn,string tempDir) : 
+  Handler(MDB_env *env, MDB_txn *txn,string tempDir,int cellLevel,bool timeIndex,bool tagIndex,bool cellLocations,bool cellStats,bool cellSegments) : 
     mEnv(env),
     mTxn(txn),
+    mCellLevel(cellLevel),
+    mTagIndex(tagIndex),
+    mCellSegments(cellSegments),
     mCellNode(tempDir,"cell_node"), 
     mLocations(txn), 
     mNodes(txn,"nodes"),
     mWays(txn,"ways"),
     mRelations(txn,"relations"),
+    mNodesPresence(txn,"nodes"),
+    mWaysPresence(txn,"ways"),
+    mRelationsPresence(txn,"relations"),
     mNodeWay(tempDir,"node_way"),
     mNodeRelation(tempDir,"node_relation"),
     mWayRelation(tempDir,"way_relation"),
     mRelationRelation(tempDir,"relation_relation")
   {
+    if (timeIndex) mTimeIndex = std::make_unique<Sorter>(tempDir,"time_index");
+    if (cellLocations) mCellLocations = std::make_unique<CellLocationSorter>(tempDir);
+    if (cellStats) mCellStats = std::make_unique<Sorter>(tempDir,"cell_stats");
   }
 
   ~Handler() {
+    if (mTagIndex) flushTags();
+    mNodesPresence.flush();
+    mWaysPresence.flush();
+    mRelationsPresence.flush();
+    if (mCellSegments) {
+      db::SegmentBounds segment_bounds(mTxn,true);
+      for (auto const &entry : mSegments) segment_bounds.raise(S2CellId(entry.first),entry.second);
+    }
     CHECK_LMDB(mdb_txn_commit(mTxn));
     mCellNode.writeDb(mEnv);
     mNodeWay.writeDb(mEnv);
     mNodeRelation.writeDb(mEnv);
     mWayRelation.writeDb(mEnv);
     mRelationRelation.writeDb(mEnv);
+    writeRelationAncestors(mEnv);
+    if (mTimeIndex) writeTimeIndex(mEnv,*mTimeIndex);
+    if (mCellLocations) mCellLocations->writeDb(mEnv);
+    if (mCellStats) writeCellStats(mEnv,*mCellStats);
   }
 
   void node(const osmium::Node& node) {
     mLocations.put(node.id(), db::Location{node.location(),(int32_t)node.version()},MDB_APPEND);
     auto loc = node.location();
     auto ll = S2LatLng::FromDegrees(loc.lat(),loc.lon());
-    auto cell = S2CellId(ll).parent(CELL_INDEX_LEVEL);
+    auto cell = S2CellId(ll).parent(mCellLevel);
     mCellNode.put(cell,node.id());
+    if (mCellLocations) mCellLocations->put(cell,node.id(),node.location(),node.version());
+    if (mTimeIndex) mTimeIndex->put(db::TimeIndex::key(node.timestamp().seconds_since_epoch(),osmium::item_type::node),node.id());
 
     if (node.tags().size() > 0) {
+      indexTags('n',node);
+      mNodesPresence.add(node.id());
       ::capnp::MallocMessageBuilder message;
       Node::Builder nodeMsg = message.initRoot<Node>();
       setTags<Node::Builder>(node.tags(),nodeMsg);
@@ -190,6 +265,11 @@ class Handler: public osmium::handler::Handler {
     kj::VectorOutputStream output;
     capnp::writeMessage(output,message);
     mWays.put(way.id(),output,MDB_APPEND);
+    if (mTimeIndex) mTimeIndex->put(db::TimeIndex::key(way.timestamp().seconds_since_epoch(),osmium::item_type::way),way.id());
+    indexTags('w',way);
+    if (mCellStats && nodes.size() > 0) countIn(nodeCell(nodes[0].ref()),way.id(),1);
+    if (mCellSegments) measure(nodes);
+    mWaysPresence.add(way.id());
   }
 
   void relation(const osmium::Relation& relation) {
@@ -224,22 +304,110 @@ class Handler: public osmium::handler::Handler {
     kj::VectorOutputStream output;
     capnp::writeMessage(output,message);
     mRelations.put(relation.id(),output,MDB_APPEND);
+    if (mTimeIndex) mTimeIndex->put(db::TimeIndex::key(relation.timestamp().seconds_since_epoch(),osmium::item_type::relation),relation.id());
+    indexTags('r',relation);
+    if (mCellStats) countIn(relationCell(relation),relation.id(),2);
+    mRelationsPresence.add(relation.id());
   }
 
   private:
+  uint64_t nodeCell(uint64_t node_id) {
+    auto loc = mLocations.get(node_id);
+    if (loc.is_undefined()) return 0;
+    return S2CellId(S2LatLng::FromDegrees(loc.coords.lat(),loc.coords.lon())).parent(mCellLevel).id();
+  }
+
+  // a relation is counted in the cell of its first node member, or of its first way member's first node.
+  uint64_t relationCell(const osmium::Relation &relation) {
+    for (auto const &member : relation.members()) {
+      if (member.type() == osmium::item_type::node) return nodeCell(member.ref());
+    }
+    for (auto const &member : relation.members()) {
+      if (member.type() != osmium::item_type::way) continue;
+      MDB_val data;
+      if (!mWays.get(member.ref(),data)) return 0;
+      auto reader = db::toReader(data);
+      auto nodes = reader.getRoot<Way>().getNodes();
+      return nodes.size() > 0 ? nodeCell(nodes[0]) : 0;
+    }
+    return 0;
+  }
+
+  // half the length of each segment, kept for the cells at both of its ends; nodes without a location are skipped,
+  // as they are in way geometries.
+  void measure(const osmium::WayNodeList &nodes) {
+    bool started = false;
+    S2Point prev;
+    uint64_t prev_cell = 0;
+    for (auto const &node_ref : nodes) {
+      auto loc = mLocations.get(node_ref.ref());
+      if (loc.is_undefined()) continue;
+      auto ll = S2LatLng::FromDegrees(loc.coords.lat(),loc.coords.lon());
+      S2Point point = ll.ToPoint();
+      uint64_t cell = S2CellId(ll).parent(mCellLevel).id();
+      if (started) {
+        double half = S2Earth::ToMeters(S1Angle(prev,point)) / 2;
+        for (uint64_t end : {prev_cell,cell}) {
+          double &longest = mSegments[end];
+          longest = max(longest,half);
+        }
+      }
+      prev = point;
+      prev_cell = cell;
+      started = true;
+    }
+  }
+
+  // the ID is kept in the entry so that elements in the same cell stay distinct through the sort.
+  void countIn(uint64_t cell, uint64_t id, uint64_t type) {
+    if (cell != 0) mCellStats->put(cell,id << 2 | type);
+  }
+
+  void indexTags(char type, const osmium::OSMObject &object) {
+    if (!mTagIndex) return;
+    for (auto const &tag : object.tags()) {
+      mTags[db::TagIndex::key(type,tag.key())].add(object.id());
+      mTags[db::TagIndex::key(type,tag.key(),tag.value())].add(object.id());
+      mTagPostings += 2;
+    }
+    if (mTagPostings >= TAG_INDEX_FLUSH) flushTags();
+  }
+
+  // merge the pending bitmaps into the tag index, so memory use stays bounded for large inputs.
+  void flushTags() {
+    db::TagIndex tag_index(mTxn,true);
+    roaring::Roaring64Map none;
+    for (auto &entry : mTags) tag_index.update(entry.first,entry.second,none);
+    mTags.clear();
+    mTagPostings = 0;
+  }
+
   MDB_env* mEnv;
   MDB_txn* mTxn;
+  int mCellLevel;
+  bool mTagIndex;
+  bool mCellSegments;
+  // half the longest segment length with an end in each index level cell.
+  unordered_map<uint64_t,double> mSegments;
+  map<string,roaring::Roaring64Map> mTags;
+  size_t mTagPostings = 0;
   Sorter mCellNode;
   db::Locations mLocations;
 
   db::Elements mNodes;
   db::Elements mWays;
   db::Elements mRelations;
+  PresenceWriter mNodesPresence;
+  PresenceWriter mWaysPresence;
+  PresenceWriter mRelationsPresence;
 
   Sorter mNodeWay;
   Sorter mNodeRelation;
   Sorter mWayRelation;
   Sorter mRelationRelation;
+  std::unique_ptr<Sorter> mTimeIndex;
+  std::unique_ptr<CellLocationSorter> mCellLocations;
+  std::unique_ptr<Sorter> mCellStats;
 };
 
 void cmdExpand(int argc, char* argv[]) {
@@ -249,17 +417,30 @@ void cmdExpand(int argc, char* argv[]) {
     ("cmd", "Command to run", cxxopts::value<string>())
     ("input", "Input .pbf", cxxopts::value<string>())
     ("output", "Output .osmx", cxxopts::value<string>())
+    ("timeIndex", "Index elements by the hour of their timestamp")
+    ("tagIndex", "Index elements by tag key and by tag key and value")
+    ("cellLocations", "Also index node locations by cell")
+    ("cellStats", "Count elements per cell at levels 0 to the index level")
+    ("cellSegments", "Record the longest way segment per cell, so osmx query near finds ways")
+    ("cellLevel", "S2 cell level of the spatial index", cxxopts::value<int>()->default_value(to_string(CELL_INDEX_LEVEL)))
   ;
   options.parse_positional({"cmd","input", "output"});
   auto result = options.parse(argc, argv);
 
-  if (result.count("input") == 0 || result.count("output") == 0) {
+  int cell_level = result["cellLevel"].as<int>();
+  if (result.count("input") == 0 || result.count("output") == 0 || cell_level < 0 || cell_level > S2CellId::kMaxLevel) {
     cout << "Usage: osmx expand OSM_FILE OSMX_FILE [OPTIONS]" << endl << endl;
     cout << "OSM_FILE must be an OSM XML or PBF." << endl << endl;
     cout << "EXAMPLE:" << endl;
     cout << " osmx expand planet_latest.osm.pbf planet.osmx" << endl << endl;
     cout << "OPTIONS:" << endl;
     cout << " --v,--verbose: verbose output." << endl;
+    cout << " --timeIndex: index elements by the hour of their timestamp, for extract --since." << endl;
+    cout << " --tagIndex: index elements by tag key and by tag key and value." << endl;
+    cout << " --cellLocations: also index node locations by cell, so extracts read them sequentially." << endl;
+    cout << " --cellStats: count elements per cell at levels 0 to the index level, for osmx stats." << endl;
+    cout << " --cellSegments: record the longest way segment per cell, so osmx query near finds ways as well as nodes." << endl;
+    cout << " --cellLevel LEVEL: S2 cell level of the spatial index, 0 to 30, default 16." << endl;
     exit(1);
   }
 
@@ -286,12 +467,13 @@ void cmdExpand(int argc, char* argv[]) {
   metadata.put("osmosis_replication_timestamp",header.get("osmosis_replication_timestamp"));
   metadata.put("osmosis_replication_sequence_number",header.get("osmosis_replication_sequence_number"));
   metadata.put("import_filename",input);
+  metadata.put("cell_level",to_string(cell_level));
   string tempDir = output + "-temp";
   assert(mkdir(tempDir.c_str(),S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0);
 
   {
     Timer insert("insert");
-    Handler handler(env,txn,tempDir);
+    Handler handler(env,txn,tempDir,cell_level,result.count("timeIndex") > 0,result.count("tagIndex") > 0,result.count("cellLocations") > 0,result.count("cellStats") > 0,result.count("cellSegments") > 0);
     osmium::apply(reader, handler);
   }
 
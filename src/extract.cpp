@@ -1,5 +1,7 @@
 #include <string>
 #include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
 #include "s2/s2latlng.h"
 #include "s2/s2region_coverer.h"
 #include "s2/s2latlng_rect.h"
@@ -8,15 +10,24 @@
 #include "osmium/memory/callback_buffer.hpp"
 #include "osmium/builder/attr.hpp"
 #include "osmium/builder/osm_object_builder.hpp"
+#include "osmium/osm/timestamp.hpp"
 #include "cxxopts.hpp"
 #include "nlohmann/json.hpp"
 #include "osmx/storage.h"
+#include "osmx/tag_filter.h"
 #include "osmx/region.h"
+#include "osmx/element_store.h"
+#include "osmx/pbf_writer.h"
+#include "osmx/sorter.h"
 #include "osmx/util.h"
 
 using namespace std;
 using namespace osmx;
 
+// streaming extracts write out what they have read once it reaches this many nodes,
+// even partway through a covering cell.
+static const uint64_t STREAMING_CHUNK_NODES = 1000000;
+
 struct ExportProgress {
   string timestamp = "";
   uint64_t cells_total = 0;
@@ -65,6 +76,503 @@ static bool endsWith(const std::string& str, const std::string& suffix)
     return str.size() >= suffix.size() && 0 == str.compare(str.size()-suffix.size(), suffix.size(), suffix);
 }
 
+// add all relations that transitively contain any of relation_ids.
+static void addParentRelations(MDB_txn *txn, roaring::Roaring64Map &relation_ids) {
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+
+  // with the precomputed closure, each relation needs one lookup.
+  if (mdb_dbi_open(txn, "relation_ancestors", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi) == 0) {
+    CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+    roaring::Roaring64Map ancestors;
+    for (auto const &relation_id : relation_ids) {
+      db::traverseReverse(cursor,relation_id,ancestors);
+    }
+    relation_ids |= ancestors;
+    mdb_cursor_close(cursor);
+    return;
+  }
+
+  CHECK_LMDB(mdb_dbi_open(txn, "relation_relation", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+  roaring::Roaring64Map discovered_relations;
+  roaring::Roaring64Map discovered_relations_2;
+
+  for (auto const &relation_id : relation_ids) {
+    db::traverseReverse(cursor,relation_id,discovered_relations);
+  }
+
+  relation_ids |= discovered_relations;
+
+  while(true) {
+    for (auto const &relation_id : discovered_relations) {
+      db::traverseReverse(cursor,relation_id,discovered_relations_2);
+    }
+    int num_discovered = 0;
+    for (auto discovered_relation_id : discovered_relations_2) {
+      if (relation_ids.addChecked(discovered_relation_id)) num_discovered++;
+    }
+    if (num_discovered == 0) break;
+    discovered_relations = discovered_relations_2;
+    discovered_relations_2.clear();
+  }
+  mdb_cursor_close(cursor);
+}
+
+static bool isMultipolygon(Relation::Reader relation) {
+  auto tags = relation.getTags();
+  for (int i = 0; i < tags.size() / 2; i++) {
+    if (tags[i*2] == "type" && tags[i*2+1] == "multipolygon") return true;
+  }
+  return false;
+}
+
+// the box header is used by some applications,
+// for example: zooming to an overview in QGIS.
+// however, PBF only supports one box header and it must be in the -180 to 180 lng, -90 to 90 lat range.
+// valid input regions can cross the antimeridian, but the output header box is omitted as it can't represent the input.
+static PbfHeader pbfHeader(const S2LatLngRect &bounds, const string &timestamp) {
+  PbfHeader header;
+  header.has_box = bounds.lng_lo().degrees() < bounds.lng_hi().degrees();
+  header.min_lon = bounds.lng_lo().degrees();
+  header.min_lat = bounds.lat_lo().degrees();
+  header.max_lon = bounds.lng_hi().degrees();
+  header.max_lat = bounds.lat_hi().degrees();
+  header.replication_timestamp = timestamp;
+  return header;
+}
+
+// Locations read along with the cell index, sorted by ID, so writing the nodes of the region
+// doesn't look each one up in locations. Other nodes, such as those of ways reaching outside, still are.
+class LocationCache {
+  public:
+  void add(uint64_t id, const db::Location &location) {
+    mEntries.emplace_back(id,location);
+  }
+
+  void sort() {
+    std::sort(mEntries.begin(),mEntries.end(),[](const pair<uint64_t,db::Location> &a, const pair<uint64_t,db::Location> &b) {
+      return a.first < b.first;
+    });
+  }
+
+  // IDs must be requested in ascending order.
+  db::Location get(uint64_t id, db::Locations &locations) {
+    while (mPos < mEntries.size() && mEntries[mPos].first < id) mPos++;
+    if (mPos < mEntries.size() && mEntries[mPos].first == id) return mEntries[mPos].second;
+    return locations.get(id);
+  }
+
+  private:
+  vector<pair<uint64_t,db::Location>> mEntries;
+  size_t mPos = 0;
+};
+
+static void writeNode(PbfWriter &writer, db::Elements &nodes_table, db::Presence &tagged, uint64_t node_id, const db::Location &loc) {
+  if (tagged.contains(node_id)) {
+    auto reader = nodes_table.getReader(node_id);
+    writer.node(node_id,loc,reader.getRoot<Node>());
+  } else {
+    writer.node(node_id,loc);
+  }
+}
+
+static void writePbf(const string &output, const PbfHeader &header, MDB_txn *txn, roaring::Roaring64Map &node_ids, LocationCache &location_cache, ElementStore &way_store, ElementStore &relation_store, bool includeUserData, ProgressSection &section) {
+  PbfWriter writer(output,header,includeUserData);
+  db::Locations location_index(txn);
+  db::Elements nodes_table(txn,"nodes");
+  db::Presence tagged(txn,"nodes");
+  for (auto node_id : node_ids) {
+    section.tick();
+    auto loc = location_cache.get(node_id,location_index);
+    if (loc.is_undefined()) continue;
+    writeNode(writer,nodes_table,tagged,node_id,loc);
+  }
+  way_store.forEach([&](StoredRecord &record) {
+    section.tick();
+    writer.way(record);
+  });
+  relation_store.forEach([&](StoredRecord &record) {
+    section.tick();
+    writer.relation(record);
+  });
+  writer.close();
+}
+
+static void writeOsmium(const string &output, const osmium::io::Header &header, MDB_txn *txn, roaring::Roaring64Map &node_ids, LocationCache &location_cache, ElementStore &way_store, ElementStore &relation_store, bool includeUserData, ProgressSection &section) {
+  osmium::io::Writer writer{output, header, osmium::io::overwrite::allow};
+  osmium::memory::CallbackBuffer cb;
+  cb.set_callback([&](osmium::memory::Buffer&& buffer) {
+    writer(std::move(buffer));
+  });
+
+  {
+    db::Locations location_index(txn);
+    db::Elements nodes_table(txn,"nodes");
+    db::Presence tagged(txn,"nodes");
+    for (auto node_id : node_ids) {
+      section.tick();
+      auto loc = location_cache.get(node_id,location_index);
+      if (loc.is_undefined()) continue;
+
+      {
+        using namespace osmium::builder::attr; 
+        osmium::builder::NodeBuilder node_builder{cb.buffer()};
+        node_builder.set_id(node_id);
+        node_builder.set_location(loc.coords);
+        node_builder.set_version(loc.version);
+
+        if (!tagged.contains(node_id)) continue;
+        auto reader = nodes_table.getReader(node_id);
+        Node::Reader node = reader.getRoot<Node>();
+        auto metadata = node.getMetadata();
+        node_builder.set_timestamp(metadata.getTimestamp());
+        if (includeUserData) {
+          node_builder.set_changeset(metadata.getChangeset());
+          node_builder.set_user(metadata.getUser());
+          node_builder.set_uid(metadata.getUid());
+        }
+
+        auto tags = node.getTags();
+        osmium::builder::TagListBuilder tag_builder{node_builder};
+        for (int i = 0; i < tags.size() / 2; i++) {
+          tag_builder.add_tag(tags[i*2],tags[i*2+1]);
+        }
+      }
+      cb.buffer().commit();
+      cb.possibly_flush();
+    }
+  }
+  
+  // Writing ways pass
+  way_store.forEach([&](StoredRecord &record) {
+    section.tick();
+    {
+      osmium::builder::WayBuilder way_builder{cb.buffer()};
+      auto header = record.readHeader();
+      way_builder.set_id(header.id);
+      way_builder.set_version(header.version);
+      way_builder.set_timestamp(header.timestamp);
+      if (includeUserData) {
+        way_builder.set_changeset(header.changeset);
+        way_builder.set_user(header.user.data,header.user.size);
+        way_builder.set_uid(header.uid);
+      }
+
+      {
+        osmium::builder::WayNodeListBuilder way_node_list_builder{way_builder};
+        uint32_t num_refs = record.read<uint32_t>();
+        for (uint32_t i = 0; i < num_refs; i++) {
+          way_node_list_builder.add_node_ref(record.read<uint64_t>());
+        }
+      }
+
+      osmium::builder::TagListBuilder tag_builder{way_builder};
+      uint32_t num_tags = record.read<uint32_t>();
+      for (uint32_t i = 0; i < num_tags; i++) {
+        auto key = record.readString();
+        auto value = record.readString();
+        tag_builder.add_tag(key.data,key.size,value.data,value.size);
+      }
+    }
+    cb.buffer().commit();
+    cb.possibly_flush();
+  });
+
+  relation_store.forEach([&](StoredRecord &record) {
+    section.tick();
+    {
+      osmium::builder::RelationBuilder relation_builder{cb.buffer()};
+      auto header = record.readHeader();
+      relation_builder.set_id(header.id);
+      relation_builder.set_version(header.version);
+      relation_builder.set_timestamp(header.timestamp);
+      if (includeUserData) {
+        relation_builder.set_changeset(header.changeset);
+        relation_builder.set_user(header.user.data,header.user.size);
+        relation_builder.set_uid(header.uid);
+      }
+
+      {
+        osmium::builder::RelationMemberListBuilder relation_member_list_builder{relation_builder};
+        uint32_t num_members = record.read<uint32_t>();
+        for (uint32_t i = 0; i < num_members; i++) {
+          auto type = (RelationMember::Type)record.read<uint8_t>();
+          auto ref = record.read<uint64_t>();
+          auto role = record.readString();
+          if (type == RelationMember::Type::NODE) {
+            relation_member_list_builder.add_member(osmium::item_type::node,ref,role.data,role.size);
+          } else if (type == RelationMember::Type::WAY) {
+            relation_member_list_builder.add_member(osmium::item_type::way,ref,role.data,role.size);
+          } else {
+            relation_member_list_builder.add_member(osmium::item_type::relation,ref,role.data,role.size);
+          }
+        }
+      }
+
+      osmium::builder::TagListBuilder tag_builder{relation_builder};
+      uint32_t num_tags = record.read<uint32_t>();
+      for (uint32_t i = 0; i < num_tags; i++) {
+        auto key = record.readString();
+        auto value = record.readString();
+        tag_builder.add_tag(key.data,key.size,value.data,value.size);
+      }
+    }
+    cb.buffer().commit();
+    cb.possibly_flush();
+  });
+
+  cb.flush();
+  writer.close();
+}
+
+// Copy the selected elements into a new .osmx database.
+// Element values are copied byte-for-byte in ID order with MDB_APPEND,
+// and the index tables are rebuilt from the selected elements only.
+static void writeOsmx(const string &output, MDB_txn *txn, roaring::Roaring64Map &node_ids, roaring::Roaring64Map &way_ids, roaring::Roaring64Map &relation_ids, ProgressSection &section) {
+  remove(output.c_str());
+  remove((output + "-lock").c_str());
+  MDB_env *out_env = db::createEnv(output,true);
+  string tempDir = output + "-temp";
+  assert(mkdir(tempDir.c_str(),S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0);
+
+  Sorter cell_node(tempDir,"cell_node");
+  Sorter node_way(tempDir,"node_way");
+  Sorter node_relation(tempDir,"node_relation");
+  Sorter way_relation(tempDir,"way_relation");
+  Sorter relation_relation(tempDir,"relation_relation");
+
+  {
+    MDB_txn *out_txn;
+    CHECK_LMDB(mdb_txn_begin(out_env, NULL, 0, &out_txn));
+
+    db::Metadata metadata(txn);
+    db::Metadata out_metadata(out_txn);
+    out_metadata.put("osmosis_replication_timestamp",metadata.get("osmosis_replication_timestamp"));
+    out_metadata.put("osmosis_replication_sequence_number",metadata.get("osmosis_replication_sequence_number"));
+    out_metadata.put("import_filename",metadata.get("import_filename"));
+    int cell_level = db::cellLevel(txn);
+    out_metadata.put("cell_level",to_string(cell_level));
+
+    MDB_val data;
+    db::Locations locations(txn);
+    db::Locations out_locations(out_txn);
+    db::Elements nodes(txn,"nodes");
+    db::Elements out_nodes(out_txn,"nodes");
+    for (auto node_id : node_ids) {
+      section.tick();
+      auto loc = locations.get(node_id);
+      if (loc.is_undefined()) continue;
+      out_locations.put(node_id,loc,MDB_APPEND);
+      cell_node.put(S2CellId(S2LatLng::FromDegrees(loc.coords.lat(),loc.coords.lon())).parent(cell_level),node_id);
+      if (nodes.get(node_id,data)) out_nodes.put(node_id,data,MDB_APPEND);
+    }
+
+    db::Elements ways(txn,"ways");
+    db::Elements out_ways(out_txn,"ways");
+    for (auto way_id : way_ids) {
+      section.tick();
+      if (!ways.get(way_id,data)) continue;
+      out_ways.put(way_id,data,MDB_APPEND);
+      auto reader = db::toReader(data);
+      for (auto node_id : reader.getRoot<Way>().getNodes()) {
+        node_way.put(node_id,way_id);
+      }
+    }
+
+    db::Elements relations(txn,"relations");
+    db::Elements out_relations(out_txn,"relations");
+    for (auto relation_id : relation_ids) {
+      section.tick();
+      if (!relations.get(relation_id,data)) continue;
+      out_relations.put(relation_id,data,MDB_APPEND);
+      auto reader = db::toReader(data);
+      for (auto const &member : reader.getRoot<Relation>().getMembers()) {
+        if (member.getType() == RelationMember::Type::NODE) node_relation.put(member.getRef(),relation_id);
+        else if (member.getType() == RelationMember::Type::WAY) way_relation.put(member.getRef(),relation_id);
+        else relation_relation.put(member.getRef(),relation_id);
+      }
+    }
+
+    CHECK_LMDB(mdb_txn_commit(out_txn));
+  }
+
+  cell_node.writeDb(out_env);
+  node_way.writeDb(out_env);
+  node_relation.writeDb(out_env);
+  way_relation.writeDb(out_env);
+  relation_relation.writeDb(out_env);
+  assert(rmdir(tempDir.c_str()) == 0);
+
+  mdb_env_sync(out_env,true);
+  mdb_env_close(out_env);
+}
+
+// Streaming extract: the covering is processed in cell order, a chunk of index level cells at a time.
+// Nodes are written as soon as their chunk is read, and each way is written by the chunk
+// holding its first node inside the covering, so no chunk needs to know about any other.
+// The only state kept across chunks is the IDs of nodes written outside the covering
+// and of relations, which are resolved and written at the end; these grow with the region's
+// boundary and the relations it touches, not with the number of nodes in it.
+class StreamingExtract {
+  public:
+  StreamingExtract(MDB_txn *txn, const S2CellUnion &covering, PbfWriter &writer) :
+    mCells(covering.cell_ids()),
+    mCellLevel(db::cellLevel(txn)),
+    mWriter(writer),
+    mLocations(txn),
+    mNodes(txn,"nodes"),
+    mWays(txn,"ways"),
+    mTagged(txn,"nodes"),
+    mWaysPresent(txn,"ways")
+  {
+  }
+
+  void run(MDB_txn *txn, ExportProgress &prog, bool jsonOutput, size_t memoryBudget, const string &output) {
+    MDB_cursor *cell_node = openCursor(txn,"cell_node");
+    MDB_cursor *node_way = openCursor(txn,"node_way");
+    MDB_cursor *node_relation = openCursor(txn,"node_relation");
+    MDB_cursor *way_relation = openCursor(txn,"way_relation");
+    roaring::Roaring64Map relation_ids;
+
+    {
+      ProgressSection section(prog,prog.cells_total,prog.cells_prog,mCells.size(),jsonOutput);
+      roaring::Roaring64Map chunk_nodes;
+      S2CellId chunk_begin = S2CellId::Begin(mCellLevel);
+      for (size_t i = 0; i < mCells.size(); i++) {
+        S2CellId cell_end = mCells[i].child_end(mCellLevel);
+        S2CellId next = S2CellId::None();
+        do {
+          next = db::traverseCell(cell_node,mCells[i],chunk_nodes,mCellLevel,STREAMING_CHUNK_NODES,next);
+          if (chunk_nodes.cardinality() >= STREAMING_CHUNK_NODES) {
+            writeChunk(chunk_nodes,chunk_begin,next,node_way,node_relation,way_relation,relation_ids);
+            chunk_begin = next;
+          }
+        } while (next != cell_end);
+        section.tick();
+      }
+      writeChunk(chunk_nodes,chunk_begin,S2CellId::End(mCellLevel),node_way,node_relation,way_relation,relation_ids);
+    }
+
+    mdb_cursor_close(cell_node);
+    mdb_cursor_close(node_way);
+    mdb_cursor_close(node_relation);
+    mdb_cursor_close(way_relation);
+
+    addParentRelations(txn,relation_ids);
+    if (!jsonOutput) cout << "Relations: " << relation_ids.cardinality() << endl;
+
+    // make it Multipolygon-complete: member ways with no node in the covering
+    // were never reached through a chunk, so they are written here.
+    db::Elements relations(txn,"relations");
+    ElementStore relation_store(output + ".relations.spill",memoryBudget);
+    roaring::Roaring64Map completion_ways;
+    for (auto relation_id : relation_ids) {
+      auto reader = relations.getReader(relation_id);
+      Relation::Reader relation = reader.getRoot<Relation>();
+      relation_store.add(relation_id,relation);
+      if (isMultipolygon(relation)) {
+        for (auto const &member : relation.getMembers()) {
+          if (member.getType() == RelationMember::Type::WAY && mWaysPresent.contains(member.getRef())) {
+            completion_ways.add(member.getRef());
+          }
+        }
+      }
+    }
+
+    roaring::Roaring64Map no_chunk;
+    for (auto way_id : completion_ways) {
+      auto reader = mWays.getReader(way_id);
+      Way::Reader way = reader.getRoot<Way>();
+      if (!ownerChunk(way,no_chunk,S2CellId::Begin(mCellLevel),S2CellId::End(mCellLevel))) writeWay(way_id,way,no_chunk);
+    }
+
+    relation_store.forEach([&](StoredRecord &record) {
+      mWriter.relation(record);
+    });
+  }
+
+  private:
+  MDB_cursor *openCursor(MDB_txn *txn, const char *name) {
+    MDB_dbi dbi;
+    MDB_cursor *cursor;
+    CHECK_LMDB(mdb_dbi_open(txn, name, MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+    CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+    return cursor;
+  }
+
+  // write the nodes of a chunk that ends before index level cell end, and the ways it owns.
+  void writeChunk(roaring::Roaring64Map &chunk_nodes, S2CellId begin, S2CellId end, MDB_cursor *node_way,
+                  MDB_cursor *node_relation, MDB_cursor *way_relation, roaring::Roaring64Map &relation_ids) {
+    roaring::Roaring64Map chunk_ways;
+    for (auto node_id : chunk_nodes) {
+      auto loc = mLocations.get(node_id);
+      if (loc.is_undefined()) continue;
+      writeNode(mWriter,mNodes,mTagged,node_id,loc);
+      db::traverseReverse(node_way,node_id,chunk_ways);
+      db::traverseReverse(node_relation,node_id,relation_ids);
+    }
+
+    for (auto way_id : chunk_ways) {
+      auto reader = mWays.getReader(way_id);
+      Way::Reader way = reader.getRoot<Way>();
+      if (ownerChunk(way,chunk_nodes,begin,end)) {
+        writeWay(way_id,way,chunk_nodes);
+        db::traverseReverse(way_relation,way_id,relation_ids);
+      }
+    }
+    chunk_nodes.clear();
+  }
+
+  // the leaf cell of loc, or None if loc is outside the covering.
+  S2CellId coveringCell(const db::Location &loc) {
+    S2CellId cell = S2CellId(S2LatLng::FromDegrees(loc.coords.lat(),loc.coords.lon()));
+    auto it = std::lower_bound(mCells.begin(),mCells.end(),cell,[](const S2CellId &a, const S2CellId &b) {
+      return a.range_max() < b;
+    });
+    if (it == mCells.end() || it->range_min() > cell) return S2CellId::None();
+    return cell;
+  }
+
+  // true if the first node of the way inside the covering falls in index level cells [begin,end).
+  bool ownerChunk(Way::Reader way, const roaring::Roaring64Map &chunk_nodes, S2CellId begin, S2CellId end) {
+    for (auto node_id : way.getNodes()) {
+      if (chunk_nodes.contains(node_id)) return true;
+      auto loc = mLocations.get(node_id);
+      if (loc.is_undefined()) continue;
+      S2CellId cell = coveringCell(loc);
+      if (cell != S2CellId::None()) {
+        S2CellId index_cell = cell.parent(mCellLevel);
+        return index_cell >= begin && index_cell < end;
+      }
+    }
+    return false;
+  }
+
+  // nodes inside the covering are written by their own chunk;
+  // nodes outside it are written once, before the first way that needs them.
+  void writeWay(uint64_t way_id, Way::Reader way, const roaring::Roaring64Map &chunk_nodes) {
+    for (auto node_id : way.getNodes()) {
+      if (chunk_nodes.contains(node_id) || mBoundaryNodes.contains(node_id)) continue;
+      auto loc = mLocations.get(node_id);
+      if (loc.is_undefined() || coveringCell(loc) != S2CellId::None()) continue;
+      mBoundaryNodes.add(node_id);
+      writeNode(mWriter,mNodes,mTagged,node_id,loc);
+    }
+    mWriter.way(way_id,way);
+  }
+
+  const vector<S2CellId> &mCells;
+  int mCellLevel;
+  PbfWriter &mWriter;
+  db::Locations mLocations;
+  db::Elements mNodes;
+  db::Elements mWays;
+  db::Presence mTagged;
+  db::Presence mWaysPresent;
+  roaring::Roaring64Map mBoundaryNodes;
+};
+
 // must be --bbox, --disc, --poly or --json
 // or --region
 void cmdExtract(int argc, char * argv[]) {
@@ -75,13 +583,18 @@ void cmdExtract(int argc, char * argv[]) {
     ("jsonOutput", "JSON progress output")
     ("cmd", "Command to run", cxxopts::value<string>())
     ("osmx", "Input .osmx", cxxopts::value<string>())
-    ("output", "Output file, pbf or xml", cxxopts::value<string>())
+    ("output", "Output file, pbf, xml or osmx", cxxopts::value<string>())
+    ("format", "Output format; osmx writes a new database, otherwise the file extension decides", cxxopts::value<string>())
     ("bbox", "rectangle in minLat,minLon,maxLat,maxLon", cxxopts::value<string>())
     ("disc", "disc in centerLat,centerLon,radiusDegrees", cxxopts::value<string>())
     ("geojson","geoJson of region", cxxopts::value<string>())
     ("poly","osmosis .poly of region", cxxopts::value<string>())
     ("region","file for region with extension .bbox, .disc, .json or .poly", cxxopts::value<string>())
     ("expand","buffer at this cell level",cxxopts::value<int>())
+    ("memoryBudget","MB of decoded ways and relations to keep in memory",cxxopts::value<int>()->default_value("1024"))
+    ("streaming","Write the extract while reading the region, a bounded chunk of nodes at a time")
+    ("since","Only elements changed since this ISO timestamp",cxxopts::value<string>())
+    ("filter","Only elements matching these tag expressions",cxxopts::value<string>())
   ;
   cmd_options.parse_positional({"cmd","osmx","output"});
   auto result = cmd_options.parse(argc, argv);
@@ -98,7 +611,12 @@ void cmdExtract(int argc, char * argv[]) {
     cout << " --geojson GEOJSON: region is an areal GeoJSON feature or geometry" << endl;
     cout << " --poly POLY: region is an Osmosis polygon" << endl;
     cout << " --region FILE: text file with .bbox, .disc, .json or .poly extension" << endl;
-    cout << " --expand CELL_LEVEL: buffer region with cells at this level, <= 16" << endl;
+    cout << " --expand CELL_LEVEL: buffer region with cells at this level, at most the database's cell level" << endl;
+    cout << " --memoryBudget MB: memory for decoded ways and relations before spilling to disk, default 1024" << endl;
+    cout << " --format osmx: write a new .osmx database; otherwise the format follows OUTPUT_FILE's extension" << endl;
+    cout << " --streaming: write the .pbf while reading the region, a chunk of nodes at a time; elements are unsorted" << endl;
+    cout << " --since TIMESTAMP: only elements changed since TIMESTAMP, to the hour, and what they reference; needs expand --timeIndex" << endl;
+    cout << " --filter EXPRESSIONS: only elements with these tags and what they reference, as [nwr/]KEY[=VALUE|*],..." << endl;
     exit(1);
   }
 
@@ -110,6 +628,7 @@ void cmdExtract(int argc, char * argv[]) {
   if (jsonOutput) prog.print();
 
   bool includeUserData = result.count("noUserData") == 0;
+  size_t memoryBudget = (size_t)result["memoryBudget"].as<int>() * 1024 * 1024;
 
   std::unique_ptr<Region> region;
   if (result.count("bbox")) region = std::make_unique<Region>(result["bbox"].as<string>(),"bbox");
@@ -130,15 +649,20 @@ void cmdExtract(int argc, char * argv[]) {
     exit(0);
   }
 
+  MDB_env* env = db::createEnv(result["osmx"].as<string>(),false);
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  int cell_level = db::cellLevel(txn);
+
   S2RegionCoverer::Options options;
   options.set_max_cells(1024);
-  options.set_max_level(CELL_INDEX_LEVEL);
+  options.set_max_level(cell_level);
   S2RegionCoverer coverer(options);
   S2CellUnion covering = region->GetCovering(coverer);
 
   if (result.count("expand")) {
     int expand = result["expand"].as<int>();
-    if (expand >= 0 && expand <= 16) {
+    if (expand >= 0 && expand <= cell_level) {
       covering.Expand(expand);
     }
   }
@@ -151,10 +675,6 @@ void cmdExtract(int argc, char * argv[]) {
   roaring::Roaring64Map way_ids;
   roaring::Roaring64Map relation_ids;
 
-  MDB_env* env = db::createEnv(result["osmx"].as<string>(),false);
-  MDB_txn* txn;
-  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
-
   db::Metadata metadata(txn);
   auto timestamp = metadata.get("osmosis_replication_timestamp");
   prog.timestamp = timestamp;
@@ -162,17 +682,53 @@ void cmdExtract(int argc, char * argv[]) {
     cout << "Snapshot timestamp is " << prog.timestamp  << endl;
   }
 
+  string output = result["output"].as<string>();
+  bool osmxOutput = endsWith(output,".osmx") || (result.count("format") && result["format"].as<string>() == "osmx");
+
+  if (result.count("streaming")) {
+    if (result.count("since") || result.count("filter")) {
+      cout << "--since and --filter cannot be combined with --streaming." << endl;
+      exit(1);
+    }
+    if (osmxOutput || !endsWith(output,".pbf")) {
+      cout << "Streaming extracts must be written to a .pbf file." << endl;
+      exit(1);
+    }
+    PbfHeader header = pbfHeader(region->GetBounds(),timestamp);
+    header.sorted = false;
+    PbfWriter writer(output,header,includeUserData);
+    StreamingExtract(txn,covering,writer).run(txn,prog,jsonOutput,memoryBudget,output);
+    writer.close();
+    mdb_env_close(env);
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - startTime ).count();
+    if (!jsonOutput) cout << "Finished export in " << duration/1000.0 << " seconds." << endl;
+    return;
+  }
+
+  LocationCache location_cache;
   {
     ProgressSection section(prog,prog.cells_total,prog.cells_prog,covering.size(),jsonOutput);
-    MDB_dbi dbi;
-    MDB_cursor *cursor;
-    CHECK_LMDB(mdb_dbi_open(txn, "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
-    CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
-    for (auto cell_id : covering.cell_ids()) {
-      db::traverseCell(cursor,cell_id,node_ids);
-      section.tick();
+    db::CellLocations cell_locations(txn);
+    if (cell_locations.exists() && !osmxOutput) {
+      for (auto cell_id : covering.cell_ids()) {
+        cell_locations.traverse(cell_id,[&](uint64_t node_id, const db::Location &location) {
+          node_ids.add(node_id);
+          location_cache.add(node_id,location);
+        });
+        section.tick();
+      }
+      location_cache.sort();
+    } else {
+      MDB_dbi dbi;
+      MDB_cursor *cursor;
+      CHECK_LMDB(mdb_dbi_open(txn, "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+      CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+      for (auto cell_id : covering.cell_ids()) {
+        db::traverseCell(cursor,cell_id,node_ids,cell_level);
+        section.tick();
+      }
+      mdb_cursor_close(cursor);
     }
-    mdb_cursor_close(cursor);
   }
 
   {
@@ -209,52 +765,88 @@ void cmdExtract(int argc, char * argv[]) {
     }
   }
 
-  {
-    MDB_dbi dbi;
-    MDB_cursor *cursor;
-    CHECK_LMDB(mdb_dbi_open(txn, "relation_relation", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
-    CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
-    roaring::Roaring64Map discovered_relations;
-    roaring::Roaring64Map discovered_relations_2;
+  addParentRelations(txn,relation_ids);
 
-    for (auto const &relation_id : relation_ids) {
-      db::traverseReverse(cursor,relation_id,discovered_relations);
+  // keep only what changed; the completion passes below still add referenced ways and nodes.
+  if (result.count("since")) {
+    db::TimeIndex time_index(txn);
+    if (!time_index.exists()) {
+      cout << "--since needs a time index; create the .osmx with osmx expand --timeIndex." << endl;
+      exit(1);
     }
+    roaring::Roaring64Map changed_nodes, changed_ways, changed_relations;
+    time_index.since(osmium::Timestamp(result["since"].as<string>()).seconds_since_epoch(),changed_nodes,changed_ways,changed_relations);
+    node_ids &= changed_nodes;
+    way_ids &= changed_ways;
+    relation_ids &= changed_relations;
+  }
 
-    relation_ids |= discovered_relations;
+  db::Elements ways(txn,"ways");
+  db::Elements relations(txn,"relations");
 
-    while(true) {
-      for (auto const &relation_id : discovered_relations) {
-        db::traverseReverse(cursor,relation_id,discovered_relations_2);
-      }
-      int num_discovered = 0;
-      for (auto discovered_relation_id : discovered_relations_2) {
-        if (relation_ids.addChecked(discovered_relation_id)) num_discovered++;
-      }
-      if (num_discovered == 0) break;
-      discovered_relations = discovered_relations_2;
-      discovered_relations_2.clear();
+  // keep only matching elements; the completion passes below still add referenced ways and nodes.
+  if (result.count("filter")) {
+    TagFilter filter(result["filter"].as<string>());
+    if (!filter.valid()) {
+      cout << "Invalid --filter expression." << endl;
+      exit(1);
+    }
+    db::TagIndex tag_index(txn);
+    if (tag_index.exists()) {
+      roaring::Roaring64Map candidate_nodes, candidate_ways, candidate_relations;
+      if (filter.candidates('n',tag_index,candidate_nodes)) node_ids &= candidate_nodes;
+      if (filter.candidates('w',tag_index,candidate_ways)) way_ids &= candidate_ways;
+      if (filter.candidates('r',tag_index,candidate_relations)) relation_ids &= candidate_relations;
+    }
+
+    db::Elements nodes(txn,"nodes");
+    db::Presence tagged(txn,"nodes");
+    roaring::Roaring64Map matched_nodes, matched_ways, matched_relations;
+    MDB_val data;
+    // untagged nodes are only in locations, and never match.
+    for (auto node_id : node_ids) {
+      if (!tagged.contains(node_id) || !nodes.get(node_id,data)) continue;
+      auto reader = db::toReader(data);
+      if (filter.matches('n',reader.getRoot<Node>().getTags())) matched_nodes.add(node_id);
+    }
+    for (auto way_id : way_ids) {
+      auto reader = ways.getReader(way_id);
+      if (filter.matches('w',reader.getRoot<Way>().getTags())) matched_ways.add(way_id);
     }
+    for (auto relation_id : relation_ids) {
+      auto reader = relations.getReader(relation_id);
+      if (filter.matches('r',reader.getRoot<Relation>().getTags())) matched_relations.add(relation_id);
+    }
+    node_ids = std::move(matched_nodes);
+    way_ids = std::move(matched_ways);
+    relation_ids = std::move(matched_relations);
   }
 
   if (!jsonOutput) cout << "Relations: " << relation_ids.cardinality() << endl;
-  db::Elements ways(txn,"ways");
-  db::Elements relations(txn,"relations");
+
+  // each way and relation is decoded once here and kept for the output pass.
+  ElementStore relation_store(output + ".relations.spill",memoryBudget);
+
+  db::Presence ways_present(txn,"ways");
 
   // make it Multipolygon-complete: go through all Relations, finding any that have tag type=multipolygon, and add to Ways
+  // with a tag index, the multipolygons are known without decoding tags,
+  // and .osmx output, which copies stored values, only decodes the multipolygons.
+  roaring::Roaring64Map multipolygons;
+  db::TagIndex tag_index(txn);
+  bool indexed = tag_index.exists() && tag_index.get(db::TagIndex::key('r',"type","multipolygon"),multipolygons);
 
   for (auto relation_id : relation_ids) {
+    if (osmxOutput && indexed && !multipolygons.contains(relation_id)) continue;
     auto reader = relations.getReader(relation_id);
     Relation::Reader relation = reader.getRoot<Relation>();
-    auto tags = relation.getTags();
-    for (int i = 0; i < tags.size() / 2; i++) {
-      if (tags[i*2] == "type" && tags[i*2+1] == "multipolygon") {
-        for (auto const &member : relation.getMembers()) {
-          if (member.getType() == RelationMember::Type::WAY) {
-            auto ref = member.getRef();
-            // check if the way exists, because this may be an extract
-            if (ways.exists(ref)) way_ids.add(member.getRef());
-          }
+    if (!osmxOutput) relation_store.add(relation_id,relation);
+    if (indexed ? multipolygons.contains(relation_id) : isMultipolygon(relation)) {
+      for (auto const &member : relation.getMembers()) {
+        if (member.getType() == RelationMember::Type::WAY) {
+          auto ref = member.getRef();
+          // check if the way exists, because this may be an extract
+          if (ways_present.contains(ref)) way_ids.add(member.getRef());
         }
       }
     }
@@ -264,10 +856,14 @@ void cmdExtract(int argc, char * argv[]) {
 
   // make it Way-complete: go through all Ways and add in any missing Nodes.
 
+  size_t way_budget = memoryBudget > relation_store.residentSize() ? memoryBudget - relation_store.residentSize() : 0;
+  ElementStore way_store(output + ".ways.spill",way_budget);
+
   {
     for (auto way_id : way_ids) {
       auto reader = ways.getReader(way_id);
       Way::Reader way = reader.getRoot<Way>();
+      if (!osmxOutput) way_store.add(way_id,way);
       for (auto node_id : way.getNodes()) {
         node_ids.add(node_id);
       }
@@ -278,153 +874,31 @@ void cmdExtract(int argc, char * argv[]) {
 
   // start Write
 
-  osmium::io::Header header;
-  header.set("generator", "osmx");
-  header.set("timestamp", timestamp);
-  header.set("osmosis_replication_timestamp", timestamp);
-
   auto bounds = region->GetBounds();
-
-
-  // the box header is used by some applications,
-  // for example: zooming to an overview in QGIS.
-  // however, osmium only supports writing one PBF box header and it must be in the -180 to 180 lng, -90 to 90 lat range.
-  // valid input regions can cross the antimeridian, but the output header box is omitted as it can't represent the input.
-  if (bounds.lng_lo().degrees() < bounds.lng_hi().degrees()) {
-    header.add_box(osmium::Box(bounds.lng_lo().degrees(),bounds.lat_lo().degrees(),bounds.lng_hi().degrees(),bounds.lat_hi().degrees()));
-  }
-  osmium::io::Writer writer{result["output"].as<string>(), header, osmium::io::overwrite::allow};
-  osmium::memory::CallbackBuffer cb;
-  cb.set_callback([&](osmium::memory::Buffer&& buffer) {
-    writer(std::move(buffer));
-  });
+  PbfHeader header = pbfHeader(bounds,timestamp);
+  uint64_t elems_total = node_ids.cardinality() + way_ids.cardinality() + relation_ids.cardinality();
 
   {
-    ProgressSection section(prog,prog.elems_total,prog.elems_prog,node_ids.cardinality() + way_ids.cardinality() + relation_ids.cardinality(),jsonOutput);
-
-    {
-      db::Locations location_index(txn);
-      db::Elements nodes_table(txn,"nodes");
-      for (auto node_id : node_ids) {
-        section.tick();
-        auto loc = location_index.get(node_id);
-        if (loc.is_undefined()) continue;
-
-        {
-          using namespace osmium::builder::attr; 
-          osmium::builder::NodeBuilder node_builder{cb.buffer()};
-          node_builder.set_id(node_id);
-          node_builder.set_location(loc.coords);
-          node_builder.set_version(loc.version);
-
-          if (!nodes_table.exists(node_id)) continue;
-          auto reader = nodes_table.getReader(node_id);
-          Node::Reader node = reader.getRoot<Node>();
-          auto metadata = node.getMetadata();
-          node_builder.set_timestamp(metadata.getTimestamp());
-          if (includeUserData) {
-            node_builder.set_changeset(metadata.getChangeset());
-            node_builder.set_user(metadata.getUser());
-            node_builder.set_uid(metadata.getUid());
-          }
-
-          auto tags = node.getTags();
-          osmium::builder::TagListBuilder tag_builder{node_builder};
-          for (int i = 0; i < tags.size() / 2; i++) {
-            tag_builder.add_tag(tags[i*2],tags[i*2+1]);
-          }
-        }
-        cb.buffer().commit();
-        cb.possibly_flush();
-      }
-    }
-    
-    // Writing ways pass
-    {
-      for (auto way_id : way_ids) {
-        section.tick();
-        auto reader = ways.getReader(way_id);
-        Way::Reader way = reader.getRoot<Way>();
-
-        {
-          using namespace osmium::builder::attr; 
-          osmium::builder::WayBuilder way_builder{cb.buffer()};
-          way_builder.set_id(way_id);
-          auto metadata = way.getMetadata();
-          way_builder.set_version(metadata.getVersion());
-          way_builder.set_timestamp(metadata.getTimestamp());
-          if (includeUserData) {
-            way_builder.set_changeset(metadata.getChangeset());
-            way_builder.set_user(metadata.getUser());
-            way_builder.set_uid(metadata.getUid());
-          }
-
-          {
-            osmium::builder::WayNodeListBuilder way_node_list_builder{way_builder};
-            for (auto node_id : way.getNodes()) {
-              way_node_list_builder.add_node_ref(node_id);
-            }
-          }
-
-          auto tags = way.getTags();
-          osmium::builder::TagListBuilder tag_builder{way_builder};
-          for (int i = 0; i < tags.size() / 2; i++) {
-            tag_builder.add_tag(tags[i*2],tags[i*2+1]);
-          }
-        }
-        cb.buffer().commit();
-        cb.possibly_flush();
-      }
-    }
-
-    {
-      for (auto relation_id : relation_ids) {
-        section.tick();
-        auto reader = relations.getReader(relation_id);
-        Relation::Reader relation = reader.getRoot<Relation>();
-
-        {
-          using namespace osmium::builder::attr; 
-          osmium::builder::RelationBuilder relation_builder{cb.buffer()};
-          relation_builder.set_id(relation_id);
-
-          auto metadata = relation.getMetadata();
-          relation_builder.set_version(metadata.getVersion());
-          relation_builder.set_timestamp(metadata.getTimestamp());
-          if (includeUserData) {
-            relation_builder.set_changeset(metadata.getChangeset());
-            relation_builder.set_user(metadata.getUser());
-            relation_builder.set_uid(metadata.getUid());
-          }
-
-          {
-            osmium::builder::RelationMemberListBuilder relation_member_list_builder{relation_builder};
-            for (auto const &member : relation.getMembers()) {
-              if (member.getType() == RelationMember::Type::NODE) {
-                relation_member_list_builder.add_member(osmium::item_type::node,member.getRef(),member.getRole());
-              } else if (member.getType() == RelationMember::Type::WAY) {
-                relation_member_list_builder.add_member(osmium::item_type::way,member.getRef(),member.getRole());
-              } else {
-                relation_member_list_builder.add_member(osmium::item_type::relation,member.getRef(),member.getRole());
-              }
-            }
-          }
-
-          auto tags = relation.getTags();
-          osmium::builder::TagListBuilder tag_builder{relation_builder};
-          for (int i = 0; i < tags.size() / 2; i++) {
-            tag_builder.add_tag(tags[i*2],tags[i*2+1]);
-          }
-        }
-        cb.buffer().commit();
-        cb.possibly_flush();
+    ProgressSection section(prog,prog.elems_total,prog.elems_prog,elems_total,jsonOutput);
+
+    // PBF output is encoded directly from the database values.
+    // other formats go through osmium's builders and writers.
+    if (osmxOutput) {
+      writeOsmx(output,txn,node_ids,way_ids,relation_ids,section);
+    } else if (endsWith(output,".pbf")) {
+      writePbf(output,header,txn,node_ids,location_cache,way_store,relation_store,includeUserData,section);
+    } else {
+      osmium::io::Header osmium_header;
+      osmium_header.set("generator", "osmx");
+      osmium_header.set("timestamp", timestamp);
+      osmium_header.set("osmosis_replication_timestamp", timestamp);
+      if (header.has_box) {
+        osmium_header.add_box(osmium::Box(header.min_lon,header.min_lat,header.max_lon,header.max_lat));
       }
+      writeOsmium(output,osmium_header,txn,node_ids,location_cache,way_store,relation_store,includeUserData,section);
     }
   }
 
-
-  cb.flush();
-  writer.close();
   mdb_env_close(env);
   auto duration = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - startTime ).count();
   if (!jsonOutput) cout << "Finished export in " << duration/1000.0 << " seconds." << endl;
@@ -0,0 +1,246 @@
+#include <algorithm>
+#include "osmium/area/assembler.hpp"
+#include "osmium/builder/osm_object_builder.hpp"
+#include "osmium/osm/area.hpp"
+#include "osmium/osm/way.hpp"
+#include "osmium/osm/relation.hpp"
+#include "osmx/geom.h"
+
+using namespace std;
+
+namespace osmx { namespace geom {
+
+LocationCache::LocationCache(MDB_txn *txn) : mLocations(txn,"locations",MDB_INTEGERKEY) {
+}
+
+void LocationCache::fetch(vector<uint64_t> &ids) {
+  sort(ids.begin(),ids.end());
+  ids.erase(unique(ids.begin(),ids.end()),ids.end());
+  for (auto id : ids) {
+    if (mCache.count(id)) continue;
+    MDB_val data;
+    osmium::Location location;
+    if (mLocations.get(id,data)) {
+      int32_t *buf = (int32_t *)data.mv_data;
+      location = osmium::Location(buf[0],buf[1]);
+    }
+    mCache.emplace(id,location);
+  }
+}
+
+osmium::Location LocationCache::get(uint64_t id) {
+  auto found = mCache.find(id);
+  if (found != mCache.end()) return found->second;
+  vector<uint64_t> ids{id};
+  fetch(ids);
+  return mCache[id];
+}
+
+Builder::Builder(MDB_txn *txn, Format format) :
+  mTxn(txn),
+  mFormat(format),
+  mLocations(txn),
+  mWays(txn,"ways"),
+  mRelations(txn,"relations")
+{
+}
+
+void Builder::collectNodes(const MDB_val &data, vector<uint64_t> &node_ids) {
+  auto reader = db::toReader(data);
+  for (auto node_id : reader.getRoot<Way>().getNodes()) node_ids.push_back(node_id);
+}
+
+// add a way with the locations of its nodes, which must already be fetched.
+void Builder::addWay(const MDB_val &data, uint64_t way_id, osmium::memory::Buffer &buffer) {
+  auto reader = db::toReader(data);
+  auto way = reader.getRoot<Way>();
+  {
+    osmium::builder::WayBuilder way_builder{buffer};
+    way_builder.set_id(way_id);
+    {
+      osmium::builder::WayNodeListBuilder way_node_list_builder{way_builder};
+      for (auto node_id : way.getNodes()) {
+        way_node_list_builder.add_node_ref(osmium::NodeRef(node_id,mLocations.get(node_id)));
+      }
+    }
+    osmium::builder::TagListBuilder tag_builder{way_builder};
+    auto tags = way.getTags();
+    for (unsigned int i = 0; i < tags.size() / 2; i++) {
+      tag_builder.add_tag(tags[i*2].cStr(),tags[i*2+1].cStr());
+    }
+  }
+  buffer.commit();
+}
+
+bool Builder::point(uint64_t node_id, string &out) {
+  auto location = mLocations.get(node_id);
+  if (!location.valid()) return false;
+  switch (mFormat) {
+    case Format::wkb: out += mWKB.create_point(location); break;
+    case Format::wkt: out += mWKT.create_point(location); break;
+    case Format::geojson: out += mGeoJSON.create_point(location); break;
+  }
+  return true;
+}
+
+bool Builder::linestring(uint64_t way_id, string &out) {
+  MDB_val data;
+  if (!mWays.get(way_id,data)) return false;
+  vector<uint64_t> node_ids;
+  collectNodes(data,node_ids);
+  mLocations.fetch(node_ids);
+
+  osmium::memory::Buffer buffer{1024,osmium::memory::Buffer::auto_grow::yes};
+  addWay(data,way_id,buffer);
+  auto const &way = buffer.get<osmium::Way>(0);
+  // a way with fewer than two distinct locations has no linestring.
+  try {
+    switch (mFormat) {
+      case Format::wkb: out += mWKB.create_linestring(way); break;
+      case Format::wkt: out += mWKT.create_linestring(way); break;
+      case Format::geojson: out += mGeoJSON.create_linestring(way); break;
+    }
+  } catch (const osmium::geometry_error &) {
+    return false;
+  }
+  return true;
+}
+
+bool Builder::assemble(osmium::item_type type, uint64_t id, osmium::memory::Buffer &areas) {
+  size_t committed = areas.committed();
+  osmium::memory::Buffer ways{1024,osmium::memory::Buffer::auto_grow::yes};
+  osmium::area::AssemblerConfig config;
+  osmium::area::Assembler assembler{config};
+  MDB_val data;
+
+  if (type == osmium::item_type::way) {
+    if (!mWays.get(id,data)) return false;
+    vector<uint64_t> node_ids;
+    collectNodes(data,node_ids);
+    mLocations.fetch(node_ids);
+    addWay(data,id,ways);
+    auto const &way = ways.get<osmium::Way>(0);
+    if (!way.is_closed() || !assembler(way,areas)) return false;
+  } else if (type == osmium::item_type::relation) {
+    if (!mRelations.get(id,data)) return false;
+    auto reader = db::toReader(data);
+    auto relation = reader.getRoot<Relation>();
+    bool multipolygon = false;
+    auto tags = relation.getTags();
+    for (unsigned int i = 0; i < tags.size() / 2; i++) {
+      if (tags[i*2] == "type" && (tags[i*2+1] == "multipolygon" || tags[i*2+1] == "boundary")) multipolygon = true;
+    }
+    if (!multipolygon) return false;
+
+    // member ways are read first, so all of their locations are fetched in one batch.
+    vector<pair<uint64_t,MDB_val>> member_ways;
+    vector<uint64_t> node_ids;
+    for (auto const &member : relation.getMembers()) {
+      if (member.getType() != RelationMember::Type::WAY) continue;
+      MDB_val way_data;
+      if (!mWays.get(member.getRef(),way_data)) continue;
+      member_ways.emplace_back(member.getRef(),way_data);
+      collectNodes(way_data,node_ids);
+    }
+    mLocations.fetch(node_ids);
+    for (auto const &member_way : member_ways) addWay(member_way.second,member_way.first,ways);
+
+    // the assembler pairs the relation's members with the ways, so only the ways that exist are members.
+    osmium::memory::Buffer relations{1024,osmium::memory::Buffer::auto_grow::yes};
+    {
+      osmium::builder::RelationBuilder relation_builder{relations};
+      relation_builder.set_id(id);
+      {
+        osmium::builder::RelationMemberListBuilder member_list_builder{relation_builder};
+        size_t way_index = 0;
+        for (auto const &member : relation.getMembers()) {
+          if (member.getType() != RelationMember::Type::WAY) continue;
+          if (way_index == member_ways.size() || member_ways[way_index].first != member.getRef()) continue;
+          member_list_builder.add_member(osmium::item_type::way,member.getRef(),member.getRole().cStr());
+          way_index++;
+        }
+      }
+      osmium::builder::TagListBuilder tag_builder{relation_builder};
+      for (unsigned int i = 0; i < tags.size() / 2; i++) {
+        tag_builder.add_tag(tags[i*2].cStr(),tags[i*2+1].cStr());
+      }
+    }
+    relations.commit();
+
+    vector<const osmium::Way *> members;
+    for (auto const &way : ways.select<osmium::Way>()) members.push_back(&way);
+    if (!assembler(relations.get<osmium::Relation>(0),members,areas)) return false;
+  } else {
+    return false;
+  }
+  return areas.committed() > committed;
+}
+
+bool Builder::area(osmium::item_type type, uint64_t id, string &out) {
+  osmium::memory::Buffer areas{1024,osmium::memory::Buffer::auto_grow::yes};
+  if (!assemble(type,id,areas)) return false;
+  auto const &area = areas.get<osmium::Area>(0);
+  try {
+    switch (mFormat) {
+      case Format::wkb: out += mWKB.create_multipolygon(area); break;
+      case Format::wkt: out += mWKT.create_multipolygon(area); break;
+      case Format::geojson: out += mGeoJSON.create_multipolygon(area); break;
+    }
+  } catch (const osmium::geometry_error &) {
+    return false;
+  }
+  return true;
+}
+
+void Builder::prefetch(const roaring::Roaring64Map &way_ids) {
+  vector<uint64_t> node_ids;
+  for (auto way_id : way_ids) {
+    MDB_val data;
+    if (mWays.get(way_id,data)) collectNodes(data,node_ids);
+  }
+  mLocations.fetch(node_ids);
+}
+
+void Builder::region(const S2CellUnion &covering, std::function<void(osmium::item_type type, uint64_t id, const std::string &geometry)> fn) {
+  int level = db::cellLevel(mTxn);
+  MDB_dbi dbi;
+  MDB_cursor *cell_node;
+  MDB_cursor *node_way;
+  CHECK_LMDB(mdb_dbi_open(mTxn, "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(mTxn,dbi,&cell_node));
+  CHECK_LMDB(mdb_dbi_open(mTxn, "node_way", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(mTxn,dbi,&node_way));
+  db::Presence tagged(mTxn,"nodes");
+
+  roaring::Roaring64Map passed_ways;
+  string geometry;
+  for (auto const &cell_id : covering.cell_ids()) {
+    roaring::Roaring64Map node_ids;
+    roaring::Roaring64Map way_ids;
+    db::traverseCell(cell_node,cell_id,node_ids,level);
+    for (auto node_id : node_ids) db::traverseReverse(node_way,node_id,way_ids);
+    way_ids -= passed_ways;
+    passed_ways |= way_ids;
+
+    vector<uint64_t> tagged_ids;
+    for (auto node_id : node_ids) {
+      if (tagged.contains(node_id)) tagged_ids.push_back(node_id);
+    }
+    mLocations.fetch(tagged_ids);
+    for (auto node_id : tagged_ids) {
+      geometry.clear();
+      if (point(node_id,geometry)) fn(osmium::item_type::node,node_id,geometry);
+    }
+
+    prefetch(way_ids);
+    for (auto way_id : way_ids) {
+      geometry.clear();
+      if (linestring(way_id,geometry)) fn(osmium::item_type::way,way_id,geometry);
+    }
+    mLocations.clear();
+  }
+  mdb_cursor_close(cell_node);
+  mdb_cursor_close(node_way);
+}
+
+} }
@@ -0,0 +1,338 @@
+#include <cmath>
+#include <iostream>
+#include "zlib.h"
+#include "osmium/osm/timestamp.hpp"
+#include "osmx/pbf_writer.h"
+
+namespace osmx {
+
+// same limits as osmium's PBF output.
+static const int MAX_ENTITIES_PER_BLOCK = 8000;
+static const size_t MAX_GROUP_BYTES = 8 * 1024 * 1024;
+
+// replace each value with the difference to its predecessor.
+template <typename T>
+static void deltaEncode(std::vector<T> &values) {
+  for (size_t i = values.size(); i-- > 1;) {
+    values[i] -= values[i-1];
+  }
+}
+
+// compress one block and frame it as BlobHeader + Blob.
+static std::string frameBlob(const std::string &type, const std::string &data) {
+  uLongf compressed_size = compressBound(data.size());
+  std::string compressed(compressed_size,'\0');
+  if (compress2((Bytef *)&compressed[0],&compressed_size,(const Bytef *)data.data(),data.size(),Z_DEFAULT_COMPRESSION) != Z_OK) {
+    std::cerr << "zlib compression failed" << std::endl;
+    abort();
+  }
+  compressed.resize(compressed_size);
+
+  std::string blob;
+  {
+    protozero::pbf_writer pw{blob};
+    pw.add_int32(2,data.size());
+    pw.add_bytes(3,compressed);
+  }
+
+  std::string blob_header;
+  {
+    protozero::pbf_writer pw{blob_header};
+    pw.add_string(1,type);
+    pw.add_int32(3,blob.size());
+  }
+
+  uint32_t header_size = blob_header.size();
+  std::string frame;
+  frame.reserve(4 + blob_header.size() + blob.size());
+  frame.push_back((char)(header_size >> 24));
+  frame.push_back((char)(header_size >> 16));
+  frame.push_back((char)(header_size >> 8));
+  frame.push_back((char)header_size);
+  frame += blob_header;
+  frame += blob;
+  return frame;
+}
+
+PbfWriter::PbfWriter(const std::string &path, const PbfHeader &header, bool includeUserData) :
+  mStream(path, std::ios::binary | std::ios::trunc),
+  mIncludeUserData(includeUserData) {
+  mStrings.push_back("");
+  mStringIds[""] = 0;
+
+  std::string data;
+  {
+    protozero::pbf_writer pw{data};
+    if (header.has_box) {
+      protozero::pbf_writer box{pw,1};
+      box.add_sint64(1,std::llround(header.min_lon * 1e9));
+      box.add_sint64(2,std::llround(header.max_lon * 1e9));
+      box.add_sint64(3,std::llround(header.max_lat * 1e9));
+      box.add_sint64(4,std::llround(header.min_lat * 1e9));
+    }
+    pw.add_string(4,"OsmSchema-V0.6");
+    pw.add_string(4,"DenseNodes");
+    if (header.sorted) pw.add_string(5,"Sort.Type_then_ID");
+    pw.add_string(16,"osmx");
+    if (!header.replication_timestamp.empty()) {
+      pw.add_int64(32,osmium::Timestamp(header.replication_timestamp.c_str()).seconds_since_epoch());
+    }
+    if (!header.replication_sequence_number.empty()) {
+      pw.add_int64(33,std::stoll(header.replication_sequence_number));
+    }
+  }
+  writeBlob("OSMHeader",std::move(data));
+}
+
+PbfWriter::~PbfWriter() {
+  if (!mClosed) close();
+}
+
+uint32_t PbfWriter::stringId(const char *data, size_t size) {
+  std::string s(data,size);
+  auto it = mStringIds.find(s);
+  if (it != mStringIds.end()) return it->second;
+  uint32_t id = mStrings.size();
+  mStringIds.emplace(s,id);
+  mStrings.push_back(std::move(s));
+  return id;
+}
+
+// a PrimitiveGroup holds only one type of entity, so a change of type starts a new block.
+void PbfWriter::beginEntity(GroupType type) {
+  if ((mGroupType != GroupType::NONE && mGroupType != type) || mGroupCount >= MAX_ENTITIES_PER_BLOCK || mGroup.size() > MAX_GROUP_BYTES) {
+    flushBlock();
+  }
+  mGroupType = type;
+  mGroupCount++;
+}
+
+void PbfWriter::denseNode(uint64_t id, const db::Location &location, uint32_t version, uint64_t timestamp, uint32_t changeset, uint32_t uid, uint32_t user_sid) {
+  mIds.push_back(id);
+  // at the default granularity of 100 nanodegrees, PBF coordinates are osmium's fixed-point values.
+  mLats.push_back(location.coords.y());
+  mLons.push_back(location.coords.x());
+  mVersions.push_back(version);
+  mTimestamps.push_back(timestamp);
+  mChangesets.push_back(changeset);
+  mUids.push_back(uid);
+  mUserSids.push_back(user_sid);
+}
+
+void PbfWriter::node(uint64_t id, const db::Location &location) {
+  beginEntity(GroupType::NODES);
+  denseNode(id,location,location.version,0,0,0,0);
+  mKeysVals.push_back(0);
+}
+
+void PbfWriter::node(uint64_t id, const db::Location &location, Node::Reader node) {
+  beginEntity(GroupType::NODES);
+  auto metadata = node.getMetadata();
+  if (mIncludeUserData) {
+    auto user = metadata.getUser();
+    denseNode(id,location,location.version,metadata.getTimestamp(),metadata.getChangeset(),metadata.getUid(),stringId(user.cStr(),user.size()));
+  } else {
+    denseNode(id,location,location.version,metadata.getTimestamp(),0,0,0);
+  }
+  for (auto const &tag : node.getTags()) {
+    mKeysVals.push_back(stringId(tag.cStr(),tag.size()));
+  }
+  mKeysVals.push_back(0);
+}
+
+static StoredHeader toHeader(uint64_t id, Metadata::Reader metadata) {
+  auto user = metadata.getUser();
+  return StoredHeader{id,metadata.getVersion(),metadata.getTimestamp(),metadata.getChangeset(),metadata.getUid(),StringRef{user.cStr(),(uint32_t)user.size()}};
+}
+
+void PbfWriter::collectTags(StoredRecord &record) {
+  mKeys.clear();
+  mVals.clear();
+  uint32_t num_tags = record.read<uint32_t>();
+  for (uint32_t i = 0; i < num_tags; i++) {
+    auto key = record.readString();
+    auto value = record.readString();
+    mKeys.push_back(stringId(key.data,key.size));
+    mVals.push_back(stringId(value.data,value.size));
+  }
+}
+
+void PbfWriter::collectTags(capnp::List<capnp::Text>::Reader tags) {
+  mKeys.clear();
+  mVals.clear();
+  for (int i = 0; i < tags.size() / 2; i++) {
+    mKeys.push_back(stringId(tags[i*2].cStr(),tags[i*2].size()));
+    mVals.push_back(stringId(tags[i*2+1].cStr(),tags[i*2+1].size()));
+  }
+}
+
+void PbfWriter::writeInfo(protozero::pbf_writer &element, const StoredHeader &header) {
+  protozero::pbf_writer info{element,4};
+  info.add_int32(1,header.version);
+  info.add_int64(2,header.timestamp);
+  if (mIncludeUserData) {
+    info.add_int64(3,header.changeset);
+    info.add_int32(4,header.uid);
+    info.add_uint32(5,stringId(header.user.data,header.user.size));
+  }
+}
+
+// encodes a Way from mKeys, mVals and mRefs.
+void PbfWriter::writeWay(const StoredHeader &header) {
+  deltaEncode(mRefs);
+  protozero::pbf_writer group{mGroup};
+  protozero::pbf_writer way{group,3};
+  way.add_int64(1,header.id);
+  way.add_packed_uint32(2,mKeys.begin(),mKeys.end());
+  way.add_packed_uint32(3,mVals.begin(),mVals.end());
+  writeInfo(way,header);
+  way.add_packed_sint64(8,mRefs.begin(),mRefs.end());
+}
+
+// encodes a Relation from mKeys, mVals, mRoles, mRefs and mTypes.
+void PbfWriter::writeRelation(const StoredHeader &header) {
+  deltaEncode(mRefs);
+  protozero::pbf_writer group{mGroup};
+  protozero::pbf_writer relation{group,4};
+  relation.add_int64(1,header.id);
+  relation.add_packed_uint32(2,mKeys.begin(),mKeys.end());
+  relation.add_packed_uint32(3,mVals.begin(),mVals.end());
+  writeInfo(relation,header);
+  relation.add_packed_int32(8,mRoles.begin(),mRoles.end());
+  relation.add_packed_sint64(9,mRefs.begin(),mRefs.end());
+  relation.add_packed_int32(10,mTypes.begin(),mTypes.end());
+}
+
+void PbfWriter::way(StoredRecord &record) {
+  beginEntity(GroupType::WAYS);
+  auto header = record.readHeader();
+  mRefs.resize(record.read<uint32_t>());
+  for (auto &ref : mRefs) ref = record.read<uint64_t>();
+  collectTags(record);
+  writeWay(header);
+}
+
+void PbfWriter::way(uint64_t id, Way::Reader way) {
+  beginEntity(GroupType::WAYS);
+  mRefs.clear();
+  for (auto node_id : way.getNodes()) mRefs.push_back(node_id);
+  collectTags(way.getTags());
+  writeWay(toHeader(id,way.getMetadata()));
+}
+
+void PbfWriter::relation(StoredRecord &record) {
+  beginEntity(GroupType::RELATIONS);
+  auto header = record.readHeader();
+  uint32_t num_members = record.read<uint32_t>();
+  mRoles.resize(num_members);
+  mRefs.resize(num_members);
+  mTypes.resize(num_members);
+  for (uint32_t i = 0; i < num_members; i++) {
+    // RelationMember::Type has the same numbering as the PBF MemberType enum.
+    mTypes[i] = record.read<uint8_t>();
+    mRefs[i] = record.read<uint64_t>();
+    auto role = record.readString();
+    mRoles[i] = stringId(role.data,role.size);
+  }
+  collectTags(record);
+  writeRelation(header);
+}
+
+void PbfWriter::relation(uint64_t id, Relation::Reader relation) {
+  beginEntity(GroupType::RELATIONS);
+  mRoles.clear();
+  mRefs.clear();
+  mTypes.clear();
+  for (auto const &member : relation.getMembers()) {
+    auto role = member.getRole();
+    mTypes.push_back((int32_t)member.getType());
+    mRefs.push_back(member.getRef());
+    mRoles.push_back(stringId(role.cStr(),role.size()));
+  }
+  collectTags(relation.getTags());
+  writeRelation(toHeader(id,relation.getMetadata()));
+}
+
+void PbfWriter::flushBlock() {
+  if (mGroupType == GroupType::NONE) return;
+
+  std::string block;
+  {
+    protozero::pbf_writer pw{block};
+    {
+      protozero::pbf_writer table{pw,1};
+      for (auto const &s : mStrings) table.add_bytes(1,s);
+    }
+
+    if (mGroupType == GroupType::NODES) {
+      deltaEncode(mIds);
+      deltaEncode(mLats);
+      deltaEncode(mLons);
+      deltaEncode(mTimestamps);
+      deltaEncode(mChangesets);
+      deltaEncode(mUids);
+      deltaEncode(mUserSids);
+
+      protozero::pbf_writer group{pw,2};
+      protozero::pbf_writer dense{group,2};
+      dense.add_packed_sint64(1,mIds.begin(),mIds.end());
+      {
+        protozero::pbf_writer info{dense,5};
+        info.add_packed_int32(1,mVersions.begin(),mVersions.end());
+        info.add_packed_sint64(2,mTimestamps.begin(),mTimestamps.end());
+        if (mIncludeUserData) {
+          info.add_packed_sint64(3,mChangesets.begin(),mChangesets.end());
+          info.add_packed_sint32(4,mUids.begin(),mUids.end());
+          info.add_packed_sint32(5,mUserSids.begin(),mUserSids.end());
+        }
+      }
+      dense.add_packed_sint64(8,mLats.begin(),mLats.end());
+      dense.add_packed_sint64(9,mLons.begin(),mLons.end());
+      dense.add_packed_int32(10,mKeysVals.begin(),mKeysVals.end());
+    } else {
+      pw.add_message(2,mGroup);
+    }
+  }
+  writeBlob("OSMData",std::move(block));
+
+  mGroupType = GroupType::NONE;
+  mGroupCount = 0;
+  mStrings.resize(1);
+  mStringIds.clear();
+  mStringIds[""] = 0;
+  mIds.clear();
+  mLats.clear();
+  mLons.clear();
+  mVersions.clear();
+  mTimestamps.clear();
+  mChangesets.clear();
+  mUids.clear();
+  mUserSids.clear();
+  mKeysVals.clear();
+  mGroup.clear();
+}
+
+void PbfWriter::writeBlob(const std::string &type, std::string data) {
+  mPending.push_back(mPool.submit([type,data = std::move(data)]() {
+    return frameBlob(type,data);
+  }));
+  writePending(mPool.num_threads() * 2);
+}
+
+// blocks are written in the order they were submitted, regardless of which finishes first.
+void PbfWriter::writePending(size_t max_pending) {
+  while (mPending.size() > max_pending) {
+    std::string frame = mPending.front().get();
+    mStream.write(frame.data(),frame.size());
+    mPending.pop_front();
+  }
+}
+
+void PbfWriter::close() {
+  flushBlock();
+  writePending(0);
+  mStream.close();
+  mClosed = true;
+}
+
+}
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include "s2/s2cell.h"
+#include "s2/s2earth.h"
+#include "s2/s2edge_distances.h"
+#include "osmx/proximity.h"
+
+using namespace std;
+
+namespace osmx {
+
+static MDB_cursor *openCursor(MDB_txn *txn, const char *name) {
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, name, MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+  return cursor;
+}
+
+static S2Point toPoint(const osmium::Location &location) {
+  return S2LatLng::FromDegrees(location.lat(),location.lon()).ToPoint();
+}
+
+ProximitySearch::ProximitySearch(MDB_txn *txn, const TagFilter *filter) :
+  mFilter(filter),
+  mLevel(db::cellLevel(txn)),
+  mLocations(txn),
+  mNodes(txn,"nodes"),
+  mWays(txn,"ways"),
+  mTagged(txn,"nodes"),
+  mCellLocations(txn),
+  mSegmentBounds(txn)
+{
+  mCellNode = openCursor(txn,"cell_node");
+  mNodeWay = openCursor(txn,"node_way");
+  if (mFilter) {
+    db::TagIndex tag_index(txn);
+    if (tag_index.exists()) {
+      mNodesIndexed = mFilter->candidates('n',tag_index,mNodeCandidates);
+      mWaysIndexed = mFilter->candidates('w',tag_index,mWayCandidates);
+    }
+  }
+}
+
+ProximitySearch::~ProximitySearch() {
+  mdb_cursor_close(mCellNode);
+  mdb_cursor_close(mNodeWay);
+}
+
+vector<Neighbor> ProximitySearch::within(const S2LatLng &point, double radius) {
+  return nearest(point,std::numeric_limits<size_t>::max(),radius);
+}
+
+vector<Neighbor> ProximitySearch::nearest(const S2LatLng &point, size_t k, double radius) {
+  vector<Neighbor> results;
+  if (k == 0) return results;
+  S2Point target = point.ToPoint();
+  S1ChordAngle limit = std::isinf(radius) ? S1ChordAngle::Infinity() : S2Earth::MetersToChordAngle(radius);
+
+  priority_queue<Entry,vector<Entry>,greater<Entry>> queue;
+  for (int face = 0; face < 6; face++) {
+    S2CellId cell_id = S2CellId::FromFace(face);
+    queue.push(Entry{cellDistance(cell_id,target),cell_id,osmium::item_type::undefined,0});
+  }
+
+  roaring::Roaring64Map seen_ways;
+  auto addNode = [&](uint64_t node_id, const osmium::Location &location) {
+    S2Point node_point = toPoint(location);
+    if (nodeMatches(node_id)) {
+      S1ChordAngle distance(target,node_point);
+      if (distance <= limit) queue.push(Entry{distance,S2CellId::None(),osmium::item_type::node,node_id});
+    }
+    if (!mSegmentBounds.exists()) return;
+    roaring::Roaring64Map way_ids;
+    db::traverseReverse(mNodeWay,node_id,way_ids);
+    for (auto way_id : way_ids) {
+      if (seen_ways.contains(way_id)) continue;
+      seen_ways.add(way_id);
+      S1ChordAngle distance;
+      if (wayDistance(way_id,target,distance) && distance <= limit) {
+        queue.push(Entry{distance,S2CellId::None(),osmium::item_type::way,way_id});
+      }
+    }
+  };
+
+  while (!queue.empty()) {
+    Entry entry = queue.top();
+    queue.pop();
+    if (limit < entry.distance) break;
+
+    if (entry.type != osmium::item_type::undefined) {
+      results.push_back(Neighbor{entry.type,entry.id,S2Earth::ToMeters(entry.distance)});
+      if (results.size() == k) break;
+      continue;
+    }
+
+    if (!hasNodes(entry.cell)) continue;
+    if (entry.cell.level() < mLevel) {
+      for (S2CellId child = entry.cell.child_begin(); child != entry.cell.child_end(); child = child.next()) {
+        S1ChordAngle distance = cellDistance(child,target);
+        if (distance <= limit) queue.push(Entry{distance,child,osmium::item_type::undefined,0});
+      }
+      continue;
+    }
+
+    if (mCellLocations.exists()) {
+      mCellLocations.traverse(entry.cell,[&](uint64_t node_id, const db::Location &location) {
+        addNode(node_id,location.coords);
+      });
+    } else {
+      roaring::Roaring64Map node_ids;
+      db::traverseCell(mCellNode,entry.cell,node_ids,mLevel);
+      for (auto node_id : node_ids) {
+        auto location = mLocations.get(node_id);
+        if (location.is_defined()) addNode(node_id,location.coords);
+      }
+    }
+  }
+  return results;
+}
+
+// a way with a node in the cell is at most the cell's half segment length closer than the node.
+S1ChordAngle ProximitySearch::cellDistance(S2CellId cell_id, const S2Point &target) {
+  S1ChordAngle distance = S2Cell(cell_id).GetDistance(target);
+  double meters = mSegmentBounds.get(cell_id);
+  if (meters == 0) return distance;
+  return S1ChordAngle(std::max(S1Angle::Zero(),distance.ToAngle() - S2Earth::MetersToAngle(meters)));
+}
+
+// true if cell_node has a node in any index level cell within cell_id.
+bool ProximitySearch::hasNodes(S2CellId cell_id) {
+  S2CellId start = cell_id.child_begin(mLevel);
+  MDB_val key, data;
+  key.mv_size = sizeof(S2CellId);
+  key.mv_data = (void *)&start;
+  if (mdb_cursor_get(mCellNode,&key,&data,MDB_SET_RANGE) != 0) return false;
+  return *((S2CellId *)key.mv_data) < cell_id.child_end(mLevel);
+}
+
+// untagged nodes are never results; with a filter, a node must also match it.
+bool ProximitySearch::nodeMatches(uint64_t id) {
+  if (!mTagged.contains(id)) return false;
+  if (!mFilter) return true;
+  if (mNodesIndexed && !mNodeCandidates.contains(id)) return false;
+  MDB_val data;
+  if (!mNodes.get(id,data)) return false;
+  auto reader = db::toReader(data);
+  return mFilter->matches('n',reader.getRoot<Node>().getTags());
+}
+
+// the distance to the nearest point of a tagged way, or false if the way isn't a result.
+bool ProximitySearch::wayDistance(uint64_t id, const S2Point &target, S1ChordAngle &distance) {
+  if (mWaysIndexed && !mWayCandidates.contains(id)) return false;
+  MDB_val data;
+  if (!mWays.get(id,data)) return false;
+  auto reader = db::toReader(data);
+  auto way = reader.getRoot<Way>();
+  if (mFilter ? !mFilter->matches('w',way.getTags()) : way.getTags().size() == 0) return false;
+
+  distance = S1ChordAngle::Infinity();
+  bool started = false;
+  S2Point prev;
+  for (auto node_id : way.getNodes()) {
+    auto location = mLocations.get(node_id);
+    if (location.is_undefined()) continue;
+    S2Point point = toPoint(location.coords);
+    if (started) S2::UpdateMinDistance(target,prev,point,&distance);
+    else distance = S1ChordAngle(target,point);
+    prev = point;
+    started = true;
+  }
+  return started;
+}
+
+}
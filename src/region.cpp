@@ -1,8 +1,11 @@
 #include <sstream>
 #include <iostream>
+#include <atomic>
+#include <thread>
 #include "s2/s2latlng.h"
 #include "s2/s2latlng_rect.h"
 #include "s2/s2cap.h"
+#include "s2/s2cell.h"
 #include "s2/s2polygon.h"
 #include "s2/s2loop.h"
 #include "osmx/region.h"
@@ -13,9 +16,44 @@ static inline void rtrim(std::string &s) {
     }).base(), s.end());
 }
 
-std::unique_ptr<S2Polygon> S2PolyFromCoordinates(nlohmann::json &coordinates) {
+// restricts a region to a single cell, so that disjoint parts
+// of one covering can be computed independently.
+class ClippedRegion : public S2Region {
+public:
+    ClippedRegion(const S2Region &region, S2CellId clip) : mRegion(region), mClip(clip) { }
+
+    ClippedRegion* Clone() const override {
+        return new ClippedRegion(mRegion, mClip.id());
+    }
+
+    S2Cap GetCapBound() const override {
+        return mClip.GetCapBound();
+    }
+
+    S2LatLngRect GetRectBound() const override {
+        return mClip.GetRectBound();
+    }
+
+    bool Contains(const S2Cell &cell) const override {
+        return mClip.Contains(cell) && mRegion.Contains(cell);
+    }
+
+    bool MayIntersect(const S2Cell &cell) const override {
+        return mClip.MayIntersect(cell) && mRegion.MayIntersect(cell);
+    }
+
+    bool Contains(const S2Point &p) const override {
+        return mClip.Contains(p) && mRegion.Contains(p);
+    }
+
+private:
+    const S2Region &mRegion;
+    S2Cell mClip;
+};
+
+std::vector<std::unique_ptr<S2Loop>> S2LoopsFromCoordinates(nlohmann::json &coordinates) {
     std::vector<std::unique_ptr<S2Loop>> loopRegions;
-    for (auto loop : coordinates) {
+    for (auto &loop : coordinates) {
         std::vector<S2Point> points;
 
         // ignore the last repeated point
@@ -29,17 +67,15 @@ std::unique_ptr<S2Polygon> S2PolyFromCoordinates(nlohmann::json &coordinates) {
         loopRegion->Normalize();
         loopRegions.push_back(std::move(loopRegion));
     };
-    return std::make_unique<S2Polygon>(std::move(loopRegions));
+    return loopRegions;
 }
 
 void Region::AddS2RegionFromGeometry(nlohmann::json &geometry) {
     if (geometry["type"] == "Polygon") {
-        auto p = S2PolyFromCoordinates(geometry["coordinates"]);
-        mRegions.push_back(std::move(p));
+        mParts.push_back(S2LoopsFromCoordinates(geometry["coordinates"]));
     } else if (geometry["type"] == "MultiPolygon") {
-        for (auto polygon : geometry["coordinates"]) {
-            auto p = S2PolyFromCoordinates(polygon);
-            mRegions.push_back(std::move(p));
+        for (auto &polygon : geometry["coordinates"]) {
+            mParts.push_back(S2LoopsFromCoordinates(polygon));
         }
     }
 }
@@ -66,7 +102,33 @@ void Region::AddS2RegionFromPolyFile(std::istringstream &file) {
 
     auto loop = std::make_unique<S2Loop>(points);
     loop->Normalize();
-    mRegions.push_back(std::move(loop));
+    std::vector<std::unique_ptr<S2Loop>> part;
+    part.push_back(std::move(loop));
+    mParts.push_back(std::move(part));
+}
+
+// Assemble all parts into one S2Polygon, so that containment and covering
+// go through a single shape index instead of one region per part.
+// The loops of a single part are nested directly, so inner loops are holes.
+// Several parts are unioned, which is O(n log n) in the number of parts:
+// nesting them would turn a part lying inside another part into a hole.
+void Region::BuildPolygon() {
+    for (auto const &part : mParts) {
+        for (auto const &loop : part) mNumVertices += loop->num_vertices();
+    }
+
+    std::unique_ptr<S2Polygon> polygon;
+    if (mParts.size() == 1) {
+        polygon = std::make_unique<S2Polygon>(std::move(mParts[0]), S2Debug::DISABLE);
+    } else {
+        std::vector<std::unique_ptr<S2Polygon>> polygons;
+        for (auto &part : mParts) {
+            polygons.push_back(std::make_unique<S2Polygon>(std::move(part), S2Debug::DISABLE));
+        }
+        polygon = S2Polygon::DestructiveUnion(std::move(polygons));
+    }
+    mParts.clear();
+    mRegion = std::move(polygon);
 }
 
 Region::Region(const std::string &text, const std::string &ext) {
@@ -75,13 +137,13 @@ Region::Region(const std::string &text, const std::string &ext) {
         std::sscanf(text.c_str(), "%lf,%lf,%lf,%lf",&minLat,&minLon,&maxLat,&maxLon);
         auto lo = S2LatLng::FromDegrees(minLat,minLon).Normalized();
         auto hi = S2LatLng::FromDegrees(maxLat,maxLon).Normalized();
-        mRegions.push_back(std::make_unique<S2LatLngRect>(lo,hi));
+        mRegion = std::make_unique<S2LatLngRect>(lo,hi);
     } else if (ext == "disc") {
         double lat,lon,radius;
         std::sscanf(text.c_str(), "%lf,%lf,%lf",&lat,&lon,&radius);
         auto center = S2LatLng::FromDegrees(lat,lon).Normalized();
         auto angle = S1Angle::Degrees(radius);
-        mRegions.push_back(std::make_unique<S2Cap>(center.ToPoint(),angle));
+        mRegion = std::make_unique<S2Cap>(center.ToPoint(),angle);
     } else if (ext == "poly") {
         std::istringstream f(text);
         std::string line;
@@ -98,60 +160,80 @@ Region::Region(const std::string &text, const std::string &ext) {
             }
             AddS2RegionFromPolyFile(f);
         }
+        BuildPolygon();
     } else if (ext == "geojson") {
         auto json = nlohmann::json::parse(text);
         if (json["type"] == "Polygon" || json["type"] == "MultiPolygon") {
             AddS2RegionFromGeometry(json);
         } else if (json["type"] == "GeometryCollection") {
-            for (auto geometry : json) {
-                AddS2RegionFromGeometry(json);
+            for (auto &geometry : json["geometries"]) {
+                AddS2RegionFromGeometry(geometry);
             }
         } else if (json["type"] == "Feature") {
             AddS2RegionFromGeometry(json["geometry"]);
         } else if (json["type"] == "FeatureCollection") {
-            for (auto feature : json["features"]) {
+            for (auto &feature : json["features"]) {
                 AddS2RegionFromGeometry(feature["geometry"]);
             }
         }
+        BuildPolygon();
     } else {
         std::cerr << "Unknown ext" << std::endl;
         assert(false);
     }
+    mBounds = mRegion->GetRectBound();
 }
 
 bool Region::Contains(S2Point p) {
-    for (auto const &region : mRegions) {
-        if (region->Contains(p)) return true;
-    }
-    return false;
+    return mRegion->Contains(p);
 }
 
-S2CellUnion Region::GetCovering(S2RegionCoverer &coverer) {
-    S2CellUnion retval;
-    for (auto const &region : mRegions) {
-        retval = retval.Union(coverer.GetCovering(*region));
+// Large polygons are split along a coarse covering, and each coarse cell
+// is covered on its own thread. max_cells is divided among the coarse cells,
+// at least 4 each, so the union stays within it; it can differ from the
+// serial covering, which spends the budget on the whole polygon at once.
+S2CellUnion Region::GetCovering(S2RegionCoverer &coverer, int parallel_vertices) {
+    unsigned int num_threads = std::thread::hardware_concurrency();
+    int max_cells = coverer.options().max_cells();
+    if (mNumVertices < parallel_vertices || num_threads < 2 || max_cells < 8) {
+        return coverer.GetCovering(*mRegion);
     }
-    return retval;
-}
 
-S2LatLngRect Region::GetBounds() {
-    auto const &firstRegion = mRegions[0];
-    auto lat_min = firstRegion->GetRectBound().lat_lo();
-    auto lat_max = firstRegion->GetRectBound().lat_hi();
-    auto lng_min = firstRegion->GetRectBound().lng_lo();
-    auto lng_max = firstRegion->GetRectBound().lng_hi();
-
-    for (size_t i = 1; i < mRegions.size(); i++) {
-        auto const &r = mRegions[i];
-        auto lat_lo = r->GetRectBound().lat_lo();
-        auto lat_hi = r->GetRectBound().lat_hi();
-        auto lng_lo = r->GetRectBound().lng_lo();
-        auto lng_hi = r->GetRectBound().lng_hi();
-        if (lat_lo < lat_min) lat_min = lat_lo;
-        if (lat_hi > lat_max) lat_max = lat_hi;
-        if (lng_lo < lng_min) lng_min = lng_lo;
-        if (lng_hi > lng_max) lng_max = lng_hi;
+    S2RegionCoverer::Options coarse_options;
+    coarse_options.set_max_cells(std::min((int)num_threads * 4, max_cells / 4));
+    coarse_options.set_max_level(coverer.options().max_level());
+    S2RegionCoverer coarse_coverer(coarse_options);
+    S2CellUnion coarse = coarse_coverer.GetCovering(*mRegion);
+    auto const &clips = coarse.cell_ids();
+
+    // the remainder of the division goes to the first coarse cells, one each.
+    std::vector<S2RegionCoverer::Options> clip_options(clips.size(), coverer.options());
+    for (size_t i = 0; i < clips.size(); i++) {
+        clip_options[i].set_max_cells(max_cells / clips.size() + (i < max_cells % clips.size() ? 1 : 0));
     }
 
-    return S2LatLngRect(S2LatLng(lat_min,lng_min),S2LatLng(lat_max,lng_max));
+    std::vector<std::vector<S2CellId>> results(clips.size());
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&]() {
+            size_t i;
+            while ((i = next++) < clips.size()) {
+                S2RegionCoverer clip_coverer(clip_options[i]);
+                ClippedRegion clipped(*mRegion, clips[i]);
+                clip_coverer.GetCovering(clipped, &results[i]);
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+
+    std::vector<S2CellId> cell_ids;
+    for (auto const &result : results) {
+        cell_ids.insert(cell_ids.end(), result.begin(), result.end());
+    }
+    return S2CellUnion(std::move(cell_ids));
+}
+
+S2LatLngRect Region::GetBounds() {
+    return mBounds;
 }
@@ -0,0 +1,129 @@
+#include <string>
+#include <fstream>
+#include <sstream>
+#include "cxxopts.hpp"
+#include "s2/s2region_coverer.h"
+#include "osmx/storage.h"
+#include "osmx/region.h"
+#include "osmx/util.h"
+
+using namespace std;
+using namespace osmx;
+
+static bool endsWith(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() && 0 == str.compare(str.size()-suffix.size(), suffix.size(), suffix);
+}
+
+// region names become directory names of per-region diffs.
+static bool validName(const string &name) {
+  if (name.empty()) return false;
+  for (char c : name) {
+    if (!isalnum(c) && c != '-' && c != '_') return false;
+  }
+  return true;
+}
+
+void cmdRegions(int argc, char* argv[]) {
+  cxxopts::Options cmd_options("Regions", "Register regions for per-region diffs.");
+  cmd_options.add_options()
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", "Input .osmx", cxxopts::value<string>())
+    ("action", "list, add or remove", cxxopts::value<string>())
+    ("name", "Region name", cxxopts::value<string>())
+    ("bbox", "rectangle in minLat,minLon,maxLat,maxLon", cxxopts::value<string>())
+    ("disc", "disc in centerLat,centerLon,radiusDegrees", cxxopts::value<string>())
+    ("geojson","geoJson of region", cxxopts::value<string>())
+    ("poly","osmosis .poly of region", cxxopts::value<string>())
+    ("region","file for region with extension .bbox, .disc, .json or .poly", cxxopts::value<string>())
+    ("expand","buffer at this cell level",cxxopts::value<int>())
+  ;
+  cmd_options.parse_positional({"cmd","osmx","action","name"});
+  auto result = cmd_options.parse(argc, argv);
+
+  string action = result.count("action") ? result["action"].as<string>() : "";
+  bool named = result.count("name") > 0;
+  if (result.count("osmx") == 0 || !(action == "list" || ((action == "add" || action == "remove") && named))) {
+    cout << "Usage: osmx regions OSMX_FILE list" << endl;
+    cout << "       osmx regions OSMX_FILE add NAME [OPTIONS]" << endl;
+    cout << "       osmx regions OSMX_FILE remove NAME" << endl;
+    cout << "Registered regions get their own diff from osmx update --regionDiffs." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx regions planet.osmx add new_york --region new_york.json" << endl << endl;
+    cout << "OPTIONS:" << endl;
+    cout << " --bbox MIN_LAT,MIN_LON,MAX_LAT,MAX_LON: region is lat/lon bbox" << endl;
+    cout << " --disc CENTER_LAT,CENTER_LON,R_DEGREES: region is disc" << endl;
+    cout << " --geojson GEOJSON: region is an areal GeoJSON feature or geometry" << endl;
+    cout << " --poly POLY: region is an Osmosis polygon" << endl;
+    cout << " --region FILE: text file with .bbox, .disc, .json or .poly extension" << endl;
+    cout << " --expand CELL_LEVEL: buffer region with cells at this level, at most the database's cell level" << endl;
+    exit(1);
+  }
+
+  MDB_env* env = db::createEnv(result["osmx"].as<string>(),action != "list");
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, action == "list" ? MDB_RDONLY : 0, &txn));
+
+  if (action == "list") {
+    db::Regions regions(txn);
+    for (auto const &region : regions.getAll()) {
+      cout << region.first << ": " << region.second.cell_ids().size() << " cells" << endl;
+    }
+    mdb_txn_abort(txn);
+  } else if (action == "remove") {
+    db::Regions regions(txn);
+    if (!regions.del(result["name"].as<string>())) {
+      cout << "No region named " << result["name"].as<string>() << endl;
+      mdb_txn_abort(txn);
+      exit(1);
+    }
+    CHECK_LMDB(mdb_txn_commit(txn));
+  } else {
+    string name = result["name"].as<string>();
+    if (!validName(name)) {
+      cout << "Region names may only contain letters, digits, - and _." << endl;
+      exit(1);
+    }
+
+    std::unique_ptr<Region> region;
+    if (result.count("bbox")) region = std::make_unique<Region>(result["bbox"].as<string>(),"bbox");
+    else if (result.count("disc")) region = std::make_unique<Region>(result["disc"].as<string>(),"disc");
+    else if (result.count("geojson")) region = std::make_unique<Region>(result["geojson"].as<string>(),"geojson");
+    else if (result.count("poly")) region = std::make_unique<Region>(result["poly"].as<string>(),"poly");
+    else if (result.count("region")) {
+      auto fname = result["region"].as<string>();
+      std::ifstream t(fname);
+      std::stringstream buffer;
+      buffer << t.rdbuf();
+      if (endsWith(fname,"bbox")) region = std::make_unique<Region>(buffer.str(),"bbox");
+      if (endsWith(fname,"disc")) region = std::make_unique<Region>(buffer.str(),"disc");
+      if (endsWith(fname,"json")) region = std::make_unique<Region>(buffer.str(),"geojson");
+      if (endsWith(fname,"poly")) region = std::make_unique<Region>(buffer.str(),"poly");
+    }
+    if (!region) {
+      cout << "No region specified." << endl;
+      exit(1);
+    }
+
+    // the same covering osmx extract uses, so a mirror made with extract stays consistent.
+    S2RegionCoverer::Options options;
+    options.set_max_cells(1024);
+    options.set_max_level(db::cellLevel(txn));
+    S2RegionCoverer coverer(options);
+    S2CellUnion covering = region->GetCovering(coverer);
+    if (result.count("expand")) {
+      int expand = result["expand"].as<int>();
+      if (expand >= 0 && expand <= db::cellLevel(txn)) {
+        covering.Expand(expand);
+      }
+    }
+
+    db::Regions regions(txn,true);
+    regions.put(name,covering);
+    CHECK_LMDB(mdb_txn_commit(txn));
+    cout << "Registered " << name << " with " << covering.cell_ids().size() << " cells." << endl;
+  }
+
+  mdb_env_sync(env,true);
+  mdb_env_close(env);
+}
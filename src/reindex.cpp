@@ -0,0 +1,148 @@
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "cxxopts.hpp"
+#include "s2/s2latlng.h"
+#include "s2/s2cell_id.h"
+#include "osmx/storage.h"
+#include "osmx/sorter.h"
+#include "osmx/util.h"
+
+using namespace std;
+using namespace osmx;
+
+// locations are read this many at a time, and their cells computed on all threads.
+static const size_t REINDEX_BATCH = 4000000;
+
+struct LocationEntry {
+  uint64_t id;
+  int32_t x;
+  int32_t y;
+  int32_t version;
+};
+
+static void computeCells(const vector<LocationEntry> &batch, vector<uint64_t> &cells, int level) {
+  cells.resize(batch.size());
+  unsigned int num_threads = max(1u,std::thread::hardware_concurrency());
+  size_t slice = (batch.size() + num_threads - 1) / num_threads;
+  vector<std::thread> threads;
+  for (size_t begin = 0; begin < batch.size(); begin += slice) {
+    size_t end = min(begin + slice,batch.size());
+    threads.emplace_back([&batch,&cells,level,begin,end]() {
+      for (size_t i = begin; i < end; i++) {
+        osmium::Location loc(batch[i].x,batch[i].y);
+        cells[i] = S2CellId(S2LatLng::FromDegrees(loc.lat(),loc.lon())).parent(level).id();
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+}
+
+// empty a table if it exists, keeping its flags.
+static bool emptyTable(MDB_txn *txn, const char *name) {
+  MDB_dbi dbi;
+  if (mdb_dbi_open(txn, name, 0, &dbi) != 0) return false;
+  CHECK_LMDB(mdb_drop(txn,dbi,0));
+  return true;
+}
+
+// Rebuild cell_node, and cell_location if the database has it, at a different cell level.
+// Nodes are sorted by their new cell in runs outside the database, so the old tables are only
+// emptied once every location has been read.
+void cmdReindex(int argc, char* argv[]) {
+  cxxopts::Options cmd_options("Reindex", "Rebuild the spatial index at a different cell level.");
+  cmd_options.add_options()
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", "Input .osmx", cxxopts::value<string>())
+    ("cellLevel", "S2 cell level of the spatial index", cxxopts::value<int>())
+  ;
+  cmd_options.parse_positional({"cmd","osmx"});
+  auto result = cmd_options.parse(argc, argv);
+
+  int level = result.count("cellLevel") ? result["cellLevel"].as<int>() : -1;
+  if (result.count("osmx") == 0 || level < 0 || level > S2CellId::kMaxLevel) {
+    cout << "Usage: osmx reindex OSMX_FILE --cellLevel LEVEL" << endl;
+    cout << "Rebuilds the spatial index of nodes at a cell level from 0 to 30." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx reindex planet.osmx --cellLevel 14" << endl;
+    exit(1);
+  }
+
+  string osmx = result["osmx"].as<string>();
+  MDB_env* env = db::createEnv(osmx,true);
+  string tempDir = osmx + "-temp";
+  assert(mkdir(tempDir.c_str(),S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0);
+
+  Timer timer("reindex");
+  Sorter cell_node(tempDir,"cell_node");
+  std::unique_ptr<CellLocationSorter> cell_locations;
+  bool cell_stats;
+  bool cell_segments;
+  {
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    int previous = db::cellLevel(txn);
+    cout << "Cell level " << previous << " to " << level << endl;
+    if (db::CellLocations(txn).exists()) cell_locations = std::make_unique<CellLocationSorter>(tempDir);
+    cell_stats = db::CellStats(txn).exists();
+    cell_segments = db::SegmentBounds(txn).exists();
+
+    MDB_dbi dbi;
+    MDB_cursor *cursor;
+    CHECK_LMDB(mdb_dbi_open(txn, "locations", MDB_INTEGERKEY, &dbi));
+    CHECK_LMDB(mdb_cursor_open(txn,dbi,&cursor));
+    vector<LocationEntry> batch;
+    vector<uint64_t> cells;
+    batch.reserve(REINDEX_BATCH);
+    auto flush = [&]() {
+      computeCells(batch,cells,level);
+      for (size_t i = 0; i < batch.size(); i++) {
+        cell_node.put(cells[i],batch[i].id);
+        if (cell_locations) cell_locations->put(S2CellId(cells[i]),batch[i].id,osmium::Location(batch[i].x,batch[i].y),batch[i].version);
+      }
+      batch.clear();
+    };
+    MDB_val key, data;
+    int retval = mdb_cursor_get(cursor,&key,&data,MDB_FIRST);
+    while (retval == 0) {
+      int32_t *buf = (int32_t *)data.mv_data;
+      batch.push_back(LocationEntry{*(uint64_t *)key.mv_data,buf[0],buf[1],buf[2]});
+      if (batch.size() == REINDEX_BATCH) flush();
+      retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT);
+    }
+    flush();
+    mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+  }
+
+  {
+    // counts and segment lengths at the old levels can't be split into finer cells, so cell_stats and cell_segments are dropped.
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+    emptyTable(txn,"cell_node");
+    if (cell_locations) emptyTable(txn,"cell_location");
+    if (cell_stats) {
+      MDB_dbi dbi;
+      CHECK_LMDB(mdb_dbi_open(txn, "cell_stats", MDB_INTEGERKEY, &dbi));
+      CHECK_LMDB(mdb_drop(txn,dbi,1));
+    }
+    if (cell_segments) {
+      MDB_dbi dbi;
+      CHECK_LMDB(mdb_dbi_open(txn, "cell_segments", MDB_INTEGERKEY, &dbi));
+      CHECK_LMDB(mdb_drop(txn,dbi,1));
+    }
+    db::Metadata metadata(txn);
+    metadata.put("cell_level",to_string(level));
+    CHECK_LMDB(mdb_txn_commit(txn));
+  }
+
+  cell_node.writeDb(env);
+  if (cell_locations) cell_locations->writeDb(env);
+  if (cell_stats) cout << "Removed cell_stats; expand again with --cellStats to rebuild it." << endl;
+  if (cell_segments) cout << "Removed cell_segments; expand again with --cellSegments to rebuild it." << endl;
+
+  assert(rmdir(tempDir.c_str()) == 0);
+  mdb_env_sync(env,true);
+  mdb_env_close(env);
+}
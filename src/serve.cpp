@@ -0,0 +1,947 @@
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "cxxopts.hpp"
+#include "nlohmann/json.hpp"
+#include "osmium/osm/timestamp.hpp"
+#include "s2/s2region_coverer.h"
+#include "osmx/storage.h"
+#include "osmx/region.h"
+#include "osmx/geom.h"
+#include "osmx/util.h"
+#include "osmx/serve.h"
+
+using namespace std;
+using namespace osmx;
+
+namespace {
+
+static const size_t MAX_HEADER_SIZE = 64 * 1024;
+static const size_t MAX_BODY_SIZE = 16 * 1024 * 1024;
+// at most this many comma-separated IDs in one element request.
+static const size_t MAX_BATCH_IDS = 10000;
+// extracts of regions with more nodes than this are refused before anything is read.
+static const uint64_t MAX_EXTRACT_NODES = 10000000;
+// responses are sent once this many bytes are pending, and extracts in chunks of this size.
+static const size_t SEND_SIZE = 64 * 1024;
+static const int IDLE_TIMEOUT_SECONDS = 60;
+static const int SEND_TIMEOUT_MS = 30000;
+
+enum Endpoint { ELEMENT, GEOMETRY, EXTRACT, STATS, OTHER, NUM_ENDPOINTS };
+static const char *ENDPOINT_NAMES[NUM_ENDPOINTS] = {"element","geometry","extract","stats","other"};
+
+// Request latencies in power-of-two microsecond buckets; bucket i counts requests that took less than 2^i microseconds.
+// Percentiles are reported as the upper bound of the bucket they fall in.
+class Histogram {
+  public:
+  void add(uint64_t micros) {
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && (1ULL << bucket) <= micros) bucket++;
+    mBuckets[bucket].fetch_add(1,memory_order_relaxed);
+    mCount.fetch_add(1,memory_order_relaxed);
+    mTotal.fetch_add(micros,memory_order_relaxed);
+  }
+
+  nlohmann::json toJson() const {
+    uint64_t counts[BUCKETS];
+    for (int i = 0; i < BUCKETS; i++) counts[i] = mBuckets[i].load(memory_order_relaxed);
+    uint64_t count = mCount.load(memory_order_relaxed);
+    nlohmann::json json;
+    json["count"] = count;
+    json["mean_us"] = count ? mTotal.load(memory_order_relaxed) / count : 0;
+    json["p50_us"] = percentile(counts,count,0.5);
+    json["p90_us"] = percentile(counts,count,0.9);
+    json["p99_us"] = percentile(counts,count,0.99);
+    json["max_us"] = percentile(counts,count,1.0);
+    nlohmann::json buckets = nlohmann::json::array();
+    for (int i = 0; i < BUCKETS; i++) {
+      if (counts[i]) buckets.push_back({1ULL << i,counts[i]});
+    }
+    json["buckets"] = buckets;
+    return json;
+  }
+
+  private:
+  enum { BUCKETS = 40 };
+
+  static uint64_t percentile(const uint64_t *counts, uint64_t count, double fraction) {
+    if (count == 0) return 0;
+    uint64_t rank = max<uint64_t>(1,(uint64_t)(fraction * count + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank) return 1ULL << i;
+    }
+    return 1ULL << (BUCKETS - 1);
+  }
+
+  std::atomic<uint64_t> mBuckets[BUCKETS]{};
+  std::atomic<uint64_t> mCount{0};
+  std::atomic<uint64_t> mTotal{0};
+};
+
+struct Request {
+  string method;
+  string path;
+  string query;
+  string body;
+  bool keep_alive;
+};
+
+struct Response {
+  int status = 200;
+  string content_type = "application/json";
+  string body;
+};
+
+struct Connection {
+  int fd;
+  // received bytes not yet parsed into requests.
+  string buffer;
+  chrono::steady_clock::time_point active;
+};
+
+static string lower(string text) {
+  for (auto &c : text) c = tolower(c);
+  return text;
+}
+
+static string trim(const string &text) {
+  size_t begin = text.find_first_not_of(" \t");
+  if (begin == string::npos) return "";
+  return text.substr(begin,text.find_last_not_of(" \t") - begin + 1);
+}
+
+static vector<string> split(const string &text, char sep) {
+  vector<string> parts;
+  size_t pos = 0;
+  while (pos <= text.size()) {
+    size_t end = text.find(sep,pos);
+    if (end == string::npos) end = text.size();
+    if (end > pos) parts.push_back(text.substr(pos,end - pos));
+    pos = end + 1;
+  }
+  return parts;
+}
+
+static string decode(const string &text) {
+  string decoded;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '+') decoded += ' ';
+    else if (text[i] == '%' && i + 2 < text.size() && isxdigit(text[i+1]) && isxdigit(text[i+2])) {
+      decoded += (char)stoi(text.substr(i+1,2),nullptr,16);
+      i += 2;
+    } else decoded += text[i];
+  }
+  return decoded;
+}
+
+// the decoded value of a query string parameter, or an empty string if it isn't given.
+static string param(const string &query, const string &name) {
+  size_t pos = 0;
+  while (pos < query.size()) {
+    size_t end = query.find('&',pos);
+    if (end == string::npos) end = query.size();
+    size_t eq = query.find('=',pos);
+    if (eq < end && eq - pos == name.size() && query.compare(pos,eq - pos,name) == 0) {
+      return decode(query.substr(eq + 1,end - eq - 1));
+    }
+    pos = end + 1;
+  }
+  return "";
+}
+
+// one request from the front of the buffer: the number of bytes it takes, 0 if it hasn't been received completely,
+// or -1 if it is malformed or too large. Request bodies must have a Content-Length.
+static long parseRequest(const string &buffer, Request &request) {
+  size_t head_end = buffer.find("\r\n\r\n");
+  if (head_end == string::npos) return buffer.size() > MAX_HEADER_SIZE ? -1 : 0;
+  if (head_end > MAX_HEADER_SIZE) return -1;
+
+  size_t line_end = buffer.find("\r\n");
+  size_t method_end = buffer.find(' ');
+  if (method_end >= line_end) return -1;
+  size_t target_end = buffer.find(' ',method_end + 1);
+  if (target_end >= line_end) return -1;
+  string target = buffer.substr(method_end + 1,target_end - method_end - 1);
+  string version = buffer.substr(target_end + 1,line_end - target_end - 1);
+  if (version.compare(0,7,"HTTP/1.") != 0) return -1;
+  request.method = buffer.substr(0,method_end);
+  request.keep_alive = version != "HTTP/1.0";
+
+  size_t content_length = 0;
+  size_t pos = line_end + 2;
+  while (pos < head_end) {
+    size_t end = buffer.find("\r\n",pos);
+    size_t colon = buffer.find(':',pos);
+    if (colon >= end) return -1;
+    string name = lower(buffer.substr(pos,colon - pos));
+    string value = trim(buffer.substr(colon + 1,end - colon - 1));
+    if (name == "content-length") {
+      if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != string::npos) return -1;
+      content_length = stoul(value);
+    } else if (name == "connection") {
+      value = lower(value);
+      if (value == "close") request.keep_alive = false;
+      else if (value == "keep-alive") request.keep_alive = true;
+    } else if (name == "transfer-encoding") {
+      return -1;
+    }
+    pos = end + 2;
+  }
+  if (content_length > MAX_BODY_SIZE) return -1;
+  size_t total = head_end + 4 + content_length;
+  if (buffer.size() < total) return 0;
+
+  size_t question = target.find('?');
+  request.path = target.substr(0,question);
+  request.query = question == string::npos ? "" : target.substr(question + 1);
+  request.body = buffer.substr(head_end + 4,content_length);
+  return total;
+}
+
+static const char *reason(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    default: return "Internal Server Error";
+  }
+}
+
+static void appendHead(string &out, int status, const string &content_type, bool keep_alive) {
+  out += "HTTP/1.1 ";
+  out += to_string(status);
+  out += ' ';
+  out += reason(status);
+  out += "\r\nContent-Type: ";
+  out += content_type;
+  out += "\r\n";
+  if (!keep_alive) out += "Connection: close\r\n";
+}
+
+static void appendResponse(string &out, const Response &response, bool keep_alive) {
+  appendHead(out,response.status,response.content_type,keep_alive);
+  out += "Content-Length: ";
+  out += to_string(response.body.size());
+  out += "\r\n\r\n";
+  out += response.body;
+}
+
+static void error(Response &response, int status, const string &message) {
+  response.status = status;
+  response.content_type = "application/json";
+  response.body = nlohmann::json{{"error",message}}.dump();
+}
+
+// sockets are non-blocking, so a client that stops reading only holds up its worker until the timeout.
+static bool sendAll(int fd, const string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd,data.data() + sent,data.size() - sent,0);
+    if (n > 0) {
+      sent += n;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pollfd pfd{fd,POLLOUT,0};
+      if (poll(&pfd,1,SEND_TIMEOUT_MS) <= 0) return false;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// append everything the client has sent so far; false once it has closed the connection.
+static bool receive(Connection &conn) {
+  char buf[SEND_SIZE];
+  while (conn.buffer.size() <= MAX_HEADER_SIZE + MAX_BODY_SIZE) {
+    ssize_t n = recv(conn.fd,buf,sizeof(buf),0);
+    if (n > 0) conn.buffer.append(buf,n);
+    else if (n == 0) return false;
+    else if (errno != EINTR) return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  return true;
+}
+
+// A response body of unknown length, sent with chunked transfer encoding as it is produced.
+// Anything already pending in out, like responses to earlier pipelined requests, is sent first.
+class ChunkedWriter {
+  public:
+  ChunkedWriter(int fd, string &out) : mFd(fd), mOut(out) { }
+
+  void write(const string &data) {
+    if (mFailed) return;
+    mChunk += data;
+    if (mChunk.size() >= SEND_SIZE) flush();
+  }
+
+  bool finish() {
+    flush();
+    mOut += "0\r\n\r\n";
+    if (!mFailed && !sendAll(mFd,mOut)) mFailed = true;
+    mOut.clear();
+    return !mFailed;
+  }
+
+  bool failed() const { return mFailed; }
+
+  private:
+  void flush() {
+    if (!mChunk.empty()) {
+      char size[24];
+      snprintf(size,sizeof(size),"%zx\r\n",mChunk.size());
+      mOut += size;
+      mOut += mChunk;
+      mOut += "\r\n";
+      mChunk.clear();
+    }
+    if (!mFailed && !sendAll(mFd,mOut)) mFailed = true;
+    mOut.clear();
+  }
+
+  int mFd;
+  string &mOut;
+  string mChunk;
+  bool mFailed = false;
+};
+
+static bool parseIds(const string &text, vector<uint64_t> &ids) {
+  size_t pos = 0;
+  while (true) {
+    size_t end = text.find(',',pos);
+    if (end == string::npos) end = text.size();
+    if (end == pos || end - pos > 19) return false;
+    uint64_t id = 0;
+    for (size_t i = pos; i < end; i++) {
+      if (!isdigit(text[i])) return false;
+      id = id * 10 + (text[i] - '0');
+    }
+    ids.push_back(id);
+    if (ids.size() > MAX_BATCH_IDS) return false;
+    if (end == text.size()) return true;
+    pos = end + 1;
+  }
+}
+
+// a bbox or disc query string parameter in the syntax of osmx extract, or a GeoJSON request body.
+static unique_ptr<Region> parseRegion(const Request &request, string &message) {
+  double values[4];
+  string bbox = param(request.query,"bbox");
+  string disc = param(request.query,"disc");
+  if (!bbox.empty()) {
+    if (sscanf(bbox.c_str(),"%lf,%lf,%lf,%lf",&values[0],&values[1],&values[2],&values[3]) != 4) {
+      message = "bbox must be MIN_LAT,MIN_LON,MAX_LAT,MAX_LON";
+      return nullptr;
+    }
+    return make_unique<Region>(bbox,"bbox");
+  }
+  if (!disc.empty()) {
+    if (sscanf(disc.c_str(),"%lf,%lf,%lf",&values[0],&values[1],&values[2]) != 3) {
+      message = "disc must be CENTER_LAT,CENTER_LON,RADIUS_DEGREES";
+      return nullptr;
+    }
+    return make_unique<Region>(disc,"disc");
+  }
+  if (request.method == "POST" && !request.body.empty()) {
+    try {
+      return make_unique<Region>(request.body,"geojson");
+    } catch (const std::exception &e) {
+      message = string("invalid GeoJSON: ") + e.what();
+      return nullptr;
+    }
+  }
+  message = "a region needs a bbox or disc parameter, or a GeoJSON body";
+  return nullptr;
+}
+
+static nlohmann::json tagsJson(capnp::List<capnp::Text>::Reader tags) {
+  nlohmann::json json = nlohmann::json::object();
+  for (unsigned int i = 0; i + 1 < tags.size(); i += 2) json[tags[i].cStr()] = tags[i+1].cStr();
+  return json;
+}
+
+template <typename T>
+static void setMetadata(nlohmann::json &element, const T &object) {
+  if (!object.hasMetadata()) return;
+  auto metadata = object.getMetadata();
+  element["version"] = metadata.getVersion();
+  element["timestamp"] = osmium::Timestamp(metadata.getTimestamp()).to_iso();
+  element["changeset"] = metadata.getChangeset();
+  element["uid"] = metadata.getUid();
+  element["user"] = metadata.getUser().cStr();
+}
+
+static const char *memberType(RelationMember::Type type) {
+  if (type == RelationMember::Type::NODE) return "node";
+  if (type == RelationMember::Type::WAY) return "way";
+  return "relation";
+}
+
+static MDB_txn *beginRead(MDB_env *env) {
+  MDB_txn *txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  return txn;
+}
+
+// A worker thread's read transaction and the tables it reads, which stay valid across reset and renew.
+class Worker : public db::Noncopyable {
+  public:
+  Worker(MDB_env *env) :
+    mTxn(beginRead(env)),
+    locations(mTxn),
+    nodes(mTxn,"nodes"),
+    ways(mTxn,"ways"),
+    relations(mTxn,"relations")
+  {
+    mdb_txn_reset(mTxn);
+  }
+
+  ~Worker() {
+    mdb_txn_abort(mTxn);
+  }
+
+  MDB_txn *txn() { return mTxn; }
+  void renew() { CHECK_LMDB(mdb_txn_renew(mTxn)); }
+  void reset() { mdb_txn_reset(mTxn); }
+
+  private:
+  MDB_txn *mTxn;
+
+  public:
+  db::Locations locations;
+  db::Elements nodes;
+  db::Elements ways;
+  db::Elements relations;
+};
+
+}
+
+namespace osmx {
+
+class Server::Impl {
+  public:
+  Impl(MDB_env *env, int listen_fd, unsigned int num_threads) : mEnv(env), mListenFd(listen_fd), mNumThreads(num_threads) {
+    db::openTables(env);
+    if (pipe(mWake) != 0) {
+      perror("pipe");
+      exit(1);
+    }
+    fcntl(mWake[0],F_SETFL,O_NONBLOCK);
+    fcntl(mWake[1],F_SETFL,O_NONBLOCK);
+  }
+
+  ~Impl() {
+    close(mWake[0]);
+    close(mWake[1]);
+  }
+
+  // poll the listening socket and idle connections until stop is called.
+  void run() {
+    vector<std::thread> threads;
+    for (unsigned int t = 0; t < mNumThreads; t++) threads.emplace_back([this]() { work(); });
+
+    vector<unique_ptr<Connection>> idle;
+    vector<pollfd> fds;
+    while (!mStop) {
+      {
+        lock_guard<mutex> lock(mReturnedMutex);
+        for (auto &conn : mReturned) idle.push_back(std::move(conn));
+        mReturned.clear();
+      }
+      fds.clear();
+      fds.push_back(pollfd{mListenFd,POLLIN,0});
+      fds.push_back(pollfd{mWake[0],POLLIN,0});
+      for (auto const &conn : idle) fds.push_back(pollfd{conn->fd,POLLIN,0});
+      if (poll(fds.data(),fds.size(),1000) < 0) {
+        if (errno == EINTR) continue;
+        perror("poll");
+        break;
+      }
+
+      if (fds[1].revents) {
+        char buf[256];
+        while (read(mWake[0],buf,sizeof(buf)) > 0) { }
+      }
+
+      auto now = chrono::steady_clock::now();
+      vector<unique_ptr<Connection>> waiting;
+      for (size_t i = 0; i < idle.size(); i++) {
+        if (fds[i + 2].revents) {
+          enqueue(std::move(idle[i]));
+        } else if (now - idle[i]->active > chrono::seconds(IDLE_TIMEOUT_SECONDS)) {
+          close(idle[i]->fd);
+        } else {
+          waiting.push_back(std::move(idle[i]));
+        }
+      }
+      idle.swap(waiting);
+
+      if (fds[0].revents & POLLIN) {
+        int fd;
+        while ((fd = accept(mListenFd,NULL,NULL)) >= 0) {
+          fcntl(fd,F_SETFL,O_NONBLOCK);
+          int one = 1;
+          setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+          auto conn = make_unique<Connection>();
+          conn->fd = fd;
+          conn->active = now;
+          idle.push_back(std::move(conn));
+        }
+      }
+    }
+
+    {
+      lock_guard<mutex> lock(mQueueMutex);
+      mStopping = true;
+    }
+    mQueueReady.notify_all();
+    for (auto &thread : threads) thread.join();
+    for (auto &conn : idle) close(conn->fd);
+    for (auto &conn : mReturned) close(conn->fd);
+  }
+
+  // only an atomic store and a write, so it can be called from a signal handler.
+  void stop() {
+    mStop = true;
+    char byte = 0;
+    if (write(mWake[1],&byte,1) < 0) { }
+  }
+
+  private:
+  void enqueue(unique_ptr<Connection> conn) {
+    {
+      lock_guard<mutex> lock(mQueueMutex);
+      mQueue.push_back(std::move(conn));
+    }
+    mQueueReady.notify_one();
+  }
+
+  void work() {
+    Worker worker(mEnv);
+    while (true) {
+      unique_ptr<Connection> conn;
+      {
+        unique_lock<mutex> lock(mQueueMutex);
+        mQueueReady.wait(lock,[this]() { return mStopping || !mQueue.empty(); });
+        if (mStopping) break;
+        conn = std::move(mQueue.front());
+        mQueue.pop_front();
+      }
+      if (!serve(worker,*conn)) {
+        close(conn->fd);
+        continue;
+      }
+      {
+        lock_guard<mutex> lock(mReturnedMutex);
+        mReturned.push_back(std::move(conn));
+      }
+      char byte = 0;
+      if (write(mWake[1],&byte,1) < 0) { }
+    }
+    lock_guard<mutex> lock(mQueueMutex);
+    for (auto &conn : mQueue) close(conn->fd);
+    mQueue.clear();
+  }
+
+  // answer every complete request received on the connection in one read transaction.
+  // false if the connection should be closed.
+  bool serve(Worker &worker, Connection &conn) {
+    bool open = receive(conn);
+    bool keep_alive = true;
+    string out;
+    worker.renew();
+    while (keep_alive) {
+      Request request;
+      long consumed = parseRequest(conn.buffer,request);
+      if (consumed == 0) break;
+      if (consumed < 0) {
+        Response response;
+        error(response,400,"malformed or too large request");
+        appendResponse(out,response,false);
+        keep_alive = false;
+        break;
+      }
+      conn.buffer.erase(0,consumed);
+      keep_alive = request.keep_alive;
+      if (!respond(worker,request,conn.fd,out)) {
+        keep_alive = false;
+        break;
+      }
+      if (out.size() >= SEND_SIZE) {
+        if (!sendAll(conn.fd,out)) keep_alive = false;
+        out.clear();
+      }
+    }
+    worker.reset();
+    if (!out.empty() && !sendAll(conn.fd,out)) return false;
+    conn.active = chrono::steady_clock::now();
+    return keep_alive && open;
+  }
+
+  // append the response to out, or for an extract, send it; false if sending failed.
+  bool respond(Worker &worker, const Request &request, int fd, string &out) {
+    auto start = chrono::steady_clock::now();
+    auto parts = split(request.path,'/');
+    Endpoint endpoint = OTHER;
+    Response response;
+    bool streamed = false;
+    bool sent = true;
+
+    if (parts.size() == 2 && (parts[0] == "node" || parts[0] == "way" || parts[0] == "relation")) endpoint = ELEMENT;
+    else if (parts.size() == 3 && parts[0] == "geometry") endpoint = GEOMETRY;
+    else if (parts.size() == 1 && parts[0] == "extract") endpoint = EXTRACT;
+    else if (parts.size() == 1 && parts[0] == "stats") endpoint = STATS;
+
+    if (request.method != "GET" && !(request.method == "POST" && endpoint == EXTRACT)) {
+      error(response,405,"method not allowed");
+    } else if (endpoint == ELEMENT) {
+      elements(worker,parts[0],parts[1],response);
+    } else if (endpoint == GEOMETRY) {
+      geometry(worker,parts[1],parts[2],request,response);
+    } else if (endpoint == EXTRACT) {
+      string message;
+      auto region = parseRegion(request,message);
+      if (!region) {
+        error(response,400,message);
+      } else {
+        S2CellUnion covering = extractCovering(worker,*region);
+        if (countNodes(worker,covering) > MAX_EXTRACT_NODES) {
+          error(response,400,"region has more than " + to_string(MAX_EXTRACT_NODES) + " nodes; use osmx extract");
+        } else {
+          sent = extract(worker,covering,fd,request.keep_alive,out);
+          streamed = true;
+        }
+      }
+    } else if (endpoint == STATS) {
+      stats(worker,request,response);
+    } else {
+      error(response,404,"unknown endpoint");
+    }
+    if (!streamed) appendResponse(out,response,request.keep_alive);
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    mLatency[endpoint].add(elapsed);
+    return sent;
+  }
+
+  nlohmann::json element(Worker &worker, const string &type, uint64_t id) {
+    nlohmann::json json;
+    MDB_val data;
+    if (type == "node") {
+      auto location = worker.locations.get(id);
+      if (location.is_undefined()) return nullptr;
+      json = {{"type","node"},{"id",id},{"lat",location.coords.lat()},{"lon",location.coords.lon()},{"version",location.version}};
+      // untagged nodes only have a location.
+      if (worker.nodes.get(id,data)) {
+        auto reader = db::toReader(data);
+        auto node = reader.getRoot<Node>();
+        json["tags"] = tagsJson(node.getTags());
+        setMetadata(json,node);
+      } else {
+        json["tags"] = nlohmann::json::object();
+      }
+    } else if (type == "way") {
+      if (!worker.ways.get(id,data)) return nullptr;
+      auto reader = db::toReader(data);
+      auto way = reader.getRoot<Way>();
+      json = {{"type","way"},{"id",id}};
+      nlohmann::json nodes = nlohmann::json::array();
+      for (auto node_id : way.getNodes()) nodes.push_back(node_id);
+      json["nodes"] = nodes;
+      json["tags"] = tagsJson(way.getTags());
+      setMetadata(json,way);
+    } else {
+      if (!worker.relations.get(id,data)) return nullptr;
+      auto reader = db::toReader(data);
+      auto relation = reader.getRoot<Relation>();
+      json = {{"type","relation"},{"id",id}};
+      nlohmann::json members = nlohmann::json::array();
+      for (auto const &member : relation.getMembers()) {
+        members.push_back({{"type",memberType(member.getType())},{"ref",member.getRef()},{"role",member.getRole().cStr()}});
+      }
+      json["members"] = members;
+      json["tags"] = tagsJson(relation.getTags());
+      setMetadata(json,relation);
+    }
+    return json;
+  }
+
+  // one ID is answered with the element, several comma-separated IDs with an array, with null for missing elements.
+  void elements(Worker &worker, const string &type, const string &ids_text, Response &response) {
+    vector<uint64_t> ids;
+    if (!parseIds(ids_text,ids)) {
+      error(response,400,"IDs must be up to " + to_string(MAX_BATCH_IDS) + " comma-separated numbers");
+      return;
+    }
+    if (ids.size() == 1) {
+      auto json = element(worker,type,ids[0]);
+      if (json.is_null()) error(response,404,type + " " + ids_text + " not found");
+      else response.body = json.dump();
+      return;
+    }
+    nlohmann::json json = nlohmann::json::array();
+    for (auto id : ids) json.push_back(element(worker,type,id));
+    response.body = json.dump();
+  }
+
+  void geometry(Worker &worker, const string &type, const string &id_text, const Request &request, Response &response) {
+    vector<uint64_t> ids;
+    if (!parseIds(id_text,ids) || ids.size() != 1) {
+      error(response,400,"geometry needs one ID");
+      return;
+    }
+    string format_name = param(request.query,"format");
+    geom::Format format = geom::Format::geojson;
+    response.content_type = "application/geo+json";
+    if (format_name == "wkt") {
+      format = geom::Format::wkt;
+      response.content_type = "text/plain";
+    } else if (format_name == "wkb") {
+      format = geom::Format::wkb;
+      response.content_type = "application/octet-stream";
+    } else if (!format_name.empty() && format_name != "geojson") {
+      error(response,400,"format must be geojson, wkt or wkb");
+      return;
+    }
+
+    geom::Builder builder(worker.txn(),format);
+    string area = param(request.query,"area");
+    bool found;
+    if (type == "node") found = builder.point(ids[0],response.body);
+    else if (type == "way" && (area == "1" || area == "true")) found = builder.area(osmium::item_type::way,ids[0],response.body);
+    else if (type == "way") found = builder.linestring(ids[0],response.body);
+    else if (type == "relation") found = builder.area(osmium::item_type::relation,ids[0],response.body);
+    else {
+      error(response,404,"unknown element type");
+      return;
+    }
+    if (!found) error(response,404,"no geometry for " + type + " " + id_text);
+  }
+
+  // the same covering osmx extract uses.
+  S2CellUnion extractCovering(Worker &worker, Region &region) {
+    S2RegionCoverer::Options options;
+    options.set_max_cells(1024);
+    options.set_max_level(db::cellLevel(worker.txn()));
+    S2RegionCoverer coverer(options);
+    return region.GetCovering(coverer);
+  }
+
+  // the nodes in the covering, counted from cell_node without reading them, up to just over MAX_EXTRACT_NODES.
+  uint64_t countNodes(Worker &worker, const S2CellUnion &covering) {
+    MDB_dbi dbi;
+    MDB_cursor *cursor;
+    CHECK_LMDB(mdb_dbi_open(worker.txn(), "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+    CHECK_LMDB(mdb_cursor_open(worker.txn(),dbi,&cursor));
+    int level = db::cellLevel(worker.txn());
+    uint64_t count = 0;
+    for (auto const &cell_id : covering.cell_ids()) {
+      count += db::countCell(cursor,cell_id,level,MAX_EXTRACT_NODES - count);
+      if (count > MAX_EXTRACT_NODES) break;
+    }
+    mdb_cursor_close(cursor);
+    return count;
+  }
+
+  // the tagged nodes and all ways of the covering, as newline-delimited GeoJSON features.
+  // Untagged ways are included, since they are often the members of multipolygons; their properties are empty.
+  bool extract(Worker &worker, const S2CellUnion &covering, int fd, bool keep_alive, string &out) {
+    appendHead(out,200,"application/x-ndjson",keep_alive);
+    out += "Transfer-Encoding: chunked\r\n\r\n";
+    ChunkedWriter writer(fd,out);
+    geom::Builder builder(worker.txn(),geom::Format::geojson);
+    builder.region(covering,[&](osmium::item_type type, uint64_t id, const string &geometry) {
+      if (writer.failed()) return;
+      MDB_val data;
+      nlohmann::json properties = nlohmann::json::object();
+      if (type == osmium::item_type::node && worker.nodes.get(id,data)) {
+        auto reader = db::toReader(data);
+        properties = tagsJson(reader.getRoot<Node>().getTags());
+      } else if (type == osmium::item_type::way && worker.ways.get(id,data)) {
+        auto reader = db::toReader(data);
+        properties = tagsJson(reader.getRoot<Way>().getTags());
+      }
+      string feature = "{\"type\":\"Feature\",\"id\":\"";
+      feature += osmium::item_type_to_name(type);
+      feature += "/" + to_string(id) + "\",\"properties\":" + properties.dump() + ",\"geometry\":" + geometry + "}\n";
+      writer.write(feature);
+    });
+    return writer.finish();
+  }
+
+  // latencies by endpoint, table sizes and the replication state; with a region, its element counts from the cell statistics.
+  void stats(Worker &worker, const Request &request, Response &response) {
+    MDB_txn *txn = worker.txn();
+    nlohmann::json json;
+    db::Metadata metadata(txn);
+    json["timestamp"] = metadata.get("osmosis_replication_timestamp");
+    json["seqnum"] = metadata.get("osmosis_replication_sequence_number");
+    json["cell_level"] = db::cellLevel(txn);
+
+    for (auto const &table : {"locations","nodes","ways","relations","cell_node","node_way","node_relation","way_relation","relation_relation"}) {
+      MDB_dbi dbi;
+      MDB_stat stat;
+      CHECK_LMDB(mdb_dbi_open(txn, table, MDB_INTEGERKEY, &dbi));
+      CHECK_LMDB(mdb_stat(txn,dbi,&stat));
+      json["tables"][table] = stat.ms_entries;
+    }
+    for (int i = 0; i < NUM_ENDPOINTS; i++) json["latency"][ENDPOINT_NAMES[i]] = mLatency[i].toJson();
+
+    if (!param(request.query,"bbox").empty() || !param(request.query,"disc").empty()) {
+      string message;
+      auto region = parseRegion(request,message);
+      if (!region) {
+        error(response,400,message);
+        return;
+      }
+      db::CellStats cell_stats(txn);
+      if (!cell_stats.exists()) {
+        error(response,404,"no cell statistics; create the .osmx with osmx expand --cellStats");
+        return;
+      }
+      S2RegionCoverer::Options options;
+      options.set_max_cells(1024);
+      options.set_max_level(db::cellLevel(txn));
+      S2RegionCoverer coverer(options);
+      auto counts = cell_stats.estimate(region->GetCovering(coverer));
+      json["estimate"] = {{"nodes",counts.nodes},{"ways",counts.ways},{"relations",counts.relations}};
+    }
+    response.body = json.dump();
+  }
+
+  MDB_env *mEnv;
+  int mListenFd;
+  unsigned int mNumThreads;
+  int mWake[2];
+  atomic<bool> mStop{false};
+
+  mutex mQueueMutex;
+  condition_variable mQueueReady;
+  deque<unique_ptr<Connection>> mQueue;
+  bool mStopping = false;
+
+  mutex mReturnedMutex;
+  vector<unique_ptr<Connection>> mReturned;
+
+  Histogram mLatency[NUM_ENDPOINTS];
+};
+
+Server::Server(MDB_env *env, int listen_fd, unsigned int num_threads) : mImpl(new Impl(env,listen_fd,num_threads)) {
+}
+
+Server::~Server() {
+}
+
+void Server::run() {
+  mImpl->run();
+}
+
+void Server::stop() {
+  mImpl->stop();
+}
+
+int listenOn(const string &address, int &port) {
+  sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET,address.c_str(),&addr.sin_addr) != 1) {
+    cout << "Invalid IPv4 address: " << address << endl;
+    exit(1);
+  }
+  int fd = socket(AF_INET,SOCK_STREAM,0);
+  int one = 1;
+  if (fd >= 0) setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+  if (fd < 0 || ::bind(fd,(sockaddr *)&addr,sizeof(addr)) != 0 || listen(fd,SOMAXCONN) != 0) {
+    cout << "Could not listen on " << address << ":" << port << ": " << strerror(errno) << endl;
+    exit(1);
+  }
+  socklen_t length = sizeof(addr);
+  getsockname(fd,(sockaddr *)&addr,&length);
+  port = ntohs(addr.sin_port);
+  fcntl(fd,F_SETFL,O_NONBLOCK);
+  return fd;
+}
+
+}
+
+static Server *serving = nullptr;
+
+static void requestStop(int) {
+  if (serving) serving->stop();
+}
+
+void cmdServe(int argc, char* argv[]) {
+  cxxopts::Options cmd_options("Serve", "Answer element, geometry, extract and stats queries over HTTP.");
+  cmd_options.add_options()
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", "Input .osmx", cxxopts::value<string>())
+    ("port", "TCP port to listen on", cxxopts::value<int>()->default_value("8080"))
+    ("bind", "IPv4 address to listen on", cxxopts::value<string>()->default_value("127.0.0.1"))
+    ("threads", "Worker threads, each with one read transaction", cxxopts::value<int>()->default_value("0"))
+  ;
+  cmd_options.parse_positional({"cmd","osmx"});
+  auto result = cmd_options.parse(argc, argv);
+
+  if (result.count("osmx") == 0) {
+    cout << "Usage: osmx serve OSMX_FILE [OPTIONS]" << endl;
+    cout << "Answers HTTP/1.1 queries while osmx update or osmx updated writes to the same file in another process." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx serve planet.osmx --port 8080" << endl;
+    cout << " curl localhost:8080/way/123,456" << endl << endl;
+    cout << "OPTIONS:" << endl;
+    cout << " --port PORT: TCP port, default 8080" << endl;
+    cout << " --bind ADDRESS: IPv4 address, default 127.0.0.1; 0.0.0.0 for all interfaces" << endl;
+    cout << " --threads N: worker threads, default one per core" << endl << endl;
+    cout << "ENDPOINTS:" << endl;
+    cout << " GET /node/ID[,ID...], /way/ID[,ID...], /relation/ID[,ID...]: elements as JSON" << endl;
+    cout << " GET /geometry/[node,way,relation]/ID[?format=geojson|wkt|wkb][&area=1]: geometry of an element" << endl;
+    cout << " GET /extract?bbox=MIN_LAT,MIN_LON,MAX_LAT,MAX_LON or ?disc=LAT,LON,R_DEGREES, or POST /extract with a GeoJSON region:" << endl;
+    cout << "   tagged nodes and all ways, tagged or not, as newline-delimited GeoJSON features, for regions of up to " << MAX_EXTRACT_NODES << " nodes" << endl;
+    cout << " GET /stats[?bbox=...]: latency histograms, table sizes, replication state and element estimates" << endl;
+    exit(1);
+  }
+
+  int num_threads = result["threads"].as<int>();
+  if (num_threads <= 0) num_threads = max(1u,std::thread::hardware_concurrency());
+
+  string osmx = result["osmx"].as<string>();
+  MDB_env* env = db::createEnv(osmx);
+  signal(SIGPIPE,SIG_IGN);
+
+  string address = result["bind"].as<string>();
+  int port = result["port"].as<int>();
+  int listen_fd = listenOn(address,port);
+  cout << "Serving " << osmx << " on http://" << address << ":" << port << " with " << num_threads << " threads." << endl;
+  {
+    Server server(env,listen_fd,num_threads);
+    serving = &server;
+    signal(SIGINT,requestStop);
+    signal(SIGTERM,requestStop);
+    server.run();
+    signal(SIGINT,SIG_DFL);
+    signal(SIGTERM,SIG_DFL);
+    serving = nullptr;
+  }
+  close(listen_fd);
+  cout << "Stopped." << endl;
+  mdb_env_close(env);
+}
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <memory>
+#include <iomanip>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include "osmium/util/progress_bar.hpp"
+#include "osmx/sorter.h"
+#include "osmx/storage.h"
+#include "osmx/util.h"
+
+namespace osmx {
+
+// sort slices of a run on all threads, then merge neighbouring slices in rounds of doubling width.
+template <typename T>
+static void parallelSort(std::vector<T> &storage) {
+  size_t num_threads = std::max(1u,std::thread::hardware_concurrency());
+  if (num_threads < 2 || storage.size() < num_threads * 65536) {
+    sort(storage.begin(),storage.end());
+    return;
+  }
+  size_t slice = (storage.size() + num_threads - 1) / num_threads;
+  std::vector<std::thread> threads;
+  for (size_t begin = 0; begin < storage.size(); begin += slice) {
+    size_t end = std::min(begin + slice,storage.size());
+    threads.emplace_back([&storage,begin,end]() { sort(storage.begin() + begin,storage.begin() + end); });
+  }
+  for (auto &thread : threads) thread.join();
+
+  for (size_t width = slice; width < storage.size(); width *= 2) {
+    threads.clear();
+    for (size_t begin = 0; begin + width < storage.size(); begin += 2 * width) {
+      size_t end = std::min(begin + 2 * width,storage.size());
+      threads.emplace_back([&storage,begin,width,end]() {
+        std::inplace_merge(storage.begin() + begin,storage.begin() + begin + width,storage.begin() + end);
+      });
+    }
+    for (auto &thread : threads) thread.join();
+  }
+}
+
+// write one sorted run to tempDir, returning its file name.
+template <typename T>
+static std::string writeRun(std::vector<T> &storage, const std::string &tempDir, const std::string &name, int runNumber) {
+  parallelSort(storage);
+  std::ofstream stream;
+  std::stringstream fname;
+  fname << tempDir << "/" << std::setw(2) << std::setfill('0') << name << "_" << std::setw(3) << std::setfill('0') << runNumber << ".run";
+  stream.open(fname.str(),std::ios::binary);
+  stream.write((char *)storage.data(),sizeof(T) * storage.size());
+  stream.close();
+  return fname.str();
+}
+
+// merge the sorted runs, calling fn for each distinct entry in order, and remove them.
+template <typename T>
+static void mergeRuns(const std::vector<std::string> &runs, const std::string &name, size_t runSize, std::function<void(const T &)> fn) {
+  Timer timer("External sort " + name);
+  osmium::ProgressBar progress{runSize * runs.size(), osmium::isatty(2)};
+  int read = 0;
+  typedef std::pair<T, int> Elem;
+  auto greater = [](const Elem &a, const Elem &b) { return b.first < a.first || (!(a.first < b.first) && b.second < a.second); };
+  std::priority_queue<Elem, std::vector<Elem>, decltype(greater)> q(greater);
+  std::vector<RunReader<T>> readers;
+  readers.reserve(runs.size());
+
+  for (int i = 0; i < runs.size(); i++) {
+    readers.emplace_back(runs[i]);
+    if (readers[i].getNext()) q.push(make_pair(readers[i].entry, i));
+  }
+
+  T last;
+  bool first = true;
+
+  while (q.size() > 0) {
+    Elem elem = q.top();
+    auto idx = elem.second;
+    if (first || elem.first != last) fn(elem.first);
+    first = false;
+    q.pop();
+    if (readers[idx].getNext()) q.push(make_pair(readers[idx].entry, idx));
+    progress.update(read++);
+    last = elem.first;
+  }
+
+  progress.done();
+
+  for (auto const &run : runs) {
+    remove(run.c_str());
+  }
+}
+
+Sorter::Sorter(std::string tempDir,std::string name) : mTempDir(tempDir), mName(name) { 
+  mStorage.reserve(MAX_RUN_SIZE);
+}
+
+void Sorter::put(uint64_t from, uint64_t to) {
+  mStorage.push_back(std::make_pair(from,to));
+  if (mStorage.size() > MAX_RUN_SIZE) persist();
+}
+
+void Sorter::put(S2CellId from, uint64_t to) {
+  put(from.id(),to);
+}
+
+void Sorter::persist() {
+  if (mStorage.size() == 0) return;
+  mSavedRuns.push_back(writeRun(mStorage,mTempDir,mName,mSavedRuns.size()));
+  mStorage.clear();
+  mStorage.reserve(MAX_RUN_SIZE);
+}
+
+void Sorter::merge(std::function<void(uint64_t from, uint64_t to)> fn) {
+  persist();
+  mergeRuns<Pair>(mSavedRuns,mName,MAX_RUN_SIZE,[&](const Pair &pair) {
+    fn(pair.first,pair.second);
+  });
+}
+
+void Sorter::writeDb(MDB_env *env) {
+  db::IndexWriter index(env,mName);
+  bool first = true;
+  uint64_t last_from;
+  merge([&](uint64_t from, uint64_t to) {
+    if (first || from != last_from) index.put(from,to,MDB_APPEND);
+    else index.put(from,to,MDB_APPENDDUP);
+    first = false;
+    last_from = from;
+  });
+  index.commit();
+}
+
+CellLocationSorter::CellLocationSorter(std::string tempDir) : mTempDir(tempDir) {
+  mStorage.reserve(MAX_RUN_SIZE);
+}
+
+void CellLocationSorter::put(S2CellId cell, uint64_t id, osmium::Location location, int32_t version) {
+  mStorage.push_back(CellLocationEntry{cell.id(),id,location.x(),location.y(),version});
+  if (mStorage.size() > MAX_RUN_SIZE) persist();
+}
+
+void CellLocationSorter::persist() {
+  if (mStorage.size() == 0) return;
+  mSavedRuns.push_back(writeRun(mStorage,mTempDir,"cell_location",mSavedRuns.size()));
+  mStorage.clear();
+  mStorage.reserve(MAX_RUN_SIZE);
+}
+
+void CellLocationSorter::writeDb(MDB_env *env) {
+  persist();
+  MDB_txn *txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+  auto cell_locations = std::make_unique<db::CellLocations>(txn,true);
+  uint64_t last_cell;
+  bool first = true;
+  int writes = 0;
+  mergeRuns<CellLocationEntry>(mSavedRuns,"cell_location",MAX_RUN_SIZE,[&](const CellLocationEntry &entry) {
+    // dups are ordered by their bytes rather than by ID, so only the first of each cell is appended.
+    cell_locations->put(entry.cell,entry.id,db::Location{osmium::Location(entry.x,entry.y),entry.version},first || entry.cell != last_cell ? MDB_APPEND : 0);
+    first = false;
+    last_cell = entry.cell;
+    if (writes++ == 8000000) {
+      CHECK_LMDB(mdb_txn_commit(txn));
+      CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+      cell_locations = std::make_unique<db::CellLocations>(txn,true);
+      writes = 0;
+    }
+  });
+  CHECK_LMDB(mdb_txn_commit(txn));
+}
+
+}
@@ -0,0 +1,113 @@
+#include <string>
+#include <fstream>
+#include <sstream>
+#include "cxxopts.hpp"
+#include "s2/s2region_coverer.h"
+#include "osmx/storage.h"
+#include "osmx/region.h"
+#include "osmx/util.h"
+
+using namespace std;
+using namespace osmx;
+
+static bool endsWith(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() && 0 == str.compare(str.size()-suffix.size(), suffix.size(), suffix);
+}
+
+static void printCounts(const db::CellStats::Counts &counts) {
+  cout << "nodes: " << counts.nodes << " ways: " << counts.ways << " relations: " << counts.relations << endl;
+}
+
+void cmdStats(int argc, char* argv[]) {
+  cxxopts::Options cmd_options("Stats", "Estimate element counts from the cell statistics.");
+  cmd_options.add_options()
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", "Input .osmx", cxxopts::value<string>())
+    ("bbox", "rectangle in minLat,minLon,maxLat,maxLon", cxxopts::value<string>())
+    ("disc", "disc in centerLat,centerLon,radiusDegrees", cxxopts::value<string>())
+    ("geojson","geoJson of region", cxxopts::value<string>())
+    ("poly","osmosis .poly of region", cxxopts::value<string>())
+    ("region","file for region with extension .bbox, .disc, .json or .poly", cxxopts::value<string>())
+    ("expand","buffer at this cell level",cxxopts::value<int>())
+    ("split","divide the region into this many parts of about equal size",cxxopts::value<int>())
+  ;
+  cmd_options.parse_positional({"cmd","osmx"});
+  auto result = cmd_options.parse(argc, argv);
+
+  if (result.count("osmx") == 0 || (result.count("split") && result["split"].as<int>() < 1)) {
+    cout << "Usage: osmx stats OSMX_FILE [OPTIONS]" << endl;
+    cout << "Estimates the number of elements an extract of a region returns. Needs expand --cellStats." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx stats planet.osmx --region new_york.json --split 8" << endl << endl;
+    cout << "OPTIONS:" << endl;
+    cout << " none specified: the whole database" << endl;
+    cout << " --bbox MIN_LAT,MIN_LON,MAX_LAT,MAX_LON: region is lat/lon bbox" << endl;
+    cout << " --disc CENTER_LAT,CENTER_LON,R_DEGREES: region is disc" << endl;
+    cout << " --geojson GEOJSON: region is an areal GeoJSON feature or geometry" << endl;
+    cout << " --poly POLY: region is an Osmosis polygon" << endl;
+    cout << " --region FILE: text file with .bbox, .disc, .json or .poly extension" << endl;
+    cout << " --expand CELL_LEVEL: buffer region with cells at this level, at most the database's cell level" << endl;
+    cout << " --split N: print N parts of about equal size as S2 cell tokens, one part per line; N is at least 1" << endl;
+    exit(1);
+  }
+
+  std::unique_ptr<Region> region;
+  if (result.count("bbox")) region = std::make_unique<Region>(result["bbox"].as<string>(),"bbox");
+  else if (result.count("disc")) region = std::make_unique<Region>(result["disc"].as<string>(),"disc");
+  else if (result.count("geojson")) region = std::make_unique<Region>(result["geojson"].as<string>(),"geojson");
+  else if (result.count("poly")) region = std::make_unique<Region>(result["poly"].as<string>(),"poly");
+  else if (result.count("region")) {
+    auto fname = result["region"].as<string>();
+    std::ifstream t(fname);
+    std::stringstream buffer;
+    buffer << t.rdbuf();
+    if (endsWith(fname,"bbox")) region = std::make_unique<Region>(buffer.str(),"bbox");
+    if (endsWith(fname,"disc")) region = std::make_unique<Region>(buffer.str(),"disc");
+    if (endsWith(fname,"json")) region = std::make_unique<Region>(buffer.str(),"geojson");
+    if (endsWith(fname,"poly")) region = std::make_unique<Region>(buffer.str(),"poly");
+  }
+
+  MDB_env* env = db::createEnv(result["osmx"].as<string>());
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+
+  // the same covering osmx extract uses; without a region, the six faces cover everything.
+  S2CellUnion covering;
+  if (region) {
+    S2RegionCoverer::Options options;
+    options.set_max_cells(1024);
+    options.set_max_level(db::cellLevel(txn));
+    S2RegionCoverer coverer(options);
+    covering = region->GetCovering(coverer);
+    if (result.count("expand")) {
+      int expand = result["expand"].as<int>();
+      if (expand >= 0 && expand <= db::cellLevel(txn)) {
+        covering.Expand(expand);
+      }
+    }
+  } else {
+    vector<S2CellId> faces;
+    for (int face = 0; face < 6; face++) faces.push_back(S2CellId::FromFace(face));
+    covering = S2CellUnion(std::move(faces));
+  }
+
+  db::CellStats cell_stats(txn);
+  if (!cell_stats.exists()) {
+    cout << "No cell statistics; create the .osmx with osmx expand --cellStats." << endl;
+    exit(1);
+  }
+
+  printCounts(cell_stats.estimate(covering));
+  if (result.count("split")) {
+    for (auto const &part : cell_stats.split(covering,result["split"].as<int>())) {
+      auto counts = cell_stats.estimate(part);
+      cout << counts.total();
+      for (auto const &cell_id : part.cell_ids()) cout << " " << cell_id.ToToken();
+      cout << endl;
+    }
+  }
+
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+}
@@ -1,3 +1,7 @@
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <queue>
 #include "osmx/storage.h"
 #include "osmx/util.h"
 
@@ -12,13 +16,35 @@ MDB_env *createEnv(std::string path, bool writable) {
   // 2TB is a safe number for just OSM data as of 02/2023
   // only affects the size of virtual memory, not real memory.
   mdb_env_set_mapsize(env,2UL * 1024UL * 1024UL * 1024UL * 1024UL);
-  mdb_env_set_maxdbs(env,10);
+  mdb_env_set_maxdbs(env,32);
   int flags = 0;
   if (!writable) flags |= MDB_RDONLY;
   CHECK_LMDB(mdb_env_open(env, path.c_str(),MDB_NOSUBDIR | MDB_NORDAHEAD | MDB_NOSYNC | flags, 0664));
   return env;
 }
 
+void openTables(MDB_env *env) {
+  MDB_txn *txn;
+  MDB_dbi main_dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  CHECK_LMDB(mdb_dbi_open(txn, NULL, 0, &main_dbi));
+  CHECK_LMDB(mdb_cursor_open(txn,main_dbi,&cursor));
+  MDB_val key, data;
+  int retval = mdb_cursor_get(cursor,&key,&data,MDB_FIRST);
+  while (retval == 0) {
+    // the keys of the main table are the table names; the flags a table was created with are stored with it.
+    std::string name((const char *)key.mv_data,key.mv_size);
+    MDB_dbi dbi;
+    retval = mdb_dbi_open(txn, name.c_str(), 0, &dbi);
+    if (retval != MDB_INCOMPATIBLE) CHECK_LMDB(retval);
+    retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT);
+  }
+  if (retval != MDB_NOTFOUND) CHECK_LMDB(retval);
+  mdb_cursor_close(cursor);
+  CHECK_LMDB(mdb_txn_commit(txn));
+}
+
 Metadata::Metadata(MDB_txn *txn) : mTxn(txn) {
   CHECK_LMDB(mdb_dbi_open(mTxn, "metadata", MDB_CREATE, &mDbi));
 }
@@ -41,6 +67,13 @@ std::string Metadata::get(const std::string &key_str) {
     else return "";
 }
 
+int cellLevel(MDB_txn *txn) {
+  Metadata metadata(txn);
+  std::string level = metadata.get("cell_level");
+  if (level.empty()) return CELL_INDEX_LEVEL;
+  return std::stoi(level);
+}
+
 Elements::Elements(MDB_txn *txn, const std::string &name) : mTxn(txn) {
   CHECK_LMDB(mdb_dbi_open(txn, name.c_str(), MDB_INTEGERKEY | MDB_CREATE, &mDbi));
 }
@@ -54,6 +87,14 @@ void Elements::put(uint64_t id, kj::VectorOutputStream &vos, int flags) {
   CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, flags));
 }
 
+// store an already-serialized value, such as one read from another database.
+void Elements::put(uint64_t id, MDB_val &data, int flags) {
+  MDB_val key;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, flags));
+}
+
 void Elements::del(uint64_t id) {
   MDB_val key, data;
   key.mv_size = sizeof(uint64_t);
@@ -68,6 +109,21 @@ bool Elements::exists(uint64_t id) {
   return mdb_get(mTxn,mDbi,&key,&data) == 0;
 }
 
+bool Elements::get(uint64_t id, MDB_val &data) {
+  MDB_val key;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  int retval = mdb_get(mTxn,mDbi,&key,&data);
+  if (retval == MDB_NOTFOUND) return false;
+  CHECK_LMDB(retval);
+  return true;
+}
+
+capnp::FlatArrayMessageReader toReader(const MDB_val &data) {
+  auto arr = kj::ArrayPtr<const capnp::word>((const capnp::word *)data.mv_data,data.mv_size / sizeof(capnp::word));
+  return capnp::FlatArrayMessageReader(arr);
+}
+
 capnp::FlatArrayMessageReader Elements::getReader(uint64_t id) {
   MDB_val key, data;
   key.mv_size = sizeof(uint64_t);
@@ -168,9 +224,748 @@ void IndexWriter::commit() {
   CHECK_LMDB(mdb_txn_commit(mTxn));
 }
 
-void traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &set) {
-  S2CellId start = cell_id.child_begin(CELL_INDEX_LEVEL);
-  S2CellId end = cell_id.child_end(CELL_INDEX_LEVEL);
+Cursor::Cursor(MDB_txn *txn, const std::string &name, unsigned int flags) {
+  MDB_dbi dbi;
+  CHECK_LMDB(mdb_dbi_open(txn, name.c_str(), flags, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn, dbi, &mCursor));
+}
+
+Cursor::~Cursor() {
+  close();
+}
+
+void Cursor::close() {
+  if (mCursor) mdb_cursor_close(mCursor);
+  mCursor = nullptr;
+}
+
+bool Cursor::get(uint64_t id, MDB_val &data) {
+  MDB_val key;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  int retval = mdb_cursor_get(mCursor, &key, &data, MDB_SET_KEY);
+  if (retval == MDB_NOTFOUND) return false;
+  CHECK_LMDB(retval);
+  return true;
+}
+
+void Cursor::put(uint64_t id, MDB_val &data) {
+  MDB_val key;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  CHECK_LMDB(mdb_cursor_put(mCursor, &key, &data, 0));
+}
+
+void Cursor::del(uint64_t id) {
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  if (mdb_cursor_get(mCursor, &key, &data, MDB_SET) == 0) {
+    CHECK_LMDB(mdb_cursor_del(mCursor, 0));
+  }
+}
+
+void Cursor::put(uint64_t from, uint64_t to) {
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&from;
+  data.mv_size = sizeof(uint64_t);
+  data.mv_data = (void *)&to;
+  CHECK_LMDB(mdb_cursor_put(mCursor, &key, &data, 0));
+}
+
+void Cursor::del(uint64_t from, uint64_t to) {
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&from;
+  data.mv_size = sizeof(uint64_t);
+  data.mv_data = (void *)&to;
+  if (mdb_cursor_get(mCursor, &key, &data, MDB_GET_BOTH) == 0) {
+    CHECK_LMDB(mdb_cursor_del(mCursor, 0));
+  }
+}
+
+static const size_t CELL_LOCATION_SIZE = sizeof(uint64_t) + sizeof(int32_t) * 3;
+
+static void cellLocationValue(char *buf, uint64_t id, const Location &location) {
+  int32_t coords[3] = {location.coords.x(),location.coords.y(),location.version};
+  memcpy(buf,&id,sizeof(uint64_t));
+  memcpy(buf + sizeof(uint64_t),coords,sizeof(coords));
+}
+
+CellLocations::CellLocations(MDB_txn *txn, bool create) : mTxn(txn), mLevel(cellLevel(txn)) {
+  int retval = mdb_dbi_open(txn, "cell_location", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | (create ? MDB_CREATE : 0), &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+}
+
+void CellLocations::put(uint64_t cell, uint64_t id, const Location &location, int flags) {
+  char buf[CELL_LOCATION_SIZE];
+  cellLocationValue(buf,id,location);
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&cell;
+  data.mv_size = CELL_LOCATION_SIZE;
+  data.mv_data = (void *)buf;
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, flags));
+}
+
+void CellLocations::del(uint64_t cell, uint64_t id, const Location &location) {
+  char buf[CELL_LOCATION_SIZE];
+  cellLocationValue(buf,id,location);
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&cell;
+  data.mv_size = CELL_LOCATION_SIZE;
+  data.mv_data = (void *)buf;
+  mdb_del(mTxn, mDbi, &key, &data);
+}
+
+void CellLocations::traverse(S2CellId cell_id, std::function<void(uint64_t id, const Location &location)> fn) {
+  if (mMissing) return;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  if (cell_id.level() > mLevel) cell_id = cell_id.parent(mLevel);
+  S2CellId start = cell_id.child_begin(mLevel);
+  S2CellId end = cell_id.child_end(mLevel);
+  MDB_val key, data;
+  key.mv_size = sizeof(S2CellId);
+  key.mv_data = (void *)&start;
+
+  int retval = mdb_cursor_get(cursor,&key,&data,MDB_SET_RANGE);
+  while (retval == 0 && *((S2CellId *)key.mv_data) < end) {
+    int retval_values = mdb_cursor_get(cursor,&key,&data,MDB_GET_MULTIPLE);
+    while (0 == retval_values) {
+      for (size_t i = 0; i < data.mv_size / CELL_LOCATION_SIZE; i++) {
+        const char *value = (const char *)data.mv_data + i * CELL_LOCATION_SIZE;
+        uint64_t id;
+        int32_t coords[3];
+        memcpy(&id,value,sizeof(uint64_t));
+        memcpy(coords,value + sizeof(uint64_t),sizeof(coords));
+        fn(id,Location{osmium::Location(coords[0],coords[1]),coords[2]});
+      }
+      retval_values = mdb_cursor_get(cursor,&key,&data,MDB_NEXT_MULTIPLE);
+    }
+    retval = mdb_cursor_get(cursor,&key,&data,MDB_NEXT_NODUP);
+  }
+  mdb_cursor_close(cursor);
+}
+
+CellStats::CellStats(MDB_txn *txn, bool create) : mTxn(txn), mLevel(cellLevel(txn)) {
+  int retval = mdb_dbi_open(txn, "cell_stats", MDB_INTEGERKEY | (create ? MDB_CREATE : 0), &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+}
+
+CellStats::Counts CellStats::get(S2CellId cell_id) {
+  Counts counts{0,0,0};
+  if (mMissing) return counts;
+  uint64_t id = cell_id.id();
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  if (mdb_get(mTxn, mDbi, &key, &data) == 0) memcpy(&counts,data.mv_data,sizeof(Counts));
+  return counts;
+}
+
+void CellStats::put(S2CellId cell_id, const Counts &counts) {
+  uint64_t id = cell_id.id();
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  if (counts.total() == 0) {
+    mdb_del(mTxn, mDbi, &key, NULL);
+    return;
+  }
+  data.mv_size = sizeof(Counts);
+  data.mv_data = (void *)&counts;
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, 0));
+}
+
+static uint64_t clampAdd(uint64_t count, int64_t change) {
+  if (change < 0 && (uint64_t)(-change) > count) return 0;
+  return count + change;
+}
+
+void CellStats::add(S2CellId cell_id, int64_t nodes, int64_t ways, int64_t relations) {
+  Counts counts = get(cell_id);
+  counts.nodes = clampAdd(counts.nodes,nodes);
+  counts.ways = clampAdd(counts.ways,ways);
+  counts.relations = clampAdd(counts.relations,relations);
+  put(cell_id,counts);
+}
+
+CellStats::Counts CellStats::estimate(const S2CellUnion &covering) {
+  Counts total{0,0,0};
+  for (auto const &cell_id : covering.cell_ids()) {
+    // coverings are at most the index level, but a finer cell gets its share of its index level parent.
+    S2CellId stats_cell = cell_id.level() > mLevel ? cell_id.parent(mLevel) : cell_id;
+    Counts counts = get(stats_cell);
+    uint64_t share = cell_id.level() > mLevel ? (uint64_t)1 << (2 * (cell_id.level() - mLevel)) : 1;
+    total.nodes += counts.nodes / share;
+    total.ways += counts.ways / share;
+    total.relations += counts.relations / share;
+  }
+  return total;
+}
+
+std::vector<S2CellUnion> CellStats::split(const S2CellUnion &covering, size_t n) {
+  std::vector<S2CellUnion> parts;
+  if (n == 0) return parts;
+  std::map<S2CellId,uint64_t> cells;
+  uint64_t total = 0;
+  for (auto const &cell_id : covering.cell_ids()) {
+    uint64_t count = get(cell_id).total();
+    cells[cell_id] = count;
+    total += count;
+  }
+
+  // refine the heaviest cells until no cell holds more than a fraction of a part.
+  uint64_t target = std::max(total / (n * 4),(uint64_t)1);
+  std::priority_queue<std::pair<uint64_t,S2CellId>> heaviest;
+  for (auto const &cell : cells) heaviest.emplace(cell.second,cell.first);
+  while (!heaviest.empty() && heaviest.top().first > target) {
+    S2CellId cell_id = heaviest.top().second;
+    heaviest.pop();
+    if (cell_id.level() >= mLevel) continue;
+    cells.erase(cell_id);
+    for (S2CellId child = cell_id.child_begin(); child != cell_id.child_end(); child = child.next()) {
+      uint64_t count = get(child).total();
+      cells[child] = count;
+      heaviest.emplace(count,child);
+    }
+  }
+
+  // cells in ID order follow the Hilbert curve, so consecutive runs are compact.
+  std::vector<S2CellId> part;
+  uint64_t part_count = 0;
+  uint64_t done = 0;
+  for (auto const &cell : cells) {
+    part.push_back(cell.first);
+    part_count += cell.second;
+    if (parts.size() + 1 < n && (done + part_count) * n >= total * (parts.size() + 1)) {
+      done += part_count;
+      parts.push_back(S2CellUnion(std::move(part)));
+      part.clear();
+      part_count = 0;
+    }
+  }
+  if (!part.empty()) parts.push_back(S2CellUnion(std::move(part)));
+  return parts;
+}
+
+SegmentBounds::SegmentBounds(MDB_txn *txn, bool create) : mTxn(txn), mLevel(cellLevel(txn)) {
+  int retval = mdb_dbi_open(txn, "cell_segments", MDB_INTEGERKEY | (create ? MDB_CREATE : 0), &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+}
+
+double SegmentBounds::get(S2CellId cell_id) {
+  double meters = 0;
+  if (mMissing) return meters;
+  uint64_t id = cell_id.id();
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&id;
+  if (mdb_get(mTxn, mDbi, &key, &data) == 0) memcpy(&meters,data.mv_data,sizeof(double));
+  return meters;
+}
+
+void SegmentBounds::raise(S2CellId cell_id, double meters) {
+  // parents are never below their children, so raising stops at the first cell that is already high enough.
+  for (int level = std::min(cell_id.level(),mLevel); level >= 0; level--) {
+    S2CellId parent = cell_id.parent(level);
+    if (get(parent) >= meters) return;
+    uint64_t id = parent.id();
+    MDB_val key, data;
+    key.mv_size = sizeof(uint64_t);
+    key.mv_data = (void *)&id;
+    data.mv_size = sizeof(double);
+    data.mv_data = (void *)&meters;
+    CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, 0));
+  }
+}
+
+static const int PRESENCE_CHUNK_BITS = 20;
+
+Presence::Presence(MDB_txn *txn, const std::string &table, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, (table + "_presence").c_str(), MDB_INTEGERKEY | (create ? MDB_CREATE : 0), &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+  if (mMissing) CHECK_LMDB(mdb_dbi_open(txn, table.c_str(), MDB_INTEGERKEY, &mTableDbi));
+}
+
+uint64_t Presence::chunk(uint64_t id) {
+  return id >> PRESENCE_CHUNK_BITS;
+}
+
+uint32_t Presence::offset(uint64_t id) {
+  return (uint32_t)(id & ((1 << PRESENCE_CHUNK_BITS) - 1));
+}
+
+roaring::Roaring &Presence::load(uint64_t chunk) {
+  auto found = mChunks.find(chunk);
+  if (found != mChunks.end()) return found->second;
+  roaring::Roaring ids;
+  MDB_val k, data;
+  k.mv_size = sizeof(uint64_t);
+  k.mv_data = (void *)&chunk;
+  if (mdb_get(mTxn, mDbi, &k, &data) == 0) {
+    ids = roaring::Roaring::readSafe((const char *)data.mv_data,data.mv_size);
+  }
+  return mChunks.emplace(chunk,std::move(ids)).first->second;
+}
+
+bool Presence::contains(uint64_t id) {
+  if (mMissing) {
+    MDB_val k, data;
+    k.mv_size = sizeof(uint64_t);
+    k.mv_data = (void *)&id;
+    return mdb_get(mTxn, mTableDbi, &k, &data) == 0;
+  }
+  return load(chunk(id)).contains(offset(id));
+}
+
+void Presence::put(uint64_t chunk, roaring::Roaring &ids, int flags) {
+  ids.runOptimize();
+  std::vector<char> buf(ids.getSizeInBytes());
+  ids.write(buf.data());
+  MDB_val k, data;
+  k.mv_size = sizeof(uint64_t);
+  k.mv_data = (void *)&chunk;
+  data.mv_size = buf.size();
+  data.mv_data = (void *)buf.data();
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &k, &data, flags));
+}
+
+void Presence::update(const roaring::Roaring64Map &added, const roaring::Roaring64Map &removed) {
+  if (mMissing) return;
+  std::vector<uint64_t> chunks;
+  for (auto id : removed) {
+    load(chunk(id)).remove(offset(id));
+    chunks.push_back(chunk(id));
+  }
+  for (auto id : added) {
+    load(chunk(id)).add(offset(id));
+    chunks.push_back(chunk(id));
+  }
+  std::sort(chunks.begin(),chunks.end());
+  chunks.erase(std::unique(chunks.begin(),chunks.end()),chunks.end());
+  for (auto c : chunks) {
+    auto &ids = mChunks[c];
+    if (ids.isEmpty()) {
+      MDB_val k;
+      k.mv_size = sizeof(uint64_t);
+      k.mv_data = (void *)&c;
+      mdb_del(mTxn, mDbi, &k, NULL);
+    } else {
+      put(c,ids);
+    }
+  }
+}
+
+Changes::Changes(MDB_txn *txn, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, "changes", MDB_INTEGERKEY | (create ? MDB_CREATE : 0), &mDbi);
+  // a database that has never been updated.
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+}
+
+void Changes::put(uint64_t seqnum, roaring::Roaring64Map &cells) {
+  cells.runOptimize();
+  std::vector<char> buf(cells.getSizeInBytes());
+  cells.write(buf.data());
+  MDB_val key, data;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&seqnum;
+  data.mv_size = buf.size();
+  data.mv_data = (void *)buf.data();
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, 0));
+}
+
+roaring::Roaring64Map Changes::get(uint64_t from_seqnum, uint64_t to_seqnum) {
+  roaring::Roaring64Map cells;
+  if (mMissing) return cells;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val key, data;
+  uint64_t start = from_seqnum + 1;
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&start;
+  int retval = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+  while (retval == 0 && *(uint64_t *)key.mv_data <= to_seqnum) {
+    cells |= roaring::Roaring64Map::readSafe((const char *)data.mv_data,data.mv_size);
+    retval = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+  }
+  mdb_cursor_close(cursor);
+  return cells;
+}
+
+bool Changes::first(uint64_t &seqnum) {
+  if (mMissing) return false;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val key, data;
+  bool found = mdb_cursor_get(cursor, &key, &data, MDB_FIRST) == 0;
+  if (found) seqnum = *(uint64_t *)key.mv_data;
+  mdb_cursor_close(cursor);
+  return found;
+}
+
+void Changes::prune(uint64_t seqnum) {
+  if (mMissing) return;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val key, data;
+  while (mdb_cursor_get(cursor, &key, &data, MDB_FIRST) == 0 && *(uint64_t *)key.mv_data <= seqnum) {
+    CHECK_LMDB(mdb_cursor_del(cursor, 0));
+  }
+  mdb_cursor_close(cursor);
+}
+
+Regions::Regions(MDB_txn *txn, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, "regions", create ? MDB_CREATE : 0, &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+}
+
+void Regions::put(const std::string &name, const S2CellUnion &covering) {
+  std::vector<uint64_t> cell_ids;
+  for (auto cell_id : covering.cell_ids()) cell_ids.push_back(cell_id.id());
+  MDB_val key, data;
+  key.mv_size = name.size();
+  key.mv_data = (void *)name.data();
+  data.mv_size = cell_ids.size() * sizeof(uint64_t);
+  data.mv_data = (void *)cell_ids.data();
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, 0));
+}
+
+bool Regions::del(const std::string &name) {
+  if (mMissing) return false;
+  MDB_val key;
+  key.mv_size = name.size();
+  key.mv_data = (void *)name.data();
+  int retval = mdb_del(mTxn, mDbi, &key, NULL);
+  if (retval == MDB_NOTFOUND) return false;
+  CHECK_LMDB(retval);
+  return true;
+}
+
+std::vector<std::pair<std::string,S2CellUnion>> Regions::getAll() {
+  std::vector<std::pair<std::string,S2CellUnion>> regions;
+  if (mMissing) return regions;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val key, data;
+  while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+    std::vector<S2CellId> cell_ids;
+    uint64_t *buf = (uint64_t *)data.mv_data;
+    for (size_t i = 0; i < data.mv_size / sizeof(uint64_t); i++) cell_ids.push_back(S2CellId(buf[i]));
+    regions.emplace_back(std::string((const char *)key.mv_data,key.mv_size),S2CellUnion(std::move(cell_ids)));
+  }
+  mdb_cursor_close(cursor);
+  return regions;
+}
+
+// history keys sort by type, then ID, then version.
+static const size_t HISTORY_KEY_SIZE = 13;
+
+static void historyKey(char *buf, char type, uint64_t id, uint32_t version) {
+  buf[0] = type;
+  for (int i = 0; i < 8; i++) buf[1 + i] = (char)(id >> (56 - i * 8));
+  for (int i = 0; i < 4; i++) buf[9 + i] = (char)(version >> (24 - i * 8));
+}
+
+// superseding sequence number, then the sequence number the version became current at.
+static const size_t HISTORY_HEADER_SIZE = sizeof(uint64_t) * 2;
+static const uint64_t HISTORY_CURRENT = UINT64_MAX;
+
+History::History(MDB_txn *txn, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, "history", create ? MDB_CREATE : 0, &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (mMissing) return;
+  CHECK_LMDB(retval);
+  // sequence numbers to the history keys superseded or made current by them, to prune in sequence order.
+  CHECK_LMDB(mdb_dbi_open(txn, "history_seqnum", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | (create ? MDB_CREATE : 0), &mSeqnumDbi));
+}
+
+void History::current(char type, uint64_t id, uint32_t version, uint64_t seqnum) {
+  char key_buf[HISTORY_KEY_SIZE];
+  historyKey(key_buf,type,id,version);
+  uint64_t header[2] = {HISTORY_CURRENT,seqnum};
+  MDB_val key, data;
+  key.mv_size = HISTORY_KEY_SIZE;
+  key.mv_data = (void *)key_buf;
+  data.mv_size = HISTORY_HEADER_SIZE;
+  data.mv_data = (void *)header;
+  // a diff applied again doesn't move the version's start.
+  int retval = mdb_put(mTxn, mDbi, &key, &data, MDB_NOOVERWRITE);
+  if (retval == MDB_KEYEXIST) return;
+  CHECK_LMDB(retval);
+
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&seqnum;
+  data.mv_size = HISTORY_KEY_SIZE;
+  data.mv_data = (void *)key_buf;
+  CHECK_LMDB(mdb_put(mTxn, mSeqnumDbi, &key, &data, 0));
+}
+
+void History::put(char type, uint64_t id, uint32_t version, uint64_t seqnum, const std::vector<char> &value) {
+  char key_buf[HISTORY_KEY_SIZE];
+  historyKey(key_buf,type,id,version);
+  MDB_val key, data;
+  key.mv_size = HISTORY_KEY_SIZE;
+  key.mv_data = (void *)key_buf;
+
+  // the version became current when it was recorded by current(), or before the history if it wasn't.
+  uint64_t since = 0;
+  if (mdb_get(mTxn, mDbi, &key, &data) == 0 && data.mv_size >= HISTORY_HEADER_SIZE) {
+    memcpy(&since,(char *)data.mv_data + sizeof(uint64_t),sizeof(uint64_t));
+  }
+
+  std::vector<char> buf(HISTORY_HEADER_SIZE + value.size());
+  memcpy(buf.data(),&seqnum,sizeof(uint64_t));
+  memcpy(buf.data() + sizeof(uint64_t),&since,sizeof(uint64_t));
+  if (!value.empty()) memcpy(buf.data() + HISTORY_HEADER_SIZE,value.data(),value.size());
+  data.mv_size = buf.size();
+  data.mv_data = (void *)buf.data();
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &key, &data, 0));
+
+  key.mv_size = sizeof(uint64_t);
+  key.mv_data = (void *)&seqnum;
+  data.mv_size = HISTORY_KEY_SIZE;
+  data.mv_data = (void *)key_buf;
+  CHECK_LMDB(mdb_put(mTxn, mSeqnumDbi, &key, &data, 0));
+}
+
+History::Lookup History::get(char type, uint64_t id, uint64_t seqnum, uint32_t &version, kj::Array<capnp::word> &value) {
+  if (mMissing) return Lookup::current;
+  char start[HISTORY_KEY_SIZE];
+  historyKey(start,type,id,0);
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val key, data;
+  key.mv_size = HISTORY_KEY_SIZE;
+  key.mv_data = (void *)start;
+  Lookup result = Lookup::current;
+  int retval = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+  // versions are superseded in order, so the first one superseded after seqnum is the candidate,
+  // if it had already become current at seqnum.
+  while (retval == 0 && key.mv_size == HISTORY_KEY_SIZE && memcmp(key.mv_data,start,9) == 0) {
+    uint64_t header[2];
+    memcpy(header,data.mv_data,HISTORY_HEADER_SIZE);
+    if (header[0] > seqnum) {
+      if (header[1] > seqnum) {
+        result = Lookup::absent;
+      } else if (header[0] != HISTORY_CURRENT) {
+        const unsigned char *k = (const unsigned char *)key.mv_data;
+        version = ((uint32_t)k[9] << 24) | ((uint32_t)k[10] << 16) | ((uint32_t)k[11] << 8) | k[12];
+        size_t size = data.mv_size - HISTORY_HEADER_SIZE;
+        value = kj::heapArray<capnp::word>((size + sizeof(capnp::word) - 1) / sizeof(capnp::word));
+        memset(value.begin(),0,value.size() * sizeof(capnp::word));
+        if (size > 0) memcpy(value.begin(),(char *)data.mv_data + HISTORY_HEADER_SIZE,size);
+        result = Lookup::stored;
+      }
+      break;
+    }
+    retval = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+  }
+  mdb_cursor_close(cursor);
+  return result;
+}
+
+void History::prune(uint64_t seqnum) {
+  if (mMissing) return;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mSeqnumDbi, &cursor));
+  MDB_val key, data;
+  while (mdb_cursor_get(cursor, &key, &data, MDB_FIRST) == 0 && *(uint64_t *)key.mv_data <= seqnum) {
+    int retval = mdb_cursor_get(cursor, &key, &data, MDB_FIRST_DUP);
+    while (retval == 0) {
+      char key_buf[HISTORY_KEY_SIZE];
+      memcpy(key_buf,data.mv_data,HISTORY_KEY_SIZE);
+      MDB_val history_key, history_data;
+      history_key.mv_size = HISTORY_KEY_SIZE;
+      history_key.mv_data = (void *)key_buf;
+      // a version made current at or before seqnum may since have been superseded after it, and is kept.
+      if (mdb_get(mTxn, mDbi, &history_key, &history_data) == 0) {
+        uint64_t header[2];
+        memcpy(header,history_data.mv_data,HISTORY_HEADER_SIZE);
+        if (header[0] <= seqnum || (header[0] == HISTORY_CURRENT && header[1] <= seqnum)) mdb_del(mTxn, mDbi, &history_key, NULL);
+      }
+      retval = mdb_cursor_get(cursor, &key, &data, MDB_NEXT_DUP);
+    }
+    mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    CHECK_LMDB(mdb_cursor_del(cursor, MDB_NODUPDATA));
+  }
+  mdb_cursor_close(cursor);
+}
+
+static const int64_t TIME_INDEX_BUCKET = 3600;
+
+TimeIndex::TimeIndex(MDB_txn *txn, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, "time_index", MDB_INTEGERKEY | (create ? MDB_CREATE : 0), &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+}
+
+uint64_t TimeIndex::key(int64_t timestamp, osmium::item_type type) {
+  uint64_t type_index = type == osmium::item_type::node ? 0 : (type == osmium::item_type::way ? 1 : 2);
+  return (uint64_t)(std::max(timestamp,(int64_t)0) / TIME_INDEX_BUCKET) * 4 + type_index;
+}
+
+void TimeIndex::put(uint64_t key, roaring::Roaring64Map &ids, int flags) {
+  ids.runOptimize();
+  std::vector<char> buf(ids.getSizeInBytes());
+  ids.write(buf.data());
+  MDB_val k, data;
+  k.mv_size = sizeof(uint64_t);
+  k.mv_data = (void *)&key;
+  data.mv_size = buf.size();
+  data.mv_data = (void *)buf.data();
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &k, &data, flags));
+}
+
+void TimeIndex::add(uint64_t key, roaring::Roaring64Map &ids) {
+  MDB_val k, data;
+  k.mv_size = sizeof(uint64_t);
+  k.mv_data = (void *)&key;
+  if (mdb_get(mTxn, mDbi, &k, &data) == 0) {
+    ids |= roaring::Roaring64Map::readSafe((const char *)data.mv_data,data.mv_size);
+  }
+  put(key,ids);
+}
+
+void TimeIndex::since(int64_t timestamp, roaring::Roaring64Map &nodes, roaring::Roaring64Map &ways, roaring::Roaring64Map &relations) {
+  if (mMissing) return;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val k, data;
+  uint64_t start = key(timestamp,osmium::item_type::node);
+  k.mv_size = sizeof(uint64_t);
+  k.mv_data = (void *)&start;
+  int retval = mdb_cursor_get(cursor, &k, &data, MDB_SET_RANGE);
+  while (retval == 0) {
+    uint64_t type_index = *(uint64_t *)k.mv_data % 4;
+    auto ids = roaring::Roaring64Map::readSafe((const char *)data.mv_data,data.mv_size);
+    if (type_index == 0) nodes |= ids;
+    else if (type_index == 1) ways |= ids;
+    else relations |= ids;
+    retval = mdb_cursor_get(cursor, &k, &data, MDB_NEXT);
+  }
+  mdb_cursor_close(cursor);
+}
+
+TagIndex::TagIndex(MDB_txn *txn, bool create) : mTxn(txn) {
+  int retval = mdb_dbi_open(txn, "tag_index", create ? MDB_CREATE : 0, &mDbi);
+  mMissing = retval == MDB_NOTFOUND;
+  if (!mMissing) CHECK_LMDB(retval);
+  mMaxKeySize = mdb_env_get_maxkeysize(mdb_txn_env(txn));
+}
+
+std::string TagIndex::key(char type, const char *tag_key) {
+  std::string k(1,type);
+  k += tag_key;
+  return k;
+}
+
+std::string TagIndex::key(char type, const char *tag_key, const char *tag_value) {
+  std::string k = key(type,tag_key);
+  k.push_back('\0');
+  k += tag_value;
+  return k;
+}
+
+// a posting list key is the tag key followed by the chunk number as a big-endian uint64_t,
+// so the chunks of one tag key sort together in ID order. Chunk numbers are below 2^44, so their first two
+// bytes are zero, and they sort before the keys that continue the tag key with a NUL and a non-empty value.
+static std::string chunkKey(const std::string &key, uint64_t chunk) {
+  std::string k = key;
+  for (int i = 0; i < 8; i++) k.push_back((char)(chunk >> (56 - i * 8)));
+  return k;
+}
+
+static bool isChunkOf(const MDB_val &k, const std::string &key) {
+  if (k.mv_size != key.size() + sizeof(uint64_t)) return false;
+  return memcmp(k.mv_data,key.data(),key.size()) == 0;
+}
+
+// a key with an empty value ends in NUL, so its chunks would sort among those of its tag key.
+bool TagIndex::indexed(const std::string &key) const {
+  return key.size() + sizeof(uint64_t) <= mMaxKeySize && key.back() != '\0';
+}
+
+void TagIndex::put(const std::string &key, uint64_t chunk, roaring::Roaring64Map &ids, int flags) {
+  ids.runOptimize();
+  std::vector<char> buf(ids.getSizeInBytes());
+  ids.write(buf.data());
+  std::string chunk_key = chunkKey(key,chunk);
+  MDB_val k, data;
+  k.mv_size = chunk_key.size();
+  k.mv_data = (void *)chunk_key.data();
+  data.mv_size = buf.size();
+  data.mv_data = (void *)buf.data();
+  CHECK_LMDB(mdb_put(mTxn, mDbi, &k, &data, flags));
+}
+
+void TagIndex::update(const std::string &key, roaring::Roaring64Map &added, const roaring::Roaring64Map &removed) {
+  if (!indexed(key)) return;
+  // added and removed IDs by chunk, so only the chunks they fall in are read and rewritten.
+  std::map<uint64_t,std::pair<std::vector<uint64_t>,std::vector<uint64_t>>> chunks;
+  auto slot = chunks.end();
+  for (auto id : added) {
+    if (slot == chunks.end() || slot->first != Presence::chunk(id)) slot = chunks.emplace(Presence::chunk(id),std::make_pair(std::vector<uint64_t>(),std::vector<uint64_t>())).first;
+    slot->second.first.push_back(id);
+  }
+  slot = chunks.end();
+  for (auto id : removed) {
+    if (slot == chunks.end() || slot->first != Presence::chunk(id)) slot = chunks.emplace(Presence::chunk(id),std::make_pair(std::vector<uint64_t>(),std::vector<uint64_t>())).first;
+    slot->second.second.push_back(id);
+  }
+
+  for (auto &entry : chunks) {
+    std::string chunk_key = chunkKey(key,entry.first);
+    MDB_val k, data;
+    k.mv_size = chunk_key.size();
+    k.mv_data = (void *)chunk_key.data();
+    roaring::Roaring64Map ids;
+    if (mdb_get(mTxn, mDbi, &k, &data) == 0) {
+      ids = roaring::Roaring64Map::readSafe((const char *)data.mv_data,data.mv_size);
+    }
+    for (auto id : entry.second.second) ids.remove(id);
+    ids.addMany(entry.second.first.size(),entry.second.first.data());
+    if (ids.isEmpty()) {
+      mdb_del(mTxn, mDbi, &k, NULL);
+    } else {
+      put(key,entry.first,ids);
+    }
+  }
+}
+
+bool TagIndex::get(const std::string &key, roaring::Roaring64Map &ids) {
+  if (!indexed(key)) return false;
+  ids.clear();
+  if (mMissing) return true;
+  std::string start = chunkKey(key,0);
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_cursor_open(mTxn, mDbi, &cursor));
+  MDB_val k, data;
+  k.mv_size = start.size();
+  k.mv_data = (void *)start.data();
+  int retval = mdb_cursor_get(cursor, &k, &data, MDB_SET_RANGE);
+  // chunks hold disjoint ID ranges, so each union only appends.
+  while (retval == 0 && isChunkOf(k,key)) {
+    ids |= roaring::Roaring64Map::readSafe((const char *)data.mv_data,data.mv_size);
+    retval = mdb_cursor_get(cursor, &k, &data, MDB_NEXT);
+  }
+  mdb_cursor_close(cursor);
+  return true;
+}
+
+void traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &set, int level) {
+  if (cell_id.level() > level) cell_id = cell_id.parent(level);
+  S2CellId start = cell_id.child_begin(level);
+  S2CellId end = cell_id.child_end(level);
   MDB_val key, data;
   key.mv_size = sizeof(S2CellId);
   key.mv_data = (void *)&start;
@@ -191,6 +986,52 @@ void traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &s
   }
 }
 
+S2CellId traverseCell(MDB_cursor *cursor, S2CellId cell_id, roaring::Roaring64Map &set, int level, uint64_t limit, S2CellId from) {
+  if (cell_id.level() > level) cell_id = cell_id.parent(level);
+  S2CellId start = from == S2CellId::None() ? cell_id.child_begin(level) : from;
+  S2CellId end = cell_id.child_end(level);
+  MDB_val key, data;
+  key.mv_size = sizeof(S2CellId);
+  key.mv_data = (void *)&start;
+
+  if (mdb_cursor_get(cursor,&key,&data,MDB_SET_RANGE) != 0) return end;
+  while (*((S2CellId *)key.mv_data) < end) {
+    int retval_values = mdb_cursor_get(cursor,&key,&data,MDB_GET_MULTIPLE);
+    while (0 == retval_values) {
+      for (int i = 0; i < data.mv_size/sizeof(uint64_t); i++) {
+        uint64_t *d = (uint64_t*)data.mv_data;
+        set.add(*(d+i));
+      }
+      retval_values = mdb_cursor_get(cursor,&key,&data,MDB_NEXT_MULTIPLE);
+    }
+    if (mdb_cursor_get(cursor,&key,&data,MDB_NEXT_NODUP) != 0) return end;
+    if (set.cardinality() >= limit) {
+      S2CellId next = *((S2CellId *)key.mv_data);
+      return next < end ? next : end;
+    }
+  }
+  return end;
+}
+
+uint64_t countCell(MDB_cursor *cursor, S2CellId cell_id, int level, uint64_t limit) {
+  if (cell_id.level() > level) cell_id = cell_id.parent(level);
+  S2CellId start = cell_id.child_begin(level);
+  S2CellId end = cell_id.child_end(level);
+  MDB_val key, data;
+  key.mv_size = sizeof(S2CellId);
+  key.mv_data = (void *)&start;
+
+  uint64_t count = 0;
+  if (mdb_cursor_get(cursor,&key,&data,MDB_SET_RANGE) != 0) return count;
+  while (*((S2CellId *)key.mv_data) < end && count <= limit) {
+    size_t values;
+    CHECK_LMDB(mdb_cursor_count(cursor,&values));
+    count += values;
+    if (mdb_cursor_get(cursor,&key,&data,MDB_NEXT_NODUP) != 0) break;
+  }
+  return count;
+}
+
 void traverseReverse(MDB_cursor *cursor,uint64_t from, roaring::Roaring64Map &set) {
   MDB_val key, data;
   key.mv_size = sizeof(uint64_t);
@@ -208,5 +1049,18 @@ void traverseReverse(MDB_cursor *cursor,uint64_t from, roaring::Roaring64Map &se
   }
 }
 
+void traverseAncestors(MDB_cursor *relation_relation, uint64_t relation_id, roaring::Roaring64Map &set) {
+  roaring::Roaring64Map frontier;
+  traverseReverse(relation_relation,relation_id,frontier);
+  // relations can contain each other in cycles, so only newly found ones are followed.
+  while (!frontier.isEmpty()) {
+    set |= frontier;
+    roaring::Roaring64Map parents;
+    for (auto id : frontier) traverseReverse(relation_relation,id,parents);
+    parents -= set;
+    frontier = std::move(parents);
+  }
+}
+
 }}
 
@@ -0,0 +1,62 @@
+#include <cstring>
+#include <sstream>
+#include "osmx/tag_filter.h"
+
+using namespace std;
+
+namespace osmx {
+
+static bool equals(const capnp::Text::Reader &text, const string &str) {
+  return text.size() == str.size() && memcmp(text.begin(),str.data(),str.size()) == 0;
+}
+
+TagFilter::TagFilter(const string &expressions) {
+  stringstream stream(expressions);
+  string expression;
+  while (getline(stream,expression,',')) {
+    if (expression.empty()) continue;
+    Expression e{"nwr","","",true};
+    auto slash = expression.find('/');
+    if (slash != string::npos && slash > 0 && expression.find_first_not_of("nwr") == slash) {
+      e.types = expression.substr(0,slash);
+      expression = expression.substr(slash+1);
+    }
+    auto eq = expression.find('=');
+    e.key = expression.substr(0,eq);
+    if (eq != string::npos) {
+      e.value = expression.substr(eq+1);
+      e.any_value = e.value == "*";
+    }
+    if (e.key.empty()) {
+      mExpressions.clear();
+      return;
+    }
+    mExpressions.push_back(e);
+  }
+}
+
+bool TagFilter::matches(char type, capnp::List<capnp::Text>::Reader tags) const {
+  for (auto const &e : mExpressions) {
+    if (e.types.find(type) == string::npos) continue;
+    for (unsigned int i = 0; i < tags.size() / 2; i++) {
+      if (!equals(tags[i*2],e.key)) continue;
+      if (e.any_value || equals(tags[i*2+1],e.value)) return true;
+    }
+  }
+  return false;
+}
+
+bool TagFilter::candidates(char type, db::TagIndex &tag_index, roaring::Roaring64Map &ids) const {
+  for (auto const &e : mExpressions) {
+    if (e.types.find(type) == string::npos) continue;
+    roaring::Roaring64Map matched;
+    // a key and value that can't be indexed falls back to the key alone.
+    if (e.any_value || !tag_index.get(db::TagIndex::key(type,e.key.c_str(),e.value.c_str()),matched)) {
+      if (!tag_index.get(db::TagIndex::key(type,e.key.c_str()),matched)) return false;
+    }
+    ids |= matched;
+  }
+  return true;
+}
+
+}
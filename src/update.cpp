@@ -1,10 +1,28 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <cassert>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <thread>
+#include <future>
+#include <csignal>
+#include <map>
+#include <array>
+#include <tuple>
 #include <set>
+#include <unordered_map>
+#include <sys/stat.h>
 #include "cxxopts.hpp"
+#include "osmium/builder/osm_object_builder.hpp"
 #include "osmium/handler.hpp"
 #include "osmium/io/any_input.hpp"
+#include "osmium/io/any_output.hpp"
 #include "osmium/visitor.hpp"
+#include "osmium/osm/object_comparisons.hpp"
+#include "osmium/osm/timestamp.hpp"
+#include "osmium/thread/pool.hpp"
 #include "osmium/util/progress_bar.hpp"
 #include "roaring/roaring.hh"
 
@@ -52,43 +70,911 @@
 
 #include "s2/s2latlng.h"
 #include "s2/s2cell_union.h"
+#include "s2/s2earth.h"
 
 #include "osmx/storage.h"
+#include "osmx/admin.h"
 #include "osmx/util.h"
 
 using namespace std;
 using namespace osmx;
 
-class DataUpdate : public osmium::handler::Handler {
+#define ELEMENT_FLAGS (MDB_INTEGERKEY | MDB_CREATE)
+#define INDEX_FLAGS (MDB_INTEGERKEY | MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP)
+
+static uint64_t cellId(const osmium::Location &location, int level) {
+  return S2CellId(S2LatLng::FromDegrees(location.lat(),location.lon())).parent(level).id();
+}
+
+static void sortUnique(vector<uint64_t> &ids) {
+  sort(ids.begin(),ids.end());
+  ids.erase(unique(ids.begin(),ids.end()),ids.end());
+}
+
+// index entries to add and remove, applied in key order once the whole diff is read.
+struct IndexChanges {
+  vector<pair<uint64_t,uint64_t>> puts;
+  vector<pair<uint64_t,uint64_t>> dels;
+
+  // record the change of an element's members from prev to next, both sorted and unique.
+  void diff(const vector<uint64_t> &prev, const vector<uint64_t> &next, uint64_t id) {
+    vector<uint64_t> changed;
+    set_difference(prev.begin(),prev.end(),next.begin(),next.end(),back_inserter(changed));
+    for (uint64_t member : changed) dels.emplace_back(member,id);
+    changed.clear();
+    set_difference(next.begin(),next.end(),prev.begin(),prev.end(),back_inserter(changed));
+    for (uint64_t member : changed) puts.emplace_back(member,id);
+  }
+
+  void apply(MDB_txn *txn, const string &name) {
+    db::Cursor cursor(txn,name,INDEX_FLAGS);
+    sort(dels.begin(),dels.end());
+    for (auto const &entry : dels) cursor.del(entry.first,entry.second);
+    sort(puts.begin(),puts.end());
+    for (auto const &entry : puts) cursor.put(entry.first,entry.second);
+  }
+};
+
+// node locations that left and joined cells, for cell_location.
+struct CellLocationChanges {
+  typedef tuple<uint64_t,uint64_t,db::Location> Entry;
+  vector<Entry> puts;
+  vector<Entry> dels;
+
+  // the table is only maintained if expand built it.
+  void apply(MDB_txn *txn) {
+    db::CellLocations cell_locations(txn);
+    if (!cell_locations.exists()) return;
+    auto order = [](const Entry &a, const Entry &b) {
+      return get<0>(a) < get<0>(b) || (get<0>(a) == get<0>(b) && get<1>(a) < get<1>(b));
+    };
+    sort(dels.begin(),dels.end(),order);
+    for (auto const &entry : dels) cell_locations.del(get<0>(entry),get<1>(entry),get<2>(entry));
+    sort(puts.begin(),puts.end(),order);
+    for (auto const &entry : puts) cell_locations.put(get<0>(entry),get<1>(entry),get<2>(entry));
+  }
+};
+
+// IDs that were written to or deleted from an element table, for its presence bitmaps.
+struct PresenceChanges {
+  roaring::Roaring64Map added;
+  roaring::Roaring64Map removed;
+
+  void set(uint64_t id, bool present) {
+    if (present) added.add(id);
+    else removed.add(id);
+  }
+
+  // the presence table is only maintained if expand built it.
+  void apply(MDB_txn *txn, const string &table) {
+    db::Presence presence(txn,table);
+    presence.update(added,removed);
+  }
+};
+
+// position a cursor at each key, so the pages holding it (or where it would be inserted) are resident.
+static void touchKeys(MDB_txn *txn, const string &name, unsigned int flags, vector<uint64_t> &keys) {
+  sortUnique(keys);
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, name.c_str(), flags, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn, dbi, &cursor));
+  MDB_val key, data;
+  for (uint64_t id : keys) {
+    key.mv_size = sizeof(uint64_t);
+    key.mv_data = (void *)&id;
+    mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+  }
+  mdb_cursor_close(cursor);
+}
+
+// Routes the changes of an update to the registered regions they affect, and writes one .osc per region.
+// A change affects a region if one of its nodes is in the region's covering, before or after the change.
+// A node also affects the regions of its parent ways, which are extracted with all of their nodes.
+// All changes are routed in one pass before any is applied, so stored elements are still the previous versions;
+// the new node locations and way node lists of the diff are added to them with locate() first.
+// A way that enters a region's covering, even only because one of its nodes moved, is new to the region,
+// so complete() adds it and its nodes as they are after the change: from the diff, or else from the snapshot.
+class RegionFanout {
   public:
-  DataUpdate(MDB_txn *txn) : 
-  mTxn(txn), 
-  mLocations(txn), 
-  mNodes(txn,"nodes"), 
-  mWays(txn,"ways"), 
-  mRelations(txn,"relations"),
-  mCellNode(txn,"cell_node"),
-  mNodeWay(txn,"node_way"),
-  mNodeRelation(txn,"node_relation"),
-  mWayRelation(txn,"way_relation"),
-  mRelationRelation(txn, "relation_relation")  {
+  RegionFanout(MDB_txn *txn) : mCellLevel(db::cellLevel(txn)) {
+    db::Regions regions(txn);
+    vector<S2CellId> all;
+    for (auto &region : regions.getAll()) {
+      mNames.push_back(region.first);
+      all.insert(all.end(),region.second.cell_ids().begin(),region.second.cell_ids().end());
+      mCoverings.push_back(std::move(region.second));
+      mBuffers.emplace_back(1024 * 1024,osmium::memory::Buffer::auto_grow::yes);
+    }
+    mEntered.resize(mNames.size());
+    mRoutedNodes.resize(mNames.size());
+    mAll = S2CellUnion(std::move(all));
+  }
+
+  size_t size() const {
+    return mNames.size();
+  }
+
+  void open(MDB_txn *txn) {
+    MDB_dbi dbi;
+    CHECK_LMDB(mdb_dbi_open(txn, "node_way", INDEX_FLAGS, &dbi));
+    CHECK_LMDB(mdb_cursor_open(txn, dbi, &mNodeWay));
+  }
+
+  void close() {
+    mdb_cursor_close(mNodeWay);
+    mNodeWay = nullptr;
+  }
+
+  // record the new version of a node or way, before any change is routed.
+  void locate(const osmium::OSMObject &object) {
+    if (object.type() == osmium::item_type::node) {
+      mNewNodes[object.id()] = &static_cast<const osmium::Node &>(object);
+    } else if (object.type() == osmium::item_type::way) {
+      mNewWays[object.id()] = &static_cast<const osmium::Way &>(object);
+    }
+  }
+
+  void route(const osmium::OSMObject &object, db::Cursor &locations, db::Cursor &ways, db::Cursor &relations) {
+    vector<bool> hits(mNames.size(),false);
+    MDB_val data;
+    if (object.type() == osmium::item_type::node) {
+      addNode(object.id(),locations,hits);
+      roaring::Roaring64Map parents;
+      db::traverseReverse(mNodeWay,object.id(),parents);
+      for (auto way_id : parents) addWay(way_id,locations,ways,hits);
+    } else if (object.type() == osmium::item_type::way) {
+      addWay(object.id(),locations,ways,hits);
+    } else if (object.type() == osmium::item_type::relation) {
+      vector<pair<osmium::item_type,uint64_t>> members;
+      if (relations.get(object.id(),data)) {
+        auto reader = db::toReader(data);
+        for (auto const &member : reader.getRoot<Relation>().getMembers()) {
+          if (member.getType() == RelationMember::Type::NODE) members.emplace_back(osmium::item_type::node,member.getRef());
+          else if (member.getType() == RelationMember::Type::WAY) members.emplace_back(osmium::item_type::way,member.getRef());
+        }
+      }
+      for (auto const &member : static_cast<const osmium::Relation &>(object).members()) {
+        members.emplace_back(member.type(),member.ref());
+      }
+      for (auto const &member : members) {
+        if (member.first == osmium::item_type::node) {
+          addNode(member.second,locations,hits);
+        } else if (member.first == osmium::item_type::way) {
+          auto const &way_hits = wayHits(member.second,locations,ways);
+          for (size_t i = 0; i < hits.size(); i++) hits[i] = hits[i] || way_hits.before[i] || way_hits.after[i];
+        }
+      }
+    }
+
+    for (size_t i = 0; i < hits.size(); i++) {
+      if (!hits[i]) continue;
+      mBuffers[i].add_item(object);
+      mBuffers[i].commit();
+      if (object.type() == osmium::item_type::node) mRoutedNodes[i].add(object.id());
+    }
+  }
+
+  // add the ways that entered a region and aren't in the diff, and the nodes of every entering way
+  // that weren't routed there, as they are after the change.
+  void complete(db::Cursor &locations, db::Cursor &nodes, db::Cursor &ways) {
+    for (size_t i = 0; i < mNames.size(); i++) {
+      for (auto way_id : mEntered[i]) {
+        vector<uint64_t> node_ids;
+        auto found_way = mNewWays.find(way_id);
+        if (found_way != mNewWays.end()) {
+          for (auto const &node_ref : found_way->second->nodes()) node_ids.push_back(node_ref.ref());
+        } else {
+          MDB_val data;
+          if (!ways.get(way_id,data)) continue;
+          auto reader = db::toReader(data);
+          Way::Reader way = reader.getRoot<Way>();
+          for (auto node_id : way.getNodes()) node_ids.push_back(node_id);
+          addStoredWay(mBuffers[i],way_id,way);
+        }
+        for (auto node_id : node_ids) {
+          if (!mRoutedNodes[i].addChecked(node_id)) continue;
+          auto found = mNewNodes.find(node_id);
+          if (found != mNewNodes.end()) {
+            mBuffers[i].add_item(*found->second);
+            mBuffers[i].commit();
+          } else {
+            addStoredNode(mBuffers[i],node_id,locations,nodes);
+          }
+        }
+      }
+    }
+  }
+
+  // write DIR/NAME/SEQNUM.osc.gz for every region, including regions with no changes,
+  // so mirrors can tell an empty diff from a missing one.
+  void write(const string &dir, const string &seqnum) {
+    for (size_t i = 0; i < mNames.size(); i++) {
+      string region_dir = dir + "/" + mNames[i];
+      mkdir(region_dir.c_str(),0775);
+      osmium::io::File output_file{region_dir + "/" + seqnum + ".osc.gz"};
+      osmium::io::Writer writer{output_file,osmium::io::overwrite::allow};
+      writer(std::move(mBuffers[i]));
+      writer.close();
+      mBuffers[i] = osmium::memory::Buffer(1024 * 1024,osmium::memory::Buffer::auto_grow::yes);
+    }
+    mWayHits.clear();
+    mNewNodes.clear();
+    mNewWays.clear();
+    for (auto &entered : mEntered) entered.clear();
+    for (auto &routed : mRoutedNodes) routed.clear();
+  }
+
+  private:
+  void addCell(uint64_t cell, vector<bool> &hits) {
+    // an index cell coarser than a covering's cells may only partly overlap it.
+    S2CellId cell_id(cell);
+    if (!mAll.Intersects(cell_id)) return;
+    for (size_t i = 0; i < mCoverings.size(); i++) {
+      if (!hits[i] && mCoverings[i].Intersects(cell_id)) hits[i] = true;
+    }
+  }
+
+  // the stored location of a node.
+  void addStored(uint64_t node_id, db::Cursor &locations, vector<bool> &hits) {
+    MDB_val data;
+    if (locations.get(node_id,data)) {
+      int32_t *buf = (int32_t *)data.mv_data;
+      addCell(cellId(osmium::Location(buf[0],buf[1]),mCellLevel),hits);
+    }
+  }
+
+  // the location of a node after the change: the diff's, or else the stored one.
+  void addCurrent(uint64_t node_id, db::Cursor &locations, vector<bool> &hits) {
+    auto found = mNewNodes.find(node_id);
+    if (found == mNewNodes.end()) {
+      addStored(node_id,locations,hits);
+    } else if (found->second->visible() && found->second->location().valid()) {
+      addCell(cellId(found->second->location(),mCellLevel),hits);
+    }
+  }
+
+  // the stored location of a node, and its new one if it changed.
+  void addNode(uint64_t node_id, db::Cursor &locations, vector<bool> &hits) {
+    addStored(node_id,locations,hits);
+    auto found = mNewNodes.find(node_id);
+    if (found != mNewNodes.end()) addCurrent(node_id,locations,hits);
+  }
+
+  // the regions a way is in before and after the change; it enters those it is only in after.
+  void addWay(uint64_t way_id, db::Cursor &locations, db::Cursor &ways, vector<bool> &hits) {
+    auto const &way_hits = wayHits(way_id,locations,ways);
+    for (size_t i = 0; i < hits.size(); i++) {
+      hits[i] = hits[i] || way_hits.before[i] || way_hits.after[i];
+      if (way_hits.after[i] && !way_hits.before[i]) mEntered[i].add(way_id);
+    }
+  }
+
+  struct WayHits {
+    vector<bool> before;
+    vector<bool> after;
+  };
+
+  const WayHits &wayHits(uint64_t way_id, db::Cursor &locations, db::Cursor &ways) {
+    auto found = mWayHits.find(way_id);
+    if (found != mWayHits.end()) return found->second;
+    WayHits hits{vector<bool>(mNames.size(),false),vector<bool>(mNames.size(),false)};
+    auto found_way = mNewWays.find(way_id);
+    bool changed = found_way != mNewWays.end();
+    MDB_val data;
+    if (ways.get(way_id,data)) {
+      auto reader = db::toReader(data);
+      for (auto const &node_id : reader.getRoot<Way>().getNodes()) {
+        addStored(node_id,locations,hits.before);
+        if (!changed) addCurrent(node_id,locations,hits.after);
+      }
+    }
+    if (changed && found_way->second->visible()) {
+      for (auto const &node_ref : found_way->second->nodes()) addCurrent(node_ref.ref(),locations,hits.after);
+    }
+    return mWayHits.emplace(way_id,std::move(hits)).first->second;
+  }
+
+  template <typename TBuilder>
+  static void addMetadata(TBuilder &builder, Metadata::Reader metadata) {
+    builder.set_timestamp(metadata.getTimestamp());
+    builder.set_changeset(metadata.getChangeset());
+    builder.set_uid(metadata.getUid());
+    builder.set_user(metadata.getUser());
+  }
+
+  static void addTags(osmium::builder::Builder &parent, capnp::List<capnp::Text>::Reader tags) {
+    osmium::builder::TagListBuilder tag_builder{parent};
+    for (int i = 0; i < tags.size() / 2; i++) {
+      tag_builder.add_tag(tags[i*2],tags[i*2+1]);
+    }
+  }
+
+  static void addStoredNode(osmium::memory::Buffer &buffer, uint64_t node_id, db::Cursor &locations, db::Cursor &nodes) {
+    MDB_val data;
+    if (!locations.get(node_id,data)) return;
+    int32_t *buf = (int32_t *)data.mv_data;
+    {
+      osmium::builder::NodeBuilder node_builder{buffer};
+      node_builder.set_id(node_id);
+      node_builder.set_location(osmium::Location(buf[0],buf[1]));
+      node_builder.set_version(buf[2]);
+      if (nodes.get(node_id,data)) {
+        auto reader = db::toReader(data);
+        Node::Reader node = reader.getRoot<Node>();
+        addMetadata(node_builder,node.getMetadata());
+        addTags(node_builder,node.getTags());
+      }
+    }
+    buffer.commit();
+  }
+
+  static void addStoredWay(osmium::memory::Buffer &buffer, uint64_t way_id, Way::Reader way) {
+    {
+      osmium::builder::WayBuilder way_builder{buffer};
+      way_builder.set_id(way_id);
+      way_builder.set_version(way.getMetadata().getVersion());
+      addMetadata(way_builder,way.getMetadata());
+      {
+        osmium::builder::WayNodeListBuilder way_node_list_builder{way_builder};
+        for (auto node_id : way.getNodes()) way_node_list_builder.add_node_ref(node_id);
+      }
+      addTags(way_builder,way.getTags());
+    }
+    buffer.commit();
+  }
+
+  int mCellLevel;
+  vector<string> mNames;
+  vector<S2CellUnion> mCoverings;
+  S2CellUnion mAll;
+  vector<osmium::memory::Buffer> mBuffers;
+  unordered_map<uint64_t,WayHits> mWayHits;
+  unordered_map<uint64_t,const osmium::Node *> mNewNodes;
+  unordered_map<uint64_t,const osmium::Way *> mNewWays;
+  vector<roaring::Roaring64Map> mEntered;
+  vector<roaring::Roaring64Map> mRoutedNodes;
+  MDB_cursor *mNodeWay = nullptr;
+};
+
+// Applies an OsmChange in sorted batches instead of in file order.
+// The whole diff is buffered and sorted by type, ID and version, and only the last version
+// of each element is applied, so each table is visited once in ascending key order
+// through a cursor. Index changes are collected and applied last, also in key order.
+class DataUpdate {
+  public:
+  void add(osmium::memory::Buffer &&buffer) {
+    for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+      mObjects.push_back(&*it);
+    }
+    mBuffers.push_back(std::move(buffer));
+    mPrepared = false;
+    mAdminPrepared = false;
+  }
+
+  // Reads every key apply() will read or write under a read transaction,
+  // so the write transaction spends its time on mutations instead of page faults.
+  void prefetch(MDB_env *env) {
+    prepare();
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    mCellLevel = db::cellLevel(txn);
+
+    vector<uint64_t> node_ids, way_ids, relation_ids, cells;
+    vector<uint64_t> way_nodes, member_nodes, member_ways, member_relations;
+    {
+      db::Cursor locations(txn,"locations",ELEMENT_FLAGS);
+      db::Cursor ways(txn,"ways",ELEMENT_FLAGS);
+      db::Cursor relations(txn,"relations",ELEMENT_FLAGS);
+      MDB_val data;
+      for (const osmium::OSMObject *object : mObjects) {
+        uint64_t id = object->id();
+        if (object->type() == osmium::item_type::node) {
+          node_ids.push_back(id);
+          if (locations.get(id,data)) {
+            int32_t *buf = (int32_t *)data.mv_data;
+            osmium::Location prev(buf[0],buf[1]);
+            cells.push_back(cellId(prev,mCellLevel));
+          }
+          auto const &location = static_cast<const osmium::Node *>(object)->location();
+          if (object->visible() && location.valid()) {
+            cells.push_back(cellId(location,mCellLevel));
+          }
+        } else if (object->type() == osmium::item_type::way) {
+          way_ids.push_back(id);
+          if (ways.get(id,data)) {
+            auto reader = db::toReader(data);
+            for (auto const &node_id : reader.getRoot<Way>().getNodes()) way_nodes.push_back(node_id);
+          }
+          for (auto const &node_ref : static_cast<const osmium::Way *>(object)->nodes()) way_nodes.push_back(node_ref.ref());
+        } else if (object->type() == osmium::item_type::relation) {
+          relation_ids.push_back(id);
+          if (relations.get(id,data)) {
+            auto reader = db::toReader(data);
+            for (auto const &member : reader.getRoot<Relation>().getMembers()) {
+              if (member.getType() == RelationMember::Type::NODE) member_nodes.push_back(member.getRef());
+              else if (member.getType() == RelationMember::Type::WAY) member_ways.push_back(member.getRef());
+              else member_relations.push_back(member.getRef());
+            }
+          }
+          for (auto const &member : static_cast<const osmium::Relation *>(object)->members()) {
+            if (member.type() == osmium::item_type::node) member_nodes.push_back(member.ref());
+            else if (member.type() == osmium::item_type::way) member_ways.push_back(member.ref());
+            else if (member.type() == osmium::item_type::relation) member_relations.push_back(member.ref());
+          }
+        }
+      }
+    }
+
+    // the locations of way and relation members are read to record touched cells.
+    vector<uint64_t> member_locations = way_nodes;
+    member_locations.insert(member_locations.end(),member_nodes.begin(),member_nodes.end());
+    touchKeys(txn,"locations",ELEMENT_FLAGS,member_locations);
+    touchKeys(txn,"ways",ELEMENT_FLAGS,member_ways);
+    touchKeys(txn,"nodes",ELEMENT_FLAGS,node_ids);
+    touchKeys(txn,"cell_node",INDEX_FLAGS,cells);
+    touchKeys(txn,"node_way",INDEX_FLAGS,way_nodes);
+    touchKeys(txn,"node_relation",INDEX_FLAGS,member_nodes);
+    touchKeys(txn,"way_relation",INDEX_FLAGS,member_ways);
+    touchKeys(txn,"relation_relation",INDEX_FLAGS,member_relations);
+    prepareAdmin(txn);
+    // committing a read-only transaction keeps the DBI handles it opened.
+    CHECK_LMDB(mdb_txn_commit(txn));
+  }
+
+  // if history is set, replaced versions are kept there, superseded at seqnum.
+  void apply(MDB_txn *txn, RegionFanout *fanout = nullptr, db::History *history = nullptr, uint64_t seqnum = 0) {
+    mTxn = txn;
+    mHistory = history;
+    mSeqnum = seqnum;
+    mTagIndexed = db::TagIndex(mTxn).exists();
+    mCellStats = db::CellStats(mTxn).exists();
+    mSegmentBounds = db::SegmentBounds(mTxn).exists();
+    mCellLevel = db::cellLevel(mTxn);
+    prepare();
+    // without prefetch(), boundaries are assembled here, before anything is written.
+    if (!mAdminPrepared) prepareAdmin(mTxn);
+
+    {
+      db::Cursor locations(mTxn,"locations",ELEMENT_FLAGS);
+      db::Cursor nodes(mTxn,"nodes",ELEMENT_FLAGS);
+      db::Cursor ways(mTxn,"ways",ELEMENT_FLAGS);
+      db::Cursor relations(mTxn,"relations",ELEMENT_FLAGS);
+
+      if (fanout) {
+        fanout->open(mTxn);
+        for (const osmium::OSMObject *object : mObjects) fanout->locate(*object);
+        for (const osmium::OSMObject *object : mObjects) fanout->route(*object,locations,ways,relations);
+        fanout->complete(locations,nodes,ways);
+        fanout->close();
+      }
+
+      for (const osmium::OSMObject *object : mObjects) {
+        if (object->type() == osmium::item_type::node) node(static_cast<const osmium::Node &>(*object),locations,nodes);
+        else if (object->type() == osmium::item_type::way) way(static_cast<const osmium::Way &>(*object),ways,locations);
+        else if (object->type() == osmium::item_type::relation) relation(static_cast<const osmium::Relation &>(*object),relations,ways,locations);
+      }
+      if (mSegmentBounds) measureMoved(ways,locations);
+    }
+
+    if (mHistory) {
+      for (const osmium::OSMObject *object : mObjects) {
+        if (object->visible()) mHistory->current(osmium::item_type_to_char(object->type()),object->id(),object->version(),mSeqnum);
+      }
+    }
+
+    mCellNode.apply(mTxn,"cell_node");
+    mCellLocations.apply(mTxn);
+    mNodeWay.apply(mTxn,"node_way");
+    mNodeRelation.apply(mTxn,"node_relation");
+    mWayRelation.apply(mTxn,"way_relation");
+    mRelationRelation.apply(mTxn,"relation_relation");
+    updateAncestors();
+    mNodesPresence.apply(mTxn,"nodes");
+    mWaysPresence.apply(mTxn,"ways");
+    mRelationsPresence.apply(mTxn,"relations");
+
+    // the time index is only maintained if expand built it.
+    db::TimeIndex time_index(mTxn);
+    if (time_index.exists()) {
+      map<uint64_t,roaring::Roaring64Map> times;
+      for (const osmium::OSMObject *object : mObjects) {
+        if (object->visible()) times[db::TimeIndex::key(object->timestamp().seconds_since_epoch(),object->type())].add(object->id());
+      }
+      for (auto &entry : times) time_index.add(entry.first,entry.second);
+    }
+
+    if (mCellStats) {
+      // every change to an index level cell applies to each of its parents.
+      map<S2CellId,array<int64_t,3>> levels;
+      for (auto const &entry : mStatChanges) {
+        S2CellId cell_id(entry.first);
+        for (int level = 0; level <= mCellLevel; level++) {
+          auto &changes = levels[cell_id.parent(level)];
+          for (int i = 0; i < 3; i++) changes[i] += entry.second[i];
+        }
+      }
+      db::CellStats cell_stats(mTxn);
+      for (auto const &entry : levels) {
+        if (entry.second[0] != 0 || entry.second[1] != 0 || entry.second[2] != 0) {
+          cell_stats.add(entry.first,entry.second[0],entry.second[1],entry.second[2]);
+        }
+      }
+      mStatChanges.clear();
+    }
+
+    if (mSegmentBounds) {
+      db::SegmentBounds segment_bounds(mTxn);
+      for (auto const &entry : mSegments) segment_bounds.raise(S2CellId(entry.first),entry.second);
+      mSegments.clear();
+      mMovedNodes.clear();
+    }
+
+    if (mTagIndexed) {
+      db::TagIndex tag_index(mTxn);
+      for (auto &entry : mTagChanges) tag_index.update(entry.first,entry.second.first,entry.second.second);
+      mTagChanges.clear();
+    }
+
+    updateAdmin();
+  }
+
+  // index level cells containing a node that changed, or a node of a way or relation that changed.
+  roaring::Roaring64Map &touchedCells() {
+    return mTouchedCells;
+  }
+
+  private:
+  // recompute relation_ancestors for relations whose parents changed, and for everything they contain.
+  // the closure is only maintained if expand built it.
+  void updateAncestors() {
+    MDB_dbi dbi;
+    if (mdb_dbi_open(mTxn, "relation_ancestors", INDEX_FLAGS & ~MDB_CREATE, &dbi) != 0) return;
+    roaring::Roaring64Map affected;
+    for (auto const &entry : mRelationRelation.puts) affected.add(entry.first);
+    for (auto const &entry : mRelationRelation.dels) affected.add(entry.first);
+
+    db::Elements relations(mTxn,"relations");
+    roaring::Roaring64Map frontier = affected;
+    while (!frontier.isEmpty()) {
+      roaring::Roaring64Map members;
+      for (auto relation_id : frontier) {
+        MDB_val data;
+        if (!relations.get(relation_id,data)) continue;
+        auto reader = db::toReader(data);
+        for (auto const &member : reader.getRoot<Relation>().getMembers()) {
+          if (member.getType() == RelationMember::Type::RELATION && affected.addChecked(member.getRef())) members.add(member.getRef());
+        }
+      }
+      frontier = std::move(members);
+    }
+
+    MDB_dbi relation_relation_dbi;
+    MDB_cursor *relation_relation;
+    CHECK_LMDB(mdb_dbi_open(mTxn, "relation_relation", INDEX_FLAGS, &relation_relation_dbi));
+    CHECK_LMDB(mdb_cursor_open(mTxn, relation_relation_dbi, &relation_relation));
+    db::Index ancestors(mTxn,"relation_ancestors");
+    for (uint64_t relation_id : affected) {
+      MDB_val key;
+      key.mv_size = sizeof(uint64_t);
+      key.mv_data = (void *)&relation_id;
+      mdb_del(mTxn, dbi, &key, NULL);
+      roaring::Roaring64Map set;
+      db::traverseAncestors(relation_relation,relation_id,set);
+      for (auto ancestor : set) ancestors.put(relation_id,ancestor);
+    }
+    mdb_cursor_close(relation_relation);
+  }
+
+  // reassemble the boundaries whose relation, member ways or way nodes change, from the stored elements
+  // and the diff's versions of them, so the write transaction only puts or deletes the results.
+  // the boundary index is only maintained if osmx admin built it.
+  void prepareAdmin(MDB_txn *txn) {
+    prepare();
+    mAdminPrepared = true;
+    mAdminPuts.clear();
+    mAdminDels.clear();
+    if (!AdminIndex(txn).exists()) return;
+
+    unordered_map<uint64_t,const osmium::Node *> new_nodes;
+    unordered_map<uint64_t,const osmium::Way *> new_ways;
+    unordered_map<uint64_t,const osmium::Relation *> new_relations;
+    roaring::Roaring64Map way_ids, relation_ids;
+    MDB_dbi dbi;
+    MDB_cursor *node_way, *way_relation;
+    CHECK_LMDB(mdb_dbi_open(txn, "node_way", INDEX_FLAGS, &dbi));
+    CHECK_LMDB(mdb_cursor_open(txn, dbi, &node_way));
+    CHECK_LMDB(mdb_dbi_open(txn, "way_relation", INDEX_FLAGS, &dbi));
+    CHECK_LMDB(mdb_cursor_open(txn, dbi, &way_relation));
+    for (const osmium::OSMObject *object : mObjects) {
+      if (object->type() == osmium::item_type::node) {
+        new_nodes[object->id()] = static_cast<const osmium::Node *>(object);
+        db::traverseReverse(node_way,object->id(),way_ids);
+      } else if (object->type() == osmium::item_type::way) {
+        new_ways[object->id()] = static_cast<const osmium::Way *>(object);
+        way_ids.add(object->id());
+      } else if (object->type() == osmium::item_type::relation) {
+        new_relations[object->id()] = static_cast<const osmium::Relation *>(object);
+        relation_ids.add(object->id());
+      }
+    }
+    for (auto way_id : way_ids) db::traverseReverse(way_relation,way_id,relation_ids);
+    mdb_cursor_close(node_way);
+    mdb_cursor_close(way_relation);
+
+    db::Locations locations(txn);
+    db::Elements ways(txn,"ways");
+    db::Elements relations(txn,"relations");
+    auto location = [&](uint64_t node_id) {
+      auto found = new_nodes.find(node_id);
+      if (found == new_nodes.end()) return locations.get(node_id).coords;
+      return found->second->visible() ? found->second->location() : osmium::Location();
+    };
+
+    for (auto relation_id : relation_ids) {
+      vector<pair<uint64_t,string>> members;
+      vector<pair<string,string>> tags;
+      MDB_val data;
+      auto found = new_relations.find(relation_id);
+      if (found != new_relations.end()) {
+        if (!found->second->visible()) {
+          mAdminDels.push_back(relation_id);
+          continue;
+        }
+        for (auto const &member : found->second->members()) {
+          if (member.type() == osmium::item_type::way) members.emplace_back(member.ref(),member.role());
+        }
+        for (auto const &tag : found->second->tags()) tags.emplace_back(tag.key(),tag.value());
+      } else if (relations.get(relation_id,data)) {
+        auto reader = db::toReader(data);
+        auto relation = reader.getRoot<Relation>();
+        for (auto const &member : relation.getMembers()) {
+          if (member.getType() == RelationMember::Type::WAY) members.emplace_back(member.getRef(),member.getRole().cStr());
+        }
+        tags = tagList(relation);
+      } else {
+        mAdminDels.push_back(relation_id);
+        continue;
+      }
+
+      // only the member ways that exist after the diff are members, as for geom::Builder.
+      osmium::memory::Buffer way_buffer{1024,osmium::memory::Buffer::auto_grow::yes};
+      osmium::memory::Buffer relation_buffer{1024,osmium::memory::Buffer::auto_grow::yes};
+      {
+        osmium::builder::RelationBuilder relation_builder{relation_buffer};
+        relation_builder.set_id(relation_id);
+        {
+          osmium::builder::RelationMemberListBuilder member_list_builder{relation_builder};
+          for (auto const &member : members) {
+            vector<uint64_t> node_ids;
+            auto found_way = new_ways.find(member.first);
+            if (found_way != new_ways.end()) {
+              if (!found_way->second->visible()) continue;
+              for (auto const &node_ref : found_way->second->nodes()) node_ids.push_back(node_ref.ref());
+            } else if (ways.get(member.first,data)) {
+              auto reader = db::toReader(data);
+              for (auto node_id : reader.getRoot<Way>().getNodes()) node_ids.push_back(node_id);
+            } else {
+              continue;
+            }
+            {
+              osmium::builder::WayBuilder way_builder{way_buffer};
+              way_builder.set_id(member.first);
+              osmium::builder::WayNodeListBuilder way_node_list_builder{way_builder};
+              for (auto node_id : node_ids) way_node_list_builder.add_node_ref(osmium::NodeRef(node_id,location(node_id)));
+            }
+            way_buffer.commit();
+            member_list_builder.add_member(osmium::item_type::way,member.first,member.second.c_str());
+          }
+        }
+        osmium::builder::TagListBuilder tag_builder{relation_builder};
+        for (auto const &tag : tags) tag_builder.add_tag(tag.first,tag.second);
+      }
+      relation_buffer.commit();
+
+      vector<const osmium::Way *> member_ways;
+      for (auto const &way : way_buffer.select<osmium::Way>()) member_ways.push_back(&way);
+      AdminIndex::Boundary boundary;
+      if (AdminIndex::assemble(relation_buffer.get<osmium::Relation>(0),member_ways,boundary) == AdminIndex::Assembled::ok) {
+        mAdminPuts.emplace_back(relation_id,std::move(boundary));
+      } else {
+        mAdminDels.push_back(relation_id);
+      }
+    }
+  }
+
+  void updateAdmin() {
+    if (mAdminPuts.empty() && mAdminDels.empty()) return;
+    AdminIndex admin(mTxn);
+    for (auto const &entry : mAdminPuts) admin.put(entry.first,entry.second);
+    for (auto relation_id : mAdminDels) admin.del(relation_id);
+    mAdminPuts.clear();
+    mAdminDels.clear();
+  }
+
+  // copy the stored value into history before it is overwritten or deleted.
+  void keepHistory(char type, uint64_t id, uint32_t prev_version, uint32_t new_version, const MDB_val &data) {
+    if (!mHistory || prev_version == new_version) return;
+    vector<char> value((char *)data.mv_data,(char *)data.mv_data + data.mv_size);
+    mHistory->put(type,id,prev_version,mSeqnum,value);
+  }
+
+  template <typename T> static vector<pair<string,string>> tagList(T reader) {
+    vector<pair<string,string>> tags;
+    auto list = reader.getTags();
+    for (int i = 0; i < list.size() / 2; i++) tags.emplace_back(list[i*2].cStr(),list[i*2+1].cStr());
+    return tags;
+  }
+
+  // collect the tag index entries the element leaves and joins.
+  void retag(char type, const vector<pair<string,string>> &prev_tags, const osmium::OSMObject &object) {
+    if (!mTagIndexed) return;
+    set<string> prev, next;
+    for (auto const &tag : prev_tags) {
+      prev.insert(db::TagIndex::key(type,tag.first.c_str()));
+      prev.insert(db::TagIndex::key(type,tag.first.c_str(),tag.second.c_str()));
+    }
+    if (object.visible()) {
+      for (auto const &tag : object.tags()) {
+        next.insert(db::TagIndex::key(type,tag.key()));
+        next.insert(db::TagIndex::key(type,tag.key(),tag.value()));
+      }
+    }
+    for (auto const &key : prev) {
+      if (!next.count(key)) mTagChanges[key].second.add(object.id());
+    }
+    for (auto const &key : next) {
+      if (!prev.count(key)) mTagChanges[key].first.add(object.id());
+    }
+  }
+
+  // half the length of each segment, kept for the cells at both of its ends, for cell_segments.
+  void measure(const vector<uint64_t> &node_ids, db::Cursor &locations) {
+    bool started = false;
+    S2Point prev;
+    uint64_t prev_cell = 0;
+    MDB_val data;
+    for (auto node_id : node_ids) {
+      if (!locations.get(node_id,data)) continue;
+      int32_t *buf = (int32_t *)data.mv_data;
+      osmium::Location location(buf[0],buf[1]);
+      S2Point point = S2LatLng::FromDegrees(location.lat(),location.lon()).ToPoint();
+      uint64_t cell = cellId(location,mCellLevel);
+      if (started) {
+        double half = S2Earth::ToMeters(S1Angle(prev,point)) / 2;
+        for (uint64_t end : {prev_cell,cell}) {
+          double &longest = mSegments[end];
+          longest = max(longest,half);
+        }
+      }
+      prev = point;
+      prev_cell = cell;
+      started = true;
+    }
+  }
+
+  // ways that aren't in the diff, but have a node that moved, have new segment lengths.
+  // node_way doesn't have this diff's changes yet, which only matter for ways in the diff, measured by way().
+  void measureMoved(db::Cursor &ways, db::Cursor &locations) {
+    if (mMovedNodes.isEmpty()) return;
+    MDB_dbi dbi;
+    MDB_cursor *node_way;
+    CHECK_LMDB(mdb_dbi_open(mTxn, "node_way", INDEX_FLAGS, &dbi));
+    CHECK_LMDB(mdb_cursor_open(mTxn, dbi, &node_way));
+    roaring::Roaring64Map way_ids;
+    for (auto node_id : mMovedNodes) db::traverseReverse(node_way,node_id,way_ids);
+    mdb_cursor_close(node_way);
+    MDB_val data;
+    for (auto way_id : way_ids) {
+      if (!ways.get(way_id,data)) continue;
+      auto reader = db::toReader(data);
+      vector<uint64_t> node_ids;
+      for (auto node_id : reader.getRoot<Way>().getNodes()) node_ids.push_back(node_id);
+      measure(node_ids,locations);
+    }
+  }
+
+  // record a change of count for cell_stats, where type is 0 for nodes, 1 for ways and 2 for relations.
+  void count(uint64_t cell, int type, int64_t change) {
+    if (!mCellStats || cell == 0) return;
+    mStatChanges[cell][type] += change;
+  }
+
+  uint64_t nodeCell(uint64_t node_id, db::Cursor &locations) {
+    MDB_val data;
+    if (!locations.get(node_id,data)) return 0;
+    int32_t *buf = (int32_t *)data.mv_data;
+    return cellId(osmium::Location(buf[0],buf[1]),mCellLevel);
+  }
+
+  // the cell a relation is counted in, from its node and way members in member order.
+  uint64_t relationCell(const vector<uint64_t> &member_nodes, const vector<uint64_t> &member_ways, db::Cursor &ways, db::Cursor &locations) {
+    if (!mCellStats) return 0;
+    if (!member_nodes.empty()) return nodeCell(member_nodes[0],locations);
+    if (member_ways.empty()) return 0;
+    MDB_val data;
+    if (!ways.get(member_ways[0],data)) return 0;
+    auto reader = db::toReader(data);
+    auto nodes = reader.getRoot<Way>().getNodes();
+    return nodes.size() > 0 ? nodeCell(nodes[0],locations) : 0;
+  }
+
+  void touch(uint64_t node_id, db::Cursor &locations) {
+    MDB_val data;
+    if (locations.get(node_id,data)) {
+      int32_t *buf = (int32_t *)data.mv_data;
+      mTouchedCells.add(cellId(osmium::Location(buf[0],buf[1]),mCellLevel));
+    }
+  }
+
+  // sort by type, ID and version and keep only the last version of each element.
+  void prepare() {
+    if (mPrepared) return;
+    // stable, so that of two identical versions the later one in the file wins.
+    stable_sort(mObjects.begin(),mObjects.end(),[](const osmium::OSMObject *a, const osmium::OSMObject *b) {
+      return osmium::object_order_type_id_version()(*a,*b);
+    });
+    size_t last = 0;
+    for (size_t i = 0; i < mObjects.size(); i++) {
+      if (i + 1 < mObjects.size() && mObjects[i+1]->type() == mObjects[i]->type() && mObjects[i+1]->id() == mObjects[i]->id()) continue;
+      mObjects[last++] = mObjects[i];
+    }
+    mObjects.resize(last);
+    mPrepared = true;
   }
 
   // update location, node, cell_location tables
-  void node(const osmium::Node& node) {
+  void node(const osmium::Node& node, db::Cursor &locations, db::Cursor &nodes) {
     uint64_t id = node.id();
-    db::Location prev_location = mLocations.get(id);
-    db::Location new_location = db::Location{node.location(),(int32_t)node.version()};
+    MDB_val data;
+    db::Location prev_location;
+    if (locations.get(id,data)) {
+      int32_t *buf = (int32_t *)data.mv_data;
+      prev_location = db::Location{osmium::Location(buf[0],buf[1]),buf[2]};
+    }
     uint64_t prev_cell;
-    if (prev_location.is_defined()) prev_cell = S2CellId(S2LatLng::FromDegrees(prev_location.coords.lat(),prev_location.coords.lon())).parent(CELL_INDEX_LEVEL).id();
+    if (prev_location.is_defined()) {
+      prev_cell = cellId(prev_location.coords,mCellLevel);
+      mTouchedCells.add(prev_cell);
+      if (mHistory && prev_location.version != (int32_t)node.version()) {
+        // padded to 16 bytes, so the message starts on a word boundary once History::get copies it out.
+        vector<char> value((char *)data.mv_data,(char *)data.mv_data + data.mv_size);
+        value.resize(sizeof(int32_t) * 4);
+        MDB_val node_data;
+        if (nodes.get(id,node_data)) value.insert(value.end(),(char *)node_data.mv_data,(char *)node_data.mv_data + node_data.mv_size);
+        mHistory->put('n',id,prev_location.version,mSeqnum,value);
+      }
+    }
+    if (mTagIndexed) {
+      vector<pair<string,string>> prev_tags;
+      MDB_val node_data;
+      if (nodes.get(id,node_data)) {
+        auto reader = db::toReader(node_data);
+        prev_tags = tagList(reader.getRoot<Node>());
+      }
+      retag('n',prev_tags,node);
+    }
 
+    mNodesPresence.set(id,node.visible() && node.tags().size() > 0);
+    if (prev_location.is_defined()) mCellLocations.dels.emplace_back(prev_cell,id,prev_location);
+    if (prev_location.is_defined()) count(prev_cell,0,-1);
+    if (node.visible()) count(cellId(node.location(),mCellLevel),0,1);
+    if (node.visible()) mCellLocations.puts.emplace_back(cellId(node.location(),mCellLevel),id,db::Location{node.location(),(int32_t)node.version()});
     if (!node.visible()) {
-      mLocations.del(id);
-      mNodes.del(id);
-      mCellNode.del(prev_cell,id);
+      // ways that still reference the node now skip it, so their segment lengths change too.
+      if (mSegmentBounds) mMovedNodes.add(id);
+      locations.del(id);
+      nodes.del(id);
+      if (prev_location.is_defined()) mCellNode.dels.emplace_back(prev_cell,id);
       return;
     } else {
-      mLocations.put(id,new_location);
+      int32_t buf[3];
+      buf[0] = node.location().x();
+      buf[1] = node.location().y();
+      buf[2] = node.version();
+      data.mv_size = sizeof(buf);
+      data.mv_data = (void *)buf;
+      locations.put(id,data);
       if (node.tags().size() > 0) {
         ::capnp::MallocMessageBuilder message;
         Node::Builder nodeMsg = message.initRoot<Node>();
@@ -101,50 +987,62 @@ class DataUpdate : public osmium::handler::Handler {
         metadata.setUser(node.user());
         kj::VectorOutputStream output;
         capnp::writeMessage(output,message);
-        mNodes.put(id,output);
+        data.mv_size = output.getArray().size();
+        data.mv_data = (void *)output.getArray().begin();
+        nodes.put(id,data);
       } else {
-        mNodes.del(id); 
+        nodes.del(id); 
       }
     }
 
-    uint64_t new_cell = S2CellId(S2LatLng::FromDegrees(new_location.coords.lat(),new_location.coords.lon())).parent(CELL_INDEX_LEVEL).id();
+    if (mSegmentBounds && (!prev_location.is_defined() || prev_location.coords != node.location())) mMovedNodes.add(id);
+    uint64_t new_cell = cellId(node.location(),mCellLevel);
+    mTouchedCells.add(new_cell);
     if (!prev_location.is_defined()) {
-      mCellNode.put(new_cell,id);
+      mCellNode.puts.emplace_back(new_cell,id);
       return;
     }
 
     if (prev_cell != new_cell) {
-      mCellNode.del(prev_cell,id);
-      mCellNode.put(new_cell,id);
+      mCellNode.dels.emplace_back(prev_cell,id);
+      mCellNode.puts.emplace_back(new_cell,id);
     }
   }
 
   // update way, node_way tables
-  void way(const osmium::Way &way) {
+  void way(const osmium::Way &way, db::Cursor &ways, db::Cursor &locations) {
     uint64_t id = way.id();
 
-    set<uint64_t> prev_nodes;
-    set<uint64_t> new_nodes;
+    vector<uint64_t> prev_nodes;
+    vector<uint64_t> new_nodes;
+    vector<pair<string,string>> prev_tags;
 
-    if (mWays.exists(id)) {
-      auto reader = mWays.getReader(id);
-      Way::Reader way = reader.getRoot<Way>();
-      for (auto const &node_id : way.getNodes()) {
-        prev_nodes.insert(node_id);
+    MDB_val data;
+    if (ways.get(id,data)) {
+      auto reader = db::toReader(data);
+      auto prev_way = reader.getRoot<Way>();
+      for (auto const &node_id : prev_way.getNodes()) {
+        prev_nodes.push_back(node_id);
       }
+      keepHistory('w',id,prev_way.getMetadata().getVersion(),way.version(),data);
+      prev_tags = tagList(prev_way);
     }
+    // ways are counted in the cell of their first node.
+    if (!prev_nodes.empty()) count(nodeCell(prev_nodes[0],locations),1,-1);
+    sortUnique(prev_nodes);
+    retag('w',prev_tags,way);
 
+    mWaysPresence.set(id,way.visible());
     if (!way.visible()) {
-      mWays.del(id);
+      ways.del(id);
     } else {
       auto const &nodes = way.nodes();
       ::capnp::MallocMessageBuilder message;
       Way::Builder wayMsg = message.initRoot<Way>();
       wayMsg.initNodes(nodes.size());
-      int i = 0;
       for (int i = 0; i < nodes.size(); i++) {
         wayMsg.getNodes().set(i,nodes[i].ref());
-        new_nodes.insert(nodes[i].ref());
+        new_nodes.push_back(nodes[i].ref());
       }
       setTags<Way::Builder>(way.tags(),wayMsg);
       auto metadata = wayMsg.initMetadata();
@@ -155,48 +1053,54 @@ class DataUpdate : public osmium::handler::Handler {
       metadata.setUser(way.user());
       kj::VectorOutputStream output;
       capnp::writeMessage(output,message);
-      mWays.put(id,output);
+      data.mv_size = output.getArray().size();
+      data.mv_data = (void *)output.getArray().begin();
+      ways.put(id,data);
+      if (mSegmentBounds) measure(new_nodes,locations);
     }
+    if (!new_nodes.empty()) count(nodeCell(new_nodes[0],locations),1,1);
+    sortUnique(new_nodes);
 
-    if (!way.visible()) {
-      for (uint64_t node_id : prev_nodes) mNodeWay.del(node_id,id);
-    } else {
-      for (uint64_t node_id : prev_nodes) {
-        if (new_nodes.count(node_id) == 0) mNodeWay.del(node_id,id);
-      }
-      for (uint64_t node_id : new_nodes) {
-        if (prev_nodes.count(node_id) == 0) mNodeWay.put(node_id,id);
-      }
-    }
+    // nodes are applied first, so these are the new locations.
+    for (auto node_id : prev_nodes) touch(node_id,locations);
+    for (auto node_id : new_nodes) touch(node_id,locations);
+
+    mNodeWay.diff(prev_nodes,new_nodes,id);
   }
 
   // update relation, node_relation, way_relation and relation_relation tables
-  void relation(const osmium::Relation &relation) {
+  void relation(const osmium::Relation &relation, db::Cursor &relations, db::Cursor &ways, db::Cursor &locations) {
     uint64_t id = relation.id();
 
-    set<uint64_t> prev_nodes;
-    set<uint64_t> prev_ways;
-    set<uint64_t> prev_relations;
-    set<uint64_t> new_nodes;
-    set<uint64_t> new_ways;
-    set<uint64_t> new_relations;
-
-    if (mRelations.exists(id)) {
-      auto reader = mRelations.getReader(id);
-      Relation::Reader relation = reader.getRoot<Relation>();
-      for (auto const &member : relation.getMembers()) {
+    vector<uint64_t> prev_nodes;
+    vector<uint64_t> prev_ways;
+    vector<uint64_t> prev_relations;
+    vector<uint64_t> new_nodes;
+    vector<uint64_t> new_ways;
+    vector<uint64_t> new_relations;
+    vector<pair<string,string>> prev_tags;
+
+    MDB_val data;
+    if (relations.get(id,data)) {
+      auto reader = db::toReader(data);
+      for (auto const &member : reader.getRoot<Relation>().getMembers()) {
         if (member.getType() == RelationMember::Type::NODE) {
-          prev_nodes.insert(member.getRef());
+          prev_nodes.push_back(member.getRef());
         } else if (member.getType() == RelationMember::Type::WAY) {
-          prev_ways.insert(member.getRef());
+          prev_ways.push_back(member.getRef());
         } else {
-          prev_relations.insert(member.getRef());
+          prev_relations.push_back(member.getRef());
         }
       }
+      keepHistory('r',id,reader.getRoot<Relation>().getMetadata().getVersion(),relation.version(),data);
+      prev_tags = tagList(reader.getRoot<Relation>());
     }
+    retag('r',prev_tags,relation);
+    count(relationCell(prev_nodes,prev_ways,ways,locations),2,-1);
 
+    mRelationsPresence.set(id,relation.visible());
     if (!relation.visible()) {
-      mRelations.del(relation.id());
+      relations.del(id);
     } else {
       ::capnp::MallocMessageBuilder message;
       Relation::Builder relationMsg = message.initRoot<Relation>();
@@ -207,15 +1111,15 @@ class DataUpdate : public osmium::handler::Handler {
         members[i].setRef(member.ref());
         members[i].setRole(member.role());
         if (member.type() == osmium::item_type::node) {
-          new_nodes.insert(member.ref());
+          new_nodes.push_back(member.ref());
           members[i].setType(RelationMember::Type::NODE);
         }
         else if (member.type() == osmium::item_type::way) {
-          new_ways.insert(member.ref());
+          new_ways.push_back(member.ref());
           members[i].setType(RelationMember::Type::WAY);
         }
         else if (member.type() == osmium::item_type::relation) {
-          new_relations.insert(member.ref());
+          new_relations.push_back(member.ref());
           members[i].setType(RelationMember::Type::RELATION);
         }
         i++;
@@ -228,48 +1132,237 @@ class DataUpdate : public osmium::handler::Handler {
       metadata.setUser(relation.user());
       kj::VectorOutputStream output;
       capnp::writeMessage(output,message);
-      mRelations.put(relation.id(),output);
+      data.mv_size = output.getArray().size();
+      data.mv_data = (void *)output.getArray().begin();
+      relations.put(id,data);
     }
 
-    if (!relation.visible()) {
-      for (uint64_t node_id : prev_nodes) mNodeRelation.del(node_id,id);
-      for (uint64_t way_id : prev_ways) mWayRelation.del(way_id,id);
-      for (uint64_t relation_id : prev_relations) mRelationRelation.del(relation_id,id);
-    } else {
-      for (uint64_t node_id : prev_nodes) {
-        if (new_nodes.count(node_id) == 0) mNodeRelation.del(node_id,id);
-      }
-      for (uint64_t node_id : new_nodes) {
-        if (prev_nodes.count(node_id) == 0) mNodeRelation.put(node_id,id);
-      }
-      for (uint64_t way_id : prev_ways) {
-        if (new_ways.count(way_id) == 0) mWayRelation.del(way_id,id);
-      }
-      for (uint64_t way_id : new_ways) {
-        if (prev_ways.count(way_id) == 0) mWayRelation.put(way_id,id);
-      }
-      for (uint64_t relation_id : prev_relations) {
-        if (new_relations.count(relation_id) == 0) mRelationRelation.del(relation_id,id);
-      }
-      for (uint64_t relation_id : new_relations) {
-        if (prev_relations.count(relation_id) == 0) mRelationRelation.put(relation_id,id);
+    count(relationCell(new_nodes,new_ways,ways,locations),2,1);
+    sortUnique(prev_nodes);
+    sortUnique(prev_ways);
+    sortUnique(prev_relations);
+    sortUnique(new_nodes);
+    sortUnique(new_ways);
+    sortUnique(new_relations);
+    // relation members are not followed, as every relation that changed is visited itself.
+    for (auto node_id : prev_nodes) touch(node_id,locations);
+    for (auto node_id : new_nodes) touch(node_id,locations);
+    vector<uint64_t> member_ways;
+    set_union(prev_ways.begin(),prev_ways.end(),new_ways.begin(),new_ways.end(),back_inserter(member_ways));
+    for (auto way_id : member_ways) {
+      if (ways.get(way_id,data)) {
+        auto reader = db::toReader(data);
+        for (auto const &node_id : reader.getRoot<Way>().getNodes()) touch(node_id,locations);
       }
     }
+
+    mNodeRelation.diff(prev_nodes,new_nodes,id);
+    mWayRelation.diff(prev_ways,new_ways,id);
+    mRelationRelation.diff(prev_relations,new_relations,id);
   }
 
-  private:
-  MDB_txn *mTxn;
-  db::Locations mLocations;
-  db::Elements mNodes;
-  db::Elements mWays;
-  db::Elements mRelations;
-  db::Index mNodeWay;
-  db::Index mNodeRelation;
-  db::Index mWayRelation;
-  db::Index mRelationRelation;
-  db::Index mCellNode;
+  MDB_txn *mTxn = nullptr;
+  db::History *mHistory = nullptr;
+  uint64_t mSeqnum = 0;
+  bool mPrepared = false;
+  bool mAdminPrepared = false;
+  // boundaries assembled by prepareAdmin().
+  vector<pair<uint64_t,AdminIndex::Boundary>> mAdminPuts;
+  vector<uint64_t> mAdminDels;
+  vector<osmium::memory::Buffer> mBuffers;
+  vector<const osmium::OSMObject *> mObjects;
+  IndexChanges mCellNode;
+  CellLocationChanges mCellLocations;
+  IndexChanges mNodeWay;
+  IndexChanges mNodeRelation;
+  IndexChanges mWayRelation;
+  IndexChanges mRelationRelation;
+  PresenceChanges mNodesPresence;
+  PresenceChanges mWaysPresence;
+  PresenceChanges mRelationsPresence;
+  roaring::Roaring64Map mTouchedCells;
+  bool mTagIndexed = false;
+  bool mCellStats = false;
+  bool mSegmentBounds = false;
+  int mCellLevel = CELL_INDEX_LEVEL;
+  // half the longest new segment length with an end in each index level cell, and nodes whose location changed.
+  unordered_map<uint64_t,double> mSegments;
+  roaring::Roaring64Map mMovedNodes;
+  // index level cell to changes of its node, way and relation counts.
+  map<uint64_t,array<int64_t,3>> mStatChanges;
+  // tag index key to the IDs that joined and left it.
+  map<string,pair<roaring::Roaring64Map,roaring::Roaring64Map>> mTagChanges;
 };
 
+struct DiffFile {
+  string osc;
+  string seqnum;
+  string timestamp;
+};
+
+struct ApplyStats {
+  string old_seqnum;
+  double seconds = 0;
+  double write_seconds = 0;
+  size_t pages_dirtied = 0;
+};
+
+// LMDB is copy-on-write: every page a transaction modifies is freed under that transaction's ID,
+// so the freelist entry plus any growth of the file approximates the pages the transaction dirtied.
+static size_t freedPages(MDB_env *env, size_t txnid) {
+  MDB_txn *txn;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  CHECK_LMDB(mdb_cursor_open(txn, 0, &cursor)); // 0 is the freelist
+  MDB_val key, data;
+  key.mv_size = sizeof(size_t);
+  key.mv_data = (void *)&txnid;
+  size_t freed = 0;
+  if (mdb_cursor_get(cursor, &key, &data, MDB_SET_KEY) == 0) freed = *(size_t *)data.mv_data;
+  mdb_cursor_close(cursor);
+  mdb_txn_abort(txn);
+  return freed;
+}
+
+static vector<osmium::memory::Buffer> readDiff(const string &osc) {
+  vector<osmium::memory::Buffer> buffers;
+  const osmium::io::File input_file{osc};
+  osmium::io::Reader reader{input_file, osmium::osm_entity_bits::object};
+  while (osmium::memory::Buffer buffer = reader.read()) {
+    buffers.push_back(std::move(buffer));
+  }
+  reader.close();
+  return buffers;
+}
+
+// Apply one or more diffs in a single transaction.
+// Diffs are coalesced by DataUpdate, so an element changed in several of them is written once.
+// Parsing and page faults happen before the write transaction begins, so the write lock
+// is only held for the mutations themselves.
+struct UpdateOptions {
+  bool commit = false;
+  bool verbose = false;
+  // if set, a diff for each registered region is written here after the commit.
+  string region_dir;
+  // sequence numbers to keep replaced versions for; 0 turns history off, -1 keeps the stored setting.
+  int64_t history = -1;
+  // sequence numbers to keep touched cells for, likewise.
+  int64_t changes = -1;
+};
+
+static ApplyStats applyDiffs(MDB_env *env, const vector<DiffFile> &diffs, const UpdateOptions &options) {
+  bool commit = options.commit;
+  bool verbose = options.verbose;
+  ApplyStats stats;
+  auto startTime = std::chrono::high_resolution_clock::now();
+
+  DataUpdate data_update;
+  {
+    osmium::thread::Pool pool{min((int)diffs.size(),(int)std::thread::hardware_concurrency())};
+    vector<std::future<vector<osmium::memory::Buffer>>> parsed;
+    for (auto const &diff : diffs) {
+      parsed.push_back(pool.submit([osc = diff.osc]() { return readDiff(osc); }));
+    }
+    for (auto &result : parsed) {
+      for (auto &buffer : result.get()) data_update.add(std::move(buffer));
+    }
+  }
+  data_update.prefetch(env);
+
+  auto writeStartTime = std::chrono::high_resolution_clock::now();
+  MDB_envinfo info;
+  mdb_env_info(env, &info);
+  size_t last_pgno = info.me_last_pgno;
+  MDB_txn* txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+  size_t txnid = mdb_txn_id(txn);
+
+  auto new_seqnum = diffs.back().seqnum;
+  auto new_timestamp = diffs.back().timestamp;
+  db::Metadata metadata(txn);
+  if (verbose) cout << "Timestamp: " << metadata.get("osmosis_replication_timestamp") << endl;
+  stats.old_seqnum = metadata.get("osmosis_replication_sequence_number");
+
+  if (verbose) cout << "Starting update from " << stats.old_seqnum << " to " << new_seqnum << endl;
+
+  std::unique_ptr<RegionFanout> fanout;
+  if (!options.region_dir.empty()) fanout = std::make_unique<RegionFanout>(txn);
+
+  // the retention window is stored, so it applies to every later update.
+  if (options.history >= 0) metadata.put("history_retention",to_string(options.history));
+  string retention = metadata.get("history_retention");
+  std::unique_ptr<db::History> history;
+  if (!retention.empty() && stoull(retention) > 0) history = std::make_unique<db::History>(txn,true);
+  if (options.changes >= 0) metadata.put("changes_retention",to_string(options.changes));
+  string changes_retention = metadata.get("changes_retention");
+
+  data_update.apply(txn,fanout.get(),history.get(),stoull(new_seqnum));
+  if (history && stoull(new_seqnum) > stoull(retention)) history->prune(stoull(new_seqnum) - stoull(retention));
+
+  if (commit) {
+    {
+      metadata.put("osmosis_replication_sequence_number",new_seqnum);
+      metadata.put("osmosis_replication_timestamp",new_timestamp);
+      if (!changes_retention.empty() && stoull(changes_retention) > 0) {
+        db::Changes changes(txn,true);
+        changes.put(stoull(new_seqnum),data_update.touchedCells());
+        if (stoull(new_seqnum) > stoull(changes_retention)) changes.prune(stoull(new_seqnum) - stoull(changes_retention));
+      }
+    }
+    CHECK_LMDB(mdb_txn_commit(txn));
+    mdb_env_info(env, &info);
+    stats.pages_dirtied = freedPages(env, txnid) + (info.me_last_pgno - last_pgno);
+    if (fanout) fanout->write(options.region_dir,new_seqnum);
+    cout << "Committed: ";
+  } else {
+    mdb_txn_abort(txn);
+    cout << "Aborted: ";
+  }
+  auto endTime = std::chrono::high_resolution_clock::now();
+  stats.seconds = (std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime ).count()) / 1000.0;
+  stats.write_seconds = (std::chrono::duration_cast<std::chrono::milliseconds>( endTime - writeStartTime ).count()) / 1000.0;
+  cout << stats.old_seqnum << " -> " << new_seqnum << " (" << diffs.size() << " diffs) in " << stats.seconds << " seconds, " << stats.write_seconds << " in the write transaction." << endl;
+  return stats;
+}
+
+// each line of a batch file is: OSC_FILE SEQNUM TIMESTAMP
+static bool isSeqnum(const string &text) {
+  if (text.empty() || text.size() > 18) return false;
+  for (char c : text) {
+    if (!isdigit(c)) return false;
+  }
+  return true;
+}
+
+// one OSC_FILE SEQNUM TIMESTAMP per line; blank lines are skipped, anything else exits with the line number.
+static vector<DiffFile> readBatch(const string &fname) {
+  vector<DiffFile> diffs;
+  std::ifstream stream(fname);
+  if (!stream) {
+    cout << "Could not read batch file " << fname << "." << endl;
+    exit(1);
+  }
+  string line;
+  size_t line_number = 0;
+  while (getline(stream,line)) {
+    line_number++;
+    std::istringstream fields(line);
+    vector<string> values;
+    string value;
+    while (fields >> value) values.push_back(value);
+    if (values.empty()) continue;
+    if (values.size() != 3 || !isSeqnum(values[1])) {
+      cout << fname << ":" << line_number << ": expected OSC_FILE SEQNUM TIMESTAMP, got: " << line << endl;
+      exit(1);
+    }
+    diffs.push_back(DiffFile{values[0],values[1],values[2]});
+  }
+  stable_sort(diffs.begin(),diffs.end(),[](const DiffFile &a, const DiffFile &b) {
+    return stoll(a.seqnum) < stoll(b.seqnum);
+  });
+  return diffs;
+}
+
 void cmdUpdate(int argc, char* argv[]) {
   cxxopts::Options cmdoptions("Update", "Update an .osmx file with a .osc diff.");
   cmdoptions.add_options()
@@ -280,61 +1373,227 @@ void cmdUpdate(int argc, char* argv[]) {
     ("osc", ".osc to apply", cxxopts::value<string>())
     ("seqnum", "The sequence number of the .osc", cxxopts::value<string>())
     ("timestamp", "The timestamp of the .osc", cxxopts::value<string>())
+    ("batch", "File listing OSC_FILE SEQNUM TIMESTAMP per line", cxxopts::value<string>())
+    ("batchSize", "Diffs per transaction in batch mode, 0 for all", cxxopts::value<int>()->default_value("0"))
+    ("regionDiffs", "Directory for per-region diffs", cxxopts::value<string>())
+    ("history", "Sequence numbers to keep replaced versions for", cxxopts::value<int>())
+    ("changes", "Sequence numbers to keep touched cells for", cxxopts::value<int>())
   ;
 
   cmdoptions.parse_positional({"cmd","osmx","osc","seqnum","timestamp"});
   auto result = cmdoptions.parse(argc, argv);
 
-  if (result.count("osmx") == 0 || result.count("osc") == 0 || \
-    result.count("seqnum") == 0 || result.count("timestamp") == 0) {
+  bool single = result.count("osc") > 0 && result.count("seqnum") > 0 && result.count("timestamp") > 0;
+  if (result.count("osmx") == 0 || (!single && result.count("batch") == 0)) {
     cout << "Usage: osmx update OSMX_FILE OSC_FILE SEQNUM TIMESTAMP [OPTIONS]" << endl;
+    cout << "       osmx update OSMX_FILE --batch BATCH_FILE [OPTIONS]" << endl;
     cout << "Applies OSC_FILE and saves SEQNUM and TIMESTAMP into the metadata table." << endl << endl;
     cout << "EXAMPLE:" << endl;
     cout << " osmx update planet.osmx 123456.osc 123456 2019-09-05T00:00:00Z --commit" << endl << endl;
     cout << "OPTIONS:" << endl;
     cout << " --v,--verbose: verbose output." << endl;
     cout << " --commit: Actually commit the transaction; otherwise runs the update and rolls back." << endl;
+    cout << " --batch BATCH_FILE: apply every diff listed in BATCH_FILE, one OSC_FILE SEQNUM TIMESTAMP per line." << endl;
+    cout << "   Only the final version of each element is written, and the last SEQNUM and TIMESTAMP are saved." << endl;
+    cout << " --batchSize N: commit after every N diffs of a batch instead of once at the end." << endl;
+    cout << " --regionDiffs DIR: write DIR/NAME/SEQNUM.osc.gz with the changes affecting each region registered with osmx regions." << endl;
+    cout << " --history N: keep versions replaced in the last N sequence numbers; saved for later updates, 0 turns it off." << endl;
+    cout << "   Diffs applied in one transaction share the last sequence number; use --batchSize 1 to keep every version." << endl;
+    cout << " --changes N: record the cells each update touches, for the last N sequence numbers; saved for later updates, 0 turns it off." << endl;
+    exit(1);
+  }
+
+  string osmx = result["osmx"].as<string>();
+  UpdateOptions options;
+  options.verbose = result.count("verbose") > 0;
+  options.commit = result.count("commit") > 0;
+  if (result.count("regionDiffs")) options.region_dir = result["regionDiffs"].as<string>();
+  if (result.count("history")) options.history = max(0,result["history"].as<int>());
+  if (result.count("changes")) options.changes = max(0,result["changes"].as<int>());
+
+  vector<DiffFile> diffs;
+  if (result.count("batch")) {
+    diffs = readBatch(result["batch"].as<string>());
+  } else {
+    diffs.push_back(DiffFile{result["osc"].as<string>(),result["seqnum"].as<string>(),result["timestamp"].as<string>()});
+  }
+  if (diffs.empty()) {
+    cout << "No diffs to apply." << endl;
+    exit(1);
+  }
+
+  size_t batch_size = result["batchSize"].as<int>() > 0 ? result["batchSize"].as<int>() : diffs.size();
+
+  MDB_env* env = db::createEnv(osmx,true);
+  for (size_t i = 0; i < diffs.size(); i += batch_size) {
+    vector<DiffFile> chunk(diffs.begin() + i,diffs.begin() + min(i + batch_size,diffs.size()));
+    applyDiffs(env,chunk,options);
+    // without --commit every chunk would start from the same state.
+    if (!options.commit) break;
+  }
+  mdb_env_sync(env,true);
+  mdb_env_close(env);
+}
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+  stopRequested = 1;
+}
+
+// replication state files are java properties: sequenceNumber=123 and timestamp=2019-09-05T00\:00\:00Z
+static bool readState(const string &fname, uint64_t &seqnum, string &timestamp) {
+  std::ifstream stream(fname);
+  if (!stream) return false;
+  string line;
+  bool found = false;
+  while (getline(stream,line)) {
+    line.erase(remove(line.begin(),line.end(),'\\'),line.end());
+    auto eq = line.find('=');
+    if (eq == string::npos) continue;
+    auto key = line.substr(0,eq);
+    auto value = line.substr(eq+1);
+    if (key == "sequenceNumber") {
+      seqnum = stoull(value);
+      found = true;
+    } else if (key == "timestamp") {
+      timestamp = value;
+    }
+  }
+  return found;
+}
+
+// the standard layout splits the zero-padded sequence number into three directories: 004/567/890
+static string sequencePath(const string &dir, uint64_t seqnum) {
+  char buf[16];
+  snprintf(buf,sizeof(buf),"%03llu/%03llu/%03llu",
+    (unsigned long long)(seqnum / 1000000 % 1000),
+    (unsigned long long)(seqnum / 1000 % 1000),
+    (unsigned long long)(seqnum % 1000));
+  return dir + "/" + buf;
+}
+
+static int64_t secondsSince(const string &timestamp) {
+  if (timestamp.empty()) return -1;
+  return time(NULL) - osmium::Timestamp(timestamp).seconds_since_epoch();
+}
+
+// write to a temporary file and rename it, so readers never see a partial status.
+static void writeStatus(const string &fname, const string &seqnum, const string &timestamp, uint64_t latest, size_t num_diffs, const ApplyStats &stats) {
+  string temp = fname + ".tmp";
+  {
+    std::ofstream out(temp);
+    out << "seqnum=" << seqnum << "\n";
+    out << "timestamp=" << timestamp << "\n";
+    out << "latest_seqnum=" << latest << "\n";
+    out << "lag_seqnums=" << latest - stoull(seqnum) << "\n";
+    out << "lag_seconds=" << secondsSince(timestamp) << "\n";
+    out << "last_apply_diffs=" << num_diffs << "\n";
+    out << "last_apply_seconds=" << stats.seconds << "\n";
+    out << "last_apply_write_seconds=" << stats.write_seconds << "\n";
+    out << "last_apply_pages_dirtied=" << stats.pages_dirtied << "\n";
+    out << "updated_at=" << osmium::Timestamp(time(NULL)).to_iso() << "\n";
+  }
+  rename(temp.c_str(),fname.c_str());
+}
+
+void cmdUpdated(int argc, char* argv[]) {
+  cxxopts::Options cmdoptions("Updated", "Apply diffs from a replication directory as they arrive.");
+  cmdoptions.add_options()
+    ("v,verbose", "Verbose output")
+    ("cmd", "Command to run", cxxopts::value<string>())
+    ("osmx", ".osmx to update", cxxopts::value<string>())
+    ("dir", "Replication directory", cxxopts::value<string>())
+    ("status", "Status file", cxxopts::value<string>())
+    ("interval", "Milliseconds between polls of state.txt", cxxopts::value<int>()->default_value("1000"))
+    ("batchSize", "Maximum diffs per transaction when catching up", cxxopts::value<int>()->default_value("60"))
+    ("regionDiffs", "Directory for per-region diffs", cxxopts::value<string>())
+  ;
+
+  cmdoptions.parse_positional({"cmd","osmx","dir"});
+  auto result = cmdoptions.parse(argc, argv);
+
+  if (result.count("osmx") == 0 || result.count("dir") == 0) {
+    cout << "Usage: osmx updated OSMX_FILE REPLICATION_DIR [OPTIONS]" << endl;
+    cout << "Keeps OSMX_FILE open and applies new diffs from REPLICATION_DIR as state.txt advances." << endl;
+    cout << "REPLICATION_DIR uses the standard layout: state.txt and 000/123/456.osc.gz, 000/123/456.state.txt." << endl << endl;
+    cout << "EXAMPLE:" << endl;
+    cout << " osmx updated planet.osmx /data/replication/minute --status planet.status" << endl << endl;
+    cout << "OPTIONS:" << endl;
+    cout << " --v,--verbose: verbose output." << endl;
+    cout << " --status FILE: write sequence number, lag, apply time and pages dirtied to FILE after each update." << endl;
+    cout << " --interval MS: milliseconds between polls of state.txt, default 1000." << endl;
+    cout << " --batchSize N: maximum diffs applied in one transaction when catching up, default 60." << endl;
+    cout << " --regionDiffs DIR: write DIR/NAME/SEQNUM.osc.gz for each region registered with osmx regions." << endl;
     exit(1);
   }
 
   string osmx = result["osmx"].as<string>();
-  string osc = result["osc"].as<string>();
+  string dir = result["dir"].as<string>();
   bool verbose = result.count("verbose") > 0;
-  auto startTime = std::chrono::high_resolution_clock::now();
+  UpdateOptions options;
+  options.verbose = verbose;
+  options.commit = true;
+  if (result.count("regionDiffs")) options.region_dir = result["regionDiffs"].as<string>();
+  auto interval = std::chrono::milliseconds(result["interval"].as<int>());
+  uint64_t batch_size = max(1,result["batchSize"].as<int>());
+
+  signal(SIGINT,requestStop);
+  signal(SIGTERM,requestStop);
 
   MDB_env* env = db::createEnv(osmx,true);
-  MDB_txn* txn;
-  CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
 
-  string old_seqnum = "UNKNOWN";
-  auto new_seqnum = result["seqnum"].as<string>();
-  auto new_timestamp = result["timestamp"].as<string>();
-  db::Metadata metadata(txn);
-  if (verbose) cout << "Timestamp: " << metadata.get("osmosis_replication_timestamp") << endl;
-  old_seqnum = metadata.get("osmosis_replication_sequence_number");
+  string current_str;
+  {
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    db::Metadata metadata(txn);
+    current_str = metadata.get("osmosis_replication_sequence_number");
+    mdb_txn_abort(txn);
+  }
+  if (current_str.empty()) {
+    cout << osmx << " has no replication sequence number; apply one diff with osmx update first." << endl;
+    exit(1);
+  }
+  uint64_t current = stoull(current_str);
+  cout << "Watching " << dir << " from sequence number " << current << endl;
 
-  if (verbose) cout << "Starting update from " << old_seqnum << " to " << new_seqnum << endl;
-  const osmium::io::File input_file{osc};
+  while (!stopRequested) {
+    uint64_t latest = 0;
+    string latest_timestamp;
+    if (!readState(dir + "/state.txt",latest,latest_timestamp) || latest <= current) {
+      std::this_thread::sleep_for(interval);
+      continue;
+    }
 
-  osmium::io::Reader reader{input_file, osmium::osm_entity_bits::object};
-  DataUpdate data_update(txn);
-  osmium::apply(reader, data_update);
-  
-  auto duration = (std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - startTime ).count()) / 1000.0;
+    vector<DiffFile> diffs;
+    for (uint64_t seqnum = current + 1; seqnum <= latest && diffs.size() < batch_size; seqnum++) {
+      auto path = sequencePath(dir,seqnum);
+      uint64_t ignored;
+      string timestamp;
+      if (!readState(path + ".state.txt",ignored,timestamp)) {
+        if (seqnum != latest) break;
+        timestamp = latest_timestamp;
+      }
+      std::ifstream osc(path + ".osc.gz");
+      if (!osc) break;
+      diffs.push_back(DiffFile{path + ".osc.gz",to_string(seqnum),timestamp});
+    }
+    if (diffs.empty()) {
+      // state.txt was written before the diff itself.
+      std::this_thread::sleep_for(interval);
+      continue;
+    }
 
-  if (result.count("commit") > 0) {
-    {
-      metadata.put("osmosis_replication_sequence_number",new_seqnum);
-      metadata.put("osmosis_replication_timestamp",new_timestamp);
+    auto stats = applyDiffs(env,diffs,options);
+    mdb_env_sync(env,true);
+    current = stoull(diffs.back().seqnum);
+    if (verbose) cout << "Dirtied " << stats.pages_dirtied << " pages, " << latest - current << " diffs behind." << endl;
+    if (result.count("status")) {
+      writeStatus(result["status"].as<string>(),diffs.back().seqnum,diffs.back().timestamp,latest,diffs.size(),stats);
     }
-    CHECK_LMDB(mdb_txn_commit(txn));
-    cout << "Committed: ";
-  } else {
-    mdb_txn_abort(txn);
-    cout << "Aborted: ";
   }
-  cout << old_seqnum << " -> " << new_seqnum << " in " << duration << " seconds." << endl;
-  mdb_env_sync(env,true);
+
+  cout << "Stopped at sequence number " << current << endl;
   mdb_env_close(env);
 }
-
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "catch2/catch_test_macros.hpp"
+#include "osmx/cmd.h"
+
+// An .osmx expanded from OSM XML, with extra expand options. Commands run in a child process,
+// since they leave their environment open, and LMDB files must not be opened twice in one process.
+struct TempOsmx {
+  TempOsmx(const std::string &osm_xml, std::vector<std::string> options = {}) {
+    xml = tempFile(osm_xml,".osm");
+    char osmx_name[] = "/tmp/osmx_test_XXXXXX";
+    close(mkstemp(osmx_name));
+    path = osmx_name;
+
+    std::vector<std::string> args = {"osmx","expand",xml,path};
+    args.insert(args.end(),options.begin(),options.end());
+    run(cmdExpand,args);
+  }
+
+  ~TempOsmx() {
+    for (auto const &file : files) unlink(file.c_str());
+    unlink(path.c_str());
+    unlink((path + "-lock").c_str());
+  }
+
+  // apply and commit an OsmChange with osmx update.
+  void update(const std::string &osc_xml, const std::string &seqnum, std::vector<std::string> options = {}) {
+    std::vector<std::string> args = {"osmx","update",path,tempFile(osc_xml,".osc"),seqnum,"2020-01-02T00:00:00Z","--commit"};
+    args.insert(args.end(),options.begin(),options.end());
+    run(cmdUpdate,args);
+  }
+
+  // a file holding contents, removed with the database.
+  std::string tempFile(const std::string &contents, const std::string &suffix) {
+    std::string name = "/tmp/osmx_test_XXXXXX" + suffix;
+    close(mkstemps(&name[0],suffix.size()));
+    std::ofstream(name) << contents;
+    files.push_back(name);
+    return name;
+  }
+
+  static void run(void (*cmd)(int, char **), std::vector<std::string> args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::vector<char *> argv;
+      for (auto &arg : args) argv.push_back(&arg[0]);
+      cmd(argv.size(),argv.data());
+      _exit(0);
+    }
+    int status;
+    waitpid(pid,&status,0);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+  }
+
+  std::string xml;
+  std::string path;
+  std::vector<std::string> files;
+};
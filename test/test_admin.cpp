@@ -0,0 +1,90 @@
+#include <string>
+#include <vector>
+#include "catch2/catch_test_macros.hpp"
+#include "osmx/admin.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+// a country from 0 to 2 degrees, with a region from 0.5 to 1.5 whose ring is split across two ways.
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.5" lon="0.5"/>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.5" lon="1.5"/>
+  <node id="3" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.5" lon="1.5"/>
+  <node id="4" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.5" lon="0.5"/>
+  <node id="11" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.0"/>
+  <node id="12" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="2.0"/>
+  <node id="13" version="1" timestamp="2020-01-01T00:00:00Z" lat="2.0" lon="2.0"/>
+  <node id="14" version="1" timestamp="2020-01-01T00:00:00Z" lat="2.0" lon="0.0"/>
+  <way id="100" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="1"/>
+    <nd ref="2"/>
+    <nd ref="3"/>
+  </way>
+  <way id="101" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="3"/>
+    <nd ref="4"/>
+    <nd ref="1"/>
+  </way>
+  <way id="200" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="11"/>
+    <nd ref="12"/>
+    <nd ref="13"/>
+    <nd ref="14"/>
+    <nd ref="11"/>
+  </way>
+  <relation id="1000" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="way" ref="100" role="outer"/>
+    <member type="way" ref="101" role="outer"/>
+    <tag k="type" v="boundary"/>
+    <tag k="boundary" v="administrative"/>
+    <tag k="admin_level" v="4"/>
+  </relation>
+  <relation id="2000" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="way" ref="200" role="outer"/>
+    <tag k="type" v="boundary"/>
+    <tag k="boundary" v="administrative"/>
+    <tag k="admin_level" v="2"/>
+  </relation>
+</osm>
+)";
+
+// moves the region's corner at 1.5,1.5 inwards, which only changes way nodes.
+static const char *OSC_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <modify>
+    <node id="3" version="2" timestamp="2020-01-02T00:00:00Z" lat="1.3" lon="1.3"/>
+  </modify>
+</osmChange>
+)";
+
+static vector<pair<int,uint64_t>> lookup(const string &path, double lat, double lon) {
+  MDB_env *env = db::createEnv(path);
+  MDB_txn *txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  vector<pair<int,uint64_t>> result;
+  {
+    AdminIndex admin(txn);
+    REQUIRE(admin.exists());
+    for (auto const &area : admin.lookup(S2LatLng::FromDegrees(lat,lon))) result.emplace_back(area.admin_level,area.relation_id);
+  }
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+  return result;
+}
+
+TEST_CASE("admin boundaries") {
+  TempOsmx osmx(OSM_XML);
+  TempOsmx::run(cmdAdmin,{"osmx","admin",osmx.path,"build"});
+
+  REQUIRE(lookup(osmx.path,1.0,1.0) == vector<pair<int,uint64_t>>{{2,2000},{4,1000}});
+  REQUIRE(lookup(osmx.path,1.4,1.4) == vector<pair<int,uint64_t>>{{2,2000},{4,1000}});
+  REQUIRE(lookup(osmx.path,0.2,0.2) == vector<pair<int,uint64_t>>{{2,2000}});
+  REQUIRE(lookup(osmx.path,3.0,3.0).empty());
+
+  osmx.update(OSC_XML,"2");
+  REQUIRE(lookup(osmx.path,1.4,1.4) == vector<pair<int,uint64_t>>{{2,2000}});
+  REQUIRE(lookup(osmx.path,1.0,1.0) == vector<pair<int,uint64_t>>{{2,2000},{4,1000}});
+}
@@ -0,0 +1,83 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "catch2/catch_test_macros.hpp"
+#include "temp_osmx.h"
+
+using namespace std;
+
+// relation 21 contains relation 20, which contains way 10.
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="1.0"/>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="1.1"/>
+  <node id="3" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="1.2"/>
+  <way id="10" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="1"/>
+    <nd ref="2"/>
+  </way>
+  <relation id="20" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="way" ref="10" role=""/>
+  </relation>
+  <relation id="21" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="relation" ref="20" role=""/>
+  </relation>
+</osm>
+)";
+
+static const char *OSC_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <create>
+    <node id="4" version="1" timestamp="2020-01-02T00:00:00Z" lat="2.0" lon="2.0"/>
+  </create>
+  <modify>
+    <node id="1" version="2" timestamp="2020-01-02T00:00:00Z" lat="1.5" lon="1.0"/>
+  </modify>
+  <delete>
+    <node id="3" version="2" timestamp="2020-01-02T00:00:00Z"/>
+  </delete>
+</osmChange>
+)";
+
+// each action as its type and the first element in it, like "modify node/1".
+static vector<string> actions(const string &adiff) {
+  vector<string> result;
+  std::istringstream lines(adiff);
+  string line, action;
+  while (getline(lines,line)) {
+    size_t pos = line.find("<action type=\"");
+    if (pos != string::npos) {
+      action = line.substr(pos + 14,line.find('"',pos + 14) - pos - 14);
+      continue;
+    }
+    if (action.empty()) continue;
+    for (string type : {"node","way","relation"}) {
+      pos = line.find("<" + type + " id=\"");
+      if (pos == string::npos) continue;
+      size_t start = pos + type.size() + 6;
+      result.push_back(action + " " + type + "/" + line.substr(start,line.find('"',start) - start));
+      action.clear();
+    }
+  }
+  return result;
+}
+
+TEST_CASE("augmented diff") {
+  TempOsmx osmx(OSM_XML);
+  string output = osmx.path + ".adiff";
+  TempOsmx::run(cmdAugmentedDiff,{"osmx","augmented-diff",osmx.path,osmx.tempFile(OSC_XML,".osc"),output});
+
+  std::ifstream stream(output);
+  std::stringstream buffer;
+  buffer << stream.rdbuf();
+  string adiff = buffer.str();
+  unlink(output.c_str());
+
+  // way 10 moved with node 1, and so did the relations containing it, directly or not.
+  REQUIRE(actions(adiff) == vector<string>{
+    "modify node/1","delete node/3","create node/4","modify way/10","modify relation/20","modify relation/21"});
+  REQUIRE(adiff.find("lat=\"1.0000000\" lon=\"1.0000000\"") != string::npos);
+  REQUIRE(adiff.find("lat=\"1.5000000\" lon=\"1.0000000\"") != string::npos);
+}
@@ -0,0 +1,102 @@
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "catch2/catch_test_macros.hpp"
+#include "osmx/storage.h"
+#include "osmx/util.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+// node 1 and relation 20's way 10 reach into the region; way 11 is entirely outside it.
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="1.0">
+    <tag k="name" v="Inside"/>
+  </node>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="2.0"/>
+  <node id="3" version="1" timestamp="2020-01-01T00:00:00Z" lat="3.0" lon="3.0"/>
+  <node id="4" version="1" timestamp="2020-01-01T00:00:00Z" lat="3.0" lon="3.1"/>
+  <way id="10" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="1"/>
+    <nd ref="2"/>
+  </way>
+  <way id="11" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="3"/>
+    <nd ref="4"/>
+  </way>
+  <relation id="20" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="way" ref="10" role=""/>
+    <tag k="type" v="route"/>
+  </relation>
+</osm>
+)";
+
+static const char *OSC_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <modify>
+    <node id="1" version="2" timestamp="2020-01-02T00:00:00Z" lat="1.0" lon="1.001"/>
+  </modify>
+</osmChange>
+)";
+
+static roaring::Roaring64Map reverse(MDB_txn *txn, const char *table, uint64_t id) {
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, table, MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn, dbi, &cursor));
+  roaring::Roaring64Map set;
+  db::traverseReverse(cursor,id,set);
+  mdb_cursor_close(cursor);
+  return set;
+}
+
+TEST_CASE("extract to osmx") {
+  TempOsmx osmx(OSM_XML);
+  string output = osmx.path + ".extract.osmx";
+  TempOsmx::run(cmdExtract,{"osmx","extract",osmx.path,output,"--bbox","0.9,0.9,1.1,1.1"});
+
+  {
+    MDB_env *env = db::createEnv(output);
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    REQUIRE(db::cellLevel(txn) == CELL_INDEX_LEVEL);
+
+    // ways are complete, so node 2 outside the region comes along with way 10.
+    db::Locations locations(txn);
+    REQUIRE(locations.get(1).coords == osmium::Location(1.0,1.0));
+    REQUIRE(locations.get(2).coords == osmium::Location(2.0,1.0));
+    REQUIRE(locations.get(3).is_undefined());
+    db::Elements nodes(txn,"nodes");
+    REQUIRE(nodes.exists(1));
+    db::Elements ways(txn,"ways");
+    REQUIRE(ways.exists(10));
+    REQUIRE_FALSE(ways.exists(11));
+    db::Elements relations(txn,"relations");
+    REQUIRE(relations.exists(20));
+
+    REQUIRE(reverse(txn,"node_way",2).contains((uint64_t)10));
+    REQUIRE(reverse(txn,"way_relation",10).contains((uint64_t)20));
+    REQUIRE(reverse(txn,"node_way",3).isEmpty());
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+  }
+
+  // the extract is a database of its own, which updates keep current.
+  {
+    std::vector<std::string> args = {"osmx","update",output,osmx.tempFile(OSC_XML,".osc"),"2","2020-01-02T00:00:00Z","--commit"};
+    TempOsmx::run(cmdUpdate,args);
+    MDB_env *env = db::createEnv(output);
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    db::Locations locations(txn);
+    REQUIRE(locations.get(1).coords == osmium::Location(1.001,1.0));
+    REQUIRE(locations.get(1).version == 2);
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+  }
+
+  unlink(output.c_str());
+  unlink((output + "-lock").c_str());
+}
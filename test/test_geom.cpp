@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "catch2/catch_test_macros.hpp"
+#include "osmx/geom.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+// a bench, a linestring, a closed way, and a multipolygon with the closed way as outer ring and a hole.
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" lat="2.0" lon="1.0">
+    <tag k="amenity" v="bench"/>
+  </node>
+  <node id="2" version="1" lat="0.0" lon="0.0"/>
+  <node id="3" version="1" lat="0.0" lon="1.0"/>
+  <node id="4" version="1" lat="1.0" lon="1.0"/>
+  <node id="5" version="1" lat="1.0" lon="0.0"/>
+  <node id="6" version="1" lat="0.25" lon="0.25"/>
+  <node id="7" version="1" lat="0.25" lon="0.75"/>
+  <node id="8" version="1" lat="0.75" lon="0.75"/>
+  <node id="9" version="1" lat="0.75" lon="0.25"/>
+  <way id="10" version="1">
+    <nd ref="2"/>
+    <nd ref="3"/>
+    <nd ref="4"/>
+  </way>
+  <way id="20" version="1">
+    <nd ref="2"/>
+    <nd ref="3"/>
+    <nd ref="4"/>
+    <nd ref="5"/>
+    <nd ref="2"/>
+  </way>
+  <way id="21" version="1">
+    <nd ref="6"/>
+    <nd ref="7"/>
+    <nd ref="8"/>
+    <nd ref="9"/>
+    <nd ref="6"/>
+  </way>
+  <relation id="30" version="1">
+    <member type="way" ref="20" role="outer"/>
+    <member type="way" ref="21" role="inner"/>
+    <tag k="type" v="multipolygon"/>
+  </relation>
+</osm>
+)";
+
+TEST_CASE("geometry builder") {
+  TempOsmx osmx(OSM_XML);
+  MDB_env *env = db::createEnv(osmx.path);
+  MDB_txn *txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+
+  {
+    geom::Builder builder(txn,geom::Format::wkt);
+    string out;
+
+    SECTION("points and linestrings") {
+      REQUIRE(builder.point(1,out));
+      REQUIRE(out == "POINT(1 2)");
+      out.clear();
+      REQUIRE(builder.linestring(10,out));
+      REQUIRE(out == "LINESTRING(0 0,1 0,1 1)");
+      REQUIRE_FALSE(builder.point(99,out));
+      REQUIRE_FALSE(builder.linestring(99,out));
+    }
+
+    SECTION("areas") {
+      REQUIRE(builder.area(osmium::item_type::way,20,out));
+      REQUIRE(out.compare(0,15,"MULTIPOLYGON(((") == 0);
+      REQUIRE(out.find("),(") == string::npos);
+      out.clear();
+      REQUIRE(builder.area(osmium::item_type::relation,30,out));
+      REQUIRE(out.compare(0,15,"MULTIPOLYGON(((") == 0);
+      REQUIRE(out.find("),(") != string::npos);
+      REQUIRE(out.find("0.25 0.25") != string::npos);
+      // an open way has no area.
+      REQUIRE_FALSE(builder.area(osmium::item_type::way,10,out));
+    }
+
+    SECTION("region") {
+      vector<pair<osmium::item_type,uint64_t>> elements;
+      builder.region(S2CellUnion(vector<S2CellId>{S2CellId::FromFace(0)}),[&](osmium::item_type type, uint64_t id, const string &geometry) {
+        elements.emplace_back(type,id);
+        if (id == 10 && type == osmium::item_type::way) REQUIRE(geometry == "LINESTRING(0 0,1 0,1 1)");
+      });
+      sort(elements.begin(),elements.end());
+      // only tagged nodes are passed, and every way once.
+      REQUIRE(elements == vector<pair<osmium::item_type,uint64_t>>{
+        {osmium::item_type::node,1},{osmium::item_type::way,10},{osmium::item_type::way,20},{osmium::item_type::way,21}});
+    }
+  }
+
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+}
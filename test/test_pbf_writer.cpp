@@ -0,0 +1,197 @@
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+#include "catch2/catch_test_macros.hpp"
+#include "capnp/message.h"
+#include "osmium/io/pbf_input.hpp"
+#include "osmium/io/reader.hpp"
+#include "osmium/osm/node.hpp"
+#include "osmium/osm/relation.hpp"
+#include "osmium/osm/way.hpp"
+#include "osmx/pbf_writer.h"
+
+using namespace std;
+using namespace osmx;
+
+// more nodes than fit in one block, so IDs, coordinates and strings are encoded across blocks.
+static const uint64_t NUM_NODES = 10000;
+static const uint64_t BIG_WAY_ID = 1ULL << 40;
+
+static void setMetadata(Metadata::Builder metadata, uint32_t version, uint64_t id) {
+  metadata.setVersion(version);
+  metadata.setTimestamp(1600000000 + id);
+  metadata.setChangeset(100 + id);
+  metadata.setUid(7);
+  metadata.setUser("mapper");
+}
+
+static void setTags(capnp::List<capnp::Text>::Builder tags, const map<string,string> &values) {
+  int i = 0;
+  for (auto const &tag : values) {
+    tags.set(i++,tag.first);
+    tags.set(i++,tag.second);
+  }
+}
+
+static osmium::Location nodeLocation(uint64_t id) {
+  return osmium::Location(-5.0 + id * 0.001,-2.0 + id * 0.0007);
+}
+
+static map<string,string> tagMap(const osmium::TagList &tags) {
+  map<string,string> result;
+  for (auto const &tag : tags) result[tag.key()] = tag.value();
+  return result;
+}
+
+static void writeFile(const string &path, bool includeUserData) {
+  PbfHeader header;
+  header.has_box = true;
+  header.min_lon = -5;
+  header.min_lat = -2;
+  header.max_lon = 5;
+  header.max_lat = 5;
+  header.replication_timestamp = "2020-01-01T00:00:00Z";
+  header.replication_sequence_number = "123";
+  PbfWriter writer(path,header,includeUserData);
+
+  for (uint64_t id = 1; id <= NUM_NODES; id++) {
+    db::Location location{nodeLocation(id),(int32_t)(id % 5 + 1)};
+    if (id % 3 != 0) {
+      writer.node(id,location);
+      continue;
+    }
+    capnp::MallocMessageBuilder message;
+    auto node = message.initRoot<Node>();
+    setTags(node.initTags(2),{{"name","n" + to_string(id)}});
+    setMetadata(node.initMetadata(),location.version,id);
+    writer.node(id,location,node.asReader());
+  }
+
+  {
+    capnp::MallocMessageBuilder message;
+    auto way = message.initRoot<Way>();
+    auto nodes = way.initNodes(4);
+    nodes.set(0,1);
+    nodes.set(1,2);
+    nodes.set(2,3);
+    nodes.set(3,1);
+    setTags(way.initTags(4),{{"highway","residential"},{"name","Main Street"}});
+    setMetadata(way.initMetadata(),2,5);
+    writer.way(5,way.asReader());
+  }
+  {
+    capnp::MallocMessageBuilder message;
+    auto way = message.initRoot<Way>();
+    auto nodes = way.initNodes(3);
+    nodes.set(0,NUM_NODES);
+    nodes.set(1,5);
+    nodes.set(2,NUM_NODES - 1);
+    setMetadata(way.initMetadata(),1,BIG_WAY_ID);
+    writer.way(BIG_WAY_ID,way.asReader());
+  }
+
+  {
+    capnp::MallocMessageBuilder message;
+    auto relation = message.initRoot<Relation>();
+    auto members = relation.initMembers(3);
+    members[0].setType(RelationMember::Type::NODE);
+    members[0].setRef(1);
+    members[0].setRole("stop");
+    members[1].setType(RelationMember::Type::WAY);
+    members[1].setRef(5);
+    members[1].setRole("");
+    members[2].setType(RelationMember::Type::RELATION);
+    members[2].setRef(3);
+    members[2].setRole("self");
+    setTags(relation.initTags(2),{{"type","route"}});
+    setMetadata(relation.initMetadata(),3,3);
+    writer.relation(3,relation.asReader());
+  }
+  writer.close();
+}
+
+static void checkMetadata(const osmium::OSMObject &object, uint32_t version, uint64_t id, bool includeUserData) {
+  REQUIRE(object.version() == version);
+  REQUIRE(object.timestamp().seconds_since_epoch() == 1600000000 + id);
+  if (includeUserData) {
+    REQUIRE(object.changeset() == 100 + id);
+    REQUIRE(object.uid() == 7);
+    REQUIRE(string(object.user()) == "mapper");
+  } else {
+    REQUIRE(object.changeset() == 0);
+    REQUIRE(object.uid() == 0);
+    REQUIRE(string(object.user()).empty());
+  }
+}
+
+TEST_CASE("pbf writer round trip") {
+  bool includeUserData = false;
+  SECTION("with user data") { includeUserData = true; }
+  SECTION("without user data") { includeUserData = false; }
+
+  char name[] = "/tmp/osmx_test_XXXXXX";
+  int fd = mkstemp(name);
+  close(fd);
+  string path = name;
+  writeFile(path,includeUserData);
+
+  osmium::io::Reader reader{osmium::io::File{path,"pbf"}};
+  auto header = reader.header();
+  REQUIRE(header.get("osmosis_replication_sequence_number") == "123");
+  REQUIRE(header.get("osmosis_replication_timestamp") == "2020-01-01T00:00:00Z");
+  REQUIRE(header.box().bottom_left() == osmium::Location(-5.0,-2.0));
+  REQUIRE(header.box().top_right() == osmium::Location(5.0,5.0));
+
+  uint64_t next_node = 1;
+  vector<uint64_t> way_ids;
+  vector<uint64_t> relation_ids;
+  while (osmium::memory::Buffer buffer = reader.read()) {
+    for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+      uint64_t id = it->id();
+      if (it->type() == osmium::item_type::node) {
+        auto const &node = static_cast<const osmium::Node &>(*it);
+        REQUIRE(id == next_node++);
+        REQUIRE(node.location() == nodeLocation(id));
+        if (id % 3 != 0) {
+          REQUIRE(node.version() == id % 5 + 1);
+          REQUIRE(node.tags().empty());
+        } else {
+          checkMetadata(node,id % 5 + 1,id,includeUserData);
+          REQUIRE(tagMap(node.tags()) == map<string,string>{{"name","n" + to_string(id)}});
+        }
+      } else if (it->type() == osmium::item_type::way) {
+        auto const &way = static_cast<const osmium::Way &>(*it);
+        way_ids.push_back(id);
+        vector<uint64_t> refs;
+        for (auto const &node_ref : way.nodes()) refs.push_back(node_ref.ref());
+        if (id == 5) {
+          REQUIRE(refs == vector<uint64_t>{1,2,3,1});
+          REQUIRE(tagMap(way.tags()) == map<string,string>{{"highway","residential"},{"name","Main Street"}});
+          checkMetadata(way,2,5,includeUserData);
+        } else {
+          REQUIRE(refs == vector<uint64_t>{NUM_NODES,5,NUM_NODES - 1});
+          REQUIRE(way.tags().empty());
+          checkMetadata(way,1,BIG_WAY_ID,includeUserData);
+        }
+      } else if (it->type() == osmium::item_type::relation) {
+        auto const &relation = static_cast<const osmium::Relation &>(*it);
+        relation_ids.push_back(id);
+        vector<tuple<osmium::item_type,uint64_t,string>> members;
+        for (auto const &member : relation.members()) members.emplace_back(member.type(),member.ref(),member.role());
+        REQUIRE(members == vector<tuple<osmium::item_type,uint64_t,string>>{
+          {osmium::item_type::node,1,"stop"},{osmium::item_type::way,5,""},{osmium::item_type::relation,3,"self"}});
+        REQUIRE(tagMap(relation.tags()) == map<string,string>{{"type","route"}});
+        checkMetadata(relation,3,3,includeUserData);
+      }
+    }
+  }
+  reader.close();
+  unlink(path.c_str());
+
+  REQUIRE(next_node == NUM_NODES + 1);
+  REQUIRE(way_ids == vector<uint64_t>{5,BIG_WAY_ID});
+  REQUIRE(relation_ids == vector<uint64_t>{3});
+}
@@ -0,0 +1,79 @@
+#include <string>
+#include <vector>
+#include "catch2/catch_test_macros.hpp"
+#include "osmx/proximity.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+// a footway whose only segment passes about 11 meters from the origin, between nodes 11 km away,
+// and benches 556 meters and 2.2 km away.
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" lat="0.005" lon="0.0">
+    <tag k="amenity" v="bench"/>
+  </node>
+  <node id="2" version="1" lat="0.0001" lon="-0.1"/>
+  <node id="3" version="1" lat="0.0001" lon="0.1"/>
+  <node id="4" version="1" lat="0.02" lon="0.0">
+    <tag k="amenity" v="bench"/>
+  </node>
+  <way id="10" version="1">
+    <nd ref="2"/>
+    <nd ref="3"/>
+    <tag k="highway" v="footway"/>
+  </way>
+</osm>
+)";
+
+static vector<pair<osmium::item_type,uint64_t>> elements(const vector<Neighbor> &neighbors) {
+  vector<pair<osmium::item_type,uint64_t>> result;
+  for (auto const &neighbor : neighbors) result.emplace_back(neighbor.type,neighbor.id);
+  return result;
+}
+
+static const auto WAY_10 = make_pair(osmium::item_type::way,(uint64_t)10);
+static const auto NODE_1 = make_pair(osmium::item_type::node,(uint64_t)1);
+static const auto NODE_4 = make_pair(osmium::item_type::node,(uint64_t)4);
+
+TEST_CASE("proximity search") {
+  S2LatLng origin = S2LatLng::FromDegrees(0,0);
+
+  SECTION("a way closer than its nodes comes first") {
+    TempOsmx osmx(OSM_XML,{"--cellSegments"});
+    MDB_env *env = db::createEnv(osmx.path);
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    {
+      ProximitySearch search(txn);
+      auto nearest = search.nearest(origin,1);
+      REQUIRE(elements(nearest) == vector<pair<osmium::item_type,uint64_t>>{WAY_10});
+      REQUIRE(nearest[0].distance > 10);
+      REQUIRE(nearest[0].distance < 12);
+      REQUIRE(elements(search.nearest(origin,2)) == vector<pair<osmium::item_type,uint64_t>>{WAY_10,NODE_1});
+      REQUIRE(elements(search.within(origin,1000)) == vector<pair<osmium::item_type,uint64_t>>{WAY_10,NODE_1});
+      REQUIRE(elements(search.within(origin,5000)) == vector<pair<osmium::item_type,uint64_t>>{WAY_10,NODE_1,NODE_4});
+    }
+    {
+      TagFilter filter("amenity=bench");
+      ProximitySearch search(txn,&filter);
+      REQUIRE(elements(search.nearest(origin,1)) == vector<pair<osmium::item_type,uint64_t>>{NODE_1});
+    }
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+  }
+
+  SECTION("without segment lengths only nodes are found") {
+    TempOsmx osmx(OSM_XML);
+    MDB_env *env = db::createEnv(osmx.path);
+    MDB_txn *txn;
+    CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+    {
+      ProximitySearch search(txn);
+      REQUIRE(elements(search.within(origin,5000)) == vector<pair<osmium::item_type,uint64_t>>{NODE_1,NODE_4});
+    }
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+  }
+}
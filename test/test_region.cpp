@@ -1,3 +1,4 @@
+#include <limits>
 #include "catch2/catch_test_macros.hpp"
 #include "s2/s2latlng.h"
 #include "osmx/region.h"
@@ -104,6 +105,157 @@ TEST_CASE("geojson polygon") {
         REQUIRE(bounds.lng_hi().degrees() >= 3.0);
     }
 
+    SECTION("overlapping multipolygon parts") {
+        string json = R"json({
+  "type": "MultiPolygon",
+  "coordinates": [
+    [[
+      [0.0,0.0],
+      [2.0,0.0],
+      [2.0,2.0],
+      [0.0,2.0],
+      [0.0,0.0]
+    ]],
+    [[
+      [1.0,1.0],
+      [3.0,1.0],
+      [3.0,3.0],
+      [1.0,3.0],
+      [1.0,1.0]
+    ]]
+  ]
+})json";
+        Region s{json,"geojson"};
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(0.5,0.5).ToPoint()));
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(1.5,1.5).ToPoint()));
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(2.5,2.5).ToPoint()));
+        REQUIRE(!s.Contains(S2LatLng::FromDegrees(0.5,2.5).ToPoint()));
+    }
+
+    SECTION("multipolygon part inside another part") {
+        string json = R"json({
+  "type": "MultiPolygon",
+  "coordinates": [
+    [[
+      [-2.0,-2.0],
+      [2.0,-2.0],
+      [2.0,2.0],
+      [-2.0,2.0],
+      [-2.0,-2.0]
+    ]],
+    [[
+      [-1.0,-1.0],
+      [1.0,-1.0],
+      [1.0,1.0],
+      [-1.0,1.0],
+      [-1.0,-1.0]
+    ]]
+  ]
+})json";
+        Region s{json,"geojson"};
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(0.0,0.0).ToPoint()));
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(1.5,1.5).ToPoint()));
+        REQUIRE(!s.Contains(S2LatLng::FromDegrees(3.0,3.0).ToPoint()));
+        S2RegionCoverer::Options options;
+        options.set_max_cells(64);
+        options.set_max_level(16);
+        S2RegionCoverer coverer(options);
+        REQUIRE(s.GetCovering(coverer).Contains(S2LatLng::FromDegrees(0.0,0.0).ToPoint()));
+    }
+
+    SECTION("feature collection with a feature inside another") {
+        string json = R"json({
+  "type": "FeatureCollection",
+  "features": [
+    {"type": "Feature", "geometry": {"type": "Polygon", "coordinates": [[[-2.0,-2.0],[2.0,-2.0],[2.0,2.0],[-2.0,2.0],[-2.0,-2.0]]]}},
+    {"type": "Feature", "geometry": {"type": "Polygon", "coordinates": [[[-1.0,-1.0],[1.0,-1.0],[1.0,1.0],[-1.0,1.0],[-1.0,-1.0]]]}}
+  ]
+})json";
+        Region s{json,"geojson"};
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(0.0,0.0).ToPoint()));
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(1.5,1.5).ToPoint()));
+    }
+
+    SECTION("geometry collection") {
+        string json = R"json({
+  "type": "GeometryCollection",
+  "geometries": [
+    {
+      "type": "Polygon",
+      "coordinates": [[[0.0,0.0],[1.0,0.0],[1.0,1.0],[0.0,1.0],[0.0,0.0]]]
+    },
+    {
+      "type": "Polygon",
+      "coordinates": [[[2.0,2.0],[3.0,2.0],[3.0,3.0],[2.0,3.0],[2.0,2.0]]]
+    }
+  ]
+})json";
+        Region s{json,"geojson"};
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(0.5,0.5).ToPoint()));
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(2.5,2.5).ToPoint()));
+        REQUIRE(!s.Contains(S2LatLng::FromDegrees(1.5,1.5).ToPoint()));
+    }
+
+    SECTION("covering of many parts") {
+        string json = R"json({"type": "MultiPolygon", "coordinates": [)json";
+        for (int i = 0; i < 100; i++) {
+            double x = i * 0.1;
+            if (i > 0) json += ",";
+            json += "[[[" + to_string(x) + ",0.0],[" + to_string(x + 0.05) + ",0.0],[" + to_string(x + 0.05) + ",0.05],[" + to_string(x) + ",0.05],[" + to_string(x) + ",0.0]]]";
+        }
+        json += "]}";
+        Region s{json,"geojson"};
+        S2RegionCoverer::Options options;
+        options.set_max_cells(1024);
+        options.set_max_level(16);
+        S2RegionCoverer coverer(options);
+        S2CellUnion covering = s.GetCovering(coverer);
+        REQUIRE(covering.Contains(S2LatLng::FromDegrees(0.025,0.025).ToPoint()));
+        REQUIRE(covering.Contains(S2LatLng::FromDegrees(0.025,9.925).ToPoint()));
+        REQUIRE(s.Contains(S2LatLng::FromDegrees(0.025,5.025).ToPoint()));
+        REQUIRE(!s.Contains(S2LatLng::FromDegrees(0.025,5.075).ToPoint()));
+    }
+
+    SECTION("parallel covering agrees with serial covering") {
+        string json = R"json({"type": "MultiPolygon", "coordinates": [)json";
+        for (int i = 0; i < 100; i++) {
+            double x = i * 0.1;
+            if (i > 0) json += ",";
+            json += "[[[" + to_string(x) + ",0.0],[" + to_string(x + 0.05) + ",0.0],[" + to_string(x + 0.05) + ",0.05],[" + to_string(x) + ",0.05],[" + to_string(x) + ",0.0]]]";
+        }
+        json += "]}";
+        Region s{json,"geojson"};
+        S2RegionCoverer::Options options;
+        options.set_max_cells(1024);
+        options.set_max_level(16);
+        S2RegionCoverer coverer(options);
+        // a threshold of 0 vertices takes the parallel path on any machine with more than one thread.
+        S2CellUnion serial = s.GetCovering(coverer,std::numeric_limits<int>::max());
+        S2CellUnion parallel = s.GetCovering(coverer,0);
+        for (int i = 0; i < 100; i++) {
+            for (double dx : {0.001,0.025,0.049}) {
+                for (double dy : {0.001,0.025,0.049}) {
+                    auto point = S2LatLng::FromDegrees(dy,i * 0.1 + dx).ToPoint();
+                    REQUIRE(s.Contains(point));
+                    REQUIRE(serial.Contains(point));
+                    REQUIRE(parallel.Contains(point));
+                }
+            }
+        }
+        for (auto const &cell_id : parallel.cell_ids()) {
+            REQUIRE(serial.Intersects(cell_id));
+        }
+        auto outside = S2LatLng::FromDegrees(5.0,5.0).ToPoint();
+        REQUIRE(!serial.Contains(outside));
+        REQUIRE(!parallel.Contains(outside));
+        REQUIRE(parallel.num_cells() <= 1024);
+
+        // a small budget is still kept when it is divided among the threads.
+        options.set_max_cells(16);
+        S2RegionCoverer small_coverer(options);
+        REQUIRE(s.GetCovering(small_coverer,0).num_cells() <= 16);
+    }
+
     SECTION("bounds beyond antimeridian") {
         string json = R"json({
   "type": "Polygon",
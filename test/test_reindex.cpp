@@ -0,0 +1,61 @@
+#include <string>
+#include <vector>
+#include "catch2/catch_test_macros.hpp"
+#include "s2/s2latlng.h"
+#include "osmx/storage.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="1.0"/>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" lat="-30.0" lon="150.0"/>
+</osm>
+)";
+
+static const char *OSC_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <modify>
+    <node id="1" version="2" timestamp="2020-01-02T00:00:00Z" lat="10.0" lon="10.0"/>
+  </modify>
+</osmChange>
+)";
+
+// the cell_node entries as (cell, node), checking the database's cell level first.
+static vector<pair<S2CellId,uint64_t>> cellNodes(const string &path, int level) {
+  MDB_env *env = db::createEnv(path);
+  MDB_txn *txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  REQUIRE(db::cellLevel(txn) == level);
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn, dbi, &cursor));
+  vector<pair<S2CellId,uint64_t>> entries;
+  MDB_val key, data;
+  while (mdb_cursor_get(cursor,&key,&data,MDB_NEXT) == 0) {
+    entries.emplace_back(*(S2CellId *)key.mv_data,*(uint64_t *)data.mv_data);
+  }
+  mdb_cursor_close(cursor);
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+  return entries;
+}
+
+static S2CellId cell(double lat, double lon, int level) {
+  return S2CellId(S2LatLng::FromDegrees(lat,lon)).parent(level);
+}
+
+TEST_CASE("cell level") {
+  TempOsmx osmx(OSM_XML,{"--cellLevel","12"});
+  REQUIRE(cellNodes(osmx.path,12) == vector<pair<S2CellId,uint64_t>>{{cell(1,1,12),1},{cell(-30,150,12),2}});
+
+  TempOsmx::run(cmdReindex,{"osmx","reindex",osmx.path,"--cellLevel","14"});
+  REQUIRE(cellNodes(osmx.path,14) == vector<pair<S2CellId,uint64_t>>{{cell(1,1,14),1},{cell(-30,150,14),2}});
+
+  // updates index moved nodes at the stored level.
+  osmx.update(OSC_XML,"2");
+  REQUIRE(cellNodes(osmx.path,14) == vector<pair<S2CellId,uint64_t>>{{cell(10,10,14),1},{cell(-30,150,14),2}});
+}
@@ -0,0 +1,209 @@
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "catch2/catch_test_macros.hpp"
+#include "nlohmann/json.hpp"
+#include "osmx/serve.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" changeset="5" uid="7" user="mapper" lat="1.0" lon="2.0">
+    <tag k="name" v="Corner"/>
+  </node>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" changeset="5" uid="7" user="mapper" lat="1.001" lon="2.0"/>
+  <node id="3" version="1" timestamp="2020-01-01T00:00:00Z" changeset="5" uid="7" user="mapper" lat="1.001" lon="2.001"/>
+  <way id="10" version="2" timestamp="2020-01-02T00:00:00Z" changeset="6" uid="7" user="mapper">
+    <nd ref="1"/>
+    <nd ref="2"/>
+    <nd ref="3"/>
+    <tag k="highway" v="residential"/>
+  </way>
+</osm>
+)";
+
+// a blocking connection to the server that reads responses one at a time.
+struct Client {
+  Client(int port) {
+    fd = socket(AF_INET,SOCK_STREAM,0);
+    sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET,"127.0.0.1",&addr.sin_addr);
+    REQUIRE(connect(fd,(sockaddr *)&addr,sizeof(addr)) == 0);
+  }
+
+  ~Client() {
+    close(fd);
+  }
+
+  void send(const string &data) {
+    REQUIRE(::send(fd,data.data(),data.size(),0) == (ssize_t)data.size());
+  }
+
+  bool fill() {
+    char buf[4096];
+    ssize_t n = recv(fd,buf,sizeof(buf),0);
+    if (n <= 0) return false;
+    buffer.append(buf,n);
+    return true;
+  }
+
+  // the status and body of the next response with a Content-Length.
+  int response(string &body) {
+    size_t head_end;
+    while ((head_end = buffer.find("\r\n\r\n")) == string::npos) REQUIRE(fill());
+    string head = buffer.substr(0,head_end);
+    size_t length_pos = head.find("Content-Length: ");
+    REQUIRE(length_pos != string::npos);
+    size_t length = stoul(head.substr(length_pos + 16));
+    while (buffer.size() < head_end + 4 + length) REQUIRE(fill());
+    body = buffer.substr(head_end + 4,length);
+    buffer.erase(0,head_end + 4 + length);
+    return stoi(head.substr(9,3));
+  }
+
+  // everything until the server closes the connection.
+  string rest() {
+    while (fill()) { }
+    string result;
+    result.swap(buffer);
+    return result;
+  }
+
+  int fd;
+  string buffer;
+};
+
+// the server running on a thread, stopped when the test ends, even after a failed assertion.
+struct Running {
+  Running(Server &server) : server(server), thread([&server]() { server.run(); }) { }
+
+  ~Running() {
+    server.stop();
+    thread.join();
+  }
+
+  Server &server;
+  std::thread thread;
+};
+
+static string get(const string &target, bool close = false) {
+  return "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n" + (close ? "Connection: close\r\n" : "") + "\r\n";
+}
+
+TEST_CASE("serve") {
+  signal(SIGPIPE,SIG_IGN);
+  TempOsmx osmx(OSM_XML);
+  MDB_env *env = db::createEnv(osmx.path);
+  int port = 0;
+  int listen_fd = listenOn("127.0.0.1",port);
+  REQUIRE(port != 0);
+
+  {
+    Server server(env,listen_fd,2);
+    Running running(server);
+    string body;
+
+    SECTION("elements") {
+      Client client(port);
+      client.send(get("/node/1"));
+      REQUIRE(client.response(body) == 200);
+      auto node = nlohmann::json::parse(body);
+      REQUIRE(node["id"] == 1);
+      REQUIRE(node["tags"]["name"] == "Corner");
+      REQUIRE(node["lat"] == 1.0);
+
+      client.send(get("/way/10"));
+      REQUIRE(client.response(body) == 200);
+      auto way = nlohmann::json::parse(body);
+      REQUIRE(way["nodes"] == nlohmann::json::array({1,2,3}));
+      REQUIRE(way["tags"]["highway"] == "residential");
+      REQUIRE(way["version"] == 2);
+
+      client.send(get("/node/2,99"));
+      REQUIRE(client.response(body) == 200);
+      auto nodes = nlohmann::json::parse(body);
+      REQUIRE(nodes.size() == 2);
+      REQUIRE(nodes[0]["id"] == 2);
+      REQUIRE(nodes[1].is_null());
+
+      client.send(get("/way/99"));
+      REQUIRE(client.response(body) == 404);
+      client.send(get("/unknown"));
+      REQUIRE(client.response(body) == 404);
+      client.send("POST /node/1 HTTP/1.1\r\nContent-Length: 0\r\n\r\n");
+      REQUIRE(client.response(body) == 405);
+    }
+
+    SECTION("geometry") {
+      Client client(port);
+      client.send(get("/geometry/way/10?format=wkt"));
+      REQUIRE(client.response(body) == 200);
+      REQUIRE(body.compare(0,10,"LINESTRING") == 0);
+      client.send(get("/geometry/node/1"));
+      REQUIRE(client.response(body) == 200);
+      REQUIRE(nlohmann::json::parse(body)["type"] == "Point");
+      client.send(get("/geometry/way/10?format=svg"));
+      REQUIRE(client.response(body) == 400);
+    }
+
+    SECTION("pipelined requests are answered in order") {
+      Client client(port);
+      client.send(get("/node/1") + get("/way/10") + get("/node/99"));
+      REQUIRE(client.response(body) == 200);
+      REQUIRE(nlohmann::json::parse(body)["type"] == "node");
+      REQUIRE(client.response(body) == 200);
+      REQUIRE(nlohmann::json::parse(body)["type"] == "way");
+      REQUIRE(client.response(body) == 404);
+    }
+
+    SECTION("connection close") {
+      Client client(port);
+      client.send(get("/node/1",true));
+      string response = client.rest();
+      REQUIRE(response.compare(0,15,"HTTP/1.1 200 OK") == 0);
+      REQUIRE(response.find("Connection: close") != string::npos);
+    }
+
+    SECTION("malformed request") {
+      Client client(port);
+      client.send("GARBAGE\r\n\r\n");
+      REQUIRE(client.rest().compare(0,12,"HTTP/1.1 400") == 0);
+    }
+
+    SECTION("extract") {
+      Client client(port);
+      client.send(get("/extract?bbox=0.9,1.9,1.1,2.1",true));
+      string response = client.rest();
+      REQUIRE(response.compare(0,15,"HTTP/1.1 200 OK") == 0);
+      REQUIRE(response.find("Transfer-Encoding: chunked") != string::npos);
+      REQUIRE(response.find("\"id\":\"node/1\"") != string::npos);
+      REQUIRE(response.find("\"id\":\"way/10\"") != string::npos);
+      // untagged nodes are only part of way geometries.
+      REQUIRE(response.find("\"id\":\"node/2\"") == string::npos);
+      // the chunked body ends with an empty chunk.
+      REQUIRE(response.size() >= 5);
+      REQUIRE(response.compare(response.size() - 5,5,"0\r\n\r\n") == 0);
+    }
+
+    SECTION("extract without a region") {
+      Client client(port);
+      client.send(get("/extract"));
+      REQUIRE(client.response(body) == 400);
+    }
+  }
+  close(listen_fd);
+  mdb_env_close(env);
+}
@@ -0,0 +1,329 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include "catch2/catch_test_macros.hpp"
+#include "osmx/storage.h"
+
+using namespace std;
+using namespace osmx;
+
+// a writable database in a temporary file, with one write transaction that is aborted at the end.
+struct TempDb {
+  TempDb() {
+    char name[] = "/tmp/osmx_test_XXXXXX";
+    int fd = mkstemp(name);
+    close(fd);
+    path = name;
+    env = db::createEnv(path,true);
+    CHECK_LMDB(mdb_txn_begin(env, NULL, 0, &txn));
+  }
+
+  ~TempDb() {
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+    unlink(path.c_str());
+    unlink((path + "-lock").c_str());
+  }
+
+  size_t entries(const char *table) {
+    MDB_dbi dbi;
+    MDB_stat stat;
+    CHECK_LMDB(mdb_dbi_open(txn, table, 0, &dbi));
+    CHECK_LMDB(mdb_stat(txn, dbi, &stat));
+    return stat.ms_entries;
+  }
+
+  string path;
+  MDB_env *env;
+  MDB_txn *txn;
+};
+
+static roaring::Roaring64Map ids(std::initializer_list<uint64_t> list) {
+  roaring::Roaring64Map map;
+  for (auto id : list) map.add(id);
+  return map;
+}
+
+static S2CellUnion cells(S2CellId cell_id) {
+  return S2CellUnion(vector<S2CellId>{cell_id});
+}
+
+// count nodes in an index level cell and in each of its parents, the way expand fills cell_stats.
+static void addNodes(db::CellStats &cell_stats, S2CellId cell_id, int64_t nodes) {
+  for (int level = 0; level <= cell_id.level(); level++) cell_stats.add(cell_id.parent(level),nodes,0,0);
+}
+
+TEST_CASE("cell stats") {
+  TempDb temp;
+  db::Metadata(temp.txn).put("cell_level","4");
+  db::CellStats cell_stats(temp.txn,true);
+  S2CellId parent = S2CellId::FromFace(0).child(1).child(2);
+
+  SECTION("estimate of cells finer than the index level") {
+    S2CellId cell_id = parent.child_begin(4);
+    addNodes(cell_stats,cell_id,64);
+    REQUIRE(cell_stats.estimate(cells(cell_id)).nodes == 64);
+    REQUIRE(cell_stats.estimate(cells(cell_id.child(0))).nodes == 16);
+    REQUIRE(cell_stats.estimate(cells(cell_id.child(0).child(3))).nodes == 4);
+    REQUIRE(cell_stats.estimate(cells(parent)).nodes == 64);
+  }
+
+  SECTION("split into balanced contiguous parts") {
+    for (S2CellId cell_id = parent.child_begin(4); cell_id != parent.child_end(4); cell_id = cell_id.next()) {
+      addNodes(cell_stats,cell_id,10);
+    }
+    S2CellUnion covering = cells(parent);
+    auto parts = cell_stats.split(covering,4);
+    REQUIRE(parts.size() == 4);
+    for (size_t i = 0; i < parts.size(); i++) {
+      REQUIRE(cell_stats.estimate(parts[i]).nodes == 40);
+      REQUIRE(covering.Contains(parts[i]));
+      if (i > 0) REQUIRE(parts[i - 1].cell_ids().back().range_max() < parts[i].cell_ids().front().range_min());
+    }
+    REQUIRE(parts[0].Union(parts[1]).Union(parts[2]).Union(parts[3]) == covering);
+  }
+
+  SECTION("split of an uneven region stays contiguous") {
+    addNodes(cell_stats,parent.child_begin(4),1000);
+    for (S2CellId cell_id = parent.child_begin(4).next(); cell_id != parent.child_end(4); cell_id = cell_id.next()) {
+      addNodes(cell_stats,cell_id,1);
+    }
+    auto parts = cell_stats.split(cells(parent),3);
+    REQUIRE(!parts.empty());
+    REQUIRE(parts.size() <= 3);
+    uint64_t total = 0;
+    for (size_t i = 0; i < parts.size(); i++) {
+      total += cell_stats.estimate(parts[i]).nodes;
+      if (i > 0) REQUIRE(parts[i - 1].cell_ids().back().range_max() < parts[i].cell_ids().front().range_min());
+    }
+    REQUIRE(total == 1015);
+  }
+}
+
+TEST_CASE("presence") {
+  TempDb temp;
+  db::Elements nodes(temp.txn,"nodes");
+
+  SECTION("IDs are kept in chunks of 2^20") {
+    REQUIRE(db::Presence::chunk((1 << 20) + 5) == 1);
+    REQUIRE(db::Presence::offset((1 << 20) + 5) == 5);
+
+    db::Presence presence(temp.txn,"nodes",true);
+    presence.update(ids({1,(1 << 20) + 5,3ULL << 20}),roaring::Roaring64Map());
+    REQUIRE(temp.entries("nodes_presence") == 3);
+
+    db::Presence reread(temp.txn,"nodes");
+    REQUIRE(reread.contains(1));
+    REQUIRE(reread.contains((1 << 20) + 5));
+    REQUIRE(reread.contains(3ULL << 20));
+    REQUIRE(!reread.contains(5));
+    REQUIRE(!reread.contains((2ULL << 20) + 1));
+  }
+
+  SECTION("empty chunks are deleted") {
+    db::Presence presence(temp.txn,"nodes",true);
+    presence.update(ids({1,2,(1 << 20) + 5}),roaring::Roaring64Map());
+    presence.update(roaring::Roaring64Map(),ids({1,2}));
+    REQUIRE(temp.entries("nodes_presence") == 1);
+    db::Presence reread(temp.txn,"nodes");
+    REQUIRE(!reread.contains(1));
+    REQUIRE(reread.contains((1 << 20) + 5));
+  }
+
+  SECTION("without a presence table the element table is used") {
+    MDB_val data;
+    uint64_t value = 0;
+    data.mv_size = sizeof(value);
+    data.mv_data = &value;
+    nodes.put(42,data);
+    db::Presence presence(temp.txn,"nodes");
+    REQUIRE(!presence.exists());
+    REQUIRE(presence.contains(42));
+    REQUIRE(!presence.contains(43));
+  }
+}
+
+TEST_CASE("tag index") {
+  TempDb temp;
+  db::TagIndex tag_index(temp.txn,true);
+  string highway = db::TagIndex::key('n',"highway");
+  // a value of 7 bytes makes the key as long as the tag key with a chunk number.
+  string primary = db::TagIndex::key('n',"highway","primary");
+  string ways = db::TagIndex::key('w',"highway");
+
+  auto added = ids({1,2,(1 << 20) + 1,5ULL << 20});
+  tag_index.update(highway,added,roaring::Roaring64Map());
+  auto two = ids({2});
+  tag_index.update(primary,two,roaring::Roaring64Map());
+
+  roaring::Roaring64Map found;
+  SECTION("posting lists are split by ID range") {
+    REQUIRE(temp.entries("tag_index") == 4);
+    REQUIRE(tag_index.get(highway,found));
+    REQUIRE(found == ids({1,2,(1 << 20) + 1,5ULL << 20}));
+    REQUIRE(tag_index.get(primary,found));
+    REQUIRE(found == ids({2}));
+    REQUIRE(tag_index.get(ways,found));
+    REQUIRE(found.isEmpty());
+  }
+
+  SECTION("updates only change the chunks they touch") {
+    roaring::Roaring64Map none;
+    auto more = ids({3});
+    tag_index.update(highway,more,ids({(1 << 20) + 1,5ULL << 20}));
+    REQUIRE(temp.entries("tag_index") == 2);
+    REQUIRE(tag_index.get(highway,found));
+    REQUIRE(found == ids({1,2,3}));
+    tag_index.update(primary,none,ids({2}));
+    REQUIRE(tag_index.get(primary,found));
+    REQUIRE(found.isEmpty());
+    REQUIRE(temp.entries("tag_index") == 1);
+  }
+
+  SECTION("keys too long for LMDB and empty values are not indexed") {
+    string value(mdb_env_get_maxkeysize(temp.env),'x');
+    REQUIRE(!tag_index.get(db::TagIndex::key('n',"name",value.c_str()),found));
+    REQUIRE(!tag_index.get(db::TagIndex::key('n',"highway",""),found));
+  }
+}
+
+TEST_CASE("time index") {
+  TempDb temp;
+  db::TimeIndex time_index(temp.txn,true);
+  auto one = ids({1});
+  auto two = ids({2});
+  auto three = ids({3});
+  time_index.add(db::TimeIndex::key(1000 * 3600 + 60,osmium::item_type::node),one);
+  time_index.add(db::TimeIndex::key(1005 * 3600,osmium::item_type::way),two);
+  time_index.add(db::TimeIndex::key(999 * 3600,osmium::item_type::relation),three);
+
+  roaring::Roaring64Map nodes, ways, relations;
+  SECTION("since takes the whole hour of the timestamp") {
+    time_index.since(1000 * 3600 + 1800,nodes,ways,relations);
+    REQUIRE(nodes == ids({1}));
+    REQUIRE(ways == ids({2}));
+    REQUIRE(relations.isEmpty());
+  }
+
+  SECTION("since a later hour") {
+    time_index.since(1001 * 3600,nodes,ways,relations);
+    REQUIRE(nodes.isEmpty());
+    REQUIRE(ways == ids({2}));
+  }
+}
+
+TEST_CASE("history") {
+  TempDb temp;
+  db::History history(temp.txn,true);
+  uint32_t version;
+  kj::Array<capnp::word> value;
+  vector<char> v1 = {'a','b'};
+
+  // way 7 was created at 10 and replaced at 20.
+  history.current('w',7,1,10);
+  history.put('w',7,1,20,v1);
+  history.current('w',7,2,20);
+
+  SECTION("versions by sequence number") {
+    REQUIRE(history.get('w',7,15,version,value) == db::History::Lookup::stored);
+    REQUIRE(version == 1);
+    REQUIRE(value.size() == 1);
+    REQUIRE(memcmp(value.begin(),v1.data(),2) == 0);
+    REQUIRE(history.get('w',7,10,version,value) == db::History::Lookup::stored);
+    REQUIRE(history.get('w',7,20,version,value) == db::History::Lookup::current);
+    REQUIRE(history.get('w',7,5,version,value) == db::History::Lookup::absent);
+    REQUIRE(history.get('n',7,15,version,value) == db::History::Lookup::current);
+  }
+
+  SECTION("stored messages decode") {
+    capnp::MallocMessageBuilder message;
+    auto way = message.initRoot<Way>();
+    auto nodes = way.initNodes(3);
+    for (int i = 0; i < 3; i++) nodes.set(i,100 + i);
+    auto tags = way.initTags(2);
+    tags.set(0,"highway");
+    tags.set(1,"residential");
+    way.initMetadata().setVersion(4);
+    auto words = capnp::messageToFlatArray(message);
+    // values of different sizes, so that some of them would start at unaligned addresses in the page.
+    for (uint64_t id = 20; id < 40; id++) {
+      vector<char> stored((char *)words.begin(),(char *)words.end());
+      if (id % 2) history.put('w',id,id % 7 + 1,30,stored);
+      vector<char> node(sizeof(int32_t) * 4 + (id % 3) * sizeof(capnp::word));
+      int32_t location[3] = {10,20,(int32_t)id};
+      memcpy(node.data(),location,sizeof(location));
+      history.put('n',id,1,30,node);
+    }
+    REQUIRE(history.get('w',21,25,version,value) == db::History::Lookup::stored);
+    REQUIRE(version == 21 % 7 + 1);
+    REQUIRE(reinterpret_cast<uintptr_t>(value.begin()) % sizeof(capnp::word) == 0);
+    capnp::FlatArrayMessageReader reader(value);
+    auto stored_way = reader.getRoot<Way>();
+    REQUIRE(stored_way.getNodes().size() == 3);
+    REQUIRE(stored_way.getNodes()[2] == 102);
+    REQUIRE(string(stored_way.getTags()[1].cStr()) == "residential");
+    REQUIRE(stored_way.getMetadata().getVersion() == 4);
+
+    REQUIRE(history.get('n',25,25,version,value) == db::History::Lookup::stored);
+    REQUIRE(value.size() == 2 + 25 % 3);
+    REQUIRE(((int32_t *)value.begin())[2] == 25);
+  }
+
+  SECTION("a version current before the history started") {
+    history.put('w',8,3,30,v1);
+    REQUIRE(history.get('w',8,25,version,value) == db::History::Lookup::stored);
+    REQUIRE(version == 3);
+  }
+
+  SECTION("applying a diff again keeps when a version became current") {
+    history.current('w',9,1,40);
+    history.current('w',9,1,50);
+    REQUIRE(history.get('w',9,45,version,value) == db::History::Lookup::current);
+    REQUIRE(history.get('w',9,35,version,value) == db::History::Lookup::absent);
+  }
+
+  SECTION("prune") {
+    history.put('w',8,3,30,v1);
+    history.prune(20);
+    REQUIRE(history.get('w',7,15,version,value) == db::History::Lookup::current);
+    REQUIRE(history.get('w',8,25,version,value) == db::History::Lookup::stored);
+    REQUIRE(temp.entries("history") == 1);
+    history.prune(30);
+    REQUIRE(temp.entries("history") == 0);
+    REQUIRE(temp.entries("history_seqnum") == 0);
+  }
+}
+
+TEST_CASE("changes") {
+  TempDb temp;
+
+  SECTION("missing table") {
+    db::Changes changes(temp.txn);
+    REQUIRE(!changes.exists());
+    REQUIRE(changes.get(0,10).isEmpty());
+  }
+
+  SECTION("cells touched in a range of sequence numbers") {
+    db::Changes changes(temp.txn,true);
+    auto five = ids({1,2});
+    auto six = ids({3});
+    auto eight = ids({4});
+    changes.put(5,five);
+    changes.put(6,six);
+    changes.put(8,eight);
+    REQUIRE(changes.get(5,8) == ids({3,4}));
+    REQUIRE(changes.get(4,6) == ids({1,2,3}));
+    REQUIRE(changes.get(8,10).isEmpty());
+
+    uint64_t first;
+    REQUIRE(changes.first(first));
+    REQUIRE(first == 5);
+    changes.prune(6);
+    REQUIRE(changes.first(first));
+    REQUIRE(first == 8);
+    REQUIRE(changes.get(4,8) == ids({4}));
+    changes.prune(8);
+    REQUIRE_FALSE(changes.first(first));
+  }
+}
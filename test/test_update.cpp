@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "catch2/catch_test_macros.hpp"
+#include "osmium/io/any_input.hpp"
+#include "osmium/io/reader.hpp"
+#include "osmium/osm/way.hpp"
+#include "s2/s2latlng.h"
+#include "osmx/storage.h"
+#include "temp_osmx.h"
+
+using namespace std;
+using namespace osmx;
+
+static const char *OSM_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.0">
+    <tag k="name" v="A"/>
+  </node>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.001"/>
+  <node id="3" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.002"/>
+  <node id="4" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.003"/>
+  <node id="6" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.001" lon="0.0"/>
+  <way id="10" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="1"/>
+    <nd ref="2"/>
+    <tag k="highway" v="residential"/>
+  </way>
+  <way id="12" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="3"/>
+    <nd ref="4"/>
+  </way>
+  <relation id="20" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="way" ref="10" role=""/>
+    <member type="relation" ref="21" role=""/>
+    <tag k="type" v="route"/>
+  </relation>
+  <relation id="21" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="node" ref="3" role="stop"/>
+  </relation>
+  <relation id="23" version="1" timestamp="2020-01-01T00:00:00Z">
+    <member type="node" ref="6" role=""/>
+  </relation>
+</osm>
+)";
+
+// creates, modifies and deletes a node, a way and a relation, moves node 2 far away,
+// and nests relation 20 in a new relation.
+static const char *OSC_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <create>
+    <node id="5" version="1" timestamp="2020-01-02T00:00:00Z" lat="0.001" lon="0.001">
+      <tag k="amenity" v="bench"/>
+    </node>
+    <way id="11" version="1" timestamp="2020-01-02T00:00:00Z">
+      <nd ref="3"/>
+      <nd ref="5"/>
+    </way>
+    <relation id="22" version="1" timestamp="2020-01-02T00:00:00Z">
+      <member type="relation" ref="20" role=""/>
+      <tag k="type" v="superroute"/>
+    </relation>
+  </create>
+  <modify>
+    <node id="1" version="2" timestamp="2020-01-02T00:00:00Z" lat="0.0" lon="0.0">
+      <tag k="name" v="B"/>
+    </node>
+    <node id="2" version="2" timestamp="2020-01-02T00:00:00Z" lat="0.5" lon="0.5"/>
+    <way id="10" version="2" timestamp="2020-01-02T00:00:00Z">
+      <nd ref="1"/>
+      <nd ref="2"/>
+      <nd ref="3"/>
+      <tag k="highway" v="residential"/>
+    </way>
+    <relation id="21" version="2" timestamp="2020-01-02T00:00:00Z">
+      <member type="node" ref="3" role="stop"/>
+      <member type="way" ref="11" role=""/>
+    </relation>
+  </modify>
+  <delete>
+    <node id="4" version="2" timestamp="2020-01-02T00:00:00Z"/>
+    <way id="12" version="2" timestamp="2020-01-02T00:00:00Z"/>
+    <relation id="23" version="2" timestamp="2020-01-02T00:00:00Z"/>
+  </delete>
+</osmChange>
+)";
+
+// the IDs an index maps id to.
+static roaring::Roaring64Map reverse(MDB_txn *txn, const char *table, uint64_t id) {
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, table, MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn, dbi, &cursor));
+  roaring::Roaring64Map set;
+  db::traverseReverse(cursor,id,set);
+  mdb_cursor_close(cursor);
+  return set;
+}
+
+static roaring::Roaring64Map ids(std::initializer_list<uint64_t> list) {
+  roaring::Roaring64Map map;
+  for (auto id : list) map.add(id);
+  return map;
+}
+
+// the nodes stored in the index level cell of a location.
+static roaring::Roaring64Map cellNodes(MDB_txn *txn, double lat, double lon) {
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  CHECK_LMDB(mdb_dbi_open(txn, "cell_node", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP, &dbi));
+  CHECK_LMDB(mdb_cursor_open(txn, dbi, &cursor));
+  int level = db::cellLevel(txn);
+  roaring::Roaring64Map set;
+  db::traverseCell(cursor,S2CellId(S2LatLng::FromDegrees(lat,lon)).parent(level),set,level);
+  mdb_cursor_close(cursor);
+  return set;
+}
+
+static vector<uint64_t> wayNodes(db::Elements &ways, uint64_t id) {
+  auto reader = ways.getReader(id);
+  vector<uint64_t> result;
+  for (auto node_id : reader.getRoot<Way>().getNodes()) result.push_back(node_id);
+  return result;
+}
+
+TEST_CASE("update") {
+  TempOsmx osmx(OSM_XML);
+  osmx.update(OSC_XML,"2");
+
+  MDB_env *env = db::createEnv(osmx.path);
+  MDB_txn *txn;
+  CHECK_LMDB(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+  REQUIRE(db::Metadata(txn).get("osmosis_replication_sequence_number") == "2");
+
+  SECTION("nodes") {
+    db::Locations locations(txn);
+    auto created = locations.get(5);
+    REQUIRE(created.is_defined());
+    REQUIRE(created.version == 1);
+    auto moved = locations.get(2);
+    REQUIRE(moved.coords == osmium::Location(0.5,0.5));
+    REQUIRE(moved.version == 2);
+    REQUIRE(locations.get(4).is_undefined());
+
+    db::Elements nodes(txn,"nodes");
+    auto reader = nodes.getReader(1);
+    auto tags = reader.getRoot<Node>().getTags();
+    REQUIRE(tags.size() == 2);
+    REQUIRE(string(tags[1].cStr()) == "B");
+    REQUIRE(nodes.exists(5));
+    REQUIRE_FALSE(nodes.exists(4));
+
+    REQUIRE(cellNodes(txn,0.5,0.5).contains((uint64_t)2));
+    REQUIRE_FALSE(cellNodes(txn,0.0,0.001).contains((uint64_t)2));
+    REQUIRE_FALSE(cellNodes(txn,0.0,0.003).contains((uint64_t)4));
+    REQUIRE(cellNodes(txn,0.001,0.001).contains((uint64_t)5));
+  }
+
+  SECTION("ways") {
+    db::Elements ways(txn,"ways");
+    REQUIRE(wayNodes(ways,10) == vector<uint64_t>{1,2,3});
+    REQUIRE(wayNodes(ways,11) == vector<uint64_t>{3,5});
+    REQUIRE_FALSE(ways.exists(12));
+    REQUIRE(reverse(txn,"node_way",3) == ids({10,11}));
+    REQUIRE(reverse(txn,"node_way",5) == ids({11}));
+    REQUIRE(reverse(txn,"node_way",4).isEmpty());
+  }
+
+  SECTION("relations") {
+    db::Elements relations(txn,"relations");
+    REQUIRE(relations.exists(22));
+    REQUIRE_FALSE(relations.exists(23));
+    auto reader = relations.getReader(21);
+    auto members = reader.getRoot<Relation>().getMembers();
+    REQUIRE(members.size() == 2);
+    REQUIRE(members[1].getType() == RelationMember::Type::WAY);
+    REQUIRE(members[1].getRef() == 11);
+
+    REQUIRE(reverse(txn,"relation_relation",20) == ids({22}));
+    REQUIRE(reverse(txn,"relation_relation",21) == ids({20}));
+    REQUIRE(reverse(txn,"way_relation",11) == ids({21}));
+    REQUIRE(reverse(txn,"way_relation",10) == ids({20}));
+    REQUIRE(reverse(txn,"node_relation",3) == ids({21}));
+    REQUIRE(reverse(txn,"node_relation",6).isEmpty());
+  }
+
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+}
+
+// way 10 runs between two nodes outside the region, until one of them moves into it.
+static const char *FANOUT_XML = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osm version="0.6" generator="test">
+  <node id="1" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.0"/>
+  <node id="2" version="1" timestamp="2020-01-01T00:00:00Z" lat="0.0" lon="0.01"/>
+  <node id="3" version="1" timestamp="2020-01-01T00:00:00Z" lat="1.0" lon="1.0"/>
+  <way id="10" version="1" timestamp="2020-01-01T00:00:00Z">
+    <nd ref="1"/>
+    <nd ref="2"/>
+    <tag k="highway" v="residential"/>
+  </way>
+</osm>
+)";
+
+static const char *FANOUT_OSC = R"(<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <modify>
+    <node id="2" version="2" timestamp="2020-01-02T00:00:00Z" lat="1.0" lon="1.0001"/>
+  </modify>
+</osmChange>
+)";
+
+TEST_CASE("region diffs") {
+  TempOsmx osmx(FANOUT_XML);
+  TempOsmx::run(cmdRegions,{"osmx","regions",osmx.path,"add","inside","--bbox","0.9,0.9,1.1,1.1"});
+  char dir_name[] = "/tmp/osmx_test_XXXXXX";
+  string dir = mkdtemp(dir_name);
+  osmx.update(FANOUT_OSC,"2",{"--regionDiffs",dir});
+
+  string osc = dir + "/inside/2.osc.gz";
+  vector<pair<osmium::item_type,uint64_t>> elements;
+  osmium::io::Reader reader{osc};
+  while (osmium::memory::Buffer buffer = reader.read()) {
+    for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+      elements.emplace_back(it->type(),it->id());
+      if (it->type() == osmium::item_type::way) {
+        vector<uint64_t> refs;
+        for (auto const &node_ref : static_cast<const osmium::Way &>(*it).nodes()) refs.push_back(node_ref.ref());
+        REQUIRE(refs == vector<uint64_t>{1,2});
+      }
+    }
+  }
+  reader.close();
+  unlink(osc.c_str());
+  rmdir((dir + "/inside").c_str());
+  rmdir(dir.c_str());
+
+  // the way entered only because node 2 moved, so it comes from the database, with its other node.
+  sort(elements.begin(),elements.end());
+  REQUIRE(elements == vector<pair<osmium::item_type,uint64_t>>{
+    {osmium::item_type::node,1},{osmium::item_type::node,2},{osmium::item_type::way,10}});
+}